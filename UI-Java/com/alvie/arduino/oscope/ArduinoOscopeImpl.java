@@ -51,6 +51,11 @@ public class ArduinoOscopeImpl implements Protocol.ScopeDisplayer, ChangeListene
     JFrame frame;
     JPanel panel;
     JDialog waitTriggerDialog;
+    JLabel statsLabel;
+    javax.swing.Timer statsTimer;
+
+    /* How often frame counters are refreshed */
+    final int STATS_INTERVAL_MS = 1000;
 
     ArduinoOscopeImpl()
     {
@@ -234,6 +239,10 @@ public class ArduinoOscopeImpl implements Protocol.ScopeDisplayer, ChangeListene
         panel.add(scope);
         panel.add(hpanel);
 
+        statsLabel = new JLabel(" ", JLabel.CENTER);
+        statsLabel.setAlignmentX(Component.CENTER_ALIGNMENT);
+        panel.add(statsLabel);
+
         JPanel buttonPanel = new JPanel();
         JButton singleShot = new JButton("Single shot");
         buttonPanel.add(singleShot);
@@ -251,6 +260,20 @@ public class ArduinoOscopeImpl implements Protocol.ScopeDisplayer, ChangeListene
         frame.setVisible(true);
 
         proto.setDisplayer(this);
+
+        statsTimer = new javax.swing.Timer(STATS_INTERVAL_MS, new ActionListener() {
+            long lastDisplayed;
+            public void actionPerformed(ActionEvent e) {
+                long displayed = proto.getFramesDisplayed();
+                statsLabel.setText("Frames: " + proto.getFramesDecoded() + " decoded, " +
+                                   displayed + " shown, " +
+                                   proto.getFramesDropped() + " dropped, " +
+                                   proto.getChecksumErrors() + " checksum errors | " +
+                                   (displayed - lastDisplayed) * 1000 / STATS_INTERVAL_MS + " fps");
+                lastDisplayed = displayed;
+            }
+        });
+        statsTimer.start();
     }
 
     public void stateChanged(ChangeEvent e) {
@@ -20,9 +20,12 @@ package com.alvie.arduino.oscope;
 
 import java.io.*;
 import java.util.*;
+import java.util.concurrent.*;
+import java.util.concurrent.atomic.*;
+import javax.swing.SwingUtilities;
 import gnu.io.*;
 
-public class Protocol implements SerialPortEventListener
+public class Protocol
 {
     private SerialPort port;
 
@@ -32,7 +35,6 @@ public class Protocol implements SerialPortEventListener
     int stopbits;
     InputStream input;
     OutputStream output;
-    int b;
     int [] pBuf;
     int cksum;
     int pBufPtr;
@@ -60,6 +62,17 @@ public class Protocol implements SerialPortEventListener
     public static int FLAG_INVERT_TRIGGER  = (1<<0);
     public static int FLAG_DUAL_CHANNEL    = (1<<1);
 
+    /* Largest payload we accept. Frames are up to 1024 samples plus trailer */
+    final int  MAX_PAYLOAD              = 1280;
+
+    /* Bytes read from serial port at a time */
+    final int  READ_BLOCK_SIZE          = 4096;
+    /* Reads return after this long, so reader notices it must stop */
+    final int  READ_TIMEOUT_MS          = 100;
+
+    /* Frames waiting for the EDT. Above this, oldest ones are dropped */
+    final int  FRAME_QUEUE_SIZE         = 4;
+
     public interface ScopeDisplayer
     {
         void displayData(int [] buf, int size);
@@ -69,6 +82,19 @@ public class Protocol implements SerialPortEventListener
 
     ScopeDisplayer displayer;
 
+    ReaderThread reader;
+
+    /* Frames decoded by reader thread, waiting to be displayed. Buffers
+     are recycled through freeFrames, so steady state does not allocate */
+    ArrayBlockingQueue<int[]> frameQueue = new ArrayBlockingQueue<int[]>(FRAME_QUEUE_SIZE);
+    ArrayBlockingQueue<int[]> freeFrames = new ArrayBlockingQueue<int[]>(FRAME_QUEUE_SIZE + 1);
+    AtomicBoolean drainScheduled = new AtomicBoolean(false);
+
+    AtomicLong framesDecoded = new AtomicLong();
+    AtomicLong framesDisplayed = new AtomicLong();
+    AtomicLong framesDropped = new AtomicLong();
+    AtomicLong checksumErrors = new AtomicLong();
+
     enum MyState {
         PING,
         GETVERSION,
@@ -94,7 +120,7 @@ public class Protocol implements SerialPortEventListener
 
     Protocol()
     {
-        pBuf = new int[1024];
+        pBuf = new int[MAX_PAYLOAD];
         reset();
     }
 
@@ -114,8 +140,83 @@ public class Protocol implements SerialPortEventListener
     boolean freeze;
     Timer pingtimer,nosampletimer;
     int pingAttempts;
+    int numSamples;
+
+    long getFramesDecoded()
+    {
+        return framesDecoded.get();
+    }
+
+    long getFramesDisplayed()
+    {
+        return framesDisplayed.get();
+    }
+
+    long getFramesDropped()
+    {
+        return framesDropped.get();
+    }
+
+    long getChecksumErrors()
+    {
+        return checksumErrors.get();
+    }
+
+    void recycleFrame(int [] frame)
+    {
+        freeFrames.offer(frame);
+    }
+
+    /* Runs on EDT. Only newest frame is worth drawing, older ones queued
+     meanwhile count as dropped */
+    Runnable drainTask = new Runnable() {
+        public void run() {
+            int [] frame, last = null;
+
+            drainScheduled.set(false);
+            while ((frame = frameQueue.poll()) != null) {
+                if (null!=last) {
+                    framesDropped.incrementAndGet();
+                    recycleFrame(last);
+                }
+                last = frame;
+            }
+            if (null==last)
+                return;
+            if (null!=displayer)
+                displayer.displayData(last, last.length);
+            framesDisplayed.incrementAndGet();
+            recycleFrame(last);
+        }
+    };
 
-    void processPacket(int command, int [] buf, int size)
+    /* Called from reader thread */
+    void queueFrame(int [] buf, int size)
+    {
+        int [] frame, old;
+
+        if (numSamples>0 && size>numSamples)
+            size = numSamples; /* Drop trailer */
+
+        frame = freeFrames.poll();
+        if (null==frame || frame.length!=size)
+            frame = new int[size];
+        System.arraycopy(buf, 0, frame, 0, size);
+        framesDecoded.incrementAndGet();
+
+        while (!frameQueue.offer(frame)) {
+            old = frameQueue.poll();
+            if (null!=old) {
+                framesDropped.incrementAndGet();
+                recycleFrame(old);
+            }
+        }
+        if (drainScheduled.compareAndSet(false, true))
+            SwingUtilities.invokeLater(drainTask);
+    }
+
+    /* Called from reader thread */
+    synchronized void processPacket(int command, int [] buf, int size)
     {
         int ns;
 
@@ -127,10 +228,18 @@ public class Protocol implements SerialPortEventListener
 
             isTriggerInvert = (buf[6] & FLAG_INVERT_TRIGGER) !=0;
             isDualChannel = (buf[6] & FLAG_DUAL_CHANNEL) !=0 ;
+            numSamples = ns;
 
             if (null!=displayer)
             {
-                displayer.gotParameters(buf[0],buf[1],buf[2],buf[3],ns,buf[6]);
+                final int [] p = new int[7];
+                final int nsamples = ns;
+                System.arraycopy(buf, 0, p, 0, 7);
+                SwingUtilities.invokeLater(new Runnable() {
+                    public void run() {
+                        displayer.gotParameters(p[0],p[1],p[2],p[3],nsamples,p[6]);
+                    }
+                });
             }
             System.out.println("Num samples: " +  ns );
         }
@@ -167,13 +276,16 @@ public class Protocol implements SerialPortEventListener
             break;
 
         case SAMPLING:
-            if (null!=displayer) {
-                displayer.displayData(buf, size);
-            }
+            queueFrame(buf, size);
 
             if ( (null!=displayer && enableTriggerDone) && ! delayRequest) {
                 inRequest=false;
-                displayer.triggerDone();
+                /* Queued after frame, so frame is shown first */
+                SwingUtilities.invokeLater(new Runnable() {
+                    public void run() {
+                        displayer.triggerDone();
+                    }
+                });
             } else{
                 if (!freeze) {
                     sendPacket(COMMAND_START_SAMPLING);
@@ -190,7 +302,7 @@ public class Protocol implements SerialPortEventListener
 
     }
 
-    void setOneShot(boolean enable)
+    synchronized void setOneShot(boolean enable)
     {
         int tvalue;
 
@@ -267,54 +379,54 @@ public class Protocol implements SerialPortEventListener
         sendPacket(command,array,1);
     }
 
-    void sendPacket(int command, int [] buf, int size)
+    /* Called from both EDT and reader thread */
+    synchronized void sendPacket(int command, int [] buf, int size)
     {
+        byte [] pkt = new byte[size + 4];
+        int len = 0;
         int cksum=0;
         int i;
         if (null==output)
             return;
-        try {
 
-            size++;
-            if (size>127) {
-		size |= 0x8000; // Set MSBit on MSB
-		cksum^= (size>>8)&0xff;
-                output.write((size>>8)&0xff);
-                size &= 0x7FFF;
-            }
-            cksum^=(size&0xff);
-            output.write(size&0xff);
+        size++;
+        if (size>127) {
+            size |= 0x8000; // Set MSBit on MSB
+            cksum^= (size>>8)&0xff;
+            pkt[len++] = (byte)((size>>8)&0xff);
+            size &= 0x7FFF;
+        }
+        cksum^=(size&0xff);
+        pkt[len++] = (byte)(size&0xff);
 
-            output.write(command&0xff);
-            cksum^=command&0xff;
+        pkt[len++] = (byte)(command&0xff);
+        cksum^=command&0xff;
 
-            size--;
+        size--;
 
-            for (i=0;i<size;i++) {
-                cksum^=buf[i]&0xff;
-                output.write(buf[i]&0xff);
-            }
+        for (i=0;i<size;i++) {
+            cksum^=buf[i]&0xff;
+            pkt[len++] = (byte)(buf[i]&0xff);
+        }
 
-            output.write(cksum&0xff);
+        pkt[len++] = (byte)(cksum&0xff);
+        try {
+            output.write(pkt, 0, len);
             output.flush();
         } catch (java.io.IOException e) {
         }
     }
 
-    void resetTarget()
+    synchronized void resetTarget()
     {
-        int i;
         try {
-            for (i=0; i<512; i++ ) {
-                output.write(0x00);
-            }
+            output.write(new byte[512]);
         } catch (java.io.IOException e) {
         }
     }
 
-    void process(int sig_bIn)
+    void process(int bIn)
     {
-        int bIn = sig_bIn & 0xff;
         cksum^=bIn;
 
         switch(st) {
@@ -333,6 +445,11 @@ public class Protocol implements SerialPortEventListener
 
         case SIZE2:
             pSize += bIn;
+            if (pSize==0 || pSize - 1 > MAX_PAYLOAD) {
+                /* Would not fit buffer. Probably garbage */
+                st = PacketState.SIZE;
+                break;
+            }
             pBufPtr = 0;
             st = PacketState.COMMAND;
             break;
@@ -360,28 +477,52 @@ public class Protocol implements SerialPortEventListener
             if (cksum==0) {
                 processPacket(command,pBuf,pBufPtr);
             } else {
-                System.out.println("Packet fails checksum check");
+                checksumErrors.incrementAndGet();
             }
             st = PacketState.SIZE;
         }
     }
 
-    synchronized public void serialEvent(SerialPortEvent serialEvent) {
-        int numbytes,i;
-        byte [] readbuf;
-        if (serialEvent.getEventType() == SerialPortEvent.DATA_AVAILABLE) {
+    /* Reads serial port in blocks and decodes packets, so that neither
+     RXTX event thread nor EDT ever see individual bytes */
+    class ReaderThread extends Thread {
+        InputStream in;
+        volatile boolean running = true;
+
+        ReaderThread(InputStream in)
+        {
+            super("oscope reader");
+            this.in = in;
+            setDaemon(true);
+        }
+
+        void shutdown()
+        {
+            running = false;
             try {
-                while ((numbytes=input.available()) > 0) {
-                    readbuf = new byte[numbytes];
-                    input.read(readbuf);
-                    for (i=0; i<readbuf.length; i++) {
-                        process(readbuf[i]);
-                    }
+                join();
+            } catch (InterruptedException e) {
+            }
+        }
+
+        public void run() {
+            byte [] readbuf = new byte[READ_BLOCK_SIZE];
+            int numbytes,i;
+
+            while (running) {
+                try {
+                    numbytes = in.read(readbuf, 0, readbuf.length);
+                } catch (IOException e) {
+                    break;
+                }
+                if (numbytes<0)
+                    break;
+                for (i=0; i<numbytes; i++) {
+                    process(readbuf[i] & 0xff);
                 }
-            } catch (IOException e) {
             }
         }
-    }
+    };
 
     Vector getPortList()
     {
@@ -458,6 +599,10 @@ public class Protocol implements SerialPortEventListener
 
     void changeSerialPort(String name) throws SerialPortOpenException
     {
+        if (null!=reader) {
+            reader.shutdown();
+            reader = null;
+        }
         if (null!=port) {
             port.close();
         }
@@ -470,11 +615,12 @@ public class Protocol implements SerialPortEventListener
                 input = port.getInputStream();
                 output = port.getOutputStream();
                 port.setSerialPortParams(115200, SerialPort.DATABITS_8, SerialPort.STOPBITS_1, SerialPort.PARITY_NONE);
-                port.addEventListener(this);
-                port.notifyOnDataAvailable(true);
+                port.enableReceiveTimeout(READ_TIMEOUT_MS);
             } catch (Exception e) {
                 throw new SerialPortOpenException();
             }
+            reader = new ReaderThread(input);
+            reader.start();
             System.out.println("Port " + name + " open successfully");
             
             pingAttempts = 3;
@@ -20,25 +20,31 @@ package com.alvie.arduino.oscope;
 
 import javax.swing.*;        
 import java.awt.*;
-import java.awt.geom.GeneralPath;
+import java.awt.image.BufferedImage;
 import java.lang.Math.*;
 
 public class ScopeDisplay extends JComponent {
 
     private int[] data;
 
+    /* Waveform is drawn here once per frame, and only blitted on paint */
+    private BufferedImage image;
+    private boolean imageValid;
+
     int triggerLevel;
     int numSamples;
     boolean isDual;
 
     public ScopeDisplay() {
         numSamples = 962;
+        setOpaque(true);
         resizeToNumSamples();
     }
 
     public void setDual(boolean value)
     {
         isDual = value;
+        imageValid = false;
         repaint();
     }
 
@@ -64,102 +70,100 @@ public class ScopeDisplay extends JComponent {
     public void setTriggerLevel(int level)
     {
         triggerLevel=level;
+        imageValid = false;
         repaint();
     }
 
+    /* Caller may reuse in_data once we return */
     public void setData(int[] in_data)
     {
-        if (null!=in_data && null!=data) {
-            if (in_data.length == data.length)
-                System.arraycopy(in_data,0,data,0,data.length);
-            else
-                data = in_data.clone();
-        } else
-            data = in_data.clone();
+        if (null==data || data.length!=in_data.length)
+            data = new int[in_data.length];
+        System.arraycopy(in_data,0,data,0,data.length);
+        imageValid = false;
         repaint();
     }
 
-    private void drawBackground(Graphics2D g2d, Dimension d)
+    int sampleY(int value, int height)
     {
-        GeneralPath p = new GeneralPath(GeneralPath.WIND_NON_ZERO);
-        
-        p.moveTo(0,0);
-        p.lineTo(d.width,0);
-        p.lineTo(d.width,d.height);
-        p.lineTo(0,d.height);
-        p.lineTo(0,0);
-        p.closePath();
-        g2d.setColor(Color.black);
-        g2d.fill(p);
+        return height - 1 - value * height / 256;
+    }
 
+    /* Every stride-th sample from first. With more samples than pixel
+     columns, each column is drawn as a vertical line between its lowest
+     and highest sample, so drawing cost depends on width, not on number
+     of samples */
+    void paintChannel(Graphics2D g2d, Dimension d, int first, int stride)
+    {
+        int len = data.length;
+        int i, x, y;
+        int prevX = -1, prevY = 0, lo = 0, hi = 0;
+
+        for (i=first; i<len; i+=stride) {
+            x = (int)((long)i * d.width / len);
+            y = sampleY(data[i], d.height);
+            if (x!=prevX) {
+                if (prevX>=0) {
+                    g2d.drawLine(prevX, lo, prevX, hi);
+                    g2d.drawLine(prevX, prevY, x, y);
+                }
+                prevX = x;
+                lo = hi = y;
+            } else {
+                if (y<lo) lo = y;
+                if (y>hi) hi = y;
+            }
+            prevY = y;
+        }
+        if (prevX>=0)
+            g2d.drawLine(prevX, lo, prevX, hi);
     }
+
     public void paintWaveform(Graphics2D g2d, Dimension d)
     {
         if (null==data)
             return;
 
-        GeneralPath p = new GeneralPath(GeneralPath.WIND_NON_ZERO);
-        int i;
-
-        
         if (isDual) {
             g2d.setColor(Color.yellow);
-            p.moveTo(0,0);
-
-            for (i=0; i<data.length;i+=2) {
-                p.lineTo(i, d.height - data[i]);
-            }
-
-            g2d.draw(p);
-
-            p.reset();
-
-            p.moveTo(1,0);
-
-            for (i=1; i<data.length;i+=2) {
-                p.lineTo(i, d.height - data[i]);
-            }
+            paintChannel(g2d, d, 0, 2);
             g2d.setColor(Color.green);
-            
-            g2d.draw(p);
-
+            paintChannel(g2d, d, 1, 2);
         } else {
             g2d.setColor(Color.green);
-            p.moveTo(0,0);
-
-            for (i=0; i<data.length;i++) {
-                p.lineTo(i, d.height - data[i]);
-            }
-            g2d.draw(p);
+            paintChannel(g2d, d, 0, 1);
         }
-
     }
 
     void paintTrigger(Graphics2D g2d, Dimension d)
     {
-        GeneralPath p = new GeneralPath(GeneralPath.WIND_NON_ZERO);
+        int y = sampleY(triggerLevel, d.height);
         g2d.setColor(Color.blue);
-        p.moveTo(0,d.height-triggerLevel);
-        p.lineTo(d.width, d.height-triggerLevel);
-        g2d.draw(p);
+        g2d.drawLine(0, y, d.width, y);
     }
 
-    public void paint(Graphics g) {
-        super.paintComponent(g);
-        Dimension d = getSize();
-
-        Graphics2D g2d = (Graphics2D)g;
-        drawBackground(g2d,d);
-
-        BasicStroke stroke = new BasicStroke(2.0f,BasicStroke.CAP_ROUND,BasicStroke.JOIN_ROUND);
-        g2d.setStroke(stroke);
-
-        RenderingHints rh = new RenderingHints(
-		RenderingHints.KEY_ANTIALIASING,
-		RenderingHints.VALUE_ANTIALIAS_ON);
+    void renderImage(Dimension d)
+    {
+        if (null==image || image.getWidth()!=d.width || image.getHeight()!=d.height)
+            image = new BufferedImage(d.width, d.height, BufferedImage.TYPE_INT_RGB);
 
-        g2d.setRenderingHints(rh);
+        Graphics2D g2d = image.createGraphics();
+        g2d.setColor(Color.black);
+        g2d.fillRect(0, 0, d.width, d.height);
         paintTrigger(g2d,d);
         paintWaveform(g2d,d);
+        g2d.dispose();
+        imageValid = true;
+    }
+
+    public void paint(Graphics g) {
+        Dimension d = getSize();
+
+        if (d.width<=0 || d.height<=0)
+            return;
+        if (!imageValid || null==image || image.getWidth()!=d.width ||
+            image.getHeight()!=d.height)
+            renderImage(d);
+        g.drawImage(image, 0, 0, null);
     }
 };
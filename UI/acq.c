@@ -0,0 +1,1218 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acq.h"
+#include "ingest.h"
+#include "filter.h"
+#include "average.h"
+#include "logic.h"
+#include "trigger.h"
+#include "decode.h"
+#include "mask.h"
+#include "autoset.h"
+#include "sampling.h"
+#include "../protocol.h"
+
+static void acq_message(struct acq *acq, const char *fmt, ...)
+{
+	char msg[128];
+	va_list ap;
+
+	if (NULL==acq->cb.message)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	acq->cb.message(acq->data, msg);
+}
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Settings commands, in the order they are sent again on reconnect:
+ buffer size before memory segments, sample rate after prescaler,
+ logic mode last */
+static const unsigned char restored[ACQ_MAX_SETTINGS] = {
+	COMMAND_SET_SAMPLES,
+	COMMAND_SET_CHANNELS,
+	COMMAND_SET_VREF,
+	COMMAND_SET_PRESCALER,
+	COMMAND_SET_SAMPLE_RATE,
+	COMMAND_SET_TRIGGER,
+	COMMAND_SET_HOLDOFF,
+	COMMAND_SET_AUTOTRIG,
+	COMMAND_SET_FLAGS,
+	COMMAND_SET_TRIGGER_MODE,
+	COMMAND_SET_MEMSEG,
+	COMMAND_SET_LOGIC
+};
+
+static void remember_setting(struct acq *acq, unsigned char command,
+							 const unsigned char *buf, unsigned short size)
+{
+	unsigned i;
+
+	if (size>ACQ_SETTING_SIZE)
+		return;
+	for (i=0; i<ACQ_MAX_SETTINGS; i++) {
+		if (restored[i]!=command)
+			continue;
+		acq->settings_gen++;
+		acq->settings[i].valid = 1;
+		acq->settings[i].size = size;
+		memcpy(acq->settings[i].buf, buf, size);
+		return;
+	}
+}
+
+static void restore_settings(struct acq *acq)
+{
+	unsigned i;
+
+	for (i=0; i<ACQ_MAX_SETTINGS; i++)
+		if (acq->settings[i].valid)
+			acq_send(acq, restored[i], acq->settings[i].buf, acq->settings[i].size);
+}
+
+static void set_state(struct acq *acq, enum acq_state state)
+{
+	acq->state = state;
+	acq->state_start = now_ms();
+}
+
+static int acq_write(struct acq *acq, const unsigned char *buf, size_t size)
+{
+	struct pollfd pfd;
+	ssize_t r;
+
+	if (acq->fd<0)
+		return -1;
+	while (size>0) {
+		r = write(acq->fd, buf, size);
+		if (r<0) {
+			if (errno==EINTR)
+				continue;
+			if (errno!=EAGAIN)
+				return -1;
+			/* Output queue full, wait for room */
+			pfd.fd = acq->fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, 1000)<=0)
+				return -1;
+			continue;
+		}
+		buf += r;
+		size -= r;
+	}
+	return 0;
+}
+
+int acq_send(struct acq *acq, unsigned char command,
+			 const unsigned char *buf, unsigned short size)
+{
+	unsigned char pkt[PROTO_MAX_PACKET];
+	size_t len;
+
+	if (size>PROTO_MAX_PAYLOAD)
+		return -1;
+	/* Kept even if device is gone, to be sent once it is back */
+	remember_setting(acq, command, buf, size);
+	if (acq->options & PROTOCOL_OPTION_COBS)
+		len = proto_encode_cobs(pkt, command, buf, size);
+	else
+		len = proto_encode(pkt, command, buf, size);
+	return acq_write(acq, pkt, len);
+}
+
+static unsigned long get_be32(const unsigned char *buf)
+{
+	return ((unsigned long)buf[0]<<24) | ((unsigned long)buf[1]<<16) |
+		((unsigned long)buf[2]<<8) | buf[3];
+}
+
+static void process_stats(struct acq *acq, unsigned char *buf,
+						  unsigned short size)
+{
+	struct acq_stats stats;
+
+	if (size<STATS_REPLY_SIZE || NULL==acq->cb.stats)
+		return;
+
+	stats.conversions = get_be32(&buf[0]);
+	stats.stored = get_be32(&buf[4]);
+	stats.missed = get_be32(&buf[8]);
+	stats.autoTriggers = get_be32(&buf[12]);
+	stats.realTriggers = get_be32(&buf[16]);
+	stats.txStallUs = get_be32(&buf[20]);
+	stats.maxIsrCycles = (buf[24]<<8) | buf[25];
+	stats.rxChecksumErrors = (buf[26]<<8) | buf[27];
+	stats.rxOversize = (buf[28]<<8) | buf[29];
+	stats.hostFrames = acq->frames;
+	stats.hostChecksumErrors = acq->parser.cksum_errors;
+	stats.hostCrcErrors = acq->crc_errors;
+	stats.hostSegmentsResent = acq->segments_resent;
+	stats.hostFramesLost = acq->frames_lost;
+
+	acq->cb.stats(acq->data, &stats);
+}
+
+int acq_parse_parameters(const unsigned char *buf, size_t size,
+						 struct acq_parameters *params)
+{
+	if (size<8)
+		return -1;
+
+	params->triggerLevel = buf[0];
+	params->holdoffSamples = buf[1];
+	params->adcref = buf[2];
+	params->prescale = buf[3];
+	params->numSamples = (buf[4] << 8) + buf[5];
+	params->flags = buf[6];
+	params->channels = buf[7];
+	params->timerClock = TIMER_CLOCK_NONE;
+	params->timerTop = 0;
+	params->logicFlags = 0;
+	params->logicMask = params->logicValue = params->logicEdge = 0;
+	params->memsegs = 1;
+	params->triggerMode = TRIGGER_MODE_EDGE;
+	params->triggerLevel2 = 255;
+	params->triggerParam = 0;
+
+	if (size>=11) {
+		/* v2.3 and above - timer-triggered sampling */
+		params->timerClock = buf[8];
+		params->timerTop = (buf[9] << 8) + buf[10];
+	}
+	if (size>=PARAMETERS_LOGIC + 4) {
+		/* v3.2 and above - logic analyzer mode */
+		params->logicFlags = buf[PARAMETERS_LOGIC];
+		params->logicMask = buf[PARAMETERS_LOGIC+1];
+		params->logicValue = buf[PARAMETERS_LOGIC+2];
+		params->logicEdge = buf[PARAMETERS_LOGIC+3];
+	}
+	if (size>PARAMETERS_MEMSEG && buf[PARAMETERS_MEMSEG]) {
+		/* v3.3 and above - memory segments */
+		params->memsegs = buf[PARAMETERS_MEMSEG];
+	}
+	if (size>=PARAMETERS_TRIGGER + 3) {
+		/* v3.4 and above - trigger modes */
+		params->triggerMode = buf[PARAMETERS_TRIGGER];
+		params->triggerLevel2 = buf[PARAMETERS_TRIGGER+1];
+		params->triggerParam = buf[PARAMETERS_TRIGGER+2];
+	}
+	params->raw = buf;
+	params->raw_size = size;
+	return 0;
+}
+
+/* Longest a capture takes at these parameters: every segment filled,
+ after holdoff and the longest auto-trigger wait */
+static unsigned long capture_time(struct acq *acq, const unsigned char *buf,
+								  unsigned short size)
+{
+	unsigned long clock = acq->clock ? acq->clock : ACQ_DEFAULT_CLOCK;
+	double rate = get_parameters_sample_frequency(clock, buf, size);
+	double conversions;
+
+	/* Logic auto-trigger waits for polls, not conversions */
+	if (acq->logic)
+		return ACQ_CAPTURE_TIMEOUT_MS;
+	if (rate<=0)
+		return 0;
+	conversions = (double)(acq->numSamples + 255 + acq->params.holdoffSamples) *
+		(acq->memsegs ? acq->memsegs : 1);
+	return 2 * conversions * 1000 / rate;
+}
+
+static void process_parameters(struct acq *acq, unsigned char *buf,
+							   unsigned short size)
+{
+	struct acq_parameters params;
+
+	if (acq_parse_parameters(buf, size, &params)<0)
+		return;
+
+	acq->params = params;
+	acq->params.raw = NULL;
+	acq->params.raw_size = 0;
+	acq->numSamples = params.numSamples;
+	acq->channels = params.channels;
+	acq->flags = params.flags;
+	acq->logic = params.logicFlags & LOGIC_FLAG_ENABLE;
+	acq->memsegs = acq->logic ? 1 : params.memsegs;
+	acq->capture_ms = capture_time(acq, buf, size);
+
+	if (acq->filter)
+		filter_bank_set_rate(acq->filter,
+							 get_parameters_sample_frequency(acq->clock, buf, size));
+	if (acq->decoder)
+		decoder_set_rate(acq->decoder,
+						 get_parameters_sample_frequency(acq->clock, buf, size));
+	if (acq->average)
+		average_reset(acq->average);
+	if (acq->mask)
+		mask_reset(acq->mask);
+
+	if (acq->cb.parameters)
+		acq->cb.parameters(acq->data, &params);
+}
+
+static void request_capture(struct acq *acq)
+{
+	acq_send(acq, COMMAND_START_SAMPLING, NULL, 0);
+	acq->in_request = 1;
+	acq->request_ms = now_ms();
+	acq->request_gen = acq->settings_gen;
+}
+
+/* Capture will never arrive. Ask for another one, so we do not stall */
+static void capture_lost(struct acq *acq)
+{
+	acq->frames_lost++;
+	if (acq->freeze)
+		acq->in_request = 0;
+	else
+		request_capture(acq);
+}
+
+/* Receive next packets in a frame of our own. Kept as long as no
+ consumer holds it, so in steady state this is a refcount check. Only
+ between packets: parser writes to rx */
+static void renew_rx(struct acq *acq)
+{
+	if (acq->rx && !frame_shared(acq->rx))
+		return;
+	if (acq->rx)
+		frame_unref(acq->rx);
+	acq->rx = frame_get(acq->pool);
+	proto_set_buffer(&acq->parser, acq->rx ? acq->rx->data : NULL);
+}
+
+static void autoset_apply(struct acq *acq, const struct autoset_settings *cur,
+						  const struct autoset_settings *next)
+{
+	struct trigger_mode mode;
+
+	if (next->vref!=cur->vref)
+		acq_set_vref(acq, next->vref);
+	if (next->prescale!=cur->prescale || next->clocksel!=cur->clocksel ||
+		next->top!=cur->top) {
+		/* Prescaler first, so reply to sample rate reflects it */
+		acq_set_prescaler(acq, next->prescale);
+		if (next->clocksel!=TIMER_CLOCK_NONE || cur->clocksel!=TIMER_CLOCK_NONE)
+			acq_set_sample_rate(acq, next->clocksel, next->top);
+	}
+	if (next->trigger!=cur->trigger)
+		acq_set_trigger_level(acq, next->trigger);
+	/* Hysteresis only replaces a plain crossing trigger. Pulse, window
+	 and runt setups are the user's, and keep their mode */
+	if ((acq->version_major>3 || (acq->version_major==3 && acq->version_minor>=4)) &&
+		(acq->params.triggerMode==TRIGGER_MODE_EDGE ||
+		 acq->params.triggerMode==TRIGGER_MODE_HYSTERESIS)) {
+		if (acq->params.triggerMode!=TRIGGER_MODE_HYSTERESIS ||
+			next->hysteresis!=cur->hysteresis) {
+			mode.mode = TRIGGER_MODE_HYSTERESIS;
+			mode.level2 = 255;
+			mode.param = next->hysteresis;
+			acq_set_trigger_mode(acq, &mode);
+		}
+	}
+}
+
+/* One frame taken with settings autoset asked for */
+static void autoset_step(struct acq *acq, unsigned char *buf, size_t size,
+						 int triggered)
+{
+	struct autoset_analysis an;
+	struct autoset_settings cur, next;
+	unsigned channels = acq->channels ? acq->channels : 1;
+	int timer = acq->version_major>2 || (acq->version_major==2 && acq->version_minor>=3);
+	int changed, settled, signal;
+	double rate;
+
+	acq->autoset.captures++;
+	autoset_analyse(buf, size, channels, &an);
+	cur.vref = acq->params.adcref;
+	cur.prescale = acq->params.prescale;
+	cur.clocksel = acq->params.timerClock;
+	cur.top = acq->params.timerTop;
+	cur.trigger = acq->params.triggerLevel;
+	cur.hysteresis = acq->params.triggerMode==TRIGGER_MODE_HYSTERESIS ?
+		acq->params.triggerParam : 0;
+	changed = autoset_decide(acq->clock, timer, size / channels, &an, &cur, &next);
+
+	/* Done when this frame, at the settings proposed, did trigger */
+	signal = an.max - an.min >= AUTOSET_MIN_SWING;
+	settled = !changed && (triggered || !signal) &&
+		abs(next.trigger - cur.trigger) <= next.hysteresis + 1;
+	if (!settled && acq->autoset.captures < AUTOSET_MAX_CAPTURES) {
+		autoset_apply(acq, &cur, &next);
+		return;
+	}
+
+	acq->autoset.active = 0;
+	rate = autoset_rate(acq->clock, &cur);
+	if (!signal) {
+		acq_message(acq, "Autoset: no signal, in %u captures, %llu ms",
+					acq->autoset.captures, now_ms() - acq->autoset.start);
+	} else if (!settled) {
+		acq_message(acq, "Autoset: no stable trigger after %u captures, %llu ms",
+					acq->autoset.captures, now_ms() - acq->autoset.start);
+	} else {
+		acq_message(acq, "Autoset: %.4g Hz signal, %.4g samples/s, trigger %d, "
+					"in %u captures, %llu ms",
+					an.period>0 ? rate / an.period : 0, rate, cur.trigger,
+					acq->autoset.captures, now_ms() - acq->autoset.start);
+	}
+}
+
+/* buf is processed in place; it lies in f, unless pool was empty */
+static void process_frame(struct acq *acq, struct frame *f, unsigned char *buf,
+						  unsigned short size, uint64_t first)
+{
+	uint64_t t = trace_now();
+	const unsigned short *avg = NULL;
+	const struct decode_event *ev = NULL;
+	size_t events = 0;
+	int triggered = 1;
+	int failed = -1;
+	int whole;
+
+	acq->frames++;
+	acq->frame = f;
+	if (acq->first_frame_pending) {
+		acq->first_frame_pending = 0;
+		acq->first_frame_ms = now_ms() - acq->start_ms;
+		acq_message(acq, "First frame %lu ms after start", acq->first_frame_ms);
+	}
+	if (acq->cb.raw_frame)
+		acq->cb.raw_frame(acq->data, buf, size);
+	size = ingest_process(buf, size, acq->numSamples);
+	acq->memsegs_now = ingest_memsegs(buf, size, acq->numSamples, acq->memseg);
+	if (t) {
+		/* Device time, where frame carries one: conversions since first
+		 segment */
+		trace_span_arg(TRACE_READ, first, acq->trace_rx, acq->frames,
+					   acq->memsegs_now ? (long)acq->memseg[acq->memsegs_now - 1].time : -1);
+		trace_span(TRACE_PARSE, acq->trace_rx, t, acq->frames);
+	}
+	/* Trailer is only of interest to raw_frame, and averaging */
+	if (acq->numSamples && size>acq->numSamples) {
+		triggered = buf[acq->numSamples + TRAILER_TRIGGERED];
+		size = acq->numSamples;
+	}
+	/* Logic samples are bit fields, not levels. Segmented frames are
+	 not one aligned piece of signal, so mask and average skip them */
+	whole = !acq->logic && acq->memsegs_now==0;
+	if (acq->autoset.active && whole) {
+		/* Frames requested before last settings change tell nothing */
+		if (acq->request_gen==acq->settings_gen)
+			autoset_step(acq, buf, size, triggered);
+		if (acq->autoset.active) {
+			acq->frame = NULL;
+			acq->delay_request = 0;
+			request_capture(acq);
+			return;
+		}
+	}
+	if (acq->filter && !acq->logic)
+		filter_bank_process(acq->filter, buf, size, acq->channels ? acq->channels : 1);
+	if (acq->mask && whole) {
+		failed = mask_test(acq->mask, buf, size, triggered);
+		if (failed>0 && acq->mask_stop && !acq->freeze) {
+			acq->freeze = 1;
+			acq_message(acq, "Mask test failed, acquisition frozen");
+		}
+	}
+	if (acq->average && whole)
+		avg = average_add(acq->average, buf, size, triggered);
+	/* Decoding would run across segment boundaries. Segmented frames
+	 decode as empty, which clears previous events */
+	if (acq->decoder)
+		ev = decoder_process(acq->decoder, buf, acq->memsegs_now ? 0 : size,
+							 acq->channels, acq->logic, &events);
+	if (acq->cb.frame)
+		acq->cb.frame(acq->data, buf, size);
+	if (failed>=0 && acq->cb.masked)
+		acq->cb.masked(acq->data, acq->mask, failed);
+	if (ev && acq->cb.decoded)
+		acq->cb.decoded(acq->data, ev, events);
+	if (avg && acq->cb.average)
+		acq->cb.average(acq->data, avg, size);
+	acq->frame = NULL;
+	trace_span(TRACE_PROCESS, t, trace_now(), acq->frames);
+
+	if (acq->oneshot && !acq->delay_request) {
+		acq->in_request = 0;
+		if (acq->cb.trigger_done)
+			acq->cb.trigger_done(acq->data);
+	} else if (!acq->freeze) {
+		request_capture(acq);
+	} else {
+		acq->in_request = 0;
+	}
+	acq->delay_request = 0;
+}
+
+static void request_missing(struct acq *acq)
+{
+	unsigned char req[2];
+	unsigned i;
+
+	req[0] = acq->seg.id;
+	for (i=0; i<acq->seg.count; i++) {
+		if (acq->seg.received & (1<<i))
+			continue;
+		req[1] = i;
+		acq_send(acq, COMMAND_GET_SEGMENT, req, 2);
+		acq->segments_resent++;
+	}
+}
+
+static void process_segment(struct acq *acq, unsigned char *buf, unsigned short size)
+{
+	unsigned short crc = 0xffff;
+	unsigned short len, i;
+	unsigned char id, index, count;
+	unsigned char *data;
+
+	if (size<SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE) {
+		acq->crc_errors++;
+		return;
+	}
+	for (i=0; i<size - SEGMENT_CRC_SIZE; i++)
+		crc = proto_crc_ccitt_update(crc, buf[i]);
+	if (crc != ((buf[size-2]<<8) | buf[size-1])) {
+		/* Missing segment is requested once last one arrives, or on timeout */
+		acq->crc_errors++;
+		return;
+	}
+
+	id = buf[0];
+	index = buf[1];
+	count = buf[2];
+	len = size - SEGMENT_HEADER_SIZE - SEGMENT_CRC_SIZE;
+
+	if (count==0 || count>ACQ_MAX_SEGMENTS || index>=count || len>SEGMENT_SIZE ||
+		count * SEGMENT_SIZE > PROTO_MAX_PAYLOAD)
+		return;
+
+	if (!acq->seg.active || acq->seg.id!=id) {
+		if (!acq->seg.active && id==acq->seg.done_id)
+			return; /* Late duplicate of a completed capture */
+		if (acq->seg.active)
+			acq->frames_lost++;
+		acq->seg.active = 1;
+		acq->seg.id = id;
+		acq->seg.count = count;
+		acq->seg.received = 0;
+		acq->seg.size = 0;
+		acq->seg.retries = 0;
+		if (NULL==acq->seg.frame)
+			acq->seg.frame = frame_get(acq->pool);
+		acq->seg.trace_first = acq->trace_packet;
+	}
+
+	data = acq->seg.frame ? acq->seg.frame->data : acq->seg.buf;
+	memcpy(&data[index * SEGMENT_SIZE], &buf[SEGMENT_HEADER_SIZE], len);
+	acq->seg.received |= 1<<index;
+	acq->seg.last = now_ms();
+	if (index==count-1)
+		acq->seg.size = index * SEGMENT_SIZE + len;
+
+	if (acq->seg.received == (1<<count) - 1) {
+		acq->seg.active = 0;
+		acq->seg.done_id = id;
+		process_frame(acq, acq->seg.frame, data, acq->seg.size, acq->seg.trace_first);
+		if (acq->seg.frame && frame_shared(acq->seg.frame)) {
+			frame_unref(acq->seg.frame);
+			acq->seg.frame = NULL;
+		}
+	} else if (index==count-1) {
+		request_missing(acq);
+	}
+}
+
+static void set_options(struct acq *acq, unsigned char options)
+{
+	/* Both sides switch framing right after the reply */
+	acq->options = options;
+	proto_set_cobs(&acq->parser, options & PROTOCOL_OPTION_COBS);
+	acq_message(acq, "Segmented captures %s, COBS framing %s",
+				options & PROTOCOL_OPTION_SEGMENTS ? "enabled" : "disabled",
+				options & PROTOCOL_OPTION_COBS ? "enabled" : "disabled");
+}
+
+/* Handshake done, by whichever path. A reconnected device lost its
+ settings, so send them again before first capture */
+static void handshake_done(struct acq *acq)
+{
+	if (acq->connects++>0)
+		restore_settings(acq);
+	request_capture(acq);
+	set_state(acq, ACQ_SAMPLING);
+}
+
+static void process_hello(struct acq *acq, unsigned char *buf, unsigned short size)
+{
+	if (size<HELLO_PARAMETERS + 6) {
+		acq_message(acq, "Short hello reply");
+		return;
+	}
+	acq->version_major = buf[HELLO_VERSION];
+	acq->version_minor = buf[HELLO_VERSION+1];
+	acq->capabilities = buf[HELLO_CAPABILITIES];
+	acq_message(acq, "Got version: OSCOPE %d.%d", acq->version_major, acq->version_minor);
+	set_options(acq, buf[HELLO_OPTIONS]);
+	if (acq->probing) {
+		set_state(acq, ACQ_PROBED);
+		return;
+	}
+	if (acq->cb.version)
+		acq->cb.version(acq->data, acq->version_major, acq->version_minor);
+	process_parameters(acq, buf + HELLO_PARAMETERS, size - HELLO_PARAMETERS);
+	handshake_done(acq);
+}
+
+static void packet_error(void *data, unsigned char command, unsigned short size)
+{
+	struct acq *acq = data;
+
+	/* Command may be corrupt, or never received (0), so any error can
+	 be the capture. Segments are recovered by request_missing() */
+	if (acq->state==ACQ_SAMPLING && acq->in_request && !acq->seg.active)
+		capture_lost(acq);
+}
+
+static void process_packet(void *data, unsigned char command,
+						   unsigned char *buf, unsigned short size)
+{
+	struct acq *acq = data;
+
+	/* Next packet starts in the same read, at the earliest */
+	acq->trace_packet = acq->trace_first;
+	acq->trace_first = acq->trace_rx;
+
+	if (command==COMMAND_PARAMETERS_REPLY)
+		process_parameters(acq, buf, size);
+
+	if (command==COMMAND_HELLO_REPLY) {
+		if (acq->state==ACQ_HELLO)
+			process_hello(acq, buf, size);
+		return;
+	}
+
+	if (command==COMMAND_STATS_REPLY) {
+		/* Can arrive at any time, does not affect state */
+		process_stats(acq, buf, size);
+		return;
+	}
+
+	if (command==COMMAND_PROTOCOL_OPTIONS_REPLY) {
+		set_options(acq, size>0 ? buf[0] : 0);
+		if (acq->state==ACQ_NEGOTIATE) {
+			acq_send(acq, COMMAND_GET_PARAMETERS, NULL, 0);
+			set_state(acq, ACQ_GETPARAMETERS);
+		}
+		return;
+	}
+
+	switch(acq->state) {
+
+	case ACQ_HELLO:
+		if (command==COMMAND_ERROR) {
+			/* Before v3.5. Step by step, as below */
+			acq_message(acq, "Pinging device...");
+			acq_send(acq, COMMAND_PING, (const unsigned char*)"BABA", 4);
+			set_state(acq, ACQ_PING);
+		}
+		break;
+
+	case ACQ_PING:
+		if (command==COMMAND_PONG) {
+			acq_message(acq, "Got ping reply");
+			if (acq->probing) {
+				set_state(acq, ACQ_PROBED);
+				break;
+			}
+			/* Request version */
+			acq_send(acq, COMMAND_GET_VERSION, NULL, 0);
+			set_state(acq, ACQ_GETVERSION);
+		}
+		break;
+
+	case ACQ_GETVERSION:
+		if (command==COMMAND_VERSION_REPLY && size>=2) {
+			acq_message(acq, "Got version: OSCOPE %d.%d", buf[0], buf[1]);
+			acq->version_major = buf[0];
+			acq->version_minor = buf[1];
+			if (acq->cb.version)
+				acq->cb.version(acq->data, buf[0], buf[1]);
+			if (buf[0]>=3 && acq->want_options) {
+				/* Nothing else may be sent until framing is agreed */
+				acq_send(acq, COMMAND_SET_PROTOCOL_OPTIONS, &acq->want_options, 1);
+				set_state(acq, ACQ_NEGOTIATE);
+			} else {
+				acq_send(acq, COMMAND_GET_PARAMETERS, NULL, 0);
+				set_state(acq, ACQ_GETPARAMETERS);
+			}
+		} else {
+			acq_message(acq, "Invalid packet %d", command);
+		}
+		break;
+
+	case ACQ_NEGOTIATE:
+		break;
+
+	case ACQ_GETPARAMETERS:
+		handshake_done(acq);
+		break;
+
+	case ACQ_SAMPLING:
+		if (command==COMMAND_BUFFER_SEG) {
+			process_frame(acq, acq->rx, buf, size, acq->trace_packet);
+			renew_rx(acq);
+		} else if (command==COMMAND_FRAME_SEGMENT)
+			process_segment(acq, buf, size);
+		break;
+
+	case ACQ_PROBED:
+	case ACQ_DISCONNECTED:
+		break;
+	}
+}
+
+/* Device path was given, so try to open it again later. Probing has its
+ own timeout, and drops devices that go away */
+static int device_lost(struct acq *acq)
+{
+	if (NULL==acq->device || acq->probing)
+		return -1;
+	close(acq->fd);
+	acq->fd = -1;
+	acq->in_request = 0;
+	acq->seg.active = 0;
+	proto_reset(&acq->parser);
+	set_state(acq, ACQ_DISCONNECTED);
+	acq_message(acq, "Device '%s' lost, reconnecting", acq->device);
+	return 0;
+}
+
+static int open_device(const char *device);
+
+static void reconnect(struct acq *acq)
+{
+	int fd = open_device(acq->device);
+
+	if (fd<0) {
+		set_state(acq, ACQ_DISCONNECTED);
+		return;
+	}
+	acq->fd = fd;
+	acq_message(acq, "Device '%s' is back", acq->device);
+	if (acq->cb.connected)
+		acq->cb.connected(acq->data, fd);
+	acq_start(acq);
+}
+
+void acq_tick(struct acq *acq)
+{
+	unsigned long long now = now_ms();
+
+	switch (acq->state) {
+	case ACQ_DISCONNECTED:
+		if (now - acq->state_start >= ACQ_RECONNECT_MS)
+			reconnect(acq);
+		return;
+	case ACQ_HELLO:
+		/* Quietly, device may take a while to start */
+		if (now - acq->state_start > ACQ_HELLO_TIMEOUT_MS)
+			acq_start(acq);
+		return;
+	case ACQ_PING:
+	case ACQ_GETVERSION:
+	case ACQ_NEGOTIATE:
+	case ACQ_GETPARAMETERS:
+		/* Reply lost. After protocol options, we cannot even tell which
+		 framing firmware uses */
+		if (now - acq->state_start > ACQ_HANDSHAKE_TIMEOUT_MS) {
+			acq_message(acq, "No reply to handshake, restarting");
+			acq_start(acq);
+			return;
+		}
+		break;
+	case ACQ_SAMPLING:
+	case ACQ_PROBED:
+		break;
+	}
+
+	if (proto_in_packet(&acq->parser) && now - acq->last_rx > ACQ_PACKET_TIMEOUT_MS) {
+		proto_reset(&acq->parser);
+		acq->resyncs++;
+		if (acq->state==ACQ_SAMPLING && acq->in_request && !acq->seg.active)
+			capture_lost(acq);
+	}
+
+	/* Request, or capture, lost without a trace. Single shot waits for
+	 a trigger as long as it takes */
+	if (acq->state==ACQ_SAMPLING && acq->in_request && !acq->oneshot &&
+		!acq->seg.active && !proto_in_packet(&acq->parser) &&
+		now - acq->request_ms > ACQ_CAPTURE_TIMEOUT_MS + acq->capture_ms) {
+		acq_message(acq, "No capture after %llu ms, requesting again",
+					now - acq->request_ms);
+		capture_lost(acq);
+	}
+
+	if (acq->seg.active && now - acq->seg.last > ACQ_SEGMENT_TIMEOUT_MS) {
+		if (acq->seg.retries++ < ACQ_SEGMENT_RETRIES) {
+			request_missing(acq);
+			acq->seg.last = now;
+		} else {
+			acq->seg.active = 0;
+			capture_lost(acq);
+		}
+	}
+}
+
+void acq_set_protocol_options(struct acq *acq, unsigned char options)
+{
+	acq->want_options = options;
+}
+
+void acq_feed(struct acq *acq, const unsigned char *buf, size_t size)
+{
+	uint64_t t = trace_now();
+
+	acq->last_rx = now_ms();
+	if (t) {
+		acq->trace_rx = t;
+		if (!proto_in_packet(&acq->parser))
+			acq->trace_first = t;
+	}
+	/* Pool was empty last time */
+	if (NULL==acq->rx && !proto_in_packet(&acq->parser))
+		renew_rx(acq);
+	proto_parse(&acq->parser, buf, size);
+}
+
+int acq_read(struct acq *acq)
+{
+	unsigned char buf[512];
+	ssize_t r;
+
+	for (;;) {
+		r = read(acq->fd, buf, sizeof(buf));
+		if (r>0) {
+			acq_feed(acq, buf, r);
+			continue;
+		}
+		if (r==0)
+			return device_lost(acq);
+		if (errno==EINTR)
+			continue;
+		if (errno==EAGAIN)
+			return 0;
+		return device_lost(acq);
+	}
+}
+
+struct acq *acq_new(int fd, const struct acq_callbacks *cb, void *data)
+{
+	struct acq *acq = calloc(1, sizeof(struct acq));
+
+	if (NULL==acq)
+		return NULL;
+
+	acq->fd = fd;
+	acq->state = ACQ_HELLO;
+	if (cb)
+		acq->cb = *cb;
+	acq->data = data;
+	acq->pool = frame_pool_new(ACQ_FRAME_POOL);
+	if (NULL==acq->pool) {
+		free(acq);
+		return NULL;
+	}
+	proto_parser_init(&acq->parser, &process_packet, acq);
+	renew_rx(acq);
+	acq->parser.error = &packet_error;
+	acq->want_options = PROTOCOL_OPTION_SEGMENTS | PROTOCOL_OPTION_COBS;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return acq;
+}
+
+/* Open serial port raw, 115200 baud. Returns -1 with errno set */
+static int open_device(const char *device)
+{
+	struct termios termset;
+	int fd;
+
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd<0)
+		return -1;
+
+	if (tcgetattr(fd, &termset)==0) {
+		termset.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
+							 | INLCR | IGNCR | ICRNL | IXON);
+		termset.c_oflag &= ~OPOST;
+		termset.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+		termset.c_cflag &= ~(CSIZE | PARENB);
+		termset.c_cflag |= CS8;
+
+		cfsetospeed(&termset,B115200);
+		cfsetispeed(&termset,B115200);
+
+		tcsetattr(fd,TCSANOW,&termset);
+	}
+	return fd;
+}
+
+struct acq *acq_open(const char *device, const struct acq_callbacks *cb,
+					 void *data)
+{
+	struct acq *acq;
+	int fd;
+
+	fd = open_device(device);
+	if (fd<0) {
+		perror("open");
+		return NULL;
+	}
+
+	acq = acq_new(fd, cb, data);
+	if (NULL==acq) {
+		close(fd);
+		return NULL;
+	}
+	acq->device = strdup(device);
+	if (NULL==acq->device) {
+		acq_close(acq);
+		return NULL;
+	}
+	acq_message(acq, "Opened device '%s'", device);
+	return acq;
+}
+
+void acq_close(struct acq *acq)
+{
+	if (acq->fd>=0)
+		close(acq->fd);
+	if (acq->rx)
+		frame_unref(acq->rx);
+	if (acq->seg.frame)
+		frame_unref(acq->seg.frame);
+	frame_pool_free(acq->pool);
+	free(acq->device);
+	free(acq);
+}
+
+struct acq *acq_probe(const char *const *devices, size_t count, unsigned timeout_ms,
+					  const struct acq_callbacks *cb, void *data)
+{
+	struct acq *acq[ACQ_PROBE_MAX], *found = NULL;
+	struct pollfd pfd[ACQ_PROBE_MAX];
+	unsigned long long end;
+	glob_t g;
+	size_t n = 0, i, j;
+	int fd;
+
+	if (NULL==devices) {
+		memset(&g, 0, sizeof(g));
+		glob("/dev/ttyUSB*", 0, NULL, &g);
+		glob("/dev/ttyACM*", GLOB_APPEND, NULL, &g);
+		devices = (const char *const *)g.gl_pathv;
+		count = g.gl_pathc;
+	}
+
+	/* Each port gets its own handshake, stopping at first reply */
+	for (i=0; i<count && n<ACQ_PROBE_MAX; i++) {
+		fd = open_device(devices[i]);
+		if (fd<0)
+			continue;
+		acq[n] = acq_new(fd, NULL, NULL);
+		if (NULL==acq[n]) {
+			close(fd);
+			continue;
+		}
+		acq[n]->device = strdup(devices[i]);
+		if (NULL==acq[n]->device) {
+			acq_close(acq[n]);
+			continue;
+		}
+		acq[n]->probing = 1;
+		if (acq_start(acq[n])<0) {
+			acq_close(acq[n]);
+			continue;
+		}
+		n++;
+	}
+
+	end = now_ms() + timeout_ms;
+	while (NULL==found && n>0 && now_ms()<end) {
+		for (i=0; i<n; i++) {
+			pfd[i].fd = acq_get_fd(acq[i]);
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, n, ACQ_TICK_MS)<0 && errno!=EINTR)
+			break;
+		for (i=j=0; i<n; i++) {
+			if ((pfd[i].revents && acq_read(acq[i])<0)) {
+				acq_close(acq[i]);
+				continue;
+			}
+			acq_tick(acq[i]);
+			if (NULL==found && acq[i]->state==ACQ_PROBED)
+				found = acq[i];
+			acq[j++] = acq[i];
+		}
+		n = j;
+	}
+	for (i=0; i<n; i++)
+		if (acq[i]!=found)
+			acq_close(acq[i]);
+	if (devices==(const char *const *)g.gl_pathv)
+		globfree(&g);
+
+	if (NULL==found)
+		return NULL;
+	found->probing = 0;
+	if (cb)
+		found->cb = *cb;
+	found->data = data;
+	acq_message(found, "Found device '%s'", found->device);
+	return found;
+}
+
+int acq_start(struct acq *acq)
+{
+	unsigned char zero[ACQ_RESET_ZEROS];
+
+	/* A run of zeroes resets the firmware packet parser, and brings it
+	 back to size-prefixed framing */
+	memset(zero, 0, sizeof(zero));
+	acq->options = 0;
+	proto_set_cobs(&acq->parser, 0);
+	set_state(acq, ACQ_HELLO);
+	acq->in_request = 0;
+	acq->delay_request = 0;
+	acq->seg.active = 0;
+	if (!acq->first_frame_pending) {
+		/* Retries count from first attempt */
+		acq->start_ms = now_ms();
+		acq->first_frame_pending = 1;
+	}
+	if (acq_write(acq, zero, sizeof(zero))<0)
+		return -1;
+	return acq_send(acq, COMMAND_HELLO, &acq->want_options, 1);
+}
+
+/* Commands below that do not get a parameters reply, so acq->params is
+ updated here; autoset works from it. Frames taken before and after do
+ not belong in the same average, nor learned mask */
+static void settings_changed(struct acq *acq)
+{
+	if (acq->average)
+		average_reset(acq->average);
+	if (acq->mask)
+		mask_reset(acq->mask);
+}
+
+int acq_set_trigger_level(struct acq *acq, unsigned char trig)
+{
+	settings_changed(acq);
+	acq->params.triggerLevel = trig;
+	return acq_send(acq, COMMAND_SET_TRIGGER, &trig, 1);
+}
+
+int acq_set_holdoff(struct acq *acq, unsigned char holdoff)
+{
+	settings_changed(acq);
+	acq->params.holdoffSamples = holdoff;
+	return acq_send(acq, COMMAND_SET_HOLDOFF, &holdoff, 1);
+}
+
+int acq_set_prescaler(struct acq *acq, unsigned char prescaler)
+{
+	settings_changed(acq);
+	acq->params.prescale = prescaler;
+	return acq_send(acq, COMMAND_SET_PRESCALER, &prescaler, 1);
+}
+
+int acq_set_vref(struct acq *acq, unsigned char vref)
+{
+	settings_changed(acq);
+	acq->params.adcref = vref;
+	return acq_send(acq, COMMAND_SET_VREF, &vref, 1);
+}
+
+int acq_set_trigger_invert(struct acq *acq, int active)
+{
+	if (active)
+		acq->flags |= FLAG_INVERT_TRIGGER;
+	else
+		acq->flags &= ~FLAG_INVERT_TRIGGER;
+	return acq_send(acq, COMMAND_SET_FLAGS, &acq->flags, 1);
+}
+
+int acq_set_channels(struct acq *acq, int channels)
+{
+	unsigned char c = channels;
+
+	if (channels<1 || channels>4)
+		return -1;
+	return acq_send(acq, COMMAND_SET_CHANNELS, &c, 1);
+}
+
+int acq_set_sample_rate(struct acq *acq, unsigned char clocksel,
+						unsigned short top)
+{
+	unsigned char buf[3];
+	buf[0] = clocksel;
+	buf[1] = top >> 8;
+	buf[2] = top & 0xff;
+	return acq_send(acq, COMMAND_SET_SAMPLE_RATE, buf, 3);
+}
+
+int acq_get_stats(struct acq *acq, int reset)
+{
+	unsigned char flags = reset ? STATS_FLAG_RESET : 0;
+	return acq_send(acq, COMMAND_GET_STATS, &flags, 1);
+}
+
+int acq_set_logic(struct acq *acq, int enable, const struct logic_trigger *trig)
+{
+	unsigned char buf[4];
+
+	if (acq->version_major<3 || (acq->version_major==3 && acq->version_minor<2)) {
+		acq_message(acq, "Logic analyzer mode needs firmware 3.2 or later");
+		return -1;
+	}
+	settings_changed(acq);
+	buf[0] = enable ? LOGIC_FLAG_ENABLE : 0;
+	buf[1] = trig ? trig->mask : 0;
+	buf[2] = trig ? trig->value : 0;
+	buf[3] = trig ? trig->edge : 0;
+	return acq_send(acq, COMMAND_SET_LOGIC, buf, 4);
+}
+
+int acq_set_memseg(struct acq *acq, unsigned count)
+{
+	unsigned char c = count;
+
+	if (acq->version_major<3 || (acq->version_major==3 && acq->version_minor<3)) {
+		acq_message(acq, "Memory segments need firmware 3.3 or later");
+		return -1;
+	}
+	if (count<1 || count>MEMSEG_MAX) {
+		acq_message(acq, "Memory segments must be 1 to %d", MEMSEG_MAX);
+		return -1;
+	}
+	settings_changed(acq);
+	return acq_send(acq, COMMAND_SET_MEMSEG, &c, 1);
+}
+
+int acq_set_trigger_mode(struct acq *acq, const struct trigger_mode *mode)
+{
+	unsigned char buf[3];
+
+	if (acq->version_major<3 || (acq->version_major==3 && acq->version_minor<4)) {
+		if (!mode || mode->mode==TRIGGER_MODE_EDGE)
+			return 0;
+		acq_message(acq, "Trigger modes need firmware 3.4 or later");
+		return -1;
+	}
+	settings_changed(acq);
+	buf[0] = mode ? mode->mode : TRIGGER_MODE_EDGE;
+	buf[1] = mode ? mode->level2 : 255;
+	buf[2] = mode ? mode->param : 0;
+	return acq_send(acq, COMMAND_SET_TRIGGER_MODE, buf, 3);
+}
+
+void acq_set_oneshot(struct acq *acq, int enable)
+{
+	unsigned char tvalue = enable ? 0 : 100;
+
+	acq->oneshot = enable;
+	acq_send(acq, COMMAND_SET_AUTOTRIG, &tvalue, 1);
+
+	if (acq->in_request)
+		acq->delay_request = 1;
+	else
+		request_capture(acq);
+}
+
+void acq_set_filter(struct acq *acq, struct filter_bank *fb, unsigned long clock)
+{
+	acq->filter = fb;
+	acq->clock = clock;
+}
+
+void acq_set_decoder(struct acq *acq, struct decoder *dec, unsigned long clock)
+{
+	acq->decoder = dec;
+	acq->clock = clock;
+}
+
+void acq_set_average(struct acq *acq, struct average *avg)
+{
+	acq->average = avg;
+}
+
+void acq_set_mask(struct acq *acq, struct mask *mask, int stop)
+{
+	acq->mask = mask;
+	acq->mask_stop = stop;
+}
+
+void acq_set_freeze(struct acq *acq, int freeze)
+{
+	acq->freeze = freeze;
+}
+
+int acq_autoset(struct acq *acq, unsigned long clock)
+{
+	if (acq->logic || acq->memsegs>1) {
+		acq_message(acq, "Autoset needs plain analog captures");
+		return -1;
+	}
+	acq->clock = clock;
+	acq->autoset.active = 1;
+	acq->autoset.captures = 0;
+	acq->autoset.start = now_ms();
+	/* Frozen or after single shot, nothing is on its way */
+	if (acq->state==ACQ_SAMPLING && !acq->in_request)
+		request_capture(acq);
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __ACQ_H__
+#define __ACQ_H__
+
+#include <stddef.h>
+#include "proto.h"
+#include "frame.h"
+#include "trace.h"
+#include "ingest.h"
+#include "../protocol.h"
+
+struct filter_bank;
+struct average;
+struct logic_trigger;
+struct trigger_mode;
+struct decoder;
+struct decode_event;
+struct mask;
+
+/* Acquisition core. Owns one device file descriptor, runs the protocol
+ state machine and hands results to the caller through callbacks. No
+ GTK nor glib here, so it can be driven from any event loop. */
+
+/* Firmware performance counters (COMMAND_STATS_REPLY), plus host-side
+ receive counters */
+struct acq_stats {
+	unsigned long conversions;
+	unsigned long stored;
+	unsigned long missed;
+	unsigned long autoTriggers;
+	unsigned long realTriggers;
+	unsigned long txStallUs;
+	unsigned short maxIsrCycles;
+	unsigned short rxChecksumErrors;
+	unsigned short rxOversize;
+
+	unsigned long hostFrames;
+	unsigned long hostChecksumErrors;
+	unsigned long hostCrcErrors;
+	unsigned long hostSegmentsResent;
+	unsigned long hostFramesLost;
+};
+
+/* Decoded COMMAND_PARAMETERS_REPLY */
+struct acq_parameters {
+	unsigned char triggerLevel;
+	unsigned char holdoffSamples;
+	unsigned char adcref;
+	unsigned char prescale;
+	unsigned short numSamples;
+	unsigned char flags;
+	unsigned char channels;
+	unsigned char timerClock;
+	unsigned short timerTop;
+	/* Logic analyzer mode (v3.2), see COMMAND_SET_LOGIC */
+	unsigned char logicFlags;
+	unsigned char logicMask;
+	unsigned char logicValue;
+	unsigned char logicEdge;
+	/* Memory segments (v3.3), 1 if not segmented */
+	unsigned char memsegs;
+	/* Trigger mode (v3.4), see COMMAND_SET_TRIGGER_MODE */
+	unsigned char triggerMode;
+	unsigned char triggerLevel2;
+	unsigned char triggerParam;
+
+	/* Undecoded reply, for recording */
+	const unsigned char *raw;
+	size_t raw_size;
+};
+
+struct acq_callbacks {
+	/* Device answered handshake */
+	void (*version)(void *data, unsigned char major, unsigned char minor);
+	void (*parameters)(void *data, const struct acq_parameters *params);
+	/* Frame as received, before ingest (trailer included) */
+	void (*raw_frame)(void *data, const unsigned char *buf, size_t size);
+	/* Frame after ingest, ready to display. Samples only, no trailer */
+	void (*frame)(void *data, unsigned char *buf, size_t size);
+	/* Average of triggered frames, 8.8 fixed point, see acq_set_average().
+	 Called after frame callback, unless frame was auto-triggered */
+	void (*average)(void *data, const unsigned short *buf, size_t size);
+	/* Bus decoder output for a frame, see acq_set_decoder(). Called after
+	 frame callback, even if nothing was decoded */
+	void (*decoded)(void *data, const struct decode_event *ev, size_t count);
+	/* Frame was mask tested, see acq_set_mask(). failed is number of
+	 samples outside mask. Called after frame callback */
+	void (*masked)(void *data, const struct mask *mask, int failed);
+	void (*stats)(void *data, const struct acq_stats *stats);
+	/* Oneshot capture completed */
+	void (*trigger_done)(void *data);
+	/* Lost device was opened again, on a new descriptor. Handshake
+	 follows, and settings sent before are sent again */
+	void (*connected)(void *data, int fd);
+	/* Informational messages */
+	void (*message)(void *data, const char *msg);
+};
+
+/* acq_tick() should be called at least this often */
+#define ACQ_TICK_MS            100
+/* Partial packet abandoned after this long without input */
+#define ACQ_PACKET_TIMEOUT_MS  500
+/* Missing segments requested again after this long */
+#define ACQ_SEGMENT_TIMEOUT_MS 250
+#define ACQ_SEGMENT_RETRIES    3
+/* COMMAND_HELLO sent again if no reply; device may still be in
+ bootloader */
+#define ACQ_HELLO_TIMEOUT_MS   250
+/* Handshake restarted if any other step gets no reply */
+#define ACQ_HANDSHAKE_TIMEOUT_MS 1000
+/* Capture given up on, and requested again, after this long plus
+ twice the time the capture itself takes. Covers transfer */
+#define ACQ_CAPTURE_TIMEOUT_MS 1000
+/* CPU frequency assumed for capture time, until one is set */
+#define ACQ_DEFAULT_CLOCK      16000000
+/* Lost device is opened again this often */
+#define ACQ_RECONNECT_MS       500
+/* Zeroes sent by reset procedure. Firmware needs more than its packet
+ size limit, and a run longer than its receive buffer may be cut short */
+#define ACQ_RESET_ZEROS        32
+#define ACQ_MAX_SEGMENTS       16
+/* Frame buffers per device: one receiving, one collecting segments, the
+ rest held by consumers */
+#define ACQ_FRAME_POOL         16
+/* Ports tried at once by acq_probe() */
+#define ACQ_PROBE_MAX          16
+#define ACQ_PROBE_TIMEOUT_MS   3000
+/* Commands whose last payload is kept and sent again on reconnect */
+#define ACQ_MAX_SETTINGS       12
+#define ACQ_SETTING_SIZE       4
+
+enum acq_state {
+	ACQ_HELLO,
+	ACQ_PING,
+	ACQ_GETVERSION,
+	ACQ_NEGOTIATE,
+	ACQ_GETPARAMETERS,
+	ACQ_SAMPLING,
+	/* Answered acq_probe(), waiting for acq_start() */
+	ACQ_PROBED,
+	/* Device went away, see ACQ_RECONNECT_MS */
+	ACQ_DISCONNECTED
+};
+
+struct acq {
+	int fd;
+	/* Path, if opened by acq_open(), so it can be opened again */
+	char *device;
+	struct proto_parser parser;
+	/* Packets are received in rx. Frame being delivered is frame, see
+	 acq_get_frame() */
+	struct frame_pool *pool;
+	struct frame *rx;
+	struct frame *frame;
+	enum acq_state state;
+	unsigned long long state_start;
+	int probing;
+	/* Handshakes completed, and time to first frame of the last one */
+	unsigned long connects;
+	unsigned long long start_ms;
+	int first_frame_pending;
+	unsigned long first_frame_ms;
+	struct {
+		int valid;
+		unsigned char size;
+		unsigned char buf[ACQ_SETTING_SIZE];
+	} settings[ACQ_MAX_SETTINGS];
+
+	int in_request;
+	/* When capture was requested, and how long it should take */
+	unsigned long long request_ms;
+	unsigned long capture_ms;
+	int delay_request;
+	int freeze;
+	int oneshot;
+	unsigned char flags;
+	unsigned short numSamples;
+	unsigned char channels;
+	unsigned char logic;
+	unsigned char memsegs;
+	unsigned long frames;
+	/* Memory segments of frame being delivered, see acq_get_memsegs() */
+	struct ingest_memseg memseg[MEMSEG_MAX];
+	unsigned memsegs_now;
+
+	/* Protocol v3 options, requested and in use. Capabilities are
+	 CAPABILITY_*, from COMMAND_HELLO_REPLY (v3.5), 0 before that */
+	unsigned char version_major;
+	unsigned char version_minor;
+	unsigned char capabilities;
+	unsigned char want_options;
+	unsigned char options;
+	struct {
+		int active;
+		unsigned char id;
+		unsigned char done_id;
+		unsigned char count;
+		unsigned short received;
+		size_t size;
+		unsigned retries;
+		unsigned long long last;
+		/* First byte of first segment read, see trace.h */
+		uint64_t trace_first;
+		/* Segments go to frame, or buf if pool is empty */
+		struct frame *frame;
+		unsigned char buf[PROTO_MAX_PAYLOAD];
+	} seg;
+	unsigned long long last_rx;
+	unsigned long crc_errors;
+	unsigned long segments_resent;
+	unsigned long frames_lost;
+	unsigned long resyncs;
+
+	/* Applied to frames before frame callback, see acq_set_filter() */
+	struct filter_bank *filter;
+	struct average *average;
+	struct decoder *decoder;
+	struct mask *mask;
+	int mask_stop;
+	/* Target CPU frequency, gives sample rate for filter and decoder */
+	unsigned long clock;
+
+	/* Tracing: time of last read, and of read holding first byte of
+	 packet being parsed, and of packet just parsed */
+	uint64_t trace_rx;
+	uint64_t trace_first;
+	uint64_t trace_packet;
+
+	/* Last parameters reply, without raw */
+	struct acq_parameters params;
+	/* Bumped by each settings command. A frame belongs to the settings
+	 in force when it was requested */
+	unsigned long settings_gen;
+	unsigned long request_gen;
+	/* See acq_autoset() */
+	struct {
+		int active;
+		unsigned captures;
+		unsigned long long start;
+	} autoset;
+
+	struct acq_callbacks cb;
+	void *data;
+};
+
+/* Open and configure a serial device. Returns NULL on error */
+struct acq *acq_open(const char *device, const struct acq_callbacks *cb,
+					 void *data);
+/* Wrap an already opened descriptor (pty, socket, pipe). Such devices
+ are not reconnected */
+struct acq *acq_new(int fd, const struct acq_callbacks *cb, void *data);
+void acq_close(struct acq *acq);
+
+/* Open whichever of devices answers first, trying all at once, and close
+ the others. NULL devices tries /dev/ttyUSB* and /dev/ttyACM*. Returns
+ NULL if none answers within timeout_ms. Call acq_start() afterwards, as
+ with acq_open() */
+struct acq *acq_probe(const char *const *devices, size_t count, unsigned timeout_ms,
+					  const struct acq_callbacks *cb, void *data);
+
+/* -1 while device is lost */
+static inline int acq_get_fd(const struct acq *acq)
+{
+	return acq->fd;
+}
+
+/* Reset target and start handshake. Sampling starts on its own once
+ parameters are known */
+int acq_start(struct acq *acq);
+
+/* Handle timeouts: stalled packets, missing segments, handshake steps
+ and reconnecting */
+void acq_tick(struct acq *acq);
+
+/* Milliseconds from acq_start() to first frame, 0 until it arrives */
+static inline unsigned long acq_get_first_frame_ms(const struct acq *acq)
+{
+	return acq->first_frame_pending ? 0 : acq->first_frame_ms;
+}
+
+/* Protocol options (PROTOCOL_OPTION_*) to request from v3 firmware.
+ Default is all of them. Call before acq_start() */
+void acq_set_protocol_options(struct acq *acq, unsigned char options);
+
+/* Read whatever is available on the descriptor and process it. Returns
+ -1 on EOF or error, unless device can be opened again: then it is
+ closed, and reopened from acq_tick() */
+int acq_read(struct acq *acq);
+void acq_feed(struct acq *acq, const unsigned char *buf, size_t size);
+
+int acq_send(struct acq *acq, unsigned char command,
+			 const unsigned char *buf, unsigned short size);
+
+int acq_set_trigger_level(struct acq *acq, unsigned char trig);
+int acq_set_holdoff(struct acq *acq, unsigned char holdoff);
+int acq_set_prescaler(struct acq *acq, unsigned char prescaler);
+int acq_set_vref(struct acq *acq, unsigned char vref);
+int acq_set_trigger_invert(struct acq *acq, int active);
+int acq_set_channels(struct acq *acq, int channels);
+int acq_set_sample_rate(struct acq *acq, unsigned char clocksel,
+						unsigned short top);
+int acq_get_stats(struct acq *acq, int reset);
+/* Capture a digital port instead of ADC (v3.2). Frames then hold one
+ byte per sample, one bit per line; filter and average are skipped */
+int acq_set_logic(struct acq *acq, int enable, const struct logic_trigger *trig);
+/* Split captures into count segments, each filled by its own trigger
+ (v3.3). 1 turns it off */
+int acq_set_memseg(struct acq *acq, unsigned count);
+/* Select analog trigger mode (v3.4), see trigger.h. NULL sets plain edge */
+int acq_set_trigger_mode(struct acq *acq, const struct trigger_mode *mode);
+void acq_set_oneshot(struct acq *acq, int enable);
+void acq_set_freeze(struct acq *acq, int freeze);
+
+/* Pick ADC reference, sample rate and trigger level for first channel,
+ see autoset.h. Frames are held back from callbacks until done, which is
+ reported as a message. clock is target CPU frequency */
+int acq_autoset(struct acq *acq, unsigned long clock);
+
+/* Filter frames before they reach frame callback; raw_frame still gets
+ them unfiltered. fb holds filter state, so each device needs its own.
+ It is not freed by acq_close(). clock is target CPU frequency, used to
+ work out sample rate */
+void acq_set_filter(struct acq *acq, struct filter_bank *fb, unsigned long clock);
+
+/* Average triggered frames, after filtering, and hand result to average
+ callback. Average restarts when settings change. Like filter, it is not
+ freed by acq_close() */
+void acq_set_average(struct acq *acq, struct average *avg);
+
+/* Decode serial buses in frames, after filtering, and hand events to
+ decoded callback. Not freed by acq_close(). clock as for
+ acq_set_filter() */
+void acq_set_decoder(struct acq *acq, struct decoder *dec, unsigned long clock);
+
+/* Test frames against mask, after filtering, and hand result to masked
+ callback. If stop is set, first failing frame freezes acquisition, as
+ acq_set_freeze() does. Mask restarts learning when settings change. Not
+ freed by acq_close() */
+void acq_set_mask(struct acq *acq, struct mask *mask, int stop);
+
+/* Memory segments of frame being delivered, valid during frame callback.
+ Returns NULL, count 0, if frame is not segmented */
+static inline const struct ingest_memseg *acq_get_memsegs(const struct acq *acq,
+														  unsigned *count)
+{
+	*count = acq->memsegs_now;
+	return acq->memsegs_now ? acq->memseg : NULL;
+}
+
+/* Pool frame holding the data passed to frame callback, valid during the
+ callback. Take a reference with frame_ref() to keep it without copying.
+ NULL if pool was empty; data must be copied then */
+static inline struct frame *acq_get_frame(const struct acq *acq)
+{
+	return acq->frame;
+}
+
+static inline int acq_in_request(const struct acq *acq)
+{
+	return acq->in_request;
+}
+
+/* Decode a COMMAND_PARAMETERS_REPLY payload. Returns -1 if too short */
+int acq_parse_parameters(const unsigned char *buf, size_t size,
+						 struct acq_parameters *params);
+
+#endif
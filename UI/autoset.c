@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <math.h>
+#include "autoset.h"
+#include "sampling.h"
+#include "../protocol.h"
+
+void autoset_analyse(const unsigned char *buf, size_t size, unsigned channels,
+					 struct autoset_analysis *an)
+{
+	unsigned char bmin = 255, bmax = 0, level, hyst;
+	unsigned long sum = 0;
+	size_t n, i, first = 0, last = 0;
+	int armed = 0;
+
+	if (channels<1)
+		channels = 1;
+	n = size / channels;
+	an->min = 255;
+	an->max = 0;
+	an->noise = 255;
+	an->crossings = 0;
+	an->period = 0;
+	an->mean = 0;
+	if (n==0)
+		return;
+
+	for (i=0; i<n; i++) {
+		unsigned char v = buf[i * channels];
+		if (v<an->min)
+			an->min = v;
+		if (v>an->max)
+			an->max = v;
+		sum += v;
+		if (v<bmin)
+			bmin = v;
+		if (v>bmax)
+			bmax = v;
+		if ((i + 1) % AUTOSET_NOISE_BLOCK==0) {
+			if (bmax - bmin < an->noise)
+				an->noise = bmax - bmin;
+			bmin = 255;
+			bmax = 0;
+		}
+	}
+	if (an->noise==255)
+		an->noise = an->max - an->min;
+	an->mean = (double)sum / n;
+
+	/* Crossing counts once signal went below level - hyst, so noise on
+	 a slow edge does not count twice */
+	level = (an->min + an->max + 1) / 2;
+	hyst = an->noise + 1;
+	if (hyst > (an->max - an->min) / 4)
+		hyst = (an->max - an->min) / 4;
+	for (i=0; i<n; i++) {
+		unsigned char v = buf[i * channels];
+		if (v + hyst < level) {
+			armed = 1;
+		} else if (armed && v>=level) {
+			armed = 0;
+			if (an->crossings++==0)
+				first = i;
+			last = i;
+		}
+	}
+	if (an->crossings>=2)
+		an->period = (double)(last - first) / (an->crossings - 1);
+}
+
+double autoset_rate(unsigned long clock, const struct autoset_settings *s)
+{
+	if (s->clocksel!=TIMER_CLOCK_NONE)
+		return get_timer_sample_frequency(clock, s->clocksel, s->top);
+	return get_sample_frequency(clock, 1UL<<s->prescale);
+}
+
+/* Settings closest to rate: free-running if a prescaler gets near
+ enough, timer-triggered below the slowest free-running rate */
+static void set_rate(unsigned long clock, int timer, double rate,
+					 struct autoset_settings *s)
+{
+	double best = 0, err;
+	unsigned char p;
+
+	s->clocksel = TIMER_CLOCK_NONE;
+	s->top = 0;
+	if (timer && rate < get_sample_frequency(clock, 1UL<<7) / AUTOSET_RATE_SLACK &&
+		get_timebase_settings(clock, rate, &s->prescale, &s->clocksel, &s->top)==0)
+		return;
+	s->clocksel = TIMER_CLOCK_NONE;
+	s->top = 0;
+	for (p=2; p<=7; p++) {
+		err = fabs(log(get_sample_frequency(clock, 1UL<<p) / rate));
+		if (p==2 || err<best) {
+			best = err;
+			s->prescale = p;
+		}
+	}
+}
+
+static unsigned full_scale_mv(unsigned char vref)
+{
+	switch (vref) {
+	case AUTOSET_VREF_AVCC:
+		return AUTOSET_AVCC_MV;
+	case AUTOSET_VREF_INTERNAL:
+		return AUTOSET_INTERNAL_MV;
+	}
+	return 0; /* AREF, unknown */
+}
+
+static unsigned char scale_code(double v, double k)
+{
+	v *= k;
+	return v>255 ? 255 : (unsigned char)(v + 0.5);
+}
+
+int autoset_decide(unsigned long clock, int timer, size_t samples,
+				   const struct autoset_analysis *an,
+				   const struct autoset_settings *cur, struct autoset_settings *next)
+{
+	double rate = autoset_rate(clock, cur), want = rate, k = 1;
+	unsigned char min = an->min, max = an->max, noise = an->noise, swing;
+	int hyst;
+
+	*next = *cur;
+
+	/* Internal reference when signal fits it with 10% to spare, AVcc
+	 when it clips there */
+	if (cur->vref==AUTOSET_VREF_AVCC &&
+		max * AUTOSET_AVCC_MV < 230 * AUTOSET_INTERNAL_MV) {
+		next->vref = AUTOSET_VREF_INTERNAL;
+	} else if (cur->vref==AUTOSET_VREF_INTERNAL && max>=254) {
+		next->vref = AUTOSET_VREF_AVCC;
+	}
+	if (next->vref!=cur->vref) {
+		k = (double)full_scale_mv(cur->vref) / full_scale_mv(next->vref);
+		min = scale_code(min, k);
+		max = scale_code(max, k);
+		noise = scale_code(noise, k);
+	}
+	swing = max - min;
+
+	if (swing>=AUTOSET_MIN_SWING) {
+		if (an->crossings<2) {
+			/* Less than a period in frame */
+			want = rate / AUTOSET_STEP;
+		} else if (an->period < AUTOSET_MIN_PERIOD) {
+			/* Might be aliased: measure again at full speed */
+			want = get_sample_frequency(clock, 1UL<<2);
+		} else {
+			want = rate / an->period * samples / AUTOSET_PERIODS;
+		}
+		if (want > rate * AUTOSET_RATE_SLACK || want < rate / AUTOSET_RATE_SLACK)
+			set_rate(clock, timer, want, next);
+		if (fabs(log(autoset_rate(clock, next) / rate)) < 1e-6) {
+			/* Same rate, set up differently: keep ours */
+			next->prescale = cur->prescale;
+			next->clocksel = cur->clocksel;
+			next->top = cur->top;
+		}
+	}
+
+	/* Mid level, re-armed well below it but clear of the bottom */
+	next->trigger = (min + max + 1) / 2;
+	hyst = 2 * noise + 2;
+	if (hyst > swing / 4)
+		hyst = swing / 4;
+	next->hysteresis = hyst;
+
+	return next->vref!=cur->vref || next->prescale!=cur->prescale ||
+		next->clocksel!=cur->clocksel || next->top!=cur->top;
+}
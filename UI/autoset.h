@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __AUTOSET_H__
+#define __AUTOSET_H__
+
+#include <stddef.h>
+
+/*
+ Autoset: pick ADC reference, sample rate and trigger level from what
+ a captured frame shows, instead of sweeping through settings.
+
+ A frame is reduced to its range, DC level, noise and period (from
+ crossings of mid level, with hysteresis). Range on the other reference
+ is predicted from the reference voltages, and the sample rate that
+ shows AUTOSET_PERIODS periods per frame comes from the models in
+ sampling.h. Only when the period cannot be measured (less than one in
+ the frame, or too few samples per period) is the rate changed by a
+ coarse AUTOSET_STEP. The last capture checks that nothing moves, and
+ that the frame triggered. That makes 2 captures for a signal the
+ current settings already show, 3 or 4 otherwise.
+ */
+
+/* Reference selection, as in COMMAND_SET_VREF */
+#define AUTOSET_VREF_AREF      0
+#define AUTOSET_VREF_AVCC      1
+#define AUTOSET_VREF_INTERNAL  3
+#define AUTOSET_AVCC_MV        5000
+#define AUTOSET_INTERNAL_MV    1100
+
+#define AUTOSET_PERIODS        3
+/* Rate factor when period is unknown */
+#define AUTOSET_STEP           16
+/* Fewer samples per period than this may be aliased */
+#define AUTOSET_MIN_PERIOD     4
+/* Smaller swing, in ADC codes, is taken as no signal */
+#define AUTOSET_MIN_SWING      8
+/* Rate within this factor of wanted one is left alone */
+#define AUTOSET_RATE_SLACK     1.5
+#define AUTOSET_MAX_CAPTURES   6
+
+struct autoset_settings {
+	unsigned char vref;
+	/* log2 of ADC prescaler, and Timer1 setup (TIMER_CLOCK_NONE for
+	 free-running), as in COMMAND_SET_SAMPLE_RATE */
+	unsigned char prescale;
+	unsigned char clocksel;
+	unsigned short top;
+	unsigned char trigger;
+	/* Depth below trigger to re-arm, for TRIGGER_MODE_HYSTERESIS */
+	unsigned char hysteresis;
+};
+
+struct autoset_analysis {
+	unsigned char min;
+	unsigned char max;
+	double mean;
+	/* Smallest range of any AUTOSET_NOISE_BLOCK samples */
+	unsigned char noise;
+	/* Rising crossings of mid level, and mean distance between them in
+	 samples; period is 0 with less than two crossings */
+	unsigned crossings;
+	double period;
+};
+
+#define AUTOSET_NOISE_BLOCK    8
+
+/* Analyse first channel of an interleaved frame */
+void autoset_analyse(const unsigned char *buf, size_t size, unsigned channels,
+					 struct autoset_analysis *an);
+
+/* Sample rate of settings, for a CPU clock */
+double autoset_rate(unsigned long clock, const struct autoset_settings *s);
+
+/* Next settings, from analysis of a frame of samples taken with cur.
+ timer tells whether firmware has timer-triggered sampling (v2.3).
+ Returns 1 if next differs, so another capture is needed, 0 if settled */
+int autoset_decide(unsigned long clock, int timer, size_t samples,
+				   const struct autoset_analysis *an,
+				   const struct autoset_settings *cur, struct autoset_settings *next);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "average.h"
+#include "ingest.h"
+#include "simd.h"
+
+/* Accumulators are 32-bit, one per sample, whatever the number of
+ frames. Running sum holds plain sums, at most 256 * 255; exponential
+ holds 16.16 fixed point samples. */
+
+struct average {
+	unsigned frames;
+	int exponential;
+	unsigned shift;          /* log2(frames), exponential */
+	unsigned count;          /* Frames in accumulators, up to frames */
+	unsigned head;           /* History slot holding oldest frame */
+	size_t numSamples;
+	unsigned long rejected;
+	int acc[INGEST_MAX_SAMPLES];
+	unsigned short out[INGEST_MAX_SAMPLES];
+	unsigned char history[];  /* frames * INGEST_MAX_SAMPLES, running sum */
+};
+
+struct average *average_new(unsigned frames, int exponential)
+{
+	struct average *a;
+	size_t history = 0;
+	unsigned shift = 0;
+
+	if (frames<2 || frames>AVERAGE_MAX_FRAMES)
+		return NULL;
+	if (exponential) {
+		if (frames & (frames - 1))
+			return NULL;
+		while ((1U<<shift) < frames)
+			shift++;
+	} else {
+		history = (size_t)frames * INGEST_MAX_SAMPLES;
+	}
+
+	a = malloc(sizeof(*a) + history);
+	if (NULL==a)
+		return NULL;
+	a->frames = frames;
+	a->exponential = exponential;
+	a->shift = shift;
+	a->rejected = 0;
+	a->numSamples = 0;
+	average_reset(a);
+	return a;
+}
+
+void average_free(struct average *a)
+{
+	free(a);
+}
+
+int average_parse(const char *spec, unsigned *frames, int *exponential)
+{
+	char *end;
+	unsigned long n = strtoul(spec, &end, 10);
+
+	*exponential = 0;
+	if (!strcmp(end, ":exp"))
+		*exponential = 1;
+	else if (*end)
+		goto bad;
+	if (n<2 || n>AVERAGE_MAX_FRAMES)
+		goto bad;
+	if (*exponential && (n & (n - 1)))
+		goto bad;
+	*frames = n;
+	return 0;
+bad:
+	fprintf(stderr,"Bad average '%s': want 2-%d frames, a power of two for :exp\n",
+			spec, AVERAGE_MAX_FRAMES);
+	return -1;
+}
+
+void average_reset(struct average *a)
+{
+	a->count = 0;
+	a->head = 0;
+	memset(a->acc, 0, sizeof(a->acc));
+	/* Empty slots read as zero, so filling up needs no special case */
+	if (!a->exponential)
+		memset(a->history, 0, (size_t)a->frames * INGEST_MAX_SAMPLES);
+}
+
+/* acc += new - oldest; oldest replaced by new. out = acc / count in 8.8,
+ through a reciprocal: acc * 2^24/count is at most 255 * 2^24, so it
+ fits in 32 bits unsigned */
+static void add_sum(struct average *a, const unsigned char *buf, size_t n)
+{
+	unsigned char *old = &a->history[(size_t)a->head * INGEST_MAX_SAMPLES];
+	unsigned recip = (1U<<24) / a->count;
+	v4si acc, x;
+	v4su o;
+	size_t i;
+
+	for (i=0; i + V4SI_WIDTH <= n; i+=V4SI_WIDTH) {
+		x = v4si_load_u8(&buf[i]);
+		acc = v4si_load(&a->acc[i]) + x - v4si_load_u8(&old[i]);
+		v4si_store(&a->acc[i], acc);
+		v4si_store_u8(&old[i], x);
+		o = ((v4su)acc * recip + 0x8000) >> 16;
+		v4si_store_u16(&a->out[i], (v4si)o);
+	}
+	for (; i<n; i++) {
+		a->acc[i] += buf[i] - old[i];
+		old[i] = buf[i];
+		a->out[i] = ((unsigned)a->acc[i] * recip + 0x8000) >> 16;
+	}
+}
+
+/* acc += (new - acc) / 2^shift, in 16.16. While filling up, shift is
+ kept to log2(count), so first frames are not dragged towards zero */
+static void add_exp(struct average *a, const unsigned char *buf, size_t n)
+{
+	unsigned shift = 0;
+	v4si acc;
+	size_t i;
+
+	while (shift<a->shift && (2U<<shift) <= a->count)
+		shift++;
+
+	for (i=0; i + V4SI_WIDTH <= n; i+=V4SI_WIDTH) {
+		acc = v4si_load(&a->acc[i]);
+		acc += ((v4si_load_u8(&buf[i]) << 16) - acc) >> shift;
+		v4si_store(&a->acc[i], acc);
+		v4si_store_u16(&a->out[i], (acc + 0x80) >> 8);
+	}
+	for (; i<n; i++) {
+		a->acc[i] += (((int)buf[i] << 16) - a->acc[i]) >> shift;
+		a->out[i] = (a->acc[i] + 0x80) >> 8;
+	}
+}
+
+const unsigned short *average_add(struct average *a, const unsigned char *buf,
+								  size_t numSamples, int triggered)
+{
+	if (!triggered) {
+		a->rejected++;
+		return NULL;
+	}
+	if (numSamples>INGEST_MAX_SAMPLES)
+		numSamples = INGEST_MAX_SAMPLES;
+	if (numSamples!=a->numSamples) {
+		average_reset(a);
+		a->numSamples = numSamples;
+	}
+
+	if (a->count<a->frames)
+		a->count++;
+
+	if (a->exponential) {
+		add_exp(a, buf, numSamples);
+	} else {
+		add_sum(a, buf, numSamples);
+		if (++a->head==a->frames)
+			a->head = 0;
+	}
+	return a->out;
+}
+
+unsigned average_count(const struct average *a)
+{
+	return a->count;
+}
+
+unsigned long average_rejected(const struct average *a)
+{
+	return a->rejected;
+}
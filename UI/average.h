@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __AVERAGE_H__
+#define __AVERAGE_H__
+
+#include <stddef.h>
+
+/* Frames averaged, at most */
+#define AVERAGE_MAX_FRAMES 256
+
+/* Averaged samples are 8.8 fixed point: sample value times this */
+#define AVERAGE_ONE 256
+
+struct average;
+
+/*
+ Average of the last frames triggered frames, 2 to AVERAGE_MAX_FRAMES.
+
+ Running sum keeps a history of frames, so memory grows with frames,
+ but each frame costs the same: newest is added, oldest subtracted.
+ Exponential keeps no history; each frame moves average by 1/frames,
+ which must be a power of two. Returns NULL on bad arguments.
+ */
+struct average *average_new(unsigned frames, int exponential);
+void average_free(struct average *a);
+
+/* Parse "<frames>[:exp]", as given on command line. Returns -1 on error */
+int average_parse(const char *spec, unsigned *frames, int *exponential);
+
+/* Forget frames averaged so far, e.g. after settings change */
+void average_reset(struct average *a);
+
+/* Add a frame of interleaved 8-bit samples. Auto-triggered frames are
+ not aligned to signal, and are rejected. Returns average, numSamples
+ long, or NULL if frame was rejected. A different numSamples restarts
+ average */
+const unsigned short *average_add(struct average *a, const unsigned char *buf,
+								  size_t numSamples, int triggered);
+
+/* Frames in current average, and frames rejected so far */
+unsigned average_count(const struct average *a);
+unsigned long average_rejected(const struct average *a);
+
+#endif
@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Headless capture tool, built on the acquisition core only */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include "acq.h"
+#include "recfile.h"
+#include "server.h"
+#include "shmring.h"
+#include "sampling.h"
+#include "filter.h"
+#include "average.h"
+#include "logic.h"
+#include "trigger.h"
+#include "decode.h"
+#include "mask.h"
+#include "trace.h"
+#include "../protocol.h"
+
+const unsigned long arduino_freq = 16000000; // 16 MHz
+
+/* Poll granularity, also bounds reaction time to -T and signals */
+#define CLI_POLL_MS 100
+
+static struct {
+	/* Settings, -1 means leave device default */
+	int trigger;
+	int holdoff;
+	int prescale;
+	double rate;
+	int channels;
+	int vref;
+	int invert;
+	int trigger_set;
+	struct trigger_mode trigger_mode;
+	int logic;
+	struct logic_trigger logic_trigger;
+	int memseg;
+	int autoset;
+	int applied;
+
+	unsigned long max_frames;
+	double max_seconds;
+	double timeout;
+	int quiet;
+
+	FILE *csv;
+	const char *recpath;
+	struct recfile_writer *rec;
+	struct acq *acq;
+	struct server *server;
+	struct shmring *shm;
+	double shm_rate;
+	struct average *average;
+	struct decoder *decoder;
+	FILE *events;
+	int events_started;
+	struct mask *mask;
+	int mask_stop;
+	int mask_failed;
+
+	unsigned char params[RECFILE_MAX_PARAMETERS];
+	size_t params_size;
+	double period;
+	unsigned channels_now;
+	int logic_now;
+	struct ingest_memseg memseg_info[MEMSEG_MAX];
+	unsigned memsegs_now;
+
+	uint64_t start;
+	int csv_started;
+	double time_base;
+	double frame_time;
+	uint64_t last_frame;
+	unsigned long frames;
+	int failed;
+} cli;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig)
+{
+	interrupted = 1;
+}
+
+static void apply_settings(struct acq *acq)
+{
+	unsigned char prescale, clocksel;
+	unsigned short top;
+
+	if (cli.trigger>=0)
+		acq_set_trigger_level(acq, cli.trigger);
+	if (cli.holdoff>=0)
+		acq_set_holdoff(acq, cli.holdoff);
+	if (cli.vref>=0)
+		acq_set_vref(acq, cli.vref);
+	if (cli.channels>0)
+		acq_set_channels(acq, cli.channels);
+	if (cli.invert)
+		acq_set_trigger_invert(acq, 1);
+	if (cli.trigger_set)
+		acq_set_trigger_mode(acq, &cli.trigger_mode);
+	if (cli.logic)
+		acq_set_logic(acq, 1, &cli.logic_trigger);
+	if (cli.memseg>0)
+		acq_set_memseg(acq, cli.memseg);
+
+	if (cli.rate>0) {
+		if (get_timebase_settings(arduino_freq, cli.rate, &prescale,
+								  &clocksel, &top)<0) {
+			fprintf(stderr,"Sample rate %g Hz not reachable\n", cli.rate);
+			return;
+		}
+		acq_set_prescaler(acq, prescale);
+		acq_set_sample_rate(acq, clocksel, top);
+	} else if (cli.prescale>=0) {
+		/* Prescaler first, so reply to sample rate reflects it */
+		acq_set_prescaler(acq, cli.prescale);
+		acq_set_sample_rate(acq, TIMER_CLOCK_NONE, 0);
+	}
+}
+
+static void cb_version(void *data, unsigned char major, unsigned char minor)
+{
+	if (!cli.quiet)
+		fprintf(stderr,"Device is OSCOPE %d.%d\n", major, minor);
+	/* After reconnect, acq sends them again by itself */
+	if (!cli.applied) {
+		cli.applied = 1;
+		apply_settings(cli.acq);
+		if (cli.autoset)
+			acq_autoset(cli.acq, arduino_freq);
+	}
+}
+
+static void cb_parameters(void *data, const struct acq_parameters *p)
+{
+	size_t size = p->raw_size;
+
+	if (size>RECFILE_MAX_PARAMETERS)
+		size = RECFILE_MAX_PARAMETERS;
+	memcpy(cli.params, p->raw, size);
+	cli.params_size = size;
+
+	cli.period = 1.0 / get_parameters_sample_frequency(arduino_freq, p->raw, p->raw_size);
+	cli.logic_now = p->logicFlags & LOGIC_FLAG_ENABLE;
+	cli.channels_now = p->channels && !cli.logic_now ? p->channels : 1;
+
+	if (cli.server)
+		server_publish_parameters(cli.server, p->raw, p->raw_size);
+	cli.shm_rate = 1.0 / (cli.period * cli.channels_now);
+
+	if (cli.rec && recfile_write(cli.rec, RECFILE_PARAMETERS, now_us() - cli.start,
+								 p->raw, size)<0)
+		cli.failed = 1;
+}
+
+static int open_recording(void)
+{
+	struct recfile_header hdr;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	hdr.freq = arduino_freq;
+	hdr.start_time = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	hdr.params_size = cli.params_size;
+	memcpy(hdr.params, cli.params, cli.params_size);
+
+	cli.rec = recfile_create(cli.recpath, &hdr);
+	if (NULL==cli.rec) {
+		perror(cli.recpath);
+		return -1;
+	}
+	return 0;
+}
+
+static void cb_raw_frame(void *data, const unsigned char *buf, size_t size)
+{
+	struct timeval tv;
+
+	if (cli.server) {
+		gettimeofday(&tv, NULL);
+		server_publish_frame(cli.server, buf, size,
+							 (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+	}
+
+	if (NULL==cli.recpath || cli.failed)
+		return;
+	/* Header wants parameters, so file is created on first frame */
+	if (NULL==cli.rec && open_recording()<0) {
+		cli.failed = 1;
+		return;
+	}
+	if (recfile_write(cli.rec, RECFILE_FRAME, now_us() - cli.start, buf, size)<0) {
+		fprintf(stderr,"Cannot write recording\n");
+		cli.failed = 1;
+	}
+}
+
+static void csv_header(void)
+{
+	unsigned k;
+
+	if (!cli.csv_started) {
+		cli.csv_started = 1;
+		fprintf(cli.csv, cli.memseg>1 ? "frame,segment,time" : "frame,time");
+		if (cli.logic_now) {
+			for (k=0; k<LOGIC_CHANNELS; k++)
+				fprintf(cli.csv, ",d%u", k);
+		} else {
+			for (k=0; k<cli.channels_now; k++)
+				fprintf(cli.csv, ",ch%u", k);
+		}
+		fputc('\n', cli.csv);
+	}
+}
+
+/* Time of sample group j, and its memory segment. A group is
+ channels_now conversions, period apart. Returns -1 for groups past last
+ segment */
+static int group_time(size_t j, double *t)
+{
+	size_t n = j * cli.channels_now;
+	const struct ingest_memseg *seg;
+	unsigned s;
+
+	if (cli.memsegs_now==0) {
+		*t = cli.frame_time + (double)n * cli.period;
+		return 0;
+	}
+	s = n / cli.memseg_info[0].length;
+	if (s>=cli.memsegs_now)
+		return -1;
+	seg = &cli.memseg_info[s];
+	*t = cli.frame_time + (double)(seg->time + n - seg->start) * cli.period;
+	return s;
+}
+
+static void cb_frame(void *data, unsigned char *buf, size_t size)
+{
+	const struct ingest_memseg *seg;
+	double t, span;
+	size_t j, groups;
+	unsigned k;
+	int s;
+
+	cli.last_frame = now_us();
+	cli.frames++;
+
+	seg = acq_get_memsegs(cli.acq, &cli.memsegs_now);
+	if (seg)
+		memcpy(cli.memseg_info, seg, cli.memsegs_now * sizeof(*seg));
+
+	/* Time of last sample is arrival time, close enough for scripting.
+	 Times are relative to first sample of first frame */
+	span = size;
+	if (cli.memsegs_now)
+		span = seg[cli.memsegs_now-1].time + seg[cli.memsegs_now-1].length;
+	t = (double)(cli.last_frame - cli.start) / 1000000.0 - span * cli.period;
+	if (cli.frames==1)
+		cli.time_base = t;
+	cli.frame_time = t - cli.time_base;
+
+	if (cli.shm)
+		shmring_publish(cli.shm, buf, size, cli.channels_now, cli.shm_rate);
+
+	/* With averaging, CSV gets averages instead */
+	if (NULL==cli.csv || cli.average)
+		return;
+
+	csv_header();
+	groups = size / cli.channels_now;
+	for (j=0; j<groups; j++) {
+		s = group_time(j, &t);
+		if (s<0)
+			break;
+		if (cli.memseg>1)
+			fprintf(cli.csv, "%lu,%d,%.9f", cli.frames - 1, s, t);
+		else
+			fprintf(cli.csv, "%lu,%.9f", cli.frames - 1, t);
+		if (cli.logic_now) {
+			for (k=0; k<LOGIC_CHANNELS; k++)
+				fprintf(cli.csv, ",%u", (buf[j] >> k) & 1);
+		} else {
+			for (k=0; k<cli.channels_now; k++)
+				fprintf(cli.csv, ",%u", buf[j*cli.channels_now + k]);
+		}
+		fputc('\n', cli.csv);
+	}
+}
+
+static void cb_average(void *data, const unsigned short *buf, size_t size)
+{
+	double t;
+	size_t j, groups;
+	unsigned k;
+
+	if (NULL==cli.csv)
+		return;
+
+	csv_header();
+	groups = size / cli.channels_now;
+	for (j=0; j<groups; j++) {
+		group_time(j, &t);
+		fprintf(cli.csv, "%lu,%.9f", cli.frames - 1, t);
+		for (k=0; k<cli.channels_now; k++)
+			fprintf(cli.csv, ",%.3f",
+					(double)buf[j*cli.channels_now + k] / AVERAGE_ONE);
+		fputc('\n', cli.csv);
+	}
+}
+
+/* Decoded list: one line per event, timed like CSV samples */
+static void cb_decoded(void *data, const struct decode_event *ev, size_t count)
+{
+	char text[64];
+	double t;
+	size_t i;
+
+	if (NULL==cli.events)
+		return;
+	if (!cli.events_started) {
+		cli.events_started = 1;
+		fprintf(cli.events, "frame,time,bus,event\n");
+	}
+	for (i=0; i<count; i++) {
+		if (group_time(ev[i].start, &t)<0)
+			continue;
+		decode_format(&ev[i], text, sizeof(text));
+		fprintf(cli.events, "%lu,%.9f,%s,%s\n", cli.frames - 1, t,
+				decoder_bus_name(cli.decoder, ev[i].bus), text);
+	}
+}
+
+static void cb_masked(void *data, const struct mask *mask, int failed)
+{
+	if (failed==0)
+		return;
+	cli.mask_failed = 1;
+	if (!cli.quiet)
+		fprintf(stderr,"Frame %lu: %d samples outside mask\n", cli.frames - 1, failed);
+}
+
+static void cb_message(void *data, const char *msg)
+{
+	if (!cli.quiet)
+		fprintf(stderr,"%s\n", msg);
+}
+
+static const struct acq_callbacks callbacks = {
+	.version = &cb_version,
+	.parameters = &cb_parameters,
+	.raw_frame = &cb_raw_frame,
+	.frame = &cb_frame,
+	.average = &cb_average,
+	.decoded = &cb_decoded,
+	.masked = &cb_masked,
+	.message = &cb_message
+};
+
+static int help(const char *cmd)
+{
+	printf("Usage: %s [options] serialport...\n\n", cmd);
+	printf("Serial port is auto to look for the device on USB serial ports, or\n");
+	printf("several ports to look on these. Lost device is reopened.\n\n");
+	printf("  -t level     Trigger level (0-255)\n");
+	printf("  -H samples   Trigger holdoff\n");
+	printf("  -r rate      Sample rate in Hz (timer-triggered)\n");
+	printf("  -p n         Free-running, ADC prescaler 2^n (2-7)\n");
+	printf("  -c channels  Number of channels (1-4)\n");
+	printf("  -v vref      Reference: 0 AREF, 1 AVcc, 3 internal 1.1V\n");
+	printf("  -i           Invert trigger\n");
+	printf("  -a           Autoset reference, sample rate and trigger level first,\n");
+	printf("               after other settings (see autoset.h)\n");
+	printf("  -X mode      Trigger mode: edge, hyst:n, pulse-gt:n, pulse-lt:n,\n");
+	printf("               window-in:level, window-out:level, runt:level (see trigger.h)\n");
+	printf("  -L trigger   Logic analyzer mode, 8 lines of port D. Trigger is one\n");
+	printf("               of x01rf per line, line 7 first, e.g. xxxxr0xx (see logic.h)\n");
+	printf("  -G segments  Memory segments, 1-%d: each trigger fills one part of a\n",
+		   MEMSEG_MAX);
+	printf("               capture, and re-arms right away\n");
+	printf("  -n frames    Stop after this many frames\n");
+	printf("  -T seconds   Stop after this long\n");
+	printf("  -w seconds   Fail if no frame arrives for this long (default 5)\n");
+	printf("  -o file      Output: recording, or CSV if it ends in .csv or is -\n");
+	printf("  -s address   Serve frames to viewers on Unix socket path or TCP [host:]port\n");
+	printf("  -m name      Publish frames to shared memory ring\n");
+	printf("  -F spec      Filter frames, e.g. notch:50,lp:2000 (see filter.h)\n");
+	printf("  -D spec      Decode buses, e.g. uart:2:9600:8n1,i2c:0:1 (see decode.h)\n");
+	printf("  -E file      Write decoded events to file instead of stdout\n");
+	printf("  -A n[:exp]   Average last n triggered frames (2-%d), or exponential\n",
+		   AVERAGE_MAX_FRAMES);
+	printf("  -M spec      Test frames against mask file, or learn:n[:margin] from\n");
+	printf("               first n triggered frames (see mask.h). Auto-triggered\n");
+	printf("               frames fail\n");
+	printf("  -K file      Save learned mask to file on exit\n");
+	printf("  -S           Stop on first frame failing mask test\n");
+	printf("  -Y file      Trace latency of each frame stage to file, as Chrome\n");
+	printf("               trace-event JSON, and print percentiles (see trace.h)\n");
+	printf("  -q           Quiet\n\n");
+	printf("Exit status is 0 on success, 1 on error, 2 on timeout, 3 if a frame\n");
+	printf("failed mask test.\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct acq *acq;
+	struct pollfd pfd;
+	const char *out = NULL;
+	const char *serve = NULL;
+	const char *shmname = NULL;
+	const char *filters = NULL;
+	struct filter_bank *filter = NULL;
+	const char *decoders = NULL;
+	const char *events = NULL;
+	const char *masks = NULL;
+	const char *mask_out = NULL;
+	const char *tracepath = NULL;
+	struct mask_stats ms;
+	unsigned avg_frames = 0;
+	int avg_exp = 0;
+	const char *ext;
+	uint64_t now;
+	int c, ret = 0;
+
+	cli.trigger = cli.holdoff = cli.prescale = cli.vref = -1;
+	cli.timeout = 5;
+
+	while ((c=getopt(argc,argv,"t:H:r:p:c:v:iX:L:G:an:T:w:o:s:m:F:A:D:E:M:K:SY:q"))!=-1) {
+		switch (c) {
+		case 't':
+			cli.trigger = atoi(optarg);
+			break;
+		case 'H':
+			cli.holdoff = atoi(optarg);
+			break;
+		case 'r':
+			cli.rate = atof(optarg);
+			break;
+		case 'p':
+			cli.prescale = atoi(optarg);
+			break;
+		case 'c':
+			cli.channels = atoi(optarg);
+			break;
+		case 'v':
+			cli.vref = atoi(optarg);
+			break;
+		case 'i':
+			cli.invert = 1;
+			break;
+		case 'X':
+			if (trigger_parse(optarg, &cli.trigger_mode)<0)
+				return 1;
+			cli.trigger_set = 1;
+			break;
+		case 'L':
+			if (logic_parse_trigger(optarg, &cli.logic_trigger)<0)
+				return 1;
+			cli.logic = 1;
+			break;
+		case 'G':
+			cli.memseg = atoi(optarg);
+			break;
+		case 'n':
+			cli.max_frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cli.max_seconds = atof(optarg);
+			break;
+		case 'w':
+			cli.timeout = atof(optarg);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 's':
+			serve = optarg;
+			break;
+		case 'm':
+			shmname = optarg;
+			break;
+		case 'F':
+			filters = optarg;
+			break;
+		case 'D':
+			decoders = optarg;
+			break;
+		case 'E':
+			events = optarg;
+			break;
+		case 'M':
+			masks = optarg;
+			break;
+		case 'K':
+			mask_out = optarg;
+			break;
+		case 'S':
+			cli.mask_stop = 1;
+			break;
+		case 'A':
+			if (average_parse(optarg, &avg_frames, &avg_exp)<0)
+				return 1;
+			break;
+		case 'a':
+			cli.autoset = 1;
+			break;
+		case 'Y':
+			tracepath = optarg;
+			trace_enable(1);
+			break;
+		case 'q':
+			cli.quiet = 1;
+			break;
+		default:
+			return help(argv[0]);
+		}
+	}
+
+	if (optind>=argc)
+		return help(argv[0]);
+
+	if (out) {
+		ext = strrchr(out, '.');
+		if (!strcmp(out, "-")) {
+			cli.csv = stdout;
+		} else if (ext && !strcasecmp(ext, ".csv")) {
+			cli.csv = fopen(out, "w");
+			if (NULL==cli.csv) {
+				perror(out);
+				return 1;
+			}
+		} else {
+			cli.recpath = out;
+		}
+	}
+
+	if (serve) {
+		cli.server = server_start(serve, arduino_freq);
+		if (NULL==cli.server)
+			return 1;
+	}
+
+	if (shmname) {
+		cli.shm = shmring_create(shmname, SHMRING_SLOTS);
+		if (NULL==cli.shm)
+			return 1;
+	}
+
+	if (filters) {
+		filter = filter_bank_new(filters);
+		if (NULL==filter)
+			return 1;
+	}
+
+	if (decoders) {
+		cli.decoder = decoder_new(decoders);
+		if (NULL==cli.decoder)
+			return 1;
+		cli.events = stdout;
+		if (events) {
+			cli.events = fopen(events, "w");
+			if (NULL==cli.events) {
+				perror(events);
+				return 1;
+			}
+		} else if (cli.csv==stdout) {
+			fprintf(stderr,"CSV already goes to stdout, use -E for decoded events\n");
+			return 1;
+		}
+	}
+
+	if (masks) {
+		cli.mask = mask_new(masks);
+		if (NULL==cli.mask)
+			return 1;
+	}
+
+	if (avg_frames) {
+		cli.average = average_new(avg_frames, avg_exp);
+		if (NULL==cli.average)
+			return 1;
+	}
+
+	if (argc - optind > 1) {
+		acq = acq_probe((const char *const *)argv + optind, argc - optind,
+						ACQ_PROBE_TIMEOUT_MS, &callbacks, NULL);
+	} else if (!strcmp(argv[optind], "auto")) {
+		acq = acq_probe(NULL, 0, ACQ_PROBE_TIMEOUT_MS, &callbacks, NULL);
+	} else {
+		acq = acq_open(argv[optind], &callbacks, NULL);
+		if (NULL==acq)
+			return 1;
+	}
+	if (NULL==acq) {
+		fprintf(stderr,"No device found\n");
+		return 1;
+	}
+	cli.acq = acq;
+	if (filter)
+		acq_set_filter(acq, filter, arduino_freq);
+	if (cli.average)
+		acq_set_average(acq, cli.average);
+	if (cli.decoder)
+		acq_set_decoder(acq, cli.decoder, arduino_freq);
+	if (cli.mask)
+		acq_set_mask(acq, cli.mask, cli.mask_stop);
+
+	signal(SIGINT, &on_signal);
+	signal(SIGTERM, &on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	cli.start = cli.last_frame = now_us();
+
+	if (acq_start(acq)<0) {
+		fprintf(stderr,"Cannot write to device\n");
+		acq_close(acq);
+		return 1;
+	}
+
+	pfd.events = POLLIN;
+
+	while (!interrupted && !cli.failed) {
+		/* Changes on reconnect, and is -1 while device is away */
+		pfd.fd = acq_get_fd(acq);
+		if (poll(&pfd, 1, CLI_POLL_MS)>0 && acq_read(acq)<0) {
+			fprintf(stderr,"Device closed\n");
+			ret = 1;
+			break;
+		}
+		acq_tick(acq);
+		now = now_us();
+		if (cli.max_frames && cli.frames>=cli.max_frames)
+			break;
+		if (cli.mask_stop && cli.mask_failed)
+			break;
+		if (cli.max_seconds>0 && now - cli.start >= cli.max_seconds * 1000000)
+			break;
+		if (cli.timeout>0 && now - cli.last_frame >= cli.timeout * 1000000) {
+			fprintf(stderr,"No frames for %g seconds\n", cli.timeout);
+			ret = 2;
+			break;
+		}
+	}
+
+	if (cli.failed)
+		ret = 1;
+	else if (ret==0 && cli.mask_failed)
+		ret = 3;
+
+	if (cli.rec && recfile_close(cli.rec)<0) {
+		fprintf(stderr,"Error closing recording\n");
+		ret = 1;
+	}
+	if (cli.csv && cli.csv!=stdout)
+		fclose(cli.csv);
+	else if (cli.csv)
+		fflush(stdout);
+
+	if (!cli.quiet)
+		fprintf(stderr,"%lu frames captured\n", cli.frames);
+	if (!cli.quiet && cli.average)
+		fprintf(stderr,"%u frames averaged, %lu auto-triggered rejected\n",
+				average_count(cli.average), average_rejected(cli.average));
+
+	if (cli.mask) {
+		mask_get_stats(cli.mask, &ms);
+		if (!cli.quiet)
+			fprintf(stderr,"Mask: %lu frames tested, %lu failed (%lu untriggered),"
+					" %lu samples outside, %lu not tested\n", ms.tested, ms.failed,
+					ms.untriggered, ms.samples, ms.skipped);
+		if (mask_out && mask_save(cli.mask, mask_out)<0)
+			ret = 1;
+		mask_free(cli.mask);
+	}
+
+	if (tracepath) {
+		trace_enable(0);
+		if (!cli.quiet)
+			trace_print_stats(stderr);
+		if (trace_dump(tracepath)<0)
+			ret = 1;
+	}
+
+	acq_close(acq);
+	if (filter)
+		filter_bank_free(filter);
+	if (cli.average)
+		average_free(cli.average);
+	if (cli.decoder)
+		decoder_free(cli.decoder);
+	if (cli.events && cli.events!=stdout)
+		fclose(cli.events);
+	else if (cli.events)
+		fflush(stdout);
+	if (cli.server)
+		server_stop(cli.server);
+	if (cli.shm)
+		shmring_destroy(cli.shm);
+	return ret;
+}
@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Viewer for the frame stream served by oscope -s or oscope-cli -s.
+ With -n, opens many connections at once to load the server. With -b,
+ serves synthetic frames itself and checks each one received */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "proto.h"
+#include "acq.h"
+#include "stream.h"
+#include "server.h"
+#include "ingest.h"
+#include "sampling.h"
+#include "../protocol.h"
+
+#define CLIENT_MAX_CONNECTIONS 1000
+/* Synthetic frames, as large as a capture gets */
+#define CLIENT_BENCH_SIZE      1024
+
+struct conn {
+	int fd;
+	int closed;
+	struct proto_parser parser;
+
+	unsigned long freq;
+	struct acq_parameters params;
+	int have_params;
+
+	int have_seq;
+	uint32_t next_seq;
+	unsigned long frames;
+	unsigned long lost;
+	unsigned long bad;
+	unsigned long long bytes;
+};
+
+static struct {
+	int packed;
+	int quiet;
+	FILE *csv;
+	unsigned long max_frames;
+	double max_seconds;
+	unsigned long csv_frames;
+	int bench;
+	unsigned interval;
+} opt;
+
+static volatile sig_atomic_t interrupted = 0;
+static volatile int bench_stop = 0;
+
+static void on_signal(int sig)
+{
+	interrupted = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_csv(struct conn *c, uint32_t seq, uint64_t timestamp,
+					  unsigned char *data, size_t size)
+{
+	unsigned char raw[PROTO_MAX_PAYLOAD];
+	unsigned channels;
+	double period, t;
+	size_t j, groups;
+	unsigned k;
+
+	if (!c->have_params)
+		return;
+
+	if (c->params.timerClock==TIMER_CLOCK_NONE)
+		period = 1.0 / get_sample_frequency(c->freq, 1<<c->params.prescale);
+	else
+		period = 1.0 / get_timer_sample_frequency(c->freq, c->params.timerClock,
+												   c->params.timerTop);
+	channels = c->params.channels ? c->params.channels : 1;
+
+	memcpy(raw, data, size);
+	size = ingest_process(raw, size, c->params.numSamples);
+	if (c->params.numSamples && size>c->params.numSamples)
+		size = c->params.numSamples;
+	groups = size / channels;
+
+	if (opt.csv_frames++==0) {
+		fprintf(opt.csv, "frame,time");
+		for (k=0; k<channels; k++)
+			fprintf(opt.csv, ",ch%u", k);
+		fputc('\n', opt.csv);
+	}
+
+	/* Timestamp is arrival of last sample */
+	t = timestamp / 1e6 - groups * period;
+	for (j=0; j<groups; j++) {
+		fprintf(opt.csv, "%u,%.6f", seq, t + j * period);
+		for (k=0; k<channels; k++)
+			fprintf(opt.csv, ",%u", raw[j*channels + k]);
+		fputc('\n', opt.csv);
+	}
+}
+
+/* Ramp per frame, with a jump every 64 samples so packing needs its
+ literal escape too */
+static unsigned char bench_sample(uint32_t seq, size_t i)
+{
+	return seq + i + (i % 64==0 ? 100 : 0);
+}
+
+static int bench_check(uint32_t seq, const unsigned char *data, size_t size)
+{
+	size_t i;
+
+	if (size!=CLIENT_BENCH_SIZE)
+		return -1;
+	for (i=0; i<size; i++)
+		if (data[i]!=bench_sample(seq, i))
+			return -1;
+	return 0;
+}
+
+/* Server numbers frames from 0 as they are published, so frame n is
+ filled for sequence n */
+static void *bench_writer(void *data)
+{
+	struct server *srv = data;
+	unsigned char frame[CLIENT_BENCH_SIZE];
+	struct timespec ts = { opt.interval / 1000000, (opt.interval % 1000000) * 1000L };
+	uint32_t seq;
+	size_t i;
+
+	for (seq=0; !bench_stop; seq++) {
+		for (i=0; i<sizeof(frame); i++)
+			frame[i] = bench_sample(seq, i);
+		nanosleep(&ts, NULL);
+		server_publish_frame(srv, frame, sizeof(frame), 0);
+	}
+	return NULL;
+}
+
+static void bench_end(struct server *srv, pthread_t writer)
+{
+	bench_stop = 1;
+	pthread_join(writer, NULL);
+	server_stop(srv);
+}
+
+static void got_frame(struct conn *c, uint32_t seq, uint64_t timestamp,
+					  unsigned char *data, size_t size)
+{
+	if (opt.bench && bench_check(seq, data, size)<0)
+		c->bad++;
+	if (c->have_seq && seq!=c->next_seq)
+		c->lost += seq - c->next_seq;
+	c->have_seq = 1;
+	c->next_seq = seq + 1;
+	c->frames++;
+
+	if (opt.csv)
+		write_csv(c, seq, timestamp, data, size);
+	else if (!opt.quiet)
+		printf("frame %u, %zu bytes, time %.6f\n", seq, size, timestamp / 1e6);
+}
+
+static void got_packet(void *data, unsigned char command, unsigned char *buf,
+					   unsigned short size)
+{
+	struct conn *c = data;
+	unsigned char frame[PROTO_MAX_PAYLOAD];
+
+	if (opt.max_frames && c->frames>=opt.max_frames)
+		return;
+	size_t fsize;
+
+	switch (command) {
+	case STREAM_HELLO:
+		if (size>=STREAM_HELLO_SIZE)
+			c->freq = stream_get_le32(&buf[1]);
+		break;
+
+	case STREAM_PARAMETERS:
+		if (acq_parse_parameters(buf, size, &c->params)==0) {
+			c->params.raw = NULL;
+			c->have_params = 1;
+		}
+		break;
+
+	case STREAM_FRAME:
+		if (size<STREAM_FRAME_HEADER)
+			break;
+		got_frame(c, stream_get_le32(buf), stream_get_le64(&buf[4]),
+				  &buf[STREAM_FRAME_HEADER], size - STREAM_FRAME_HEADER);
+		break;
+
+	case STREAM_FRAME_PACKED:
+		if (size<STREAM_PACKED_HEADER)
+			break;
+		fsize = buf[13] | (buf[14]<<8);
+		if (fsize>sizeof(frame) ||
+			stream_unpack(frame, fsize, &buf[STREAM_PACKED_HEADER],
+						  size - STREAM_PACKED_HEADER, buf[12])<0) {
+			fprintf(stderr,"Bad packed frame\n");
+			break;
+		}
+		got_frame(c, stream_get_le32(buf), stream_get_le64(&buf[4]), frame, fsize);
+		break;
+	}
+}
+
+static int conn_open(struct conn *c, const char *address)
+{
+	unsigned char pkt[8];
+	unsigned char flags = opt.packed ? STREAM_FLAG_PACKED : 0;
+	size_t len;
+
+	memset(c, 0, sizeof(*c));
+	c->fd = stream_connect(address);
+	if (c->fd<0)
+		return -1;
+	proto_parser_init(&c->parser, &got_packet, c);
+
+	len = proto_encode(pkt, STREAM_SUBSCRIBE, &flags, 1);
+	if (write(c->fd, pkt, len)!=len) {
+		close(c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void conn_read(struct conn *c)
+{
+	unsigned char buf[4096];
+	ssize_t r;
+
+	r = read(c->fd, buf, sizeof(buf));
+	if (r>0) {
+		c->bytes += r;
+		proto_parse(&c->parser, buf, r);
+	} else if (r==0 || errno!=EINTR) {
+		c->closed = 1;
+	}
+}
+
+static int help(const char *cmd)
+{
+	printf("Usage: %s [options] address\n\n", cmd);
+	printf("  address is a Unix socket path, or TCP [host:]port\n\n");
+	printf("  -z           Ask for packed frames\n");
+	printf("  -o file      Write frames as CSV (- for stdout)\n");
+	printf("  -n clients   Open this many connections, report totals (load test)\n");
+	printf("  -c frames    Stop after this many frames per connection\n");
+	printf("  -T seconds   Stop after this long\n");
+	printf("  -b           Serve synthetic frames on a temporary socket instead of\n");
+	printf("               address, and check every frame received (load test)\n");
+	printf("  -i usec      Synthetic frame interval (default 1000)\n");
+	printf("  -q           Quiet\n\n");
+	printf("With -b, exit status is 1 if a frame was wrong or none came.\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static struct conn conns[CLIENT_MAX_CONNECTIONS];
+	static struct pollfd pfd[CLIENT_MAX_CONNECTIONS];
+	unsigned long nconn = 1, open_conns, i;
+	unsigned long total = 0, lost = 0, bad = 0, minf = 0, maxf = 0;
+	unsigned long long bytes = 0;
+	const char *out = NULL, *address;
+	char benchname[64];
+	struct server *srv = NULL;
+	pthread_t writer;
+	double start, elapsed;
+	int c;
+
+	opt.interval = 1000;
+	while ((c=getopt(argc,argv,"zo:n:c:T:bi:q"))!=-1) {
+		switch (c) {
+		case 'z':
+			opt.packed = 1;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'n':
+			nconn = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opt.max_frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			opt.max_seconds = atof(optarg);
+			break;
+		case 'b':
+			opt.bench = 1;
+			break;
+		case 'i':
+			opt.interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			opt.quiet = 1;
+			break;
+		default:
+			return help(argv[0]);
+		}
+	}
+
+	if ((!opt.bench && optind>=argc) || nconn<1 || nconn>CLIENT_MAX_CONNECTIONS)
+		return help(argv[0]);
+	address = argv[optind];
+
+	if (opt.bench) {
+		snprintf(benchname, sizeof(benchname), "/tmp/oscope-client-bench-%d",
+				 (int)getpid());
+		address = benchname;
+		srv = server_start(address, ACQ_DEFAULT_CLOCK);
+		if (NULL==srv)
+			return 1;
+		if (pthread_create(&writer, NULL, &bench_writer, srv)!=0) {
+			perror("pthread_create");
+			server_stop(srv);
+			return 1;
+		}
+	}
+
+	if (nconn>1)
+		opt.quiet = 1;
+	else if (out) {
+		opt.csv = strcmp(out, "-") ? fopen(out, "w") : stdout;
+		if (NULL==opt.csv) {
+			perror(out);
+			return 1;
+		}
+	}
+
+	for (i=0; i<nconn; i++) {
+		if (conn_open(&conns[i], address)<0) {
+			fprintf(stderr,"Cannot connect to '%s' (connection %lu)\n",
+					address, i);
+			if (srv)
+				bench_end(srv, writer);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, &on_signal);
+	signal(SIGTERM, &on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	start = now();
+	open_conns = nconn;
+
+	while (!interrupted && open_conns>0) {
+		for (i=0; i<nconn; i++) {
+			pfd[i].fd = conns[i].closed ? -1 : conns[i].fd;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, nconn, 100)<0 && errno!=EINTR)
+			break;
+
+		open_conns = 0;
+		for (i=0; i<nconn; i++) {
+			if (pfd[i].revents)
+				conn_read(&conns[i]);
+			if (opt.max_frames && conns[i].frames>=opt.max_frames)
+				conns[i].closed = 1;
+			if (!conns[i].closed)
+				open_conns++;
+		}
+		if (opt.max_seconds>0 && now() - start >= opt.max_seconds)
+			break;
+	}
+	elapsed = now() - start;
+
+	if (srv)
+		bench_end(srv, writer);
+
+	for (i=0; i<nconn; i++) {
+		total += conns[i].frames;
+		lost += conns[i].lost;
+		bad += conns[i].bad;
+		bytes += conns[i].bytes;
+		if (i==0 || conns[i].frames<minf)
+			minf = conns[i].frames;
+		if (conns[i].frames>maxf)
+			maxf = conns[i].frames;
+		close(conns[i].fd);
+	}
+
+	if (opt.csv && opt.csv!=stdout)
+		fclose(opt.csv);
+
+	fprintf(stderr,"%lu connection(s), %.2f s: %lu frames (min %lu, max %lu per "
+			"connection), %lu lost, %.1f kB/s\n", nconn, elapsed, total, minf,
+			maxf, lost, bytes / 1024.0 / (elapsed>0 ? elapsed : 1));
+	if (opt.bench && bad)
+		fprintf(stderr,"%lu frames wrong\n", bad);
+	return opt.bench && (bad || total==0) ? 1 : 0;
+}
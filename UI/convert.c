@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ oscope-convert: convert a capture recording (see recfile.h) to CSV,
+ multi-channel WAV or VCD. The recording is mapped, not loaded, and
+ frames are split in chunks which are formatted by worker threads and
+ written out in order, so memory use does not depend on recording size.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include "recfile.h"
+#include "sampling.h"
+#include "ingest.h"
+#include "../protocol.h"
+
+/* Frames formatted by each job */
+#define CHUNK_FRAMES 64
+
+/* Jobs in flight, per worker thread */
+#define JOBS_PER_THREAD 2
+
+#define WAV_HEADER_SIZE 44
+
+enum format {
+	FORMAT_CSV,
+	FORMAT_WAV,
+	FORMAT_VCD
+};
+
+struct outbuf {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+enum jobstate {
+	JOB_EMPTY,
+	JOB_PENDING,
+	JOB_BUSY,
+	JOB_READY
+};
+
+struct job {
+	enum jobstate state;
+	size_t first;          /* Records first to last-1 */
+	size_t last;
+	uint64_t frame;        /* Number of first frame in job */
+	unsigned char params[RECFILE_MAX_PARAMETERS];
+	size_t params_size;    /* Parameters in effect at first record */
+	struct outbuf out;
+	unsigned long skipped;
+};
+
+static struct {
+	struct recfile *file;
+	enum format format;
+	unsigned long freq;
+	int deskew;
+	unsigned wav_channels;
+
+	struct job *jobs;
+	size_t njobs;
+	int quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} conv;
+
+static void ob_reserve(struct outbuf *ob, size_t n)
+{
+	if (ob->len + n <= ob->alloc)
+		return;
+	while (ob->len + n > ob->alloc)
+		ob->alloc = ob->alloc ? ob->alloc*2 : 65536;
+	ob->data = realloc(ob->data, ob->alloc);
+	if (NULL==ob->data) {
+		fprintf(stderr,"Out of memory\n");
+		exit(1);
+	}
+}
+
+static void ob_putc(struct outbuf *ob, char c)
+{
+	ob_reserve(ob, 1);
+	ob->data[ob->len++] = c;
+}
+
+static void ob_printf(struct outbuf *ob, const char *fmt, ...)
+	__attribute__((format(printf,2,3)));
+
+static void ob_printf(struct outbuf *ob, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	ob_reserve(ob, 64);
+	va_start(ap, fmt);
+	n = vsnprintf(ob->data + ob->len, ob->alloc - ob->len, fmt, ap);
+	va_end(ap);
+	if ((size_t)n >= ob->alloc - ob->len) {
+		ob_reserve(ob, n + 1);
+		va_start(ap, fmt);
+		vsnprintf(ob->data + ob->len, ob->alloc - ob->len, fmt, ap);
+		va_end(ap);
+	}
+	ob->len += n;
+}
+
+/* Sample values are formatted a lot, avoid printf for those */
+static void ob_putu8(struct outbuf *ob, unsigned char v)
+{
+	ob_reserve(ob, 3);
+	if (v>=100)
+		ob->data[ob->len++] = '0' + v/100;
+	if (v>=10)
+		ob->data[ob->len++] = '0' + (v/10)%10;
+	ob->data[ob->len++] = '0' + v%10;
+}
+
+static void ob_putbin8(struct outbuf *ob, unsigned char v)
+{
+	int i;
+	ob_reserve(ob, 8);
+	for (i=7; i>=0; i--)
+		ob->data[ob->len++] = (v>>i) & 1 ? '1' : '0';
+}
+
+/*
+ Layout of a frame: samples, channels and mux delay from its trailer.
+ Returns -1 if frame is not valid.
+ */
+static int get_frame_layout(const struct recfile_record *rec, const unsigned char *params,
+							size_t params_size, unsigned short *n, unsigned *channels,
+							unsigned *muxDelay)
+{
+	*n = recfile_param_samples(params, params_size);
+	*muxDelay = 0;
+
+	if (*n==0 || *n>INGEST_MAX_SAMPLES || rec->size < (size_t)*n + TRAILER_CHANNELS + 1)
+		return -1;
+
+	*channels = rec->data[*n + TRAILER_CHANNELS];
+	if (*channels<1 || *channels>INGEST_MAX_CHANNELS)
+		return -1;
+
+	if (rec->size >= (size_t)*n + TRAILER_MUX_DELAY + 1 && *channels>1)
+		*muxDelay = rec->data[*n + TRAILER_MUX_DELAY];
+	return 0;
+}
+
+/*
+ Get samples of a memory segment, or of a whole frame, as groups of
+ channels. Each segment has its own mux schedule: samples before mux
+ delay are dropped so that sample j*channels+k is channel k. Returns
+ number of groups, 0 if segment is too short.
+ */
+static size_t get_segment_samples(const struct recfile_record *rec,
+								  const struct ingest_memseg *seg, unsigned channels,
+								  unsigned muxDelay, unsigned char *buf,
+								  const unsigned char **samples)
+{
+	if (seg->length < muxDelay + channels)
+		return 0;
+
+	if (conv.deskew && channels>1) {
+		ingest_deskew(buf, rec->data + seg->start, seg->length, channels, muxDelay);
+		*samples = buf;
+	} else {
+		*samples = rec->data + seg->start + muxDelay;
+	}
+	return (seg->length - muxDelay) / channels;
+}
+
+static void format_csv(struct job *job, uint64_t frame, double start, double period,
+					   const unsigned char *s, size_t groups, unsigned channels)
+{
+	size_t j;
+	unsigned k;
+
+	for (j=0; j<groups; j++) {
+		ob_printf(&job->out, "%llu,%.9f", (unsigned long long)frame,
+				  start + (double)j * period);
+		for (k=0; k<channels; k++) {
+			ob_putc(&job->out, ',');
+			ob_putu8(&job->out, s[j*channels + k]);
+		}
+		ob_putc(&job->out, '\n');
+	}
+}
+
+static void format_wav(struct job *job, const unsigned char *s, size_t groups, unsigned channels)
+{
+	if (channels!=conv.wav_channels) {
+		job->skipped++;
+		return;
+	}
+	/* 8-bit WAV is unsigned and interleaved, same as our samples */
+	ob_reserve(&job->out, groups*channels);
+	memcpy(job->out.data + job->out.len, s, groups*channels);
+	job->out.len += groups*channels;
+}
+
+static void format_vcd(struct job *job, double start, double period,
+					   const unsigned char *s, size_t groups, unsigned channels)
+{
+	size_t j;
+	unsigned k;
+	long long t, last = -1;
+
+	for (j=0; j<groups; j++) {
+		t = (long long)((start + (double)j * period) * 1e9 + 0.5);
+		if (t<=last)
+			t = last + 1;
+
+		for (k=0; k<channels; k++) {
+			/* Frames are not contiguous, dump all values at frame start */
+			if (j>0 && s[j*channels + k]==s[(j-1)*channels + k])
+				continue;
+			if (t!=last) {
+				ob_printf(&job->out, "#%lld\n", t);
+				last = t;
+			}
+			ob_putc(&job->out, 'b');
+			ob_putbin8(&job->out, s[j*channels + k]);
+			ob_putc(&job->out, ' ');
+			ob_putc(&job->out, '!' + k);
+			ob_putc(&job->out, '\n');
+		}
+	}
+}
+
+static void format_job(struct job *job)
+{
+	unsigned char params[RECFILE_MAX_PARAMETERS];
+	size_t params_size = job->params_size;
+	unsigned char buf[INGEST_MAX_SAMPLES];
+	struct recfile_record rec;
+	struct ingest_memseg seg[MEMSEG_MAX];
+	const unsigned char *samples;
+	unsigned channels, muxDelay, segs, k;
+	unsigned short n;
+	uint64_t frame = job->frame;
+	size_t i, groups;
+	double rate, start, period;
+
+	memcpy(params, job->params, params_size);
+	job->out.len = 0;
+	job->skipped = 0;
+
+	for (i=job->first; i<job->last; i++) {
+		if (recfile_get_record(conv.file, i, &rec)<0)
+			break;
+
+		if (rec.type==RECFILE_PARAMETERS) {
+			params_size = rec.size > RECFILE_MAX_PARAMETERS ? RECFILE_MAX_PARAMETERS : rec.size;
+			memcpy(params, rec.data, params_size);
+			continue;
+		}
+		if (rec.type!=RECFILE_FRAME)
+			continue;
+
+		rate = get_parameters_sample_frequency(conv.freq, params, params_size);
+		if (get_frame_layout(&rec, params, params_size, &n, &channels, &muxDelay)<0 ||
+			rate<=0) {
+			job->skipped++;
+			frame++;
+			continue;
+		}
+		segs = ingest_memsegs(rec.data, rec.size, n, seg);
+		if (segs==0) {
+			seg[0].start = 0;
+			seg[0].length = n;
+			seg[0].time = 0;
+			segs = 1;
+		}
+
+		for (k=0; k<segs; k++) {
+			groups = get_segment_samples(&rec, &seg[k], channels, muxDelay, buf, &samples);
+			if (groups==0) {
+				job->skipped++;
+				continue;
+			}
+
+			/* Frame timestamp is its arrival time. Captures never overlap
+			 transmission of previous one, so use it as first sample time.
+			 Segments start when they triggered, time is in conversions */
+			start = (double)rec.timestamp / 1e6 + (double)seg[k].time / rate;
+			period = (double)channels / rate;
+
+			switch (conv.format) {
+			case FORMAT_CSV:
+				format_csv(job, frame, start, period, samples, groups, channels);
+				break;
+			case FORMAT_WAV:
+				format_wav(job, samples, groups, channels);
+				break;
+			case FORMAT_VCD:
+				format_vcd(job, start, period, samples, groups, channels);
+				break;
+			}
+		}
+		frame++;
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct job *job;
+	size_t i;
+
+	pthread_mutex_lock(&conv.lock);
+	for (;;) {
+		/* Oldest pending job first */
+		job = NULL;
+		for (i=0; i<conv.njobs; i++) {
+			if (conv.jobs[i].state==JOB_PENDING &&
+				(NULL==job || conv.jobs[i].first < job->first))
+				job = &conv.jobs[i];
+		}
+		if (NULL==job) {
+			if (conv.quit)
+				break;
+			pthread_cond_wait(&conv.cond, &conv.lock);
+			continue;
+		}
+		job->state = JOB_BUSY;
+		pthread_mutex_unlock(&conv.lock);
+
+		format_job(job);
+
+		pthread_mutex_lock(&conv.lock);
+		job->state = JOB_READY;
+		pthread_cond_broadcast(&conv.cond);
+	}
+	pthread_mutex_unlock(&conv.lock);
+	return NULL;
+}
+
+/* Parameters and frame count where next job starts */
+static struct {
+	size_t record;
+	uint64_t frame;
+	unsigned char params[RECFILE_MAX_PARAMETERS];
+	size_t params_size;
+} cursor;
+
+/* Fill job with next CHUNK_FRAMES frames. Returns 0 if no more */
+static int prepare_job(struct job *job)
+{
+	struct recfile_record rec;
+	size_t total = recfile_num_records(conv.file);
+	unsigned frames = 0;
+
+	if (cursor.record >= total)
+		return 0;
+
+	job->first = cursor.record;
+	job->frame = cursor.frame;
+	memcpy(job->params, cursor.params, cursor.params_size);
+	job->params_size = cursor.params_size;
+
+	while (cursor.record < total && frames < CHUNK_FRAMES) {
+		if (recfile_get_record(conv.file, cursor.record, &rec)==0) {
+			if (rec.type==RECFILE_FRAME) {
+				frames++;
+			} else if (rec.type==RECFILE_PARAMETERS) {
+				cursor.params_size = rec.size > RECFILE_MAX_PARAMETERS ?
+					RECFILE_MAX_PARAMETERS : rec.size;
+				memcpy(cursor.params, rec.data, cursor.params_size);
+			}
+		}
+		cursor.record++;
+	}
+	cursor.frame += frames;
+	job->last = cursor.record;
+
+	recfile_advise(conv.file, job->first, job->last - 1);
+	return 1;
+}
+
+static void put_le16(unsigned char *p, unsigned v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, unsigned long v)
+{
+	put_le16(p, v & 0xffff);
+	put_le16(p + 2, v >> 16);
+}
+
+static void write_wav_header(FILE *out, unsigned channels, unsigned long rate, uint64_t datasize)
+{
+	unsigned char h[WAV_HEADER_SIZE];
+
+	if (datasize > 0xffffffffUL - 36)
+		datasize = 0xffffffffUL - 36;
+
+	memcpy(h, "RIFF", 4);
+	put_le32(&h[4], 36 + datasize);
+	memcpy(&h[8], "WAVEfmt ", 8);
+	put_le32(&h[16], 16);
+	put_le16(&h[20], 1);           /* PCM */
+	put_le16(&h[22], channels);
+	put_le32(&h[24], rate);
+	put_le32(&h[28], rate * channels);
+	put_le16(&h[32], channels);    /* Block align */
+	put_le16(&h[34], 8);           /* Bits per sample */
+	memcpy(&h[36], "data", 4);
+	put_le32(&h[40], datasize);
+
+	fwrite(h, sizeof(h), 1, out);
+}
+
+static void write_header(FILE *out)
+{
+	const struct recfile_header *hdr = recfile_get_header(conv.file);
+	unsigned channels = recfile_param_channels(hdr->params, hdr->params_size);
+	double rate = get_parameters_sample_frequency(conv.freq, hdr->params, hdr->params_size);
+	time_t start = hdr->start_time / 1000000;
+	unsigned k;
+
+	if (channels<1 || channels>INGEST_MAX_CHANNELS)
+		channels = 1;
+
+	switch (conv.format) {
+	case FORMAT_CSV:
+		fprintf(out, "frame,time");
+		for (k=0; k<channels; k++)
+			fprintf(out, ",ch%u", k);
+		fprintf(out, "\n");
+		break;
+	case FORMAT_WAV:
+		conv.wav_channels = channels;
+		write_wav_header(out, channels, (unsigned long)(rate / channels + 0.5), 0);
+		break;
+	case FORMAT_VCD:
+		fprintf(out, "$date %s$end\n", ctime(&start));
+		fprintf(out, "$version arduino-oscope $end\n");
+		fprintf(out, "$timescale 1 ns $end\n");
+		fprintf(out, "$scope module oscope $end\n");
+		for (k=0; k<INGEST_MAX_CHANNELS; k++)
+			fprintf(out, "$var wire 8 %c ch%u [7:0] $end\n", '!' + k, k);
+		fprintf(out, "$upscope $end\n");
+		fprintf(out, "$enddefinitions $end\n");
+		break;
+	}
+}
+
+static int help(char *cmd)
+{
+	printf("Usage: %s [-f csv|wav|vcd] [-j threads] [-d] recording output\n\n", cmd);
+	printf("  -f format   Output format. Default guessed from output extension\n");
+	printf("  -j threads  Number of worker threads. Default is number of CPUs\n");
+	printf("  -d          Align channels to a common time base (deskew)\n\n");
+	printf("  Output can be '-' for standard output (not for WAV)\n");
+	return -1;
+}
+
+static int parse_format(const char *name, enum format *f)
+{
+	if (!strcasecmp(name,"csv"))
+		*f = FORMAT_CSV;
+	else if (!strcasecmp(name,"wav"))
+		*f = FORMAT_WAV;
+	else if (!strcasecmp(name,"vcd"))
+		*f = FORMAT_VCD;
+	else
+		return -1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *format = NULL;
+	const char *ext;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *threads;
+	struct job *job;
+	unsigned long skipped = 0;
+	uint64_t datasize = 0;
+	size_t slot;
+	FILE *out;
+	long i;
+	int c;
+
+	while ((c=getopt(argc,argv,"f:j:d"))!=-1) {
+		switch (c) {
+		case 'f':
+			format = optarg;
+			break;
+		case 'j':
+			nthreads = atol(optarg);
+			break;
+		case 'd':
+			conv.deskew = 1;
+			break;
+		default:
+			return help(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		return help(argv[0]);
+
+	if (NULL==format) {
+		ext = strrchr(argv[optind+1], '.');
+		format = ext ? ext + 1 : "csv";
+	}
+	if (parse_format(format, &conv.format)<0) {
+		fprintf(stderr,"Unknown format '%s'\n", format);
+		return -1;
+	}
+	if (nthreads<1)
+		nthreads = 1;
+
+	conv.file = recfile_open(argv[optind]);
+	if (NULL==conv.file) {
+		fprintf(stderr,"Cannot open recording '%s'\n", argv[optind]);
+		return -1;
+	}
+	conv.freq = recfile_get_header(conv.file)->freq;
+
+	if (!strcmp(argv[optind+1], "-")) {
+		if (conv.format==FORMAT_WAV) {
+			fprintf(stderr,"WAV output cannot be standard output\n");
+			return -1;
+		}
+		out = stdout;
+	} else {
+		out = fopen(argv[optind+1], "wb");
+		if (NULL==out) {
+			perror(argv[optind+1]);
+			return -1;
+		}
+	}
+
+	cursor.params_size = recfile_get_header(conv.file)->params_size;
+	memcpy(cursor.params, recfile_get_header(conv.file)->params, cursor.params_size);
+
+	write_header(out);
+
+	pthread_mutex_init(&conv.lock, NULL);
+	pthread_cond_init(&conv.cond, NULL);
+
+	conv.njobs = nthreads * JOBS_PER_THREAD;
+	conv.jobs = calloc(conv.njobs, sizeof(struct job));
+	threads = calloc(nthreads, sizeof(pthread_t));
+
+	for (slot=0; slot<conv.njobs; slot++) {
+		if (prepare_job(&conv.jobs[slot]))
+			conv.jobs[slot].state = JOB_PENDING;
+	}
+
+	for (i=0; i<nthreads; i++)
+		pthread_create(&threads[i], NULL, &worker, NULL);
+
+	/* Write jobs in order, refilling each slot as soon as it is written */
+	for (slot=0;; slot = (slot + 1) % conv.njobs) {
+		job = &conv.jobs[slot];
+
+		pthread_mutex_lock(&conv.lock);
+		while (job->state==JOB_PENDING || job->state==JOB_BUSY)
+			pthread_cond_wait(&conv.cond, &conv.lock);
+		pthread_mutex_unlock(&conv.lock);
+
+		if (job->state==JOB_EMPTY)
+			break;
+
+		if (fwrite(job->out.data, 1, job->out.len, out)!=job->out.len) {
+			perror("write");
+			return -1;
+		}
+		datasize += job->out.len;
+		skipped += job->skipped;
+
+		pthread_mutex_lock(&conv.lock);
+		job->state = prepare_job(job) ? JOB_PENDING : JOB_EMPTY;
+		pthread_cond_broadcast(&conv.cond);
+		pthread_mutex_unlock(&conv.lock);
+	}
+
+	pthread_mutex_lock(&conv.lock);
+	conv.quit = 1;
+	pthread_cond_broadcast(&conv.cond);
+	pthread_mutex_unlock(&conv.lock);
+
+	for (i=0; i<nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (conv.format==FORMAT_WAV) {
+		const struct recfile_header *hdr = recfile_get_header(conv.file);
+		double rate = get_parameters_sample_frequency(conv.freq, hdr->params, hdr->params_size);
+		if (fseek(out, 0, SEEK_SET)==0)
+			write_wav_header(out, conv.wav_channels,
+							 (unsigned long)(rate / conv.wav_channels + 0.5), datasize);
+	}
+
+	if (skipped)
+		fprintf(stderr,"%lu frames or segments skipped\n", skipped);
+
+	for (slot=0; slot<conv.njobs; slot++)
+		free(conv.jobs[slot].out.data);
+	free(conv.jobs);
+	free(threads);
+	recfile_free(conv.file);
+
+	return fclose(out)==0 ? 0 : -1;
+}
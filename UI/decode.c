@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "decode.h"
+#include "ingest.h"
+#include "simd.h"
+#include "../protocol.h"
+
+/* Lines are thresholded into bit-streams, 64 samples per word. Edges are
+ found a word at a time, and decoders jump from edge to edge with
+ count-trailing-zeroes, so idle stretches cost next to nothing. */
+
+#define DECODE_WORDS ((INGEST_MAX_SAMPLES + 63) / 64)
+#define DECODE_MAX_LINES 4
+
+enum bus_type {
+	BUS_UART,
+	BUS_SPI,
+	BUS_I2C
+};
+
+struct bits {
+	uint64_t level[DECODE_WORDS];
+	uint64_t rise[DECODE_WORDS];
+	uint64_t fall[DECODE_WORDS];
+};
+
+struct bus {
+	enum bus_type type;
+	char name[24];
+	int line[DECODE_MAX_LINES];   /* uart rx; spi clk, mosi, miso, cs; i2c scl, sda */
+	double baud;
+	unsigned bits;
+	char parity;
+	unsigned stop;
+	unsigned mode;
+	struct bits b[DECODE_MAX_LINES];
+};
+
+struct decoder {
+	struct bus bus[DECODE_MAX_BUSES];
+	unsigned count;
+	unsigned char threshold;
+	double rate;
+	size_t words;
+	size_t samples;
+	size_t events;
+	struct decode_event ev[DECODE_MAX_EVENTS];
+};
+
+static int parse_bus(struct decoder *d, struct bus *b, const char *item)
+{
+	char type[16], fmt[4] = "8n1";
+	int l[5] = { -1, -1, -1, -1, 0 };
+	double baud;
+	int n, i;
+
+	for (i=0; i<DECODE_MAX_LINES; i++)
+		b->line[i] = -1;
+
+	if (sscanf(item, "%15[a-z0-9]:", type)!=1)
+		return -1;
+
+	if (strcmp(type, "uart")==0) {
+		n = sscanf(item, "uart:%d:%lf:%3s", &l[0], &baud, fmt);
+		if (n<2 || baud<=0 || strlen(fmt)!=3 || fmt[0]<'5' || fmt[0]>'8' ||
+			!strchr("neo", fmt[1]) || (fmt[2]!='1' && fmt[2]!='2'))
+			return -1;
+		b->type = BUS_UART;
+		b->baud = baud;
+		b->bits = fmt[0] - '0';
+		b->parity = fmt[1];
+		b->stop = fmt[2] - '0';
+		n = 1;
+	} else if (strcmp(type, "spi")==0) {
+		n = sscanf(item, "spi:%d:%d:%d:%d:%d", &l[0], &l[1], &l[2], &l[3], &l[4]);
+		if (n<2 || l[4]<0 || l[4]>3)
+			return -1;
+		b->type = BUS_SPI;
+		b->mode = l[4];
+		n = 4;
+	} else if (strcmp(type, "i2c")==0) {
+		if (sscanf(item, "i2c:%d:%d", &l[0], &l[1])!=2)
+			return -1;
+		b->type = BUS_I2C;
+		n = 2;
+	} else {
+		return -1;
+	}
+
+	for (i=0; i<n; i++) {
+		if (l[i]>=LOGIC_CHANNELS)
+			return -1;
+		b->line[i] = l[i];
+	}
+	/* Clock and data are mandatory */
+	if (b->line[0]<0 || (b->type!=BUS_UART && b->line[1]<0))
+		return -1;
+	snprintf(b->name, sizeof(b->name), "%s%u", type, d->count);
+	return 0;
+}
+
+struct decoder *decoder_new(const char *spec)
+{
+	struct decoder *d = calloc(1, sizeof(*d));
+	char *copy, *item, *save;
+	int thr;
+
+	if (NULL==d)
+		return NULL;
+	d->threshold = DECODE_DEFAULT_THRESHOLD;
+
+	copy = strdup(spec);
+	for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (sscanf(item, "thr:%d", &thr)==1 && thr>0 && thr<256) {
+			d->threshold = thr;
+			continue;
+		}
+		if (d->count>=DECODE_MAX_BUSES ||
+			parse_bus(d, &d->bus[d->count], item)<0) {
+			fprintf(stderr,"Invalid decoder '%s'\n", item);
+			free(copy);
+			free(d);
+			return NULL;
+		}
+		d->count++;
+	}
+	free(copy);
+	return d;
+}
+
+void decoder_free(struct decoder *d)
+{
+	free(d);
+}
+
+void decoder_set_rate(struct decoder *d, double rate)
+{
+	d->rate = rate;
+}
+
+const char *decoder_bus_name(const struct decoder *d, unsigned bus)
+{
+	return bus<d->count ? d->bus[bus].name : "?";
+}
+
+/* 64 samples to 64 bits, 16 at a time through the byte sign bits */
+static uint64_t pack_logic(const unsigned char *p, unsigned line)
+{
+	uint64_t w = 0;
+	unsigned i;
+
+	for (i=0; i<64; i+=V16QU_WIDTH)
+		w |= (uint64_t)v16qu_movemask(v16qu_load(&p[i]) << (7 - line)) << i;
+	return w;
+}
+
+static uint64_t pack_threshold(const unsigned char *p, unsigned char thr)
+{
+	v16qu t = v16qu_set1(thr);
+	uint64_t w = 0;
+	unsigned i;
+
+	for (i=0; i<64; i+=V16QU_WIDTH)
+		w |= (uint64_t)v16qu_movemask((v16qu)(v16qu_load(&p[i]) >= t)) << i;
+	return w;
+}
+
+static void build_bits(struct decoder *d, struct bits *b, const unsigned char *buf,
+					   unsigned channels, int logic, unsigned line)
+{
+	unsigned char tmp[64];
+	const unsigned char *src;
+	size_t w, j, base, len;
+	uint64_t prev, shifted, valid;
+
+	for (w=0; w<d->words; w++) {
+		base = w * 64;
+		len = d->samples - base < 64 ? d->samples - base : 64;
+		if (channels>1) {
+			for (j=0; j<len; j++)
+				tmp[j] = buf[(base + j) * channels + line];
+			src = tmp;
+		} else if (len<64) {
+			memcpy(tmp, &buf[base], len);
+			src = tmp;
+		} else {
+			src = &buf[base];
+		}
+		if (len<64)
+			memset(&tmp[len], 0, 64 - len);
+
+		if (logic)
+			b->level[w] = pack_logic(src, line);
+		else
+			b->level[w] = pack_threshold(src, d->threshold);
+	}
+
+	/* No edge at sample 0: it is compared with itself */
+	prev = b->level[0] & 1;
+	for (w=0; w<d->words; w++) {
+		shifted = (b->level[w] << 1) | prev;
+		prev = b->level[w] >> 63;
+		b->rise[w] = b->level[w] & ~shifted;
+		b->fall[w] = ~b->level[w] & shifted;
+	}
+	valid = d->samples & 63 ? (1ULL << (d->samples & 63)) - 1 : ~0ULL;
+	b->rise[d->words - 1] &= valid;
+	b->fall[d->words - 1] &= valid;
+}
+
+static inline int bit_at(const struct bits *b, size_t i)
+{
+	return (b->level[i >> 6] >> (i & 63)) & 1;
+}
+
+/* First set bit at or after from, or -1 */
+static long next_set(const uint64_t *m, size_t words, size_t from)
+{
+	size_t w = from >> 6;
+	uint64_t v;
+
+	if (w>=words)
+		return -1;
+	v = m[w] & (~0ULL << (from & 63));
+	while (!v) {
+		if (++w>=words)
+			return -1;
+		v = m[w];
+	}
+	return (long)(w << 6) + __builtin_ctzll(v);
+}
+
+static struct decode_event *add_event(struct decoder *d, unsigned bus, enum decode_type type,
+									  size_t start, size_t end)
+{
+	struct decode_event *ev;
+
+	if (d->events>=DECODE_MAX_EVENTS)
+		return NULL;
+	ev = &d->ev[d->events++];
+	memset(ev, 0, sizeof(*ev));
+	ev->bus = bus;
+	ev->type = type;
+	ev->start = start;
+	ev->end = end;
+	return ev;
+}
+
+static void decode_uart(struct decoder *d, unsigned index, double rate)
+{
+	struct bus *b = &d->bus[index];
+	const struct bits *rx = &b->b[0];
+	struct decode_event *ev;
+	double spb = rate / b->baud;
+	unsigned frame = 1 + b->bits + (b->parity!='n') + b->stop;
+	unsigned value, k, ones, flags;
+	size_t t, from;
+	long s;
+
+	if (spb<2.0)
+		return; /* Cannot sample mid-bit */
+
+	for (s = next_set(rx->fall, d->words, 0); s>=0; s = next_set(rx->fall, d->words, from)) {
+		/* Whole character must be in frame */
+		if ((double)s + frame * spb > (double)d->samples)
+			break;
+		from = s + 1;
+		if (bit_at(rx, (size_t)(s + spb / 2)))
+			continue; /* Glitch, not a start bit */
+
+		value = ones = flags = 0;
+		for (k=0; k<b->bits; k++) {
+			t = (size_t)(s + (k + 1.5) * spb);
+			if (bit_at(rx, t)) {
+				value |= 1 << k;
+				ones++;
+			}
+		}
+		if (b->parity!='n') {
+			t = (size_t)(s + (b->bits + 1.5) * spb);
+			ones += bit_at(rx, t);
+			if ((ones & 1) != (b->parity=='o'))
+				flags |= DECODE_FLAG_PARITY;
+			k++;
+		}
+		t = (size_t)(s + (k + 1.5) * spb);
+		if (!bit_at(rx, t))
+			flags |= DECODE_FLAG_FRAMING;
+
+		ev = add_event(d, index, DECODE_DATA, s, (size_t)(s + (k + 2) * spb));
+		if (NULL==ev)
+			return;
+		ev->value = value;
+		ev->flags = flags;
+		/* Next start bit is after middle of stop bit */
+		from = t;
+	}
+}
+
+static void decode_spi(struct decoder *d, unsigned index)
+{
+	struct bus *b = &d->bus[index];
+	const struct bits *clk = &b->b[0], *mosi = &b->b[1], *miso = &b->b[2], *cs = &b->b[3];
+	/* CPOL == CPHA samples on rising clock edge */
+	const uint64_t *sample = ((b->mode>>1) ^ (b->mode & 1)) ? clk->fall : clk->rise;
+	int has_miso = b->line[2]>=0, has_cs = b->line[3]>=0;
+	unsigned char out = 0, in = 0;
+	unsigned count = 0;
+	size_t w, first = 0, i;
+	uint64_t m, csm;
+	struct decode_event *ev;
+
+	for (w=0; w<d->words; w++) {
+		csm = has_cs ? cs->rise[w] | cs->fall[w] : 0;
+		m = sample[w] | csm;
+		while (m) {
+			i = (w << 6) + __builtin_ctzll(m);
+			m &= m - 1;
+			if (csm & (1ULL << (i & 63))) {
+				/* Select or deselect: partial byte is dropped */
+				count = 0;
+				continue;
+			}
+			if (has_cs && bit_at(cs, i))
+				continue;
+			if (count==0)
+				first = i;
+			out = (out << 1) | bit_at(mosi, i);
+			if (has_miso)
+				in = (in << 1) | bit_at(miso, i);
+			if (++count==8) {
+				ev = add_event(d, index, DECODE_DATA, first, i);
+				if (NULL==ev)
+					return;
+				ev->value = out;
+				ev->value2 = in;
+				count = 0;
+			}
+		}
+	}
+}
+
+static void decode_i2c(struct decoder *d, unsigned index)
+{
+	struct bus *b = &d->bus[index];
+	const struct bits *scl = &b->b[0], *sda = &b->b[1];
+	enum { IDLE, ADDRESS, DATA } state = IDLE;
+	unsigned char value = 0;
+	unsigned count = 0;
+	size_t w, first = 0, i;
+	uint64_t m, start, stop, bit;
+	struct decode_event *ev;
+
+	for (w=0; w<d->words; w++) {
+		/* SDA changing while SCL is high is START or STOP */
+		start = sda->fall[w] & scl->level[w];
+		stop = sda->rise[w] & scl->level[w];
+		m = start | stop | scl->rise[w];
+		while (m) {
+			bit = m & -m;
+			m &= m - 1;
+			i = (w << 6) + __builtin_ctzll(bit);
+			if (bit & (start | stop)) {
+				if (NULL==add_event(d, index, bit & start ? DECODE_START : DECODE_STOP, i, i))
+					return;
+				state = bit & start ? ADDRESS : IDLE;
+				count = 0;
+				continue;
+			}
+			if (state==IDLE)
+				continue;
+			if (count==0)
+				first = i;
+			if (count<8) {
+				value = (value << 1) | bit_at(sda, i);
+				count++;
+				continue;
+			}
+			/* Ninth clock: acknowledge, low is ACK */
+			ev = add_event(d, index, state==ADDRESS ? DECODE_ADDRESS : DECODE_DATA, first, i);
+			if (NULL==ev)
+				return;
+			ev->value = value;
+			if (bit_at(sda, i))
+				ev->flags |= DECODE_FLAG_NACK;
+			state = DATA;
+			count = 0;
+		}
+	}
+}
+
+static int event_compare(const void *a, const void *b)
+{
+	const struct decode_event *x = a, *y = b;
+
+	if (x->start!=y->start)
+		return x->start < y->start ? -1 : 1;
+	return (int)x->bus - (int)y->bus;
+}
+
+const struct decode_event *decoder_process(struct decoder *d, const unsigned char *buf,
+										   size_t numSamples, unsigned channels,
+										   int logic, size_t *count)
+{
+	unsigned i, l;
+	struct bus *b;
+	double rate;
+
+	d->events = 0;
+	if (logic || channels<1)
+		channels = 1;
+	d->samples = numSamples / channels;
+	if (d->samples>INGEST_MAX_SAMPLES)
+		d->samples = INGEST_MAX_SAMPLES;
+	d->words = (d->samples + 63) / 64;
+	rate = d->rate / channels;
+
+	if (d->samples==0 || rate<=0) {
+		*count = 0;
+		return d->ev;
+	}
+
+	for (i=0; i<d->count; i++) {
+		b = &d->bus[i];
+		for (l=0; l<DECODE_MAX_LINES; l++) {
+			if (b->line[l]<0)
+				continue;
+			/* Analog frames have fewer channels than logic lines */
+			if (!logic && (unsigned)b->line[l]>=channels)
+				break;
+			build_bits(d, &b->b[l], buf, channels, logic, b->line[l]);
+		}
+		if (l<DECODE_MAX_LINES)
+			continue;
+
+		switch (b->type) {
+		case BUS_UART:
+			decode_uart(d, i, rate);
+			break;
+		case BUS_SPI:
+			decode_spi(d, i);
+			break;
+		case BUS_I2C:
+			decode_i2c(d, i);
+			break;
+		}
+	}
+
+	if (d->count>1)
+		qsort(d->ev, d->events, sizeof(d->ev[0]), &event_compare);
+	*count = d->events;
+	return d->ev;
+}
+
+int decode_format(const struct decode_event *ev, char *buf, size_t size)
+{
+	char c = ev->value>=0x20 && ev->value<0x7f ? ev->value : '.';
+
+	switch (ev->type) {
+	case DECODE_START:
+		return snprintf(buf, size, "START");
+	case DECODE_STOP:
+		return snprintf(buf, size, "STOP");
+	case DECODE_ADDRESS:
+		return snprintf(buf, size, "ADDR 0x%02x %c %s", ev->value >> 1,
+						ev->value & 1 ? 'R' : 'W',
+						ev->flags & DECODE_FLAG_NACK ? "NACK" : "ACK");
+	default:
+		break;
+	}
+	return snprintf(buf, size, "0x%02x '%c'%s%s%s", ev->value, c,
+					ev->flags & DECODE_FLAG_NACK ? " NACK" : "",
+					ev->flags & DECODE_FLAG_PARITY ? " PARITY" : "",
+					ev->flags & DECODE_FLAG_FRAMING ? " FRAMING" : "");
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <stddef.h>
+
+/* Limits for a decoder set */
+#define DECODE_MAX_BUSES  4
+#define DECODE_MAX_EVENTS 512
+
+/* Analog channels are high at or above this level, unless thr: is given */
+#define DECODE_DEFAULT_THRESHOLD 128
+
+enum decode_type {
+	DECODE_DATA,
+	DECODE_ADDRESS,  /* I2C, value includes R/W bit */
+	DECODE_START,
+	DECODE_STOP
+};
+
+#define DECODE_FLAG_NACK    (1<<0) /* I2C byte not acknowledged */
+#define DECODE_FLAG_PARITY  (1<<1) /* UART parity error */
+#define DECODE_FLAG_FRAMING (1<<2) /* UART stop bit low */
+
+/* Sample indices count samples of one line, i.e. groups for analog
+ frames with several channels */
+struct decode_event {
+	unsigned start;
+	unsigned end;
+	unsigned char bus;
+	unsigned char type;
+	unsigned char flags;
+	unsigned char value;
+	unsigned char value2;  /* SPI MISO */
+};
+
+struct decoder;
+
+/*
+ Create decoders from a comma-separated list of buses. Lines are bits of
+ logic analyzer frames, or channels of analog frames:
+
+   uart:<rx>:<baud>[:<format>]    format is bits, parity (n, e or o) and
+                                  stop bits, default 8n1
+   spi:<clk>:<mosi>[:<miso>[:<cs>[:<mode>]]]
+                                  -1 for unused lines, mode 0 to 3, cs
+                                  active low
+   i2c:<scl>:<sda>
+   thr:<level>                    Threshold for analog channels
+
+ Returns NULL on error.
+ */
+struct decoder *decoder_new(const char *spec);
+void decoder_free(struct decoder *d);
+
+/* Sample rate, all channels together, as for filter_bank_set_rate() */
+void decoder_set_rate(struct decoder *d, double rate);
+
+/* Decode one frame of interleaved samples, or logic analyzer samples if
+ logic is set. Frames are decoded on their own, as captures are not
+ contiguous. Events are in order of start sample, and valid until next
+ call */
+const struct decode_event *decoder_process(struct decoder *d, const unsigned char *buf,
+										   size_t numSamples, unsigned channels,
+										   int logic, size_t *count);
+
+/* Short bus name, e.g. "uart1" */
+const char *decoder_bus_name(const struct decoder *d, unsigned bus);
+
+/* Event as text, e.g. "0x41 'A'", "ADDR 0x50 W ACK", "START" */
+int decode_format(const struct decode_event *ev, char *buf, size_t size);
+
+#endif
@@ -19,6 +19,18 @@
 #include <gtk/gtk.h>
 #include "scope.h"
 #include "serial.h"
+#include "ingest.h"
+#include "filter.h"
+#include "average.h"
+#include "decode.h"
+#include "mask.h"
+#include "logic.h"
+#include "trigger.h"
+#include "record.h"
+#include "trace.h"
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,17 +46,75 @@ cairo_t *cr;
 
 GtkWidget *scale_trigger;
 GtkWidget *scale_holdoff;
-GtkWidget *combo_prescaler;
+GtkWidget *combo_timebase;
 GtkWidget *combo_vref;
 GtkWidget *combo_channels;
+GtkWidget *combo_memseg;
+GtkWidget *combo_trigmode;
+GtkWidget *history_button;
+GtkWidget *scale_history_span;
+GtkWidget *scale_history_back;
+GtkWidget *scale_trigparam;
+GtkWidget *scale_memseg;
 GtkWidget *shot_button;
 GtkWidget *freeze_button;
+GtkWidget *stats_label;
+GtkWidget *mask_label;
+GtkWidget *record_button;
+GtkWidget *logic_button;
 
 unsigned short numSamples;
 static gboolean frozen=FALSE;
+static double sample_freq;
+static unsigned char replay_channels = 1;
+
+/* Live frames are filtered and averaged by acquisition, replayed ones
+ here */
+static struct filter_bank *replay_filter;
+static struct average *replay_average;
+static struct decoder *replay_decoder;
+static struct mask *replay_mask;
+static gboolean replay_logic;
+
+/* Logic analyzer trigger, from -L */
+static struct logic_trigger logic_trigger;
+/* Analog trigger mode, set from -X and the trigger mode widgets */
+static struct trigger_mode trigger_mode = { TRIGGER_MODE_EDGE, 255, 0 };
+static gboolean trigger_mode_set;
+
+/* Arrival time of last frame from each device, for aligning traces */
+static gint64 trace_arrival[SERIAL_MAX_DEVICES];
 
 const unsigned long arduino_freq = 16000000; // 16 MHz
 
+/* Entries in timebase combo. Timer-triggered rates come first, followed
+ by free-running ADC rates (rate 0), which depend only on prescaler */
+static const struct {
+	double rate;
+	unsigned char prescale;
+} timebases[] = {
+	{ 100, 0 },
+	{ 200, 0 },
+	{ 500, 0 },
+	{ 1000, 0 },
+	{ 2000, 0 },
+	{ 5000, 0 },
+	{ 10000, 0 },
+	{ 20000, 0 },
+	{ 50000, 0 },
+	{ 0, 7 },
+	{ 0, 6 },
+	{ 0, 5 },
+	{ 0, 4 },
+	{ 0, 3 },
+	{ 0, 2 }
+};
+
+#define NUM_TIMEBASES (sizeof(timebases)/sizeof(timebases[0]))
+
+/* Interval between COMMAND_GET_STATS polls, in ms */
+#define STATS_POLL_INTERVAL 1000
+
 void win_destroy_callback()
 {
 	gtk_main_quit();
@@ -52,26 +122,179 @@ void win_destroy_callback()
 
 unsigned char current_trigger_level = 0;
 
-void mysetdata(unsigned char *data,size_t size)
+void mysetdata(unsigned char *data,size_t size,struct frame *frame)
+{
+	scope_display_set_frame(image,frame,data,size);
+}
+
+void mysetaverage(const unsigned short *data,size_t size)
+{
+	scope_display_set_data16(image,data,size);
+}
+
+/* Bus events of frame last shown, one annotation row per bus */
+void mysetdecoded(const struct decode_event *ev,size_t count)
+{
+	struct scope_annotation *a = g_new(struct scope_annotation, count ? count : 1);
+	size_t i;
+
+	for (i=0; i<count; i++) {
+		a[i].start = ev[i].start;
+		a[i].end = ev[i].end;
+		a[i].row = ev[i].bus;
+		decode_format(&ev[i], a[i].text, sizeof(a[i].text));
+	}
+	scope_display_set_annotations(image, a, count);
+	g_free(a);
+}
+
+void set_frozen(gboolean yes);
+
+void mysetmask(const unsigned char *lower, const unsigned char *upper,
+			   const unsigned char *violations, size_t size, int failed,
+			   const struct mask_stats *stats, gboolean stopped)
+{
+	gchar *text;
+
+	scope_display_set_mask(image, lower, upper, violations, size);
+	text = g_strdup_printf("Mask: %lu frames tested, %lu failed, %lu samples outside%s",
+						   stats->tested, stats->failed, stats->samples,
+						   stopped ? " | STOPPED on failure" : "");
+	gtk_label_set_text(GTK_LABEL(mask_label), text);
+	g_free(text);
+	/* Only main device tests frames and froze itself */
+	if (stopped && failed>0) {
+		serial_freeze_unfreeze(TRUE);
+		set_frozen(TRUE);
+	}
+}
+
+/* Shift extra traces by difference in arrival time to main trace. All
+ devices run same settings, so frames take equally long to capture */
+static void update_trace_offsets()
 {
-	scope_display_set_data(image,data,size);
+	int i;
+	double delta;
+
+	for (i=1; i<serial_num_devices(); i++) {
+		if (trace_arrival[i]==0 || trace_arrival[0]==0)
+			continue;
+		delta = (double)(trace_arrival[i] - trace_arrival[0]) / 1000000.0;
+		scope_display_set_trace_offset(image, i-1, (int)lrint(delta * sample_freq));
+	}
 }
 
+void scope_got_trace(int device, unsigned char *data, size_t size,
+					 unsigned char channels, gint64 arrival)
+{
+	trace_arrival[device] = arrival;
+	update_trace_offsets();
+	if (device>0)
+		scope_display_set_trace(image, device-1, data, size, channels);
+}
+
+static int timebase_index(unsigned char prescale, unsigned char timerClock, double fsample)
+{
+	unsigned int i;
+	int best = -1;
+	double err, besterr = 0;
+
+	for (i=0; i<NUM_TIMEBASES; i++) {
+		if (timerClock==TIMER_CLOCK_NONE) {
+			if (timebases[i].rate==0 && timebases[i].prescale==prescale)
+				return i;
+		} else if (timebases[i].rate>0) {
+			err = fabs(timebases[i].rate - fsample);
+			if (best<0 || err<besterr) {
+				best = i;
+				besterr = err;
+			}
+		}
+	}
+	return best;
+}
+
+gboolean trigger_level_changed(GtkWidget *widget);
+gboolean holdoff_level_changed(GtkWidget *widget);
+gboolean timebase_changed(GtkWidget *widget);
+gboolean vref_changed(GtkWidget *widget);
+void channels_changed(GtkWidget *widget);
+void logic_toggled(GtkWidget *widget);
+void memseg_changed(GtkWidget *widget);
+void trigmode_changed(GtkWidget *widget);
+void trigparam_changed(GtkWidget *widget);
+
+/* Whether scale_trigparam is second level or parameter in mode */
+static gboolean trigmode_uses_level2(unsigned char mode)
+{
+	return mode==TRIGGER_MODE_WINDOW_IN || mode==TRIGGER_MODE_WINDOW_OUT ||
+		mode==TRIGGER_MODE_RUNT;
+}
+
+/* Choices in memory segments combo */
+static const unsigned memseg_choices[] = { 1, 2, 4, 8, 16 };
+
+#define NUM_MEMSEG_CHOICES (sizeof(memseg_choices)/sizeof(memseg_choices[0]))
+
 void scope_got_parameters(unsigned char triggerLevel,
 						  unsigned char holdoffSamples,
 						  unsigned char adcref,
 						  unsigned char prescale,
 						  unsigned short numS,
 						  unsigned char flags,
-						  unsigned char num_channels)
+						  unsigned char num_channels,
+						  unsigned char timerClock,
+						  unsigned short timerTop,
+						  unsigned char logicFlags,
+						  unsigned char memsegs,
+						  const struct trigger_mode *trig)
 {
+	gboolean logic = (logicFlags & LOGIC_FLAG_ENABLE) != 0;
+	int i;
+	double fsample;
+
 	numSamples=numS;
 	gtk_widget_set_size_request(image,numS,256);
 	scope_display_set_samples(image,numS);
 	scope_display_set_channels(image,num_channels);
+	scope_display_set_logic(image,logic);
+	/* Reflect device state, without sending it back */
+	g_signal_handlers_block_by_func(logic_button, logic_toggled, NULL);
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(logic_button),logic);
+	g_signal_handlers_unblock_by_func(logic_button, logic_toggled, NULL);
+	for (i=0; i<NUM_MEMSEG_CHOICES; i++) {
+		if (memseg_choices[i]!=memsegs)
+			continue;
+		g_signal_handlers_block_by_func(combo_memseg, memseg_changed, NULL);
+		gtk_combo_box_set_active(GTK_COMBO_BOX(combo_memseg),i);
+		g_signal_handlers_unblock_by_func(combo_memseg, memseg_changed, NULL);
+	}
+	gtk_range_set_range(GTK_RANGE(scale_memseg),0,memsegs>1 ? memsegs : 1);
+	/* -X applies once device answered, then widgets follow device */
+	if (trigger_mode_set) {
+		trigger_mode_set = FALSE;
+		serial_set_trigger_mode(&trigger_mode);
+	} else {
+		trigger_mode = *trig;
+	}
+	g_signal_handlers_block_by_func(combo_trigmode, trigmode_changed, NULL);
+	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_trigmode),trigger_mode.mode);
+	g_signal_handlers_unblock_by_func(combo_trigmode, trigmode_changed, NULL);
+	g_signal_handlers_block_by_func(scale_trigparam, trigparam_changed, NULL);
+	gtk_range_set_value(GTK_RANGE(scale_trigparam),
+						trigmode_uses_level2(trigger_mode.mode) ?
+						trigger_mode.level2 : trigger_mode.param);
+	g_signal_handlers_unblock_by_func(scale_trigparam, trigparam_changed, NULL);
+	g_signal_handlers_block_by_func(scale_trigger, trigger_level_changed, NULL);
 	gtk_range_set_value(GTK_RANGE(scale_trigger),triggerLevel);
+	g_signal_handlers_unblock_by_func(scale_trigger, trigger_level_changed, NULL);
+	current_trigger_level = triggerLevel;
+	scope_display_set_trigger_level(image,triggerLevel);
+	g_signal_handlers_block_by_func(scale_holdoff, holdoff_level_changed, NULL);
 	gtk_range_set_value(GTK_RANGE(scale_holdoff),holdoffSamples);
+	g_signal_handlers_unblock_by_func(scale_holdoff, holdoff_level_changed, NULL);
 
+	g_signal_handlers_block_by_func(combo_vref, vref_changed, NULL);
 	switch(adcref) {
 	case 0:
 	case 1:
@@ -81,12 +304,195 @@ void scope_got_parameters(unsigned char triggerLevel,
 	default:
 		gtk_combo_box_set_active(GTK_COMBO_BOX(combo_vref),2);
 	}
+	g_signal_handlers_unblock_by_func(combo_vref, vref_changed, NULL);
 
-	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_prescaler),7-prescale);
+	if (logic && timerClock==TIMER_CLOCK_NONE) {
+		fsample = (double)arduino_freq / LOGIC_LOOP_CYCLES;
+	} else if (timerClock==TIMER_CLOCK_NONE) {
+		fsample = get_sample_frequency(arduino_freq, 1<<prescale);
+	} else {
+		fsample = get_timer_sample_frequency(arduino_freq, timerClock, timerTop);
+	}
+	scope_display_set_sample_freq(image, fsample);
+	sample_freq = fsample;
+	replay_channels = num_channels;
+	replay_logic = logic;
+	if (replay_filter)
+		filter_bank_set_rate(replay_filter, fsample);
+	if (replay_average)
+		average_reset(replay_average);
+	if (replay_decoder)
+		decoder_set_rate(replay_decoder, fsample);
+	if (replay_mask)
+		mask_reset(replay_mask);
+
+	/* Nearest entry only: rates autoset picks need not be in the combo */
+	i = timebase_index(prescale, timerClock, fsample);
+	g_signal_handlers_block_by_func(combo_timebase, timebase_changed, NULL);
+	if (i>=0)
+		gtk_combo_box_set_active(GTK_COMBO_BOX(combo_timebase),i);
+	g_signal_handlers_unblock_by_func(combo_timebase, timebase_changed, NULL);
+	g_signal_handlers_block_by_func(combo_channels, channels_changed, NULL);
 	gtk_combo_box_set_active(GTK_COMBO_BOX(combo_channels),num_channels-1);
+	g_signal_handlers_unblock_by_func(combo_channels, channels_changed, NULL);
 }
 
 
+/* Replay cannot be paused, so a failure is only shown */
+static void replay_test(const unsigned char *data,size_t size)
+{
+	struct mask_stats stats;
+	int triggered = size>numSamples ? data[numSamples + TRAILER_TRIGGERED] : 1;
+	int failed;
+
+	failed = mask_test(replay_mask, data, size<numSamples ? size : numSamples, triggered);
+	if (failed<0)
+		return;
+	mask_get_stats(replay_mask, &stats);
+	mysetmask(mask_lower(replay_mask), mask_upper(replay_mask),
+			  mask_violations(replay_mask), mask_size(replay_mask), failed, &stats, FALSE);
+}
+
+/* Segmented frames decode as empty, as acq does */
+static void replay_decode(const unsigned char *data,size_t size,unsigned memsegs)
+{
+	const struct decode_event *ev;
+	size_t events;
+
+	if (NULL==replay_decoder)
+		return;
+	if (memsegs)
+		size = 0;
+	ev = decoder_process(replay_decoder, data, size<numSamples ? size : numSamples,
+						 replay_channels, replay_logic, &events);
+	if (ev)
+		mysetdecoded(ev, events);
+}
+
+void scope_got_memsegs(const struct ingest_memseg *seg, unsigned count)
+{
+	scope_display_set_memsegs(image, seg, count);
+}
+
+void replay_data(unsigned char *data,size_t size)
+{
+	struct ingest_memseg seg[MEMSEG_MAX];
+	const unsigned short *avg;
+	unsigned memsegs;
+	int triggered;
+
+	size = ingest_process(data, size, numSamples);
+	memsegs = ingest_memsegs(data, size, numSamples, seg);
+	scope_got_memsegs(seg, memsegs);
+	/* Logic samples are bit fields, and segmented frames are not one
+	 aligned piece of signal, so mask and average skip them */
+	if (replay_logic || memsegs) {
+		if (replay_filter && !replay_logic)
+			filter_bank_process(replay_filter, data, numSamples, replay_channels);
+		mysetdata(data, size, NULL);
+		replay_decode(data, size, memsegs);
+		return;
+	}
+	if (replay_filter)
+		filter_bank_process(replay_filter, data, size<numSamples ? size : numSamples,
+							replay_channels);
+	if (replay_mask)
+		replay_test(data, size);
+	if (replay_average) {
+		triggered = size>numSamples ? data[numSamples + TRAILER_TRIGGERED] : 1;
+		avg = average_add(replay_average, data, size<numSamples ? size : numSamples,
+						  triggered);
+		if (avg)
+			mysetaverage(avg, size<numSamples ? size : numSamples);
+		replay_decode(data, size, memsegs);
+		return;
+	}
+	mysetdata(data, size, NULL);
+	replay_decode(data, size, memsegs);
+}
+
+void replay_done()
+{
+	fprintf(stderr,"Replay finished\n");
+}
+
+void record_toggled(GtkWidget *widget)
+{
+	gboolean active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	char name[64];
+	time_t now;
+
+	if (active && !record_is_active()) {
+		now = time(NULL);
+		strftime(name, sizeof(name), "oscope-%Y%m%d-%H%M%S.rec", localtime(&now));
+		if (record_start(name, arduino_freq)<0)
+			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(widget), FALSE);
+	} else if (!active && record_is_active()) {
+		record_stop();
+	}
+}
+
+void trace_toggled(GtkWidget *widget)
+{
+	gboolean active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	char name[64];
+	time_t now;
+
+	trace_enable(active);
+	scope_display_set_trace_overlay(image, active);
+	if (!active) {
+		now = time(NULL);
+		strftime(name, sizeof(name), "oscope-%Y%m%d-%H%M%S.trace.json", localtime(&now));
+		if (trace_dump(name)==0)
+			printf("Trace written to %s\n", name);
+	}
+}
+
+void scope_got_stats(const struct acq_stats *stats)
+{
+	static gboolean header_done = FALSE;
+	gchar *text;
+
+	text = g_strdup_printf("Conversions: %lu stored: %lu missed: %lu | "
+						   "Triggers: %lu real, %lu auto | "
+						   "ISR max: %u cycles | TX stall: %lu ms | "
+						   "RX errors: %u cksum, %u oversize | "
+						   "Host: %lu frames, %lu cksum errors, %lu CRC errors, "
+						   "%lu resent, %lu lost",
+						   stats->conversions, stats->stored, stats->missed,
+						   stats->realTriggers, stats->autoTriggers,
+						   stats->maxIsrCycles, stats->txStallUs/1000,
+						   stats->rxChecksumErrors, stats->rxOversize,
+						   stats->hostFrames, stats->hostChecksumErrors,
+						   stats->hostCrcErrors, stats->hostSegmentsResent,
+						   stats->hostFramesLost);
+	gtk_label_set_text(GTK_LABEL(stats_label), text);
+	g_free(text);
+
+	if (!header_done) {
+		fprintf(stderr,"time,conversions,stored,missed,real_triggers,auto_triggers,"
+				"max_isr_cycles,tx_stall_us,rx_cksum_errors,rx_oversize,"
+				"host_frames,host_cksum_errors,host_crc_errors,"
+				"host_segments_resent,host_frames_lost\n");
+		header_done = TRUE;
+	}
+	fprintf(stderr,"%.3f,%lu,%lu,%lu,%lu,%lu,%u,%lu,%u,%u,%lu,%lu,%lu,%lu,%lu\n",
+			(double)g_get_real_time() / 1000000.0,
+			stats->conversions, stats->stored, stats->missed,
+			stats->realTriggers, stats->autoTriggers,
+			stats->maxIsrCycles, stats->txStallUs,
+			stats->rxChecksumErrors, stats->rxOversize,
+			stats->hostFrames, stats->hostChecksumErrors,
+			stats->hostCrcErrors, stats->hostSegmentsResent,
+			stats->hostFramesLost);
+}
+
+gboolean poll_stats(gpointer data)
+{
+	serial_get_stats(FALSE);
+	return TRUE;
+}
+
 gboolean trigger_level_changed(GtkWidget *widget)
 {
 	int l = (int)gtk_range_get_value(GTK_RANGE(widget));
@@ -112,29 +518,42 @@ gboolean zoom_changed(GtkWidget *widget)
 	return TRUE;
 }
 
-gboolean prescaler_changed(GtkWidget *widget)
+gboolean timebase_changed(GtkWidget *widget)
 {
-	gchar *c = gtk_combo_box_get_active_text(GTK_COMBO_BOX(widget));
-
-	int base = (int)log2((double)atoi(c));
-	//printf("Prescale: 0x%x\n",base);
-	serial_set_prescaler(base);
-
-	double fsample = get_sample_frequency(arduino_freq, atol(c));
-	printf("Fsample: %F Hz\n", fsample);
+	int i = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+	unsigned char prescale, clocksel;
+	unsigned short top;
+	double fsample;
+
+	if (i<0 || i>=NUM_TIMEBASES)
+		return TRUE;
+
+	if (timebases[i].rate>0) {
+		if (get_timebase_settings(arduino_freq, timebases[i].rate,
+								  &prescale, &clocksel, &top)<0)
+			return TRUE;
+		serial_set_prescaler(prescale);
+		serial_set_sample_rate(clocksel, top);
+		fsample = get_timer_sample_frequency(arduino_freq, clocksel, top);
+	} else {
+		prescale = timebases[i].prescale;
+		serial_set_prescaler(prescale);
+		serial_set_sample_rate(TIMER_CLOCK_NONE, 0);
+		fsample = get_sample_frequency(arduino_freq, 1<<prescale);
+	}
 
-	// 512 samples.
+	printf("Fsample: %F Hz (ADC prescaler %d)\n", fsample, 1<<prescale);
 
 	// Ts = 1/freq.
-	// Full scope time: 512*1/freq.
-	// Each slot: 512/freq/10
+	// Full scope time: numSamples*1/freq.
+	// Each slot: numSamples/freq/10
     // In ms * 1000.0
 
 	printf("Tdiv: %F ms\n", (double)numSamples*100.0 / fsample );
-	printf("Test with freq %F Hz\n", fsample/((double)numSamples/10.0));
 	scope_display_set_sample_freq(image, fsample);
 	return TRUE;
 }
+
 gboolean vref_changed(GtkWidget *widget)
 {
 	unsigned char base;
@@ -158,6 +577,65 @@ void trigger_toggle_changed(GtkWidget *widget)
 	serial_set_trigger_invert(active);
 }
 
+void logic_toggled(GtkWidget *widget)
+{
+	gboolean active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+	serial_set_logic(active, &logic_trigger);
+}
+
+void memseg_changed(GtkWidget *widget)
+{
+	gint i = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+
+	if (i>=0 && i<NUM_MEMSEG_CHOICES)
+		serial_set_memseg(memseg_choices[i]);
+}
+
+void trigmode_changed(GtkWidget *widget)
+{
+	gint i = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+
+	if (i<0 || i>TRIGGER_MODE_MAX)
+		return;
+	trigger_mode.mode = i;
+	trigparam_changed(scale_trigparam);
+}
+
+void trigparam_changed(GtkWidget *widget)
+{
+	unsigned char v = gtk_range_get_value(GTK_RANGE(widget));
+
+	if (trigmode_uses_level2(trigger_mode.mode))
+		trigger_mode.level2 = v;
+	else
+		trigger_mode.param = v;
+	serial_set_trigger_mode(&trigger_mode);
+}
+
+void history_toggled(GtkWidget *widget)
+{
+	gboolean active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+
+	if (scope_display_set_history(image, active)<0) {
+		g_signal_handlers_block_by_func(widget, history_toggled, NULL);
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(widget), FALSE);
+		g_signal_handlers_unblock_by_func(widget, history_toggled, NULL);
+	}
+}
+
+/* Span scale is log2 of samples per pixel */
+void history_view_changed(GtkWidget *widget)
+{
+	scope_display_set_history_view(image,
+								   pow(2, gtk_range_get_value(GTK_RANGE(scale_history_span))),
+								   gtk_range_get_value(GTK_RANGE(scale_history_back)));
+}
+
+void memseg_view_changed(GtkWidget *widget)
+{
+	scope_display_set_memseg_view(image, gtk_range_get_value(GTK_RANGE(widget)));
+}
+
 void channels_changed(GtkWidget *widget)
 {
 	char *active_s = gtk_combo_box_get_active_text(GTK_COMBO_BOX(widget));
@@ -201,6 +679,11 @@ void freeze_unfreeze(GtkWidget *widget)
 	}
 }
 
+void autoset_clicked(GtkWidget *widget)
+{
+	serial_autoset(arduino_freq);
+}
+
 gboolean trigger_single_shot(GtkWidget *widget)
 {
 	GtkWidget *dialog= gtk_dialog_new_with_buttons("Waiting for trigger...",
@@ -225,7 +708,31 @@ gboolean trigger_single_shot(GtkWidget *widget)
 
 int help(char*cmd)
 {
-	printf("Usage: %s serialport\n\n",cmd);
+	printf("Usage: %s [-r recording] serialport [serialport...]\n",cmd);
+	printf("       %s -p recording [-f]\n\n",cmd);
+	printf("  -r file   Record all captures to file\n");
+	printf("  -p file   Replay recorded captures instead of using serial port\n");
+	printf("  -f        Replay as fast as possible, not at recorded pace\n");
+	printf("  -s addr   Serve frames to viewers (oscope-client) on Unix socket\n");
+	printf("            path or TCP [host:]port\n");
+	printf("  -m name   Publish frames to shared memory ring (oscope-shmread)\n");
+	printf("  -F spec   Filter frames, e.g. notch:50,lp:2000 (see filter.h)\n");
+	printf("  -A n[:exp] Show average of last n triggered frames (2-%d),\n",
+		   AVERAGE_MAX_FRAMES);
+	printf("            or exponential average if :exp\n");
+	printf("  -D spec   Decode buses, e.g. uart:2:9600:8n1,i2c:0:1 (see decode.h)\n");
+	printf("  -M spec   Test frames against mask file, or learn:n[:margin] from\n");
+	printf("            first n triggered frames (see mask.h). Auto-triggered\n");
+	printf("            frames fail\n");
+	printf("  -S        Freeze on first frame failing mask test\n");
+	printf("  -X mode   Trigger mode: edge, hyst:n, pulse-gt:n, pulse-lt:n,\n");
+	printf("            window-in:level, window-out:level, runt:level (see trigger.h)\n");
+	printf("  -L trig   Logic analyzer trigger, one of x01rf per line, line 7\n");
+	printf("            first, e.g. xxxxr0xx (see logic.h)\n\n");
+	printf("  Extra serial ports (up to %d) are shown as dashed traces. Port\n",
+		   SERIAL_MAX_DEVICES - 1);
+	printf("  auto looks for the device on USB serial ports. Lost devices are\n");
+	printf("  reopened with the same settings\n\n");
 	printf("  example: %s /dev/ttyUSB0\n\n",cmd);
 	return -1;
 }
@@ -233,14 +740,102 @@ int help(char*cmd)
 int main(int argc,char **argv)
 {
 	GtkWidget*scale_zoom;
+	unsigned int i;
+	int c;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	gboolean replay_fast = FALSE;
+	char *serve = NULL;
+	struct server *server = NULL;
+	char *shmname = NULL;
+	struct shmring *shm = NULL;
+	char *filters = NULL;
+	unsigned avg_frames = 0;
+	int avg_exp = 0;
+	char *decoders = NULL;
+	char *masks = NULL;
+	gboolean mask_stop = FALSE;
 
 	gtk_init(&argc,&argv);
 
-	if (argc<2)
-		return help(argv[0]);
+	while ((c=getopt(argc,argv,"r:p:fs:m:F:A:L:X:D:M:S"))!=-1) {
+		switch (c) {
+		case 'r':
+			record_file = optarg;
+			break;
+		case 'p':
+			replay_file = optarg;
+			break;
+		case 'f':
+			replay_fast = TRUE;
+			break;
+		case 's':
+			serve = optarg;
+			break;
+		case 'm':
+			shmname = optarg;
+			break;
+		case 'F':
+			filters = optarg;
+			break;
+		case 'D':
+			decoders = optarg;
+			break;
+		case 'M':
+			masks = optarg;
+			break;
+		case 'S':
+			mask_stop = TRUE;
+			break;
+		case 'L':
+			if (logic_parse_trigger(optarg, &logic_trigger)<0)
+				return -1;
+			break;
+		case 'X':
+			if (trigger_parse(optarg, &trigger_mode)<0)
+				return -1;
+			trigger_mode_set = TRUE;
+			break;
+		case 'A':
+			if (average_parse(optarg, &avg_frames, &avg_exp)<0)
+				return -1;
+			break;
+		default:
+			return help(argv[0]);
+		}
+	}
 
-	if (serial_init(argv[1])<0)
-		return -1;
+	if (NULL==replay_file) {
+		if (optind>=argc)
+			return help(argv[0]);
+
+		if (NULL!=filters && serial_set_filter(filters, arduino_freq)<0)
+			return -1;
+		if (avg_frames)
+			serial_set_average(avg_frames, avg_exp, &mysetaverage);
+		if (NULL!=decoders && serial_set_decoder(decoders, arduino_freq, &mysetdecoded)<0)
+			return -1;
+		if (NULL!=masks && serial_set_mask(masks, mask_stop, &mysetmask)<0)
+			return -1;
+
+		for (i=optind; i<argc; i++) {
+			if (serial_init(argv[i])<0)
+				return -1;
+		}
+		if (NULL!=serve) {
+			signal(SIGPIPE, SIG_IGN);
+			server = server_start(serve, arduino_freq);
+			if (NULL==server)
+				return -1;
+			serial_set_server(server);
+		}
+		if (NULL!=shmname) {
+			shm = shmring_create(shmname, SHMRING_SLOTS);
+			if (NULL==shm)
+				return -1;
+			serial_set_shmring(shm, arduino_freq);
+		}
+	}
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 
@@ -269,6 +864,20 @@ int main(int argc,char **argv)
 	gtk_box_pack_start(GTK_BOX(hbox),scale_trigger,TRUE,TRUE,0);
 	g_signal_connect(G_OBJECT(scale_trigger),"value-changed",G_CALLBACK(&trigger_level_changed),NULL);
 
+	hbox = gtk_hbox_new(FALSE,4);
+	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Trigger mode:"),TRUE,TRUE,0);
+	combo_trigmode = gtk_combo_box_new_text();
+	gtk_box_pack_start(GTK_BOX(hbox),combo_trigmode,TRUE,TRUE,0);
+	for (i=0; i<=TRIGGER_MODE_MAX; i++)
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_trigmode),trigger_mode_name(i));
+	g_signal_connect(G_OBJECT(combo_trigmode),"changed",G_CALLBACK(&trigmode_changed),NULL);
+	/* Hysteresis or pulse width, or second level for window and runt */
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Width / level 2:"),TRUE,TRUE,0);
+	scale_trigparam=gtk_hscale_new_with_range(0,255,1);
+	gtk_box_pack_start(GTK_BOX(hbox),scale_trigparam,TRUE,TRUE,0);
+	g_signal_connect(G_OBJECT(scale_trigparam),"value-changed",G_CALLBACK(&trigparam_changed),NULL);
+
 	hbox = gtk_hbox_new(FALSE,4);
 	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
 	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Holdoff samples:"),TRUE,TRUE,0);
@@ -278,18 +887,25 @@ int main(int argc,char **argv)
 
 	hbox = gtk_hbox_new(FALSE,4);
 	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
-	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Prescaler:"),TRUE,TRUE,0);
-	combo_prescaler=gtk_combo_box_new_text();
-	gtk_box_pack_start(GTK_BOX(hbox),combo_prescaler,TRUE,TRUE,0);
-	g_signal_connect(G_OBJECT(combo_prescaler),"changed",G_CALLBACK(&prescaler_changed),NULL);
-
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"128");
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"64");
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"32");
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"16");
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"8");
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"4");
-	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_prescaler),"2");
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Sample rate:"),TRUE,TRUE,0);
+	combo_timebase=gtk_combo_box_new_text();
+	gtk_box_pack_start(GTK_BOX(hbox),combo_timebase,TRUE,TRUE,0);
+
+	for (i=0; i<NUM_TIMEBASES; i++) {
+		gchar *label;
+		double rate = timebases[i].rate;
+		if (rate>0) {
+			label = rate>=1000 ? g_strdup_printf("%g kHz", rate/1000) :
+				g_strdup_printf("%g Hz", rate);
+		} else {
+			rate = get_sample_frequency(arduino_freq, 1<<timebases[i].prescale);
+			label = g_strdup_printf("%.2f kHz (free-running, /%d)", rate/1000,
+									1<<timebases[i].prescale);
+		}
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_timebase),label);
+		g_free(label);
+	}
+	g_signal_connect(G_OBJECT(combo_timebase),"changed",G_CALLBACK(&timebase_changed),NULL);
 
 	hbox = gtk_hbox_new(FALSE,4);
 	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
@@ -315,6 +931,40 @@ int main(int argc,char **argv)
 	gtk_combo_box_append_text(GTK_COMBO_BOX(combo_channels),"4");
 	g_signal_connect(G_OBJECT(combo_channels),"changed",G_CALLBACK(&channels_changed),NULL);
 
+	hbox = gtk_hbox_new(FALSE,4);
+	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Memory segments:"),TRUE,TRUE,0);
+	combo_memseg = gtk_combo_box_new_text();
+	gtk_box_pack_start(GTK_BOX(hbox),combo_memseg,TRUE,TRUE,0);
+	for (i=0; i<NUM_MEMSEG_CHOICES; i++) {
+		gchar *label = memseg_choices[i]>1 ? g_strdup_printf("%u", memseg_choices[i]) :
+			g_strdup("Off");
+		gtk_combo_box_append_text(GTK_COMBO_BOX(combo_memseg),label);
+		g_free(label);
+	}
+	g_signal_connect(G_OBJECT(combo_memseg),"changed",G_CALLBACK(&memseg_changed),NULL);
+	/* 0 overlays all segments */
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Show (0 = all):"),TRUE,TRUE,0);
+	scale_memseg=gtk_hscale_new_with_range(0,1,1);
+	gtk_box_pack_start(GTK_BOX(hbox),scale_memseg,TRUE,TRUE,0);
+	g_signal_connect(G_OBJECT(scale_memseg),"value-changed",G_CALLBACK(&memseg_view_changed),NULL);
+
+	hbox = gtk_hbox_new(FALSE,4);
+	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
+	history_button = gtk_check_button_new_with_label("History");
+	gtk_box_pack_start(GTK_BOX(hbox),history_button,TRUE,TRUE,0);
+	g_signal_connect(G_OBJECT(history_button),"toggled",G_CALLBACK(&history_toggled),NULL);
+	/* 2^-6 (64 pixels per sample) up to whole history in a few pixels */
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Samples/pixel (log2):"),TRUE,TRUE,0);
+	scale_history_span=gtk_hscale_new_with_range(-6,SCOPE_HISTORY_BITS-8,1);
+	gtk_range_set_value(GTK_RANGE(scale_history_span),0);
+	gtk_box_pack_start(GTK_BOX(hbox),scale_history_span,TRUE,TRUE,0);
+	g_signal_connect(G_OBJECT(scale_history_span),"value-changed",G_CALLBACK(&history_view_changed),NULL);
+	gtk_box_pack_start(GTK_BOX(hbox),gtk_label_new("Back (0 = live):"),TRUE,TRUE,0);
+	scale_history_back=gtk_hscale_new_with_range(0,1,0.001);
+	gtk_box_pack_start(GTK_BOX(hbox),scale_history_back,TRUE,TRUE,0);
+	g_signal_connect(G_OBJECT(scale_history_back),"value-changed",G_CALLBACK(&history_view_changed),NULL);
+
 
 	hbox = gtk_hbox_new(FALSE,4);
 	gtk_box_pack_start(GTK_BOX(vbox),hbox,TRUE,TRUE,0);
@@ -323,22 +973,80 @@ int main(int argc,char **argv)
 	g_signal_connect(G_OBJECT(shot_button),"clicked",G_CALLBACK(&trigger_single_shot),NULL);
 	gtk_box_pack_start(GTK_BOX(hbox),shot_button,TRUE,TRUE,0);
 
+	GtkWidget *autoset_button = gtk_button_new_with_label("Autoset");
+	g_signal_connect(G_OBJECT(autoset_button),"clicked",G_CALLBACK(&autoset_clicked),NULL);
+	gtk_box_pack_start(GTK_BOX(hbox),autoset_button,TRUE,TRUE,0);
+
 	freeze_button = gtk_button_new_with_label("Freeze");
 	g_signal_connect(G_OBJECT(freeze_button),"clicked",G_CALLBACK(&freeze_unfreeze),NULL);
 	gtk_box_pack_start(GTK_BOX(hbox),freeze_button,TRUE,TRUE,0);
 
+	record_button = gtk_toggle_button_new_with_label("Record");
+	g_signal_connect(G_OBJECT(record_button),"toggled",G_CALLBACK(&record_toggled),NULL);
+	gtk_box_pack_start(GTK_BOX(hbox),record_button,TRUE,TRUE,0);
+
+	GtkWidget *trace_button = gtk_toggle_button_new_with_label("Trace");
+	g_signal_connect(G_OBJECT(trace_button),"toggled",G_CALLBACK(&trace_toggled),NULL);
+	gtk_box_pack_start(GTK_BOX(hbox),trace_button,TRUE,TRUE,0);
+
 	GtkWidget *tog = gtk_check_button_new_with_label("Invert trigger");
 	gtk_box_pack_start(GTK_BOX(hbox),tog,TRUE,TRUE,0);
 	g_signal_connect(G_OBJECT(tog),"toggled",G_CALLBACK(&trigger_toggle_changed),NULL);
 
+	logic_button = gtk_check_button_new_with_label("Logic analyzer");
+	gtk_box_pack_start(GTK_BOX(hbox),logic_button,TRUE,TRUE,0);
+	g_signal_connect(G_OBJECT(logic_button),"toggled",G_CALLBACK(&logic_toggled),NULL);
+
+
+
+	stats_label = gtk_label_new("");
+	gtk_box_pack_start(GTK_BOX(vbox),stats_label,TRUE,TRUE,0);
 
+	mask_label = gtk_label_new(masks ? "Mask: learning" : "");
+	gtk_box_pack_start(GTK_BOX(vbox),mask_label,TRUE,TRUE,0);
 
 	gtk_widget_show_all(window);
 	gtk_widget_set_size_request(image,512,256);
 
-	serial_run( &mysetdata );
+	if (NULL!=replay_file) {
+		gtk_widget_set_sensitive(record_button, FALSE);
+		if (NULL!=filters) {
+			replay_filter = filter_bank_new(filters);
+			if (NULL==replay_filter)
+				return -1;
+		}
+		if (avg_frames)
+			replay_average = average_new(avg_frames, avg_exp);
+		if (NULL!=decoders) {
+			replay_decoder = decoder_new(decoders);
+			if (NULL==replay_decoder)
+				return -1;
+		}
+		if (NULL!=masks) {
+			replay_mask = mask_new(masks);
+			if (NULL==replay_mask)
+				return -1;
+		}
+		if (replay_start(replay_file, !replay_fast, &serial_process_parameters,
+						 &replay_data, &replay_done)<0)
+			return -1;
+	} else {
+		if (NULL!=record_file && record_start(record_file, arduino_freq)==0)
+			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(record_button), TRUE);
+
+		serial_run( &mysetdata );
+		g_timeout_add(STATS_POLL_INTERVAL, &poll_stats, NULL);
+	}
 
 	gtk_main();
 
+	serial_stop();
+	if (server)
+		server_stop(server);
+	if (shm)
+		shmring_destroy(shm);
+	record_stop();
+	replay_stop();
+
 	return 0;
 }
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "filter.h"
+#include "ingest.h"
+#include "simd.h"
+
+/* Room around a channel in scratch buffers: FIR history before, centering
+ look-ahead and vector tail after */
+#define FILTER_PAD_BEFORE FILTER_MAX_TAPS
+#define FILTER_PAD_AFTER  (FILTER_MAX_TAPS / 2 + V4SF_WIDTH)
+
+enum filter_type {
+	FILTER_LOWPASS,
+	FILTER_HIGHPASS,
+	FILTER_NOTCH,
+	FILTER_AVERAGE
+};
+
+struct filter_state {
+	int primed;
+	float hist[FILTER_MAX_TAPS]; /* Last taps-1 inputs, oldest first */
+	float z1, z2;                /* Biquad, transposed direct form II */
+};
+
+struct filter_stage {
+	enum filter_type type;
+	int channel;                 /* -1 for all */
+	double freq;
+	double q;
+	unsigned taps;
+	float h[FILTER_MAX_TAPS];    /* FIR taps */
+	float b0, b1, b2, a1, a2;    /* Biquad, a0 normalized to 1 */
+	struct filter_state state[INGEST_MAX_CHANNELS];
+};
+
+struct filter_bank {
+	struct filter_stage stage[FILTER_MAX_STAGES];
+	unsigned count;
+	int streaming;
+	double rate;
+	unsigned channels;
+};
+
+/*
+ FIR kernel. out[j] = sum h[k] * in[j-k], computed V4SF_WIDTH outputs at
+ a time, so in must be readable up to count rounded up. Always inlined,
+ so that common lengths below get their own copy with constant taps,
+ which the compiler fully unrolls.
+ */
+static inline __attribute__((always_inline))
+void fir_kernel(float *restrict out, const float *restrict in, size_t count,
+				const float *restrict h, unsigned taps)
+{
+	v4sf acc;
+	size_t j;
+	unsigned k;
+
+	for (j=0; j<count; j+=V4SF_WIDTH) {
+		acc = v4sf_set1(0);
+		for (k=0; k<taps; k++)
+			acc += v4sf_set1(h[k]) * v4sf_load(in + j - k);
+		v4sf_store(&out[j], acc);
+	}
+}
+
+static void fir_run(float *restrict out, const float *restrict in, size_t count,
+					const float *restrict h, unsigned taps)
+{
+	switch (taps) {
+	case 7:  fir_kernel(out, in, count, h, 7); break;
+	case 15: fir_kernel(out, in, count, h, 15); break;
+	case 31: fir_kernel(out, in, count, h, 31); break;
+	case 63: fir_kernel(out, in, count, h, 63); break;
+	default: fir_kernel(out, in, count, h, taps);
+	}
+}
+
+/* Windowed-sinc low-pass, fc relative to sample rate. Unity DC gain */
+static void design_lowpass(float *h, unsigned taps, double fc)
+{
+	double m = (taps - 1) / 2.0;
+	double sum = 0, x, v;
+	unsigned k;
+
+	for (k=0; k<taps; k++) {
+		x = k - m;
+		v = x==0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+		if (taps>1)
+			v *= 0.54 - 0.46 * cos(2 * M_PI * k / (taps - 1)); /* Hamming */
+		h[k] = v;
+		sum += v;
+	}
+	for (k=0; k<taps; k++)
+		h[k] /= sum;
+}
+
+static void design_stage(struct filter_stage *s, double rate)
+{
+	double fc = s->freq / rate;
+	double w0, alpha, a0;
+	unsigned k;
+
+	switch (s->type) {
+	case FILTER_LOWPASS:
+	case FILTER_HIGHPASS:
+		if (fc>=0.5)
+			fc = 0.5;
+		design_lowpass(s->h, s->taps, fc);
+		if (s->type==FILTER_HIGHPASS) {
+			/* Spectral inversion. taps is odd, so there is a center tap */
+			for (k=0; k<s->taps; k++)
+				s->h[k] = -s->h[k];
+			s->h[s->taps / 2] += 1;
+		}
+		break;
+
+	case FILTER_AVERAGE:
+		for (k=0; k<s->taps; k++)
+			s->h[k] = 1.0f / s->taps;
+		break;
+
+	case FILTER_NOTCH:
+		if (fc>=0.5) {
+			/* Above Nyquist, nothing to remove */
+			s->b0 = 1;
+			s->b1 = s->b2 = s->a1 = s->a2 = 0;
+			break;
+		}
+		w0 = 2 * M_PI * fc;
+		alpha = sin(w0) / (2 * s->q);
+		a0 = 1 + alpha;
+		s->b0 = 1 / a0;
+		s->b1 = -2 * cos(w0) / a0;
+		s->b2 = 1 / a0;
+		s->a1 = -2 * cos(w0) / a0;
+		s->a2 = (1 - alpha) / a0;
+		break;
+	}
+}
+
+static int parse_stage(struct filter_stage *s, const char *item)
+{
+	char type[16];
+	double a = 0, b = 0;
+	int n;
+	char *at;
+
+	s->channel = -1;
+	at = strchr(item, '@');
+	if (at) {
+		s->channel = atoi(item);
+		if (s->channel<0 || s->channel>=INGEST_MAX_CHANNELS)
+			return -1;
+		item = at + 1;
+	}
+
+	n = sscanf(item, "%15[a-z]:%lf:%lf", type, &a, &b);
+	if (n<2)
+		return -1;
+
+	if (strcmp(type, "lp")==0 || strcmp(type, "hp")==0) {
+		s->type = type[0]=='l' ? FILTER_LOWPASS : FILTER_HIGHPASS;
+		s->freq = a;
+		s->taps = n>2 ? (unsigned)b : FILTER_DEFAULT_TAPS;
+		s->taps |= 1; /* Odd, for a center tap */
+		if (a<=0 || s->taps>FILTER_MAX_TAPS)
+			return -1;
+	} else if (strcmp(type, "notch")==0) {
+		s->type = FILTER_NOTCH;
+		s->freq = a;
+		s->q = n>2 ? b : FILTER_DEFAULT_Q;
+		if (a<=0 || s->q<=0)
+			return -1;
+	} else if (strcmp(type, "avg")==0) {
+		s->type = FILTER_AVERAGE;
+		s->taps = (unsigned)a;
+		if (s->taps<1 || s->taps>FILTER_MAX_TAPS)
+			return -1;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+struct filter_bank *filter_bank_new(const char *spec)
+{
+	struct filter_bank *fb = calloc(1, sizeof(*fb));
+	char *copy, *item, *save;
+
+	if (NULL==fb)
+		return NULL;
+
+	copy = strdup(spec);
+	for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "stream")==0) {
+			fb->streaming = 1;
+			continue;
+		}
+		if (fb->count>=FILTER_MAX_STAGES ||
+			parse_stage(&fb->stage[fb->count], item)<0) {
+			fprintf(stderr,"Invalid filter '%s'\n", item);
+			free(copy);
+			free(fb);
+			return NULL;
+		}
+		fb->count++;
+	}
+	free(copy);
+	return fb;
+}
+
+void filter_bank_free(struct filter_bank *fb)
+{
+	free(fb);
+}
+
+static void filter_bank_design(struct filter_bank *fb, unsigned channels)
+{
+	unsigned i;
+
+	fb->channels = channels;
+	for (i=0; i<fb->count; i++) {
+		design_stage(&fb->stage[i], fb->rate / channels);
+		memset(fb->stage[i].state, 0, sizeof(fb->stage[i].state));
+	}
+}
+
+void filter_bank_set_rate(struct filter_bank *fb, double rate)
+{
+	fb->rate = rate;
+	fb->channels = 0; /* Designed on next frame */
+}
+
+/*
+ x has FILTER_PAD_BEFORE samples before it and FILTER_PAD_AFTER after.
+ When streaming, history comes from the previous frame and output is
+ causal. Otherwise frame is extended with its edge samples, and output is
+ centered so the waveform does not move relative to trigger.
+ */
+static void fir_stage(struct filter_stage *s, struct filter_state *st, int streaming,
+					  float *out, float *x, size_t count)
+{
+	unsigned hist = s->taps - 1;
+	unsigned shift = streaming ? 0 : hist / 2;
+	unsigned i;
+
+	if (!streaming || !st->primed) {
+		for (i=0; i<hist; i++)
+			st->hist[i] = x[0];
+		st->primed = 1;
+	}
+	memcpy(x - hist, st->hist, hist * sizeof(float));
+	for (i=0; i<shift + V4SF_WIDTH; i++)
+		x[count + i] = x[count - 1];
+
+	fir_run(out, x + shift, count, s->h, s->taps);
+	if (s->type==FILTER_HIGHPASS)
+		for (i=0; i<count; i++)
+			out[i] += FILTER_AC_OFFSET;
+
+	if (streaming) {
+		/* Keep last inputs. Frames shorter than filter keep older history */
+		if (count>=hist) {
+			memcpy(st->hist, x + count - hist, hist * sizeof(float));
+		} else {
+			memmove(st->hist, st->hist + count, (hist - count) * sizeof(float));
+			memcpy(st->hist + hist - count, x, count * sizeof(float));
+		}
+	}
+}
+
+/* Recursive, so each channel runs sample by sample. Only five multiplies
+ per sample, far below FIR cost */
+static void biquad_stage(struct filter_stage *s, struct filter_state *st, int streaming,
+						 float *x, size_t count)
+{
+	float z1, z2, in, y;
+	size_t j;
+
+	if (!streaming || !st->primed) {
+		/* Steady state for a constant input at x[0] */
+		y = x[0] * (s->b0 + s->b1 + s->b2) / (1 + s->a1 + s->a2);
+		st->z2 = s->b2 * x[0] - s->a2 * y;
+		st->z1 = s->b1 * x[0] - s->a1 * y + st->z2;
+		st->primed = 1;
+	}
+	z1 = st->z1;
+	z2 = st->z2;
+	for (j=0; j<count; j++) {
+		in = x[j];
+		y = s->b0 * in + z1;
+		z1 = s->b1 * in - s->a1 * y + z2;
+		z2 = s->b2 * in - s->a2 * y;
+		x[j] = y;
+	}
+	st->z1 = z1;
+	st->z2 = z2;
+}
+
+void filter_bank_process(struct filter_bank *fb, unsigned char *buf,
+						 size_t numSamples, unsigned channels)
+{
+	float bufa[FILTER_PAD_BEFORE + INGEST_MAX_SAMPLES + FILTER_PAD_AFTER];
+	float bufb[FILTER_PAD_BEFORE + INGEST_MAX_SAMPLES + FILTER_PAD_AFTER];
+	float *x = &bufa[FILTER_PAD_BEFORE];
+	float *y = &bufb[FILTER_PAD_BEFORE];
+	float *t, v;
+	struct filter_stage *s;
+	size_t groups, j;
+	unsigned i, k;
+
+	if (fb->count==0 || fb->rate<=0 || numSamples>INGEST_MAX_SAMPLES ||
+		channels<1 || channels>INGEST_MAX_CHANNELS)
+		return;
+
+	if (channels!=fb->channels)
+		filter_bank_design(fb, channels);
+
+	groups = numSamples / channels;
+	if (groups==0)
+		return;
+
+	for (k=0; k<channels; k++) {
+		x = &bufa[FILTER_PAD_BEFORE];
+		y = &bufb[FILTER_PAD_BEFORE];
+		for (j=0; j<groups; j++)
+			x[j] = buf[j*channels + k];
+
+		for (i=0; i<fb->count; i++) {
+			s = &fb->stage[i];
+			if (s->channel>=0 && (unsigned)s->channel!=k)
+				continue;
+			if (s->type==FILTER_NOTCH) {
+				biquad_stage(s, &s->state[k], fb->streaming, x, groups);
+			} else {
+				fir_stage(s, &s->state[k], fb->streaming, y, x, groups);
+				t = x;
+				x = y;
+				y = t;
+			}
+		}
+
+		for (j=0; j<groups; j++) {
+			v = x[j] + 0.5f;
+			if (v<0)
+				v = 0;
+			if (v>255)
+				v = 255;
+			buf[j*channels + k] = (unsigned char)v;
+		}
+	}
+
+	for (j=groups*channels; j<numSamples; j++)
+		buf[j] = buf[j - channels];
+}
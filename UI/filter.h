@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+
+/* Limits for a filter chain */
+#define FILTER_MAX_STAGES 8
+#define FILTER_MAX_TAPS   127
+
+/* High-pass output is centered here, like AC coupling */
+#define FILTER_AC_OFFSET 128
+
+/* Default FIR length for low-pass and high-pass, and notch Q */
+#define FILTER_DEFAULT_TAPS 31
+#define FILTER_DEFAULT_Q    10.0
+
+struct filter_bank;
+
+/*
+ Create a filter chain from a comma-separated list of stages, applied in
+ order to each channel of every frame:
+
+   lp:<hz>[:<taps>]    FIR low-pass (windowed sinc)
+   hp:<hz>[:<taps>]    FIR high-pass, output centered on mid-scale
+   notch:<hz>[:<q>]    Biquad IIR notch, e.g. notch:50 for mains hum
+   avg:<n>             Moving average over n samples
+   stream              Frames are contiguous: keep filter state from one
+                       frame to the next, instead of restarting each frame
+
+ A stage may be restricted to one channel with a "<channel>@" prefix,
+ e.g. "notch:50,1@lp:2000". Returns NULL on error.
+ */
+struct filter_bank *filter_bank_new(const char *spec);
+void filter_bank_free(struct filter_bank *fb);
+
+/* ADC conversion rate, all channels together. Stage frequencies are
+ relative to each channel's own rate. Filter state is reset */
+void filter_bank_set_rate(struct filter_bank *fb, double rate);
+
+/* Filter interleaved 8-bit samples in place. numSamples excludes trailer */
+void filter_bank_process(struct filter_bank *fb, unsigned char *buf,
+						 size_t numSamples, unsigned channels);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include "frame.h"
+
+struct frame_pool {
+	struct frame *free;
+	/* One for the owner, one per frame in use */
+	int refs;
+	unsigned long misses;
+	unsigned count;
+	struct frame frames[];
+};
+
+struct frame_pool *frame_pool_new(unsigned count)
+{
+	struct frame_pool *pool;
+	unsigned i;
+
+	pool = malloc(sizeof(*pool) + count * sizeof(struct frame));
+	if (NULL==pool)
+		return NULL;
+	pool->free = NULL;
+	pool->refs = 1;
+	pool->misses = 0;
+	pool->count = count;
+	for (i=0; i<count; i++) {
+		pool->frames[i].pool = pool;
+		pool->frames[i].refs = 0;
+		pool->frames[i].next = pool->free;
+		pool->free = &pool->frames[i];
+	}
+	return pool;
+}
+
+static void pool_unref(struct frame_pool *pool)
+{
+	if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL)==0)
+		free(pool);
+}
+
+void frame_pool_free(struct frame_pool *pool)
+{
+	if (pool)
+		pool_unref(pool);
+}
+
+/* Only one thread takes, so the head cannot be taken and put back
+ between our load and exchange (no ABA) */
+struct frame *frame_get(struct frame_pool *pool)
+{
+	struct frame *f = __atomic_load_n(&pool->free, __ATOMIC_ACQUIRE);
+
+	do {
+		if (NULL==f) {
+			pool->misses++;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&pool->free, &f, f->next, 1,
+										  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	f->refs = 1;
+	__atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+void frame_unref(struct frame *f)
+{
+	struct frame_pool *pool = f->pool;
+	struct frame *head;
+
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL)!=0)
+		return;
+	head = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+	do {
+		f->next = head;
+	} while (!__atomic_compare_exchange_n(&pool->free, &head, f, 1,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	pool_unref(pool);
+}
+
+unsigned long frame_pool_misses(const struct frame_pool *pool)
+{
+	return pool->misses;
+}
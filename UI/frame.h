@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stddef.h>
+#include "proto.h"
+
+/*
+ Pool of reference counted frame buffers, all allocated up front.
+
+ The packet parser writes payloads straight into a pool frame (see
+ proto_set_buffer()), frames are processed in place, and consumers that
+ keep a frame past the callback take a reference instead of copying it.
+ Once the pool has warmed up, nothing is allocated per frame.
+
+ frame_get() is for one thread only, the one reading the device.
+ frame_ref() and frame_unref() may be called from any thread: the free
+ list is a lock-free stack, safe with a single taker.
+ */
+
+/* Any packet fits, frames being the largest: 1024 samples and trailer */
+#define FRAME_MAX_SIZE PROTO_BUFFER_SIZE
+
+struct frame_pool;
+
+struct frame {
+	struct frame_pool *pool;
+	struct frame *next;
+	int refs;
+	unsigned char data[FRAME_MAX_SIZE];
+};
+
+/* Returns NULL if out of memory */
+struct frame_pool *frame_pool_new(unsigned count);
+/* Memory goes once frames still referenced are released too */
+void frame_pool_free(struct frame_pool *pool);
+
+/* Frame with one reference, or NULL if all are in use */
+struct frame *frame_get(struct frame_pool *pool);
+
+static inline struct frame *frame_ref(struct frame *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+void frame_unref(struct frame *f);
+
+/* Held by someone other than the caller */
+static inline int frame_shared(const struct frame *f)
+{
+	return __atomic_load_n(&f->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Times frame_get() found the pool empty */
+unsigned long frame_pool_misses(const struct frame_pool *pool);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ oscope-histcheck: append a random walk to small histories, so the ring
+ wraps many times, and compare history_minmax() and history_render()
+ against a plain scan of every sample appended. Ranges start and end
+ at random, so they cross block and level boundaries and the ring end.
+
+ Usage: oscope-histcheck [seed]. Run by make check.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "history.h"
+
+/* Small rings wrap often, and still have a few pyramid levels */
+#define CHECK_MIN_BITS   HISTORY_MIN_BITS
+#define CHECK_MAX_BITS   12
+#define CHECK_WRAPS      6
+#define CHECK_CHANNELS   3
+#define CHECK_QUERIES    200
+#define CHECK_COLUMNS    64
+
+static unsigned long cases, failures;
+
+static void walk(unsigned char *v, size_t n)
+{
+	int x = 128;
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		x += rand() % 9 - 4;
+		/* A spike now and then, so only some blocks hold extremes */
+		if (rand() % 97==0)
+			x = rand() % 256;
+		x = x<0 ? 0 : x>255 ? 255 : x;
+		v[i] = x;
+	}
+}
+
+static void scan(const unsigned char *all, uint64_t a, uint64_t b,
+				 unsigned char *min, unsigned char *max)
+{
+	*min = 255;
+	*max = 0;
+	for (; a<b; a++) {
+		*min = all[a]<*min ? all[a] : *min;
+		*max = all[a]>*max ? all[a] : *max;
+	}
+}
+
+/* Random range within end, biased to block and level edges */
+static uint64_t point(uint64_t end)
+{
+	uint64_t p = (uint64_t)rand() * RAND_MAX + rand();
+
+	p %= end + 1;
+	if (rand() % 4==0)
+		p &= ~(uint64_t)(HISTORY_BLOCK - 1);
+	return p;
+}
+
+static void check_minmax(const struct history *h, const unsigned char *all)
+{
+	uint64_t first = history_first(h), end = history_end(h), a, b, t;
+	unsigned char min, max, wmin, wmax;
+	int ret;
+	unsigned q;
+
+	for (q=0; q<CHECK_QUERIES; q++) {
+		a = point(end);
+		b = point(end);
+		if (a>b) {
+			t = a;
+			a = b;
+			b = t;
+		}
+		ret = history_minmax(h, a, b, &min, &max);
+		cases++;
+		if (a>=b || a<first) {
+			if (ret!=-1) {
+				failures++;
+				printf("FAIL minmax %llu-%llu, first %llu: returned %d, want -1\n",
+					   (unsigned long long)a, (unsigned long long)b,
+					   (unsigned long long)first, ret);
+			}
+			continue;
+		}
+		scan(all, a, b, &wmin, &wmax);
+		if (ret!=0 || min!=wmin || max!=wmax) {
+			failures++;
+			printf("FAIL minmax %llu-%llu: %u-%u, want %u-%u\n",
+				   (unsigned long long)a, (unsigned long long)b,
+				   min, max, wmin, wmax);
+		}
+	}
+	cases++;
+	if (history_minmax(h, first, end + 1, &min, &max)!=-1) {
+		failures++;
+		printf("FAIL minmax past end: not rejected\n");
+	}
+}
+
+/* Clip as history_render() documents, then split evenly */
+static void check_render(const struct history *h, const unsigned char *all)
+{
+	uint64_t first = history_first(h), end = history_end(h);
+	uint64_t start, span, a, b, s, n;
+	unsigned char min[CHECK_COLUMNS], max[CHECK_COLUMNS], wmin, wmax;
+	size_t columns, got, want, i;
+	unsigned q;
+
+	for (q=0; q<CHECK_QUERIES; q++) {
+		/* Some ranges begin before first kept, or run past end */
+		start = point(end + end / 8);
+		span = point(end / 2) + 1;
+		columns = 1 + rand() % CHECK_COLUMNS;
+		got = history_render(h, start, span, min, max, columns);
+
+		s = start<first ? first : start;
+		n = start + span>s ? start + span - s : 0;
+		if (s + n>end)
+			n = s<end ? end - s : 0;
+		want = n<columns ? n : columns;
+		cases++;
+		if (got!=want) {
+			failures++;
+			printf("FAIL render %llu+%llu in %lu: %lu columns, want %lu\n",
+				   (unsigned long long)start, (unsigned long long)span,
+				   (unsigned long)columns, (unsigned long)got, (unsigned long)want);
+			continue;
+		}
+		for (i=0; i<want; i++) {
+			a = s + n * i / want;
+			b = s + n * (i + 1) / want;
+			scan(all, a, b, &wmin, &wmax);
+			if (min[i]!=wmin || max[i]!=wmax) {
+				failures++;
+				printf("FAIL render %llu+%llu in %lu, column %lu: %u-%u, want %u-%u\n",
+					   (unsigned long long)start, (unsigned long long)span,
+					   (unsigned long)columns, (unsigned long)i,
+					   min[i], max[i], wmin, wmax);
+				break;
+			}
+		}
+	}
+}
+
+/* Fill in uneven chunks, checking as the ring fills and wraps */
+static void check_bits(unsigned bits)
+{
+	size_t total = ((size_t)CHECK_WRAPS << bits) + 7;
+	size_t chunk, done = 0, c;
+	unsigned char *all = malloc(total);
+	unsigned char *frame = malloc(CHECK_CHANNELS * total);
+	struct history *h = history_new(bits);
+	struct history *hc = history_new(bits);
+
+	if (NULL==all || NULL==frame || NULL==h || NULL==hc) {
+		printf("FAIL %u bits: out of memory\n", bits);
+		failures++;
+		exit(1);
+	}
+	walk(all, total);
+
+	while (done<total) {
+		chunk = 1 + rand() % ((size_t)3 << bits >> 2);
+		if (chunk>total - done)
+			chunk = total - done;
+		history_append(h, all + done, chunk);
+		/* Same samples as the middle of interleaved channels */
+		for (c=0; c<chunk; c++) {
+			frame[c * CHECK_CHANNELS] = rand();
+			frame[c * CHECK_CHANNELS + 1] = all[done + c];
+			frame[c * CHECK_CHANNELS + 2] = rand();
+		}
+		history_append_channel(hc, frame, chunk * CHECK_CHANNELS, 1, CHECK_CHANNELS);
+		done += chunk;
+
+		check_minmax(h, all);
+		check_minmax(hc, all);
+		check_render(h, all);
+	}
+
+	history_reset(h);
+	cases++;
+	if (history_end(h)!=0 || history_render(h, 0, 100, frame, frame + 100, 10)!=0) {
+		failures++;
+		printf("FAIL %u bits: reset history not empty\n", bits);
+	}
+
+	history_free(h);
+	history_free(hc);
+	free(frame);
+	free(all);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned seed = argc>1 ? strtoul(argv[1], NULL, 0) : 1;
+	unsigned bits;
+
+	srand(seed);
+	for (bits=CHECK_MIN_BITS; bits<=CHECK_MAX_BITS; bits++)
+		check_bits(bits);
+
+	printf("%lu history cases, %lu failed, seed %u\n", cases, failures, seed);
+	return failures ? 1 : 0;
+}
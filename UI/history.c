@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "history.h"
+
+struct history {
+	unsigned bits;
+	unsigned levels;
+	uint64_t end;
+	unsigned char *buf;
+	/* Per level, min and max of 2^(bits - shift) blocks of 2^shift
+	 samples, where shift is level_shift() */
+	unsigned char *min[HISTORY_MAX_LEVELS];
+	unsigned char *max[HISTORY_MAX_LEVELS];
+};
+
+static inline unsigned level_shift(unsigned level)
+{
+	return HISTORY_BLOCK_BITS + level * HISTORY_FANOUT_BITS;
+}
+
+static inline size_t level_slot(const struct history *h, unsigned level, uint64_t sample)
+{
+	unsigned shift = level_shift(level);
+	return (sample >> shift) & (((size_t)1 << (h->bits - shift)) - 1);
+}
+
+struct history *history_new(unsigned bits)
+{
+	struct history *h;
+	size_t size = 0, blocks;
+	unsigned char *p;
+	unsigned l;
+
+	if (bits<HISTORY_MIN_BITS || bits>HISTORY_MAX_BITS)
+		return NULL;
+	h = calloc(1, sizeof(*h));
+	if (NULL==h) {
+		perror("calloc");
+		return NULL;
+	}
+	h->bits = bits;
+	for (l=0; l<HISTORY_MAX_LEVELS && level_shift(l)<=bits; l++)
+		size += (size_t)2 << (bits - level_shift(l));
+	h->levels = l;
+
+	h->buf = malloc(((size_t)1 << bits) + size);
+	if (NULL==h->buf) {
+		perror("malloc");
+		free(h);
+		return NULL;
+	}
+	p = h->buf + ((size_t)1 << bits);
+	for (l=0; l<h->levels; l++) {
+		blocks = (size_t)1 << (bits - level_shift(l));
+		h->min[l] = p;
+		h->max[l] = p + blocks;
+		p += 2 * blocks;
+	}
+	return h;
+}
+
+void history_free(struct history *h)
+{
+	free(h->buf);
+	free(h);
+}
+
+void history_reset(struct history *h)
+{
+	h->end = 0;
+}
+
+/* Sample n just completed a level 0 block. Build it, and every level
+ above it completes */
+static void build_blocks(struct history *h, uint64_t n)
+{
+	const unsigned char *s = &h->buf[(n - HISTORY_BLOCK) & (((size_t)1 << h->bits) - 1)];
+	unsigned char lo = 255, hi = 0;
+	size_t slot;
+	unsigned l, i;
+
+	for (i=0; i<HISTORY_BLOCK; i++) {
+		if (s[i]<lo)
+			lo = s[i];
+		if (s[i]>hi)
+			hi = s[i];
+	}
+	slot = level_slot(h, 0, n - 1);
+	h->min[0][slot] = lo;
+	h->max[0][slot] = hi;
+
+	for (l=1; l<h->levels && (n & (((uint64_t)1 << level_shift(l)) - 1))==0; l++) {
+		/* Blocks below are consecutive slots, as fanout divides them */
+		slot = level_slot(h, l - 1, n - 1) & ~(size_t)(HISTORY_FANOUT - 1);
+		lo = 255;
+		hi = 0;
+		for (i=0; i<HISTORY_FANOUT; i++) {
+			if (h->min[l-1][slot + i]<lo)
+				lo = h->min[l-1][slot + i];
+			if (h->max[l-1][slot + i]>hi)
+				hi = h->max[l-1][slot + i];
+		}
+		slot = level_slot(h, l, n - 1);
+		h->min[l][slot] = lo;
+		h->max[l][slot] = hi;
+	}
+}
+
+void history_append(struct history *h, const unsigned char *buf, size_t size)
+{
+	size_t mask = ((size_t)1 << h->bits) - 1;
+	size_t i;
+
+	for (i=0; i<size; i++) {
+		h->buf[h->end & mask] = buf[i];
+		h->end++;
+		if ((h->end & (HISTORY_BLOCK - 1))==0)
+			build_blocks(h, h->end);
+	}
+}
+
+void history_append_channel(struct history *h, const unsigned char *buf, size_t size,
+							unsigned channel, unsigned channels)
+{
+	size_t mask = ((size_t)1 << h->bits) - 1;
+	size_t i;
+
+	for (i=channel; i<size; i+=channels) {
+		h->buf[h->end & mask] = buf[i];
+		h->end++;
+		if ((h->end & (HISTORY_BLOCK - 1))==0)
+			build_blocks(h, h->end);
+	}
+}
+
+uint64_t history_first(const struct history *h)
+{
+	uint64_t kept = (uint64_t)1 << h->bits;
+	return h->end>kept ? h->end - kept : 0;
+}
+
+uint64_t history_end(const struct history *h)
+{
+	return h->end;
+}
+
+/* Combine blocks, narrowing range from both ends a level at a time until
+ it is aligned to the level above. At most HISTORY_BLOCK - 1 samples, and
+ HISTORY_FANOUT - 1 blocks per level, on each side */
+static void range_minmax(const struct history *h, uint64_t a, uint64_t b,
+						 unsigned char *min, unsigned char *max)
+{
+	size_t mask = ((size_t)1 << h->bits) - 1;
+	unsigned char lo = 255, hi = 0, v;
+	uint64_t step, align;
+	size_t slot;
+	unsigned l;
+
+	while (a<b && (a & (HISTORY_BLOCK - 1))) {
+		v = h->buf[a++ & mask];
+		lo = v<lo ? v : lo;
+		hi = v>hi ? v : hi;
+	}
+	while (a<b && (b & (HISTORY_BLOCK - 1))) {
+		v = h->buf[--b & mask];
+		lo = v<lo ? v : lo;
+		hi = v>hi ? v : hi;
+	}
+	for (l=0; a<b; l++) {
+		step = (uint64_t)1 << level_shift(l);
+		/* Top level takes whatever is left, at most a few blocks */
+		align = l + 1<h->levels ? ((uint64_t)1 << level_shift(l + 1)) - 1 : 0;
+		while (a<b && (a & align)) {
+			slot = level_slot(h, l, a);
+			lo = h->min[l][slot]<lo ? h->min[l][slot] : lo;
+			hi = h->max[l][slot]>hi ? h->max[l][slot] : hi;
+			a += step;
+		}
+		while (a<b && (b & align)) {
+			b -= step;
+			slot = level_slot(h, l, b);
+			lo = h->min[l][slot]<lo ? h->min[l][slot] : lo;
+			hi = h->max[l][slot]>hi ? h->max[l][slot] : hi;
+		}
+		if (!align) {
+			while (a<b) {
+				slot = level_slot(h, l, a);
+				lo = h->min[l][slot]<lo ? h->min[l][slot] : lo;
+				hi = h->max[l][slot]>hi ? h->max[l][slot] : hi;
+				a += step;
+			}
+		}
+	}
+	*min = lo;
+	*max = hi;
+}
+
+int history_minmax(const struct history *h, uint64_t start, uint64_t end,
+				   unsigned char *min, unsigned char *max)
+{
+	if (start>=end || start<history_first(h) || end>h->end)
+		return -1;
+	range_minmax(h, start, end, min, max);
+	return 0;
+}
+
+size_t history_render(const struct history *h, uint64_t start, uint64_t span,
+					  unsigned char *min, unsigned char *max, size_t columns)
+{
+	uint64_t first = history_first(h), a, b;
+	size_t i;
+
+	if (start<first) {
+		span = start + span>first ? span - (first - start) : 0;
+		start = first;
+	}
+	if (start>=h->end || columns==0)
+		return 0;
+	if (start + span>h->end)
+		span = h->end - start;
+	if (span<columns)
+		columns = span;
+
+	for (i=0; i<columns; i++) {
+		a = start + span * i / columns;
+		b = start + span * (i + 1) / columns;
+		range_minmax(h, a, b, &min[i], &max[i]);
+	}
+	return columns;
+}
+
+size_t history_memory(const struct history *h)
+{
+	size_t size = (size_t)1 << h->bits;
+	unsigned l;
+
+	for (l=0; l<h->levels; l++)
+		size += (size_t)2 << (h->bits - level_shift(l));
+	return size;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Long history of one channel: a ring of the last 2^bits samples, with
+ a min/max pyramid over it so any range reduces in O(log n).
+
+ Level 0 holds min and max of each block of HISTORY_BLOCK samples, and
+ each level above combines HISTORY_FANOUT blocks of the one below. That
+ costs 2 / HISTORY_BLOCK bytes per sample, plus a third of that for the
+ upper levels, about 17% of the samples themselves. Blocks are built as
+ samples come in.
+
+ Samples are numbered from first ever appended; only the last 2^bits
+ are kept, see history_first().
+ */
+
+#define HISTORY_BLOCK_BITS  4
+#define HISTORY_FANOUT_BITS 2
+#define HISTORY_BLOCK       (1 << HISTORY_BLOCK_BITS)
+#define HISTORY_FANOUT      (1 << HISTORY_FANOUT_BITS)
+#define HISTORY_MIN_BITS    HISTORY_BLOCK_BITS
+#define HISTORY_MAX_BITS    28
+#define HISTORY_MAX_LEVELS  ((HISTORY_MAX_BITS - HISTORY_BLOCK_BITS) / HISTORY_FANOUT_BITS + 1)
+
+struct history;
+
+/* Returns NULL on bad bits or out of memory */
+struct history *history_new(unsigned bits);
+void history_free(struct history *h);
+void history_reset(struct history *h);
+
+/* Append samples, oldest first */
+void history_append(struct history *h, const unsigned char *buf, size_t size);
+/* Append one channel of interleaved samples */
+void history_append_channel(struct history *h, const unsigned char *buf, size_t size,
+							unsigned channel, unsigned channels);
+
+/* Number of oldest sample kept, and one past newest */
+uint64_t history_first(const struct history *h);
+uint64_t history_end(const struct history *h);
+
+/* Min and max of samples start to end-1. Returns -1 if range is empty
+ or not kept */
+int history_minmax(const struct history *h, uint64_t start, uint64_t end,
+				   unsigned char *min, unsigned char *max);
+
+/*
+ Split span samples from start into columns, and give min and max of
+ each. With fewer samples than columns, there is one column per sample.
+ Range is clipped to what is kept. Returns number of columns filled.
+ Cost depends on columns, not span.
+ */
+size_t history_render(const struct history *h, uint64_t start, uint64_t span,
+					  unsigned char *min, unsigned char *max, size_t columns);
+
+/* Bytes used, samples and pyramid */
+size_t history_memory(const struct history *h);
+
+#endif
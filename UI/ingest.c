@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <string.h>
+#include "ingest.h"
+#include "simd.h"
+#include "../protocol.h"
+
+/* Fractional delay interpolator taps, and padding needed around input */
+#define DESKEW_TAPS       4
+#define DESKEW_PAD_BEFORE 2
+#define DESKEW_PAD_AFTER  V4SF_WIDTH
+
+/*
+ Third-order Lagrange interpolator coefficients. Interpolates at mu
+ (0 to 1) between x[j-1] and x[j], using x[j-2], x[j-1], x[j], x[j+1].
+ */
+static void lagrange_coeffs(float h[DESKEW_TAPS], float mu)
+{
+	h[0] = -mu * (mu - 1) * (mu - 2) / 6;
+	h[1] = (mu + 1) * (mu - 1) * (mu - 2) / 2;
+	h[2] = -(mu + 1) * mu * (mu - 2) / 2;
+	h[3] = (mu + 1) * mu * (mu - 1) / 6;
+}
+
+/* in must have DESKEW_PAD_BEFORE samples before it, and DESKEW_PAD_AFTER
+ after count. Output is rounded up to V4SF_WIDTH samples */
+static void fractional_delay(float *restrict out, const float *restrict in,
+							 size_t count, const float h[DESKEW_TAPS])
+{
+	v4sf h0 = v4sf_set1(h[0]);
+	v4sf h1 = v4sf_set1(h[1]);
+	v4sf h2 = v4sf_set1(h[2]);
+	v4sf h3 = v4sf_set1(h[3]);
+	const float *x;
+	size_t j;
+
+	for (j=0; j<count; j+=V4SF_WIDTH) {
+		x = in + j;
+		v4sf_store(&out[j],
+				   h0 * v4sf_load(x - 2) +
+				   h1 * v4sf_load(x - 1) +
+				   h2 * v4sf_load(x) +
+				   h3 * v4sf_load(x + 1));
+	}
+}
+
+void ingest_deskew(unsigned char *out, const unsigned char *in, size_t numSamples,
+				   unsigned channels, unsigned muxDelay)
+{
+	/* Scratch buffers are on stack, so this can run in several threads */
+	unsigned char src[INGEST_MAX_SAMPLES];
+	float chan_in[DESKEW_PAD_BEFORE + INGEST_MAX_SAMPLES + DESKEW_PAD_AFTER];
+	float chan_out[INGEST_MAX_SAMPLES + V4SF_WIDTH];
+	float h[DESKEW_TAPS];
+	float *x = &chan_in[DESKEW_PAD_BEFORE];
+	size_t groups, i, j;
+	unsigned k;
+	float v;
+
+	if (channels<2 || channels>INGEST_MAX_CHANNELS ||
+		numSamples>INGEST_MAX_SAMPLES || numSamples<muxDelay + channels) {
+		if (out!=in)
+			memmove(out, in, numSamples);
+		return;
+	}
+
+	groups = (numSamples - muxDelay) / channels;
+	memcpy(src, in + muxDelay, numSamples - muxDelay);
+
+	for (k=0; k<channels; k++) {
+		for (j=0; j<groups; j++)
+			x[j] = src[j*channels + k];
+
+		for (i=1; i<=DESKEW_PAD_BEFORE; i++)
+			x[-(long)i] = x[0];
+		for (i=0; i<DESKEW_PAD_AFTER; i++)
+			x[groups + i] = x[groups - 1];
+
+		/* Channel k was sampled k/channels of a group period after
+		 channel 0. Interpolate back to channel 0 instant */
+		lagrange_coeffs(h, 1.0f - (float)k / (float)channels);
+		fractional_delay(chan_out, x, groups, h);
+
+		for (j=0; j<groups; j++) {
+			v = chan_out[j] + 0.5f;
+			if (v<0)
+				v = 0;
+			if (v>255)
+				v = 255;
+			out[j*channels + k] = (unsigned char)v;
+		}
+	}
+
+	for (i=groups*channels; i<numSamples; i++)
+		out[i] = out[i - channels];
+}
+
+/* Segment count is implied by bytes after trailer */
+static unsigned memseg_count(size_t size, unsigned short numSamples)
+{
+	size_t extra;
+
+	if (numSamples==0 || size<=numSamples + TRAILER_SIZE)
+		return 0;
+	extra = size - numSamples - TRAILER_SIZE;
+	if (extra % MEMSEG_INFO_SIZE || extra / MEMSEG_INFO_SIZE > MEMSEG_MAX)
+		return 0;
+	return extra / MEMSEG_INFO_SIZE;
+}
+
+unsigned ingest_memsegs(const unsigned char *buf, size_t size, unsigned short numSamples,
+						struct ingest_memseg *seg)
+{
+	const unsigned char *info = buf + numSamples + TRAILER_SIZE;
+	unsigned count = memseg_count(size, numSamples);
+	unsigned long t, t0 = 0;
+	unsigned k;
+
+	for (k=0; k<count; k++, info+=MEMSEG_INFO_SIZE) {
+		t = (unsigned long)info[MEMSEG_INFO_TIME] << 16 |
+			info[MEMSEG_INFO_TIME+1] << 8 | info[MEMSEG_INFO_TIME+2];
+		if (k==0)
+			t0 = t;
+		seg[k].start = k * (numSamples / count);
+		seg[k].length = numSamples / count;
+		seg[k].triggered = info[MEMSEG_INFO_TRIGGERED];
+		seg[k].time = (t - t0) & 0xffffff;
+	}
+	return count;
+}
+
+size_t ingest_process(unsigned char *buf, size_t size, unsigned short numSamples)
+{
+	unsigned channels, count, length, k;
+	unsigned muxDelay = 0;
+
+	/* Pre-2.5 firmware has no mux schedule, but discards samples so that
+	 round-robin starts at first sample */
+	if (numSamples==0 || size<numSamples + TRAILER_CHANNELS + 1)
+		return size;
+
+	channels = buf[numSamples + TRAILER_CHANNELS];
+	if (size>=numSamples + TRAILER_MUX_DELAY + 1)
+		muxDelay = buf[numSamples + TRAILER_MUX_DELAY];
+
+	if (channels<2)
+		return size;
+	count = memseg_count(size, numSamples);
+	if (count>1) {
+		length = numSamples / count;
+		for (k=0; k<count; k++)
+			ingest_deskew(buf + k * length, buf + k * length, length, channels, muxDelay);
+	} else {
+		ingest_deskew(buf, buf, numSamples, channels, muxDelay);
+	}
+
+	return size;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __INGEST_H__
+#define __INGEST_H__
+
+#include <stddef.h>
+
+/* Largest frame (in samples) and channel count we handle */
+#define INGEST_MAX_SAMPLES  1024
+#define INGEST_MAX_CHANNELS 4
+
+/* Memory segment of a capture (v3.3), see COMMAND_SET_MEMSEG */
+struct ingest_memseg {
+	unsigned start;          /* First sample, in interleaved samples */
+	unsigned length;
+	int triggered;
+	unsigned long time;      /* ADC conversions since first segment */
+};
+
+/*
+ Process a COMMAND_BUFFER_SEG payload (samples plus trailer) in place,
+ before it is displayed. For multi-channel frames, each channel is
+ resampled onto channel 0 time base, using mux schedule from trailer;
+ each memory segment on its own. Returns new payload size.
+ */
+size_t ingest_process(unsigned char *buf, size_t size, unsigned short numSamples);
+
+/*
+ Resample interleaved multi-channel samples so that all channels of a
+ group share channel 0 sampling instant. Samples before muxDelay belong to
+ channel 0 and are dropped. Output is numSamples long, interleaved; tail
+ is padded with last group. in and out may be the same buffer.
+ */
+void ingest_deskew(unsigned char *out, const unsigned char *in, size_t numSamples,
+				   unsigned channels, unsigned muxDelay);
+
+/* Memory segments in a capture, from segment info after trailer. seg
+ must hold MEMSEG_MAX entries. Returns 0 if capture is not segmented */
+unsigned ingest_memsegs(const unsigned char *buf, size_t size, unsigned short numSamples,
+						struct ingest_memseg *seg);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "logic.h"
+#include "simd.h"
+
+int logic_parse_trigger(const char *spec, struct logic_trigger *t)
+{
+	size_t len = strlen(spec);
+	unsigned char bit;
+	size_t i;
+
+	memset(t, 0, sizeof(*t));
+	if (len>LOGIC_CHANNELS)
+		goto bad;
+
+	for (i=0; i<len; i++) {
+		bit = 1 << (len - 1 - i);
+		switch (spec[i]) {
+		case 'x':
+		case 'X':
+			break;
+		case '1':
+			t->value |= bit;
+			/* Fall through */
+		case '0':
+			t->mask |= bit;
+			break;
+		case 'r':
+		case 'R':
+			t->value |= bit;
+			/* Fall through */
+		case 'f':
+		case 'F':
+			t->edge |= bit;
+			break;
+		default:
+			goto bad;
+		}
+	}
+	return 0;
+bad:
+	fprintf(stderr,"Bad logic trigger '%s': want up to %d of x01rf, line %d first\n",
+			spec, LOGIC_CHANNELS, LOGIC_CHANNELS - 1);
+	return -1;
+}
+
+void logic_decode(const unsigned char *buf, size_t size,
+				  unsigned char *planes, size_t stride)
+{
+	v16qu v, one = v16qu_set1(1);
+	size_t i;
+	unsigned n;
+
+	for (i=0; i + V16QU_WIDTH <= size; i+=V16QU_WIDTH) {
+		v = v16qu_load(&buf[i]);
+		for (n=0; n<LOGIC_CHANNELS; n++)
+			v16qu_store(&planes[n * stride + i], (v >> n) & one);
+	}
+	for (; i<size; i++)
+		for (n=0; n<LOGIC_CHANNELS; n++)
+			planes[n * stride + i] = (buf[i] >> n) & 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __LOGIC_H__
+#define __LOGIC_H__
+
+#include <stddef.h>
+#include "../protocol.h"
+
+/* Logic analyzer mode (COMMAND_SET_LOGIC). Each sample is one byte,
+ with line n in bit n */
+
+struct logic_trigger {
+	unsigned char mask;  /* Lines that must match value */
+	unsigned char value;
+	unsigned char edge;  /* Lines that must have just changed to value */
+};
+
+/*
+ Parse a trigger, one character per line, line 7 first as in binary:
+
+   x  don't care     0  low      1  high
+   r  rising edge    f  falling edge
+
+ e.g. "xxxxr0xx" fires on a rising edge of line 3 while line 2 is low.
+ Shorter specs leave upper lines as don't care. Empty spec, or all
+ don't care, never waits for trigger. Returns -1 on error.
+ */
+int logic_parse_trigger(const char *spec, struct logic_trigger *t);
+
+/*
+ Split samples into bit-planes: planes[n * stride + i] is 1 if line n
+ was high in sample i, 0 otherwise. stride must be at least size
+ */
+void logic_decode(const unsigned char *buf, size_t size,
+				  unsigned char *planes, size_t stride);
+
+#endif
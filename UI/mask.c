@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mask.h"
+#include "ingest.h"
+#include "simd.h"
+
+struct mask {
+	unsigned learn;          /* Frames to learn from, 0 if from file */
+	unsigned learned;
+	unsigned char margin;
+	size_t size;             /* 0 until envelopes are complete */
+	size_t learn_size;
+	struct mask_stats stats;
+	unsigned char lower[INGEST_MAX_SAMPLES];
+	unsigned char upper[INGEST_MAX_SAMPLES];
+	unsigned char violations[INGEST_MAX_SAMPLES];
+};
+
+static struct mask *mask_alloc(void)
+{
+	struct mask *m = calloc(1, sizeof(*m));
+
+	if (NULL==m)
+		perror("calloc");
+	return m;
+}
+
+static struct mask *mask_load(const char *path)
+{
+	struct mask *m;
+	char line[128], *p;
+	unsigned lo, hi;
+	unsigned lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (NULL==f) {
+		perror(path);
+		return NULL;
+	}
+	m = mask_alloc();
+	if (NULL==m)
+		goto out;
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		p = line + strspn(line, " \t\r\n");
+		if (*p=='\0')
+			continue;
+		if (sscanf(p, "%u %u", &lo, &hi)!=2 || lo>hi || hi>255) {
+			fprintf(stderr,"%s:%u: want 'lower upper', 0-255\n", path, lineno);
+			goto bad;
+		}
+		if (m->size==INGEST_MAX_SAMPLES) {
+			fprintf(stderr,"%s: more than %d samples\n", path, INGEST_MAX_SAMPLES);
+			goto bad;
+		}
+		m->lower[m->size] = lo;
+		m->upper[m->size] = hi;
+		m->size++;
+	}
+	if (m->size==0) {
+		fprintf(stderr,"%s: empty mask\n", path);
+		goto bad;
+	}
+	goto out;
+bad:
+	free(m);
+	m = NULL;
+out:
+	fclose(f);
+	return m;
+}
+
+struct mask *mask_new(const char *spec)
+{
+	struct mask *m;
+	unsigned long n, margin = MASK_DEFAULT_MARGIN;
+	char *end;
+
+	if (strncmp(spec, "learn:", 6))
+		return mask_load(spec);
+
+	n = strtoul(spec + 6, &end, 10);
+	if (*end==':')
+		margin = strtoul(end + 1, &end, 10);
+	if (*end || n<1 || n>MASK_MAX_LEARN || margin>255) {
+		fprintf(stderr,"Bad mask '%s': want learn:<1-%d frames>[:<margin 0-255>]\n",
+				spec, MASK_MAX_LEARN);
+		return NULL;
+	}
+	m = mask_alloc();
+	if (NULL==m)
+		return NULL;
+	m->learn = n;
+	m->margin = margin;
+	return m;
+}
+
+void mask_free(struct mask *m)
+{
+	free(m);
+}
+
+int mask_save(const struct mask *m, const char *path)
+{
+	FILE *f;
+	size_t i;
+
+	if (m->size==0) {
+		fprintf(stderr,"Mask not learned yet, not saved\n");
+		return -1;
+	}
+	f = fopen(path, "w");
+	if (NULL==f) {
+		perror(path);
+		return -1;
+	}
+	fprintf(f, "# lower upper, one line per sample\n");
+	for (i=0; i<m->size; i++)
+		fprintf(f, "%u %u\n", m->lower[i], m->upper[i]);
+	if (fclose(f)!=0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+void mask_reset(struct mask *m)
+{
+	if (m->learn) {
+		m->learned = 0;
+		m->size = 0;
+	}
+}
+
+/* Envelopes are running min and max of frames seen so far. Vector
+ compares give all-ones lanes where true, so selection is plain bit
+ operations */
+static void learn_frame(struct mask *m, const unsigned char *buf, size_t n)
+{
+	v16qu x, lo, hi, lt, gt;
+	size_t i;
+
+	if (m->learned==0 || n!=m->learn_size) {
+		memcpy(m->lower, buf, n);
+		memcpy(m->upper, buf, n);
+		m->learn_size = n;
+		m->learned = 0;
+	}
+	for (i=0; i + V16QU_WIDTH <= n; i+=V16QU_WIDTH) {
+		x = v16qu_load(&buf[i]);
+		lo = v16qu_load(&m->lower[i]);
+		hi = v16qu_load(&m->upper[i]);
+		lt = (v16qu)(x < lo);
+		gt = (v16qu)(x > hi);
+		v16qu_store(&m->lower[i], (x & lt) | (lo & ~lt));
+		v16qu_store(&m->upper[i], (x & gt) | (hi & ~gt));
+	}
+	for (; i<n; i++) {
+		if (buf[i] < m->lower[i])
+			m->lower[i] = buf[i];
+		if (buf[i] > m->upper[i])
+			m->upper[i] = buf[i];
+	}
+
+	if (++m->learned < m->learn)
+		return;
+	for (i=0; i<n; i++) {
+		m->lower[i] = m->lower[i] > m->margin ? m->lower[i] - m->margin : 0;
+		m->upper[i] = m->upper[i] < 255 - m->margin ? m->upper[i] + m->margin : 255;
+	}
+	m->size = n;
+}
+
+/* Sixteen samples per step: compare against both envelopes, keep lane
+ masks for display, and count them from the movemask */
+static int test_frame(struct mask *m, const unsigned char *buf, size_t n)
+{
+	v16qu x, bad;
+	unsigned count = 0;
+	size_t i;
+
+	for (i=0; i + V16QU_WIDTH <= n; i+=V16QU_WIDTH) {
+		x = v16qu_load(&buf[i]);
+		bad = (v16qu)((x < v16qu_load(&m->lower[i])) | (x > v16qu_load(&m->upper[i])));
+		v16qu_store(&m->violations[i], bad);
+		count += __builtin_popcount(v16qu_movemask(bad));
+	}
+	for (; i<n; i++) {
+		m->violations[i] = (buf[i] < m->lower[i] || buf[i] > m->upper[i]) ? 0xFF : 0;
+		count += m->violations[i] & 1;
+	}
+	return count;
+}
+
+int mask_test(struct mask *m, const unsigned char *buf, size_t numSamples,
+			  int triggered)
+{
+	int count;
+
+	if (numSamples>INGEST_MAX_SAMPLES)
+		numSamples = INGEST_MAX_SAMPLES;
+	if (m->size==0) {
+		if (triggered)
+			learn_frame(m, buf, numSamples);
+		m->stats.skipped++;
+		return -1;
+	}
+	if (numSamples!=m->size) {
+		m->stats.skipped++;
+		return -1;
+	}
+
+	if (triggered) {
+		count = test_frame(m, buf, numSamples);
+	} else {
+		memset(m->violations, 0xFF, numSamples);
+		count = numSamples;
+		m->stats.untriggered++;
+	}
+	m->stats.tested++;
+	if (count) {
+		m->stats.failed++;
+		m->stats.samples += count;
+	}
+	return count;
+}
+
+size_t mask_size(const struct mask *m)
+{
+	return m->size;
+}
+
+const unsigned char *mask_lower(const struct mask *m)
+{
+	return m->lower;
+}
+
+const unsigned char *mask_upper(const struct mask *m)
+{
+	return m->upper;
+}
+
+const unsigned char *mask_violations(const struct mask *m)
+{
+	return m->violations;
+}
+
+void mask_get_stats(const struct mask *m, struct mask_stats *stats)
+{
+	*stats = m->stats;
+}
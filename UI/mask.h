@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __MASK_H__
+#define __MASK_H__
+
+#include <stddef.h>
+
+/* Frames a mask may be learned from, at most */
+#define MASK_MAX_LEARN 1024
+
+/* Learned envelopes are widened by this much, unless told otherwise */
+#define MASK_DEFAULT_MARGIN 8
+
+struct mask;
+
+/* Counters since mask was created */
+struct mask_stats {
+	unsigned long tested;
+	unsigned long failed;      /* Frames with at least one sample outside */
+	unsigned long samples;     /* Samples outside, over all failed frames */
+	unsigned long untriggered; /* Failed frames that were auto-triggered */
+	unsigned long skipped;     /* Learning, or wrong size */
+};
+
+/*
+ Limit test: every sample of a frame must lie within lower and upper
+ envelopes, one pair per interleaved sample. Envelopes come either from
+ a file, or are learned from the first triggered frames, widened by
+ margin on each side.
+
+ spec is "learn:<frames>[:<margin>]" or name of a mask file. A mask file
+ holds one "lower upper" pair per line, in sample order; '#' starts a
+ comment. Returns NULL on error.
+ */
+struct mask *mask_new(const char *spec);
+void mask_free(struct mask *m);
+
+/* Write envelopes in mask file format. Returns -1 on error, or if
+ mask is still learning */
+int mask_save(const struct mask *m, const char *path);
+
+/* Settings changed. A learned mask starts learning again; a mask from
+ file is kept. Counters are kept */
+void mask_reset(struct mask *m);
+
+/* Test a frame of numSamples interleaved samples. Returns number of
+ samples outside envelopes, or -1 if frame was not tested: frames are
+ not tested while learning, and frames of a different size than mask
+ never match. An auto-triggered frame is not aligned to signal, and a
+ lost or flat signal only ever auto-triggers, so it fails with every
+ sample outside */
+int mask_test(struct mask *m, const unsigned char *buf, size_t numSamples,
+			  int triggered);
+
+/* Envelopes, and 0xFF for each sample outside them in last frame tested.
+ size is 0 while learning */
+size_t mask_size(const struct mask *m);
+const unsigned char *mask_lower(const struct mask *m);
+const unsigned char *mask_upper(const struct mask *m);
+const unsigned char *mask_violations(const struct mask *m);
+void mask_get_stats(const struct mask *m, struct mask_stats *stats);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <string.h>
+#include "proto.h"
+
+void proto_parser_init(struct proto_parser *p,
+					   void (*packet)(void *data, unsigned char command,
+									  unsigned char *buf, unsigned short size),
+					   void *data)
+{
+	memset(p, 0, sizeof(*p));
+	p->st = PROTO_SIZE;
+	p->buf = p->store;
+	p->packet = packet;
+	p->data = data;
+}
+
+static void proto_cobs_put(struct proto_parser *p, unsigned char bIn)
+{
+	p->cksum ^= bIn;
+	if (!p->size)
+		p->command = bIn;
+	else if (p->ptr < PROTO_BUFFER_SIZE)
+		p->buf[p->ptr++] = bIn;
+	else
+		p->overflow = 1; /* Counted at delimiter */
+	p->size = 1; /* Command seen */
+}
+
+/* COBS frame holds command, payload and checksum. Whatever happens, we
+ are back in sync at next zero */
+static void proto_process_cobs(struct proto_parser *p, unsigned char bIn)
+{
+	if (bIn!=0) {
+		if (p->st!=PROTO_COBS) {
+			p->st = PROTO_COBS;
+			p->cksum = 0;
+			p->size = 0;
+			p->ptr = 0;
+			p->cobs_left = 0;
+			p->cobs_zero = 0;
+			p->overflow = 0;
+		}
+		if (p->cobs_left==0) {
+			if (p->cobs_zero)
+				proto_cobs_put(p, 0);
+			p->cobs_left = bIn - 1;
+			p->cobs_zero = (bIn!=PROTO_COBS_MAX_RUN + 1);
+		} else {
+			proto_cobs_put(p, bIn);
+			p->cobs_left--;
+		}
+		return;
+	}
+
+	if (p->st!=PROTO_COBS)
+		return; /* Back-to-back delimiters */
+	p->st = PROTO_SIZE;
+
+	if (p->overflow) {
+		p->oversize++;
+		if (p->error)
+			p->error(p->data, p->command, p->ptr);
+	} else if (p->ptr==0 || p->cobs_left) {
+		/* Truncated */
+		p->cksum_errors++;
+		if (p->error)
+			p->error(p->data, p->size ? p->command : 0, 0);
+	} else if (p->cksum!=0) {
+		p->cksum_errors++;
+		if (p->error)
+			p->error(p->data, p->command, p->ptr - 1);
+	} else {
+		p->packet(p->data, p->command, p->buf, p->ptr - 1);
+	}
+}
+
+static void proto_process(struct proto_parser *p, unsigned char bIn)
+{
+	p->cksum^=bIn;
+
+	switch(p->st) {
+	case PROTO_SIZE:
+		p->cksum = bIn;
+		if (bIn==0)
+			break; // Reset procedure.
+		if (bIn & 0x80) {
+			p->size =((unsigned short)(bIn&0x7F)<<8);
+			p->st = PROTO_SIZE2;
+		} else {
+			p->size = bIn;
+			p->ptr = 0;
+			p->st = PROTO_COMMAND;
+		}
+		break;
+
+	case PROTO_SIZE2:
+		p->size += bIn;
+		if (p->size==0 || p->size - 1 > PROTO_MAX_PAYLOAD) {
+			/* Would not fit buffer. Probably garbage */
+			p->oversize++;
+			p->st = PROTO_SIZE;
+			if (p->error)
+				p->error(p->data, 0, p->size);
+			break;
+		}
+		p->ptr = 0;
+		p->st = PROTO_COMMAND;
+		break;
+
+	case PROTO_COMMAND:
+		p->command = bIn;
+		p->size--;
+		if (p->size>0)
+			p->st = PROTO_PAYLOAD;
+		else
+			p->st = PROTO_CKSUM;
+		break;
+
+	case PROTO_PAYLOAD:
+		p->buf[p->ptr++] = bIn;
+		p->size--;
+		if (p->size==0) {
+			p->st = PROTO_CKSUM;
+		}
+		break;
+
+	case PROTO_COBS:
+		/* Only used with COBS framing */
+		p->st = PROTO_SIZE;
+		break;
+
+	case PROTO_CKSUM:
+		if (p->cksum==0) {
+			p->packet(p->data, p->command, p->buf, p->ptr);
+		} else {
+			p->cksum_errors++;
+			if (p->error)
+				p->error(p->data, p->command, p->ptr);
+		}
+		p->st = PROTO_SIZE;
+	}
+}
+
+void proto_parse(struct proto_parser *p, const unsigned char *buf, size_t len)
+{
+	size_t i;
+	/* Framing may change from within packet callback */
+	for (i=0; i<len; i++) {
+		if (p->cobs)
+			proto_process_cobs(p, buf[i]);
+		else
+			proto_process(p, buf[i]);
+	}
+}
+
+size_t proto_encode(unsigned char *out, unsigned char command,
+					const unsigned char *payload, unsigned short size)
+{
+	unsigned char cksum=0;
+	unsigned short dsize = size + 1;
+	size_t len = 0;
+	unsigned short i;
+
+	if (dsize>127) {
+		dsize |= 0x8000; // Set MSBit on MSB
+		out[len++] = dsize >> 8;
+		cksum ^= dsize >> 8;
+	}
+	out[len++] = dsize & 0xff;
+	cksum ^= dsize & 0xff;
+
+	out[len++] = command;
+	cksum ^= command;
+
+	for (i=0; i<size; i++) {
+		out[len++] = payload[i];
+		cksum ^= payload[i];
+	}
+	out[len++] = cksum;
+	return len;
+}
+
+size_t proto_encode_cobs(unsigned char *out, unsigned char command,
+						 const unsigned char *payload, unsigned short size)
+{
+	unsigned char cksum = command;
+	size_t len = 1, code = 0;
+	unsigned short i;
+	unsigned char b;
+
+	/* out[code] is code byte of current block, filled in when it ends */
+	for (i=0; i<=size + 1; i++) {
+		if (i==0)
+			b = command;
+		else if (i<=size)
+			b = payload[i-1];
+		else
+			b = cksum;
+		if (i>0 && i<=size)
+			cksum ^= b;
+
+		if (b==0) {
+			out[code] = len - code;
+			code = len++;
+			continue;
+		}
+		out[len++] = b;
+		if (len - code == PROTO_COBS_MAX_RUN + 1) {
+			out[code] = len - code;
+			code = len++;
+		}
+	}
+	out[code] = len - code;
+	out[len++] = 0;
+	return len;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stddef.h>
+
+/* Largest payload we accept. Frames are up to 1024 samples plus trailer */
+#define PROTO_MAX_PAYLOAD 1280
+/* Parser buffer: payload, and checksum with COBS framing */
+#define PROTO_BUFFER_SIZE (PROTO_MAX_PAYLOAD + 1)
+
+/* Longest run of non-zero bytes in a COBS block */
+#define PROTO_COBS_MAX_RUN 254
+
+/* Largest encoded packet. Size (2), command, payload and checksum, or
+ COBS code bytes, command, payload, checksum and delimiter */
+#define PROTO_MAX_PACKET (PROTO_MAX_PAYLOAD + 4 + (PROTO_MAX_PAYLOAD + 2) / PROTO_COBS_MAX_RUN + 2)
+
+enum proto_state {
+	PROTO_SIZE,
+	PROTO_SIZE2,
+	PROTO_COMMAND,
+	PROTO_PAYLOAD,
+	PROTO_CKSUM,
+	PROTO_COBS
+};
+
+struct proto_parser {
+	enum proto_state st;
+	unsigned char cksum;
+	unsigned short size;
+	unsigned short ptr;
+	unsigned char command;
+	/* Payload. Points to store unless set by proto_set_buffer() */
+	unsigned char *buf;
+	unsigned char store[PROTO_BUFFER_SIZE];
+
+	/* COBS framing: bytes left in block, block ends with implied zero */
+	int cobs;
+	unsigned char cobs_left;
+	unsigned char cobs_zero;
+	unsigned char overflow;
+
+	unsigned long cksum_errors;
+	unsigned long oversize;
+
+	void (*packet)(void *data, unsigned char command, unsigned char *buf,
+				   unsigned short size);
+	/* Optional, called for packets failing checksum, truncated or too
+	 large. command is 0 if none was received */
+	void (*error)(void *data, unsigned char command, unsigned short size);
+	void *data;
+};
+
+void proto_parser_init(struct proto_parser *p,
+					   void (*packet)(void *data, unsigned char command,
+									  unsigned char *buf, unsigned short size),
+					   void *data);
+void proto_parse(struct proto_parser *p, const unsigned char *buf, size_t len);
+
+/* Bytes of a packet still to come. 0 between packets */
+static inline int proto_in_packet(const struct proto_parser *p)
+{
+	return p->st!=PROTO_SIZE;
+}
+
+/* Abandon partial packet, e.g. after a timeout */
+static inline void proto_reset(struct proto_parser *p)
+{
+	p->st = PROTO_SIZE;
+}
+
+/* Write next packets to buf, of PROTO_BUFFER_SIZE bytes, or back to
+ parser own buffer if NULL. May be called from packet callback, once done
+ with the packet */
+static inline void proto_set_buffer(struct proto_parser *p, unsigned char *buf)
+{
+	p->buf = buf ? buf : p->store;
+}
+
+/* Switch between size-prefixed and COBS framing. Partial packet, if
+ any, is discarded */
+static inline void proto_set_cobs(struct proto_parser *p, int enable)
+{
+	p->cobs = enable;
+	proto_reset(p);
+}
+
+/* CRC-16 used by COMMAND_FRAME_SEGMENT. Same as avr-libc
+ _crc_ccitt_update(), start value 0xffff */
+static inline unsigned short proto_crc_ccitt_update(unsigned short crc,
+													unsigned char data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+	return ((((unsigned short)data << 8) | (crc >> 8)) ^ (unsigned char)(data >> 4)
+			^ ((unsigned short)data << 3));
+}
+
+/* Encode a packet into out, which must hold size + 4 bytes. Returns
+ encoded length */
+size_t proto_encode(unsigned char *out, unsigned char command,
+					const unsigned char *payload, unsigned short size);
+
+/* Same, with COBS framing. out must hold PROTO_MAX_PACKET bytes */
+size_t proto_encode_cobs(unsigned char *out, unsigned char command,
+						 const unsigned char *payload, unsigned short size);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ oscope-protofuzz: feed random and corrupted packets through
+ proto_parse(), in both framings, then measure parser throughput.
+
+ After each corrupted packet comes a delimiter, then a known packet,
+ which must be received intact: with COBS framing the delimiter is a
+ zero, with size-prefixed framing it is a run of zeros as long as the
+ longest packet, as the reset procedure sends. The parser writes to a
+ buffer with guard bytes after it, checked after every round.
+
+ Usage: oscope-protofuzz [rounds [seed]]. Run by make check.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "proto.h"
+#include "../protocol.h"
+
+#define FUZZ_ROUNDS      20000
+#define FUZZ_GUARD       64
+#define FUZZ_GUARD_BYTE  0xA5
+/* Throughput: frames of 1024 samples plus trailer, as the scope sends */
+#define FUZZ_FRAME_SIZE  1027
+#define FUZZ_FRAMES      256
+#define FUZZ_BENCH_BYTES (256UL << 20)
+#define FUZZ_CHUNK       4096
+
+static struct {
+	unsigned char buf[PROTO_BUFFER_SIZE];
+	unsigned char guard[FUZZ_GUARD];
+} rx;
+
+/* Packet expected next, and what the parser handed over */
+static unsigned char want_command;
+static unsigned char want[PROTO_MAX_PAYLOAD];
+static unsigned short want_size;
+static int got_match;
+static unsigned long packets, bad_calls;
+
+static unsigned long long rnd_state;
+
+static unsigned rnd(void)
+{
+	/* xorshift64* */
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return (rnd_state * 2685821657736338717ULL) >> 32;
+}
+
+static void on_packet(void *data, unsigned char command, unsigned char *buf,
+					  unsigned short size)
+{
+	packets++;
+	if (buf!=rx.buf || size>PROTO_MAX_PAYLOAD) {
+		bad_calls++;
+		return;
+	}
+	got_match = command==want_command && size==want_size &&
+		memcmp(buf, want, size)==0;
+}
+
+static size_t encode(int cobs, unsigned char *out, unsigned char command,
+					 const unsigned char *payload, unsigned short size)
+{
+	if (cobs)
+		return proto_encode_cobs(out, command, payload, size);
+	return proto_encode(out, command, payload, size);
+}
+
+static void random_packet(unsigned char *command, unsigned char *payload,
+						  unsigned short *size)
+{
+	unsigned short i;
+
+	*command = rnd();
+	/* Mostly short, some up to the limit */
+	*size = rnd() % 4 ? rnd() % 64 : rnd() % (PROTO_MAX_PAYLOAD + 1);
+	for (i=0; i<*size; i++)
+		payload[i] = rnd() % 8 ? rnd() : 0;
+}
+
+/* Flip, drop or insert bytes, or replace all by garbage. Returns new
+ length */
+static size_t corrupt(unsigned char *pkt, size_t len, size_t max)
+{
+	size_t i, n;
+
+	switch (rnd() % 4) {
+	case 0:
+		n = 1 + rnd() % 3;
+		while (n--)
+			pkt[rnd() % len] ^= 1 + rnd() % 255;
+		return len;
+	case 1:
+		return rnd() % len;
+	case 2:
+		n = 1 + rnd() % 16;
+		if (len + n > max)
+			n = max - len;
+		i = rnd() % len;
+		memmove(pkt + i + n, pkt + i, len - i);
+		for (len += n; n>0; n--)
+			pkt[i + n - 1] = rnd();
+		return len;
+	default:
+		n = rnd() % max;
+		for (i=0; i<n; i++)
+			pkt[i] = rnd();
+		return n;
+	}
+}
+
+static int guard_ok(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUZZ_GUARD; i++)
+		if (rx.guard[i]!=FUZZ_GUARD_BYTE)
+			return 0;
+	return 1;
+}
+
+/* Returns number of failures */
+static unsigned fuzz(int cobs, unsigned long rounds)
+{
+	static unsigned char pkt[2 * PROTO_MAX_PACKET];
+	static unsigned char zeros[PROTO_MAX_PACKET];
+	struct proto_parser p;
+	unsigned long r, corrupted = 0, bytes = 0;
+	unsigned failures = 0;
+	size_t len;
+	int broken;
+
+	proto_parser_init(&p, on_packet, NULL);
+	proto_set_cobs(&p, cobs);
+	proto_set_buffer(&p, rx.buf);
+	packets = bad_calls = 0;
+
+	for (r=0; r<rounds; r++) {
+		random_packet(&want_command, want, &want_size);
+		len = encode(cobs, pkt, want_command, want, want_size);
+		broken = rnd() % 4==0;
+		if (broken) {
+			len = corrupt(pkt, len, sizeof(pkt));
+			corrupted++;
+		}
+		got_match = 0;
+		proto_parse(&p, pkt, len);
+		bytes += len;
+		if (!broken && !got_match) {
+			if (failures++ < 10)
+				printf("FAIL %s round %lu: clean packet of %u bytes lost\n",
+					   cobs ? "cobs" : "size", r, want_size);
+		}
+		if (broken) {
+			/* Delimiter, then a packet that must come through */
+			if (cobs)
+				proto_parse(&p, zeros, 1);
+			else
+				proto_parse(&p, zeros, sizeof(zeros));
+			random_packet(&want_command, want, &want_size);
+			len = encode(cobs, pkt, want_command, want, want_size);
+			got_match = 0;
+			proto_parse(&p, pkt, len);
+			bytes += len;
+			if (!got_match && failures++ < 10)
+				printf("FAIL %s round %lu: no resync after corrupted packet\n",
+					   cobs ? "cobs" : "size", r);
+		}
+		if (!guard_ok()) {
+			printf("FAIL %s round %lu: write past PROTO_BUFFER_SIZE\n",
+				   cobs ? "cobs" : "size", r);
+			return failures + 1;
+		}
+	}
+	if (bad_calls) {
+		printf("FAIL %s: %lu packets outside buffer or over PROTO_MAX_PAYLOAD\n",
+			   cobs ? "cobs" : "size", bad_calls);
+		failures++;
+	}
+	printf("%s: %lu rounds, %lu corrupted, %lu bytes, %lu checksum errors, "
+		   "%lu oversize, %u failures\n", cobs ? "cobs" : "size", rounds,
+		   corrupted, bytes, p.cksum_errors, p.oversize, failures);
+	return failures;
+}
+
+static void discard(void *data, unsigned char command, unsigned char *buf,
+					unsigned short size)
+{
+	packets++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse a stream of frames, sized like the scope sends, in chunks as
+ read() returns them */
+static void bench(int cobs)
+{
+	unsigned char frame[FUZZ_FRAME_SIZE];
+	unsigned char *stream;
+	struct proto_parser p;
+	size_t len = 0, done, n, i;
+	unsigned f;
+	double start, secs;
+
+	stream = malloc(FUZZ_FRAMES * PROTO_MAX_PACKET);
+	if (!stream) {
+		perror("malloc");
+		return;
+	}
+	for (f=0; f<FUZZ_FRAMES; f++) {
+		for (i=0; i<sizeof(frame); i++)
+			frame[i] = rnd();
+		len += encode(cobs, stream + len, COMMAND_BUFFER_SEG, frame,
+					  sizeof(frame));
+	}
+
+	proto_parser_init(&p, discard, NULL);
+	proto_set_cobs(&p, cobs);
+	packets = 0;
+	start = now();
+	for (done=0; done<FUZZ_BENCH_BYTES; done+=len) {
+		for (i=0; i<len; i+=n) {
+			n = len - i < FUZZ_CHUNK ? len - i : FUZZ_CHUNK;
+			proto_parse(&p, stream + i, n);
+		}
+	}
+	secs = now() - start;
+	printf("%s: %.1f MB/s, %lu frames\n", cobs ? "cobs" : "size",
+		   done / secs / 1e6, packets);
+	free(stream);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long rounds = argc>1 ? strtoul(argv[1], NULL, 0) : FUZZ_ROUNDS;
+	unsigned failures;
+
+	rnd_state = argc>2 ? strtoull(argv[2], NULL, 0) : 0x5eed;
+	if (rnd_state==0)
+		rnd_state = 1;
+	memset(rx.guard, FUZZ_GUARD_BYTE, sizeof(rx.guard));
+
+	failures = fuzz(0, rounds) + fuzz(1, rounds);
+	bench(0);
+	bench(1);
+	return failures ? 1 : 0;
+}
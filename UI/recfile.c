@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "recfile.h"
+
+static const char header_magic[8] = { 'O','S','C','O','P','R','E','C' };
+static const char footer_magic[8] = { 'O','S','C','O','P','I','D','X' };
+
+/* Writer output buffer */
+#define RECFILE_BUFFER_SIZE (1024*1024)
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+struct recfile_writer {
+	FILE *f;
+	uint64_t offset;
+	uint64_t *index;
+	size_t count;
+	size_t alloc;
+};
+
+struct recfile {
+	int fd;
+	const unsigned char *map;
+	uint64_t size;
+	struct recfile_header hdr;
+	/* Index, either in mapping (mapped_index) or built by scanning */
+	const unsigned char *mapped_index;
+	uint64_t *index;
+	size_t count;
+};
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+struct recfile_writer *recfile_create(const char *path, const struct recfile_header *hdr)
+{
+	struct recfile_writer *w;
+	unsigned char buf[RECFILE_HEADER_SIZE];
+
+	if (hdr->params_size > RECFILE_MAX_PARAMETERS)
+		return NULL;
+
+	w = calloc(1, sizeof(*w));
+	if (NULL==w)
+		return NULL;
+
+	w->f = fopen(path, "wb");
+	if (NULL==w->f) {
+		free(w);
+		return NULL;
+	}
+	setvbuf(w->f, NULL, _IOFBF, RECFILE_BUFFER_SIZE);
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, header_magic, sizeof(header_magic));
+	put_le16(&buf[8], RECFILE_VERSION);
+	put_le16(&buf[10], hdr->params_size);
+	put_le32(&buf[12], hdr->freq);
+	put_le64(&buf[16], hdr->start_time);
+	memcpy(&buf[24], hdr->params, hdr->params_size);
+
+	if (fwrite(buf, sizeof(buf), 1, w->f)!=1) {
+		fclose(w->f);
+		free(w);
+		return NULL;
+	}
+	w->offset = sizeof(buf);
+	return w;
+}
+
+int recfile_write(struct recfile_writer *w, unsigned char type, uint64_t timestamp,
+				  const unsigned char *data, size_t size)
+{
+	static const unsigned char pad[8];
+	unsigned char rh[RECFILE_RECORD_SIZE];
+	uint64_t len = ALIGN8(RECFILE_RECORD_SIZE + size);
+	uint64_t *n;
+
+	if (w->count==w->alloc) {
+		w->alloc = w->alloc ? w->alloc*2 : 4096;
+		n = realloc(w->index, w->alloc * sizeof(uint64_t));
+		if (NULL==n)
+			return -1;
+		w->index = n;
+	}
+
+	memset(rh, 0, sizeof(rh));
+	put_le32(&rh[0], size);
+	rh[4] = type;
+	put_le64(&rh[8], timestamp);
+
+	if (fwrite(rh, sizeof(rh), 1, w->f)!=1 ||
+		(size && fwrite(data, size, 1, w->f)!=1) ||
+		(len - RECFILE_RECORD_SIZE - size &&
+		 fwrite(pad, len - RECFILE_RECORD_SIZE - size, 1, w->f)!=1))
+		return -1;
+
+	w->index[w->count++] = w->offset;
+	w->offset += len;
+	return 0;
+}
+
+int recfile_close(struct recfile_writer *w)
+{
+	unsigned char buf[RECFILE_FOOTER_SIZE];
+	size_t i;
+	int r = 0;
+
+	for (i=0; i<w->count; i++) {
+		put_le64(buf, w->index[i]);
+		if (fwrite(buf, 8, 1, w->f)!=1)
+			r = -1;
+	}
+
+	memcpy(buf, footer_magic, sizeof(footer_magic));
+	put_le64(&buf[8], w->offset);
+	put_le64(&buf[16], w->count);
+	if (fwrite(buf, sizeof(buf), 1, w->f)!=1)
+		r = -1;
+
+	if (fclose(w->f)!=0)
+		r = -1;
+	free(w->index);
+	free(w);
+	return r;
+}
+
+/* Rebuild index from records, for files which were not closed */
+static int recfile_scan(struct recfile *r)
+{
+	uint64_t offset = RECFILE_HEADER_SIZE;
+	uint64_t len;
+	size_t alloc = 0;
+	uint64_t *n;
+
+	while (offset + RECFILE_RECORD_SIZE <= r->size) {
+		len = ALIGN8(RECFILE_RECORD_SIZE + (uint64_t)get_le32(r->map + offset));
+		if (offset + len > r->size)
+			break;
+		if (r->count==alloc) {
+			alloc = alloc ? alloc*2 : 4096;
+			n = realloc(r->index, alloc * sizeof(uint64_t));
+			if (NULL==n)
+				return -1;
+			r->index = n;
+		}
+		r->index[r->count++] = offset;
+		offset += len;
+	}
+	return 0;
+}
+
+struct recfile *recfile_open(const char *path)
+{
+	struct recfile *r;
+	struct stat st;
+	const unsigned char *footer;
+	uint64_t idx, count;
+
+	r = calloc(1, sizeof(*r));
+	if (NULL==r)
+		return NULL;
+
+	r->fd = open(path, O_RDONLY);
+	if (r->fd<0)
+		goto err;
+
+	if (fstat(r->fd, &st)<0 || (uint64_t)st.st_size < RECFILE_HEADER_SIZE)
+		goto err;
+
+	r->size = st.st_size;
+	r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (MAP_FAILED==r->map) {
+		r->map = NULL;
+		goto err;
+	}
+
+	if (memcmp(r->map, header_magic, sizeof(header_magic)) ||
+		get_le16(r->map + 8)!=RECFILE_VERSION)
+		goto err;
+
+	r->hdr.params_size = get_le16(r->map + 10);
+	if (r->hdr.params_size > RECFILE_MAX_PARAMETERS)
+		goto err;
+	r->hdr.freq = get_le32(r->map + 12);
+	r->hdr.start_time = get_le64(r->map + 16);
+	memcpy(r->hdr.params, r->map + 24, r->hdr.params_size);
+
+	if (r->size >= RECFILE_HEADER_SIZE + RECFILE_FOOTER_SIZE) {
+		footer = r->map + r->size - RECFILE_FOOTER_SIZE;
+		idx = get_le64(footer + 8);
+		count = get_le64(footer + 16);
+		if (!memcmp(footer, footer_magic, sizeof(footer_magic)) &&
+			idx >= RECFILE_HEADER_SIZE &&
+			count <= (r->size - RECFILE_FOOTER_SIZE - idx) / 8 &&
+			idx + count*8 == r->size - RECFILE_FOOTER_SIZE) {
+			r->mapped_index = r->map + idx;
+			r->count = count;
+			return r;
+		}
+	}
+
+	if (recfile_scan(r)<0)
+		goto err;
+	return r;
+
+err:
+	recfile_free(r);
+	return NULL;
+}
+
+const struct recfile_header *recfile_get_header(const struct recfile *r)
+{
+	return &r->hdr;
+}
+
+size_t recfile_num_records(const struct recfile *r)
+{
+	return r->count;
+}
+
+static uint64_t recfile_offset(const struct recfile *r, size_t index)
+{
+	if (r->mapped_index)
+		return get_le64(r->mapped_index + index*8);
+	return r->index[index];
+}
+
+int recfile_get_record(const struct recfile *r, size_t index, struct recfile_record *rec)
+{
+	uint64_t offset;
+	const unsigned char *p;
+
+	if (index >= r->count)
+		return -1;
+
+	offset = recfile_offset(r, index);
+	if (offset + RECFILE_RECORD_SIZE > r->size)
+		return -1;
+
+	p = r->map + offset;
+	rec->size = get_le32(p);
+	rec->type = p[4];
+	rec->timestamp = get_le64(p + 8);
+	rec->data = p + RECFILE_RECORD_SIZE;
+
+	if (offset + RECFILE_RECORD_SIZE + rec->size > r->size)
+		return -1;
+	return 0;
+}
+
+/* Hint kernel that records first to last (inclusive) will be read soon */
+void recfile_advise(const struct recfile *r, size_t first, size_t last)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uint64_t start, end;
+
+	if (first >= r->count)
+		return;
+	if (last >= r->count)
+		last = r->count - 1;
+
+	start = recfile_offset(r, first) & ~((uint64_t)pagesize - 1);
+	end = last + 1 < r->count ? recfile_offset(r, last + 1) : r->size;
+	if (end > start)
+		madvise((void*)(r->map + start), end - start, MADV_WILLNEED);
+}
+
+void recfile_free(struct recfile *r)
+{
+	if (r->map)
+		munmap((void*)r->map, r->size);
+	if (r->fd>=0)
+		close(r->fd);
+	free(r->index);
+	free(r);
+}
+
+unsigned short recfile_param_samples(const unsigned char *params, size_t size)
+{
+	if (size<6)
+		return 0;
+	return (params[4] << 8) | params[5];
+}
+
+unsigned char recfile_param_channels(const unsigned char *params, size_t size)
+{
+	if (size<8)
+		return 1;
+	return params[7];
+}
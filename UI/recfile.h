@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __RECFILE_H__
+#define __RECFILE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Capture recording file format. All values are little-endian.
+
+ File header (RECFILE_HEADER_SIZE bytes):
+   0-7   - Magic, "OSCOPREC"
+   8,9   - Format version (RECFILE_VERSION)
+   10,11 - Size of parameters
+   12-15 - Target CPU frequency, in Hz
+   16-23 - Recording start time, microseconds since epoch
+   24-47 - COMMAND_PARAMETERS_REPLY payload at start of recording
+
+ Followed by records, each aligned to 8 bytes:
+   0-3   - Payload size
+   4     - Record type (RECFILE_FRAME or RECFILE_PARAMETERS)
+   5-7   - Reserved
+   8-15  - Timestamp, microseconds since recording start
+   16-   - Payload: COMMAND_BUFFER_SEG or COMMAND_PARAMETERS_REPLY payload
+
+ When recording is closed, an index is appended: one 64-bit file offset
+ per record, followed by footer:
+   0-7   - Magic, "OSCOPIDX"
+   8-15  - File offset of index
+   16-23 - Number of records
+
+ Files without index (e.g. recorder crashed) are scanned on open.
+ */
+
+#define RECFILE_VERSION        1
+#define RECFILE_HEADER_SIZE    48
+#define RECFILE_MAX_PARAMETERS 24
+#define RECFILE_RECORD_SIZE    16
+#define RECFILE_FOOTER_SIZE    24
+
+#define RECFILE_FRAME          1
+#define RECFILE_PARAMETERS     2
+
+struct recfile_header {
+	uint32_t freq;
+	uint64_t start_time;
+	uint16_t params_size;
+	unsigned char params[RECFILE_MAX_PARAMETERS];
+};
+
+struct recfile_record {
+	unsigned char type;
+	uint64_t timestamp;
+	const unsigned char *data;
+	size_t size;
+};
+
+/* Writer. Not thread-safe, record.c runs it in its own thread */
+
+struct recfile_writer;
+
+struct recfile_writer *recfile_create(const char *path, const struct recfile_header *hdr);
+int recfile_write(struct recfile_writer *w, unsigned char type, uint64_t timestamp,
+				  const unsigned char *data, size_t size);
+int recfile_close(struct recfile_writer *w);
+
+/* Reader, backed by a read-only mapping of whole file */
+
+struct recfile;
+
+struct recfile *recfile_open(const char *path);
+const struct recfile_header *recfile_get_header(const struct recfile *r);
+size_t recfile_num_records(const struct recfile *r);
+int recfile_get_record(const struct recfile *r, size_t index, struct recfile_record *rec);
+void recfile_advise(const struct recfile *r, size_t first, size_t last);
+void recfile_free(struct recfile *r);
+
+/* Parameters reply field helpers */
+unsigned short recfile_param_samples(const unsigned char *params, size_t size);
+unsigned char recfile_param_channels(const unsigned char *params, size_t size);
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include "record.h"
+#include "recfile.h"
+#include "frame.h"
+
+/* Records to prefetch at a time during replay */
+#define REPLAY_ADVISE_CHUNK 256
+
+/* Raw frames are processed in place after recording, so they are
+ copied rather than referenced. Writer hands items back for reuse */
+struct record_item {
+	unsigned char type; /* RECFILE_FRAME, RECFILE_PARAMETERS, or 0 to stop writer */
+	guint64 timestamp;
+	size_t size;
+	struct record_item *next;
+	unsigned char data[FRAME_MAX_SIZE];
+};
+
+static unsigned char last_params[RECFILE_MAX_PARAMETERS];
+static size_t last_params_size;
+
+/* Protects writer and last parameters. Acquisition may run in its own
+ thread */
+G_LOCK_DEFINE_STATIC(recorder);
+
+static GAsyncQueue *queue = NULL;
+static GThread *writer = NULL;
+static gint64 start_time;
+static unsigned long dropped;
+
+/* Items written, kept across recordings */
+G_LOCK_DEFINE_STATIC(free_items);
+static struct record_item *free_items;
+
+static struct {
+	struct recfile *file;
+	size_t next;
+	gboolean realtime;
+	gint64 start;
+	guint source;
+	unsigned char *buf;
+	size_t bufsize;
+	void (*setparams)(unsigned char *params, size_t size);
+	void (*setdata)(unsigned char *data, size_t size);
+	void (*done)(void);
+} replay;
+
+static void put_item(struct record_item *item)
+{
+	G_LOCK(free_items);
+	item->next = free_items;
+	free_items = item;
+	G_UNLOCK(free_items);
+}
+
+static gpointer record_writer(gpointer data)
+{
+	struct recfile_writer *w = data;
+	struct record_item *item;
+	gboolean failed = FALSE;
+
+	for (;;) {
+		item = g_async_queue_pop(queue);
+		if (item->type==0) {
+			put_item(item);
+			break;
+		}
+		if (!failed && recfile_write(w, item->type, item->timestamp,
+									 item->data, item->size)<0) {
+			fprintf(stderr,"Cannot write recording, further frames lost\n");
+			failed = TRUE;
+		}
+		put_item(item);
+	}
+
+	if (recfile_close(w)<0)
+		fprintf(stderr,"Error closing recording\n");
+	return NULL;
+}
+
+/* Called from acquisition path with lock held. Never blocks: frames are
+ dropped if writer thread cannot keep up. Items are reused, so nothing
+ is allocated once the queue has been as deep as it gets */
+static void record_push(unsigned char type, const unsigned char *data, size_t size)
+{
+	struct record_item *item;
+
+	if (NULL==writer)
+		return;
+
+	if (type!=0 && (g_async_queue_length(queue) >= RECORD_MAX_QUEUE ||
+					size>sizeof(item->data))) {
+		dropped++;
+		return;
+	}
+
+	G_LOCK(free_items);
+	item = free_items;
+	if (item)
+		free_items = item->next;
+	G_UNLOCK(free_items);
+	if (NULL==item)
+		item = g_malloc(sizeof(*item));
+	item->type = type;
+	item->timestamp = g_get_monotonic_time() - start_time;
+	item->size = size;
+	if (size)
+		memcpy(item->data, data, size);
+	g_async_queue_push(queue, item);
+}
+
+void record_set_parameters(const unsigned char *params, size_t size)
+{
+	if (size>RECFILE_MAX_PARAMETERS)
+		size = RECFILE_MAX_PARAMETERS;
+	G_LOCK(recorder);
+	memcpy(last_params, params, size);
+	last_params_size = size;
+
+	record_push(RECFILE_PARAMETERS, params, size);
+	G_UNLOCK(recorder);
+}
+
+int record_start(const char *path, unsigned long freq)
+{
+	struct recfile_header hdr;
+	struct recfile_writer *w;
+
+	G_LOCK(recorder);
+	if (NULL!=writer) {
+		G_UNLOCK(recorder);
+		return -1;
+	}
+
+	hdr.freq = freq;
+	hdr.start_time = g_get_real_time();
+	hdr.params_size = last_params_size;
+	memcpy(hdr.params, last_params, last_params_size);
+
+	w = recfile_create(path, &hdr);
+	if (NULL==w) {
+		G_UNLOCK(recorder);
+		perror(path);
+		return -1;
+	}
+
+	if (NULL==queue)
+		queue = g_async_queue_new();
+
+	start_time = g_get_monotonic_time();
+	dropped = 0;
+	writer = g_thread_new("recorder", &record_writer, w);
+	G_UNLOCK(recorder);
+
+	fprintf(stderr,"Recording to '%s'\n", path);
+	return 0;
+}
+
+void record_frame(const unsigned char *data, size_t size)
+{
+	G_LOCK(recorder);
+	record_push(RECFILE_FRAME, data, size);
+	G_UNLOCK(recorder);
+}
+
+void record_stop(void)
+{
+	GThread *thread;
+
+	G_LOCK(recorder);
+	if (NULL==writer) {
+		G_UNLOCK(recorder);
+		return;
+	}
+	record_push(0, NULL, 0);
+	thread = writer;
+	writer = NULL;
+	G_UNLOCK(recorder);
+
+	g_thread_join(thread);
+
+	if (dropped)
+		fprintf(stderr,"Recording stopped, %lu frames dropped\n", dropped);
+	else
+		fprintf(stderr,"Recording stopped\n");
+}
+
+gboolean record_is_active(void)
+{
+	return writer!=NULL;
+}
+
+unsigned long record_get_dropped(void)
+{
+	return dropped;
+}
+
+static void replay_finish(void)
+{
+	recfile_free(replay.file);
+	replay.file = NULL;
+	if (replay.done)
+		replay.done();
+}
+
+static gboolean replay_next(gpointer data)
+{
+	struct recfile_record rec;
+	gint64 due, now;
+
+	replay.source = 0;
+
+	while (replay.next < recfile_num_records(replay.file)) {
+		if (recfile_get_record(replay.file, replay.next, &rec)<0)
+			break;
+
+		if (replay.realtime) {
+			now = g_get_monotonic_time();
+			due = replay.start + rec.timestamp;
+			if (due > now) {
+				replay.source = g_timeout_add((due - now + 999) / 1000, &replay_next, NULL);
+				return FALSE;
+			}
+		}
+
+		if (replay.next % REPLAY_ADVISE_CHUNK == 0)
+			recfile_advise(replay.file, replay.next + REPLAY_ADVISE_CHUNK,
+						   replay.next + 2*REPLAY_ADVISE_CHUNK - 1);
+		replay.next++;
+
+		/* Consumers may modify data in place, it cannot be the mapping */
+		if (rec.size > replay.bufsize) {
+			replay.buf = g_realloc(replay.buf, rec.size);
+			replay.bufsize = rec.size;
+		}
+		memcpy(replay.buf, rec.data, rec.size);
+
+		if (rec.type==RECFILE_PARAMETERS) {
+			replay.setparams(replay.buf, rec.size);
+		} else if (rec.type==RECFILE_FRAME) {
+			replay.setdata(replay.buf, rec.size);
+			if (!replay.realtime) {
+				/* Let main loop draw, then go on */
+				replay.source = g_idle_add(&replay_next, NULL);
+				return FALSE;
+			}
+		}
+	}
+
+	replay_finish();
+	return FALSE;
+}
+
+int replay_start(const char *path, gboolean realtime,
+				 void (*setparams)(unsigned char *params, size_t size),
+				 void (*setdata)(unsigned char *data, size_t size),
+				 void (*done)(void))
+{
+	const struct recfile_header *hdr;
+
+	replay_stop();
+
+	replay.file = recfile_open(path);
+	if (NULL==replay.file) {
+		fprintf(stderr,"Cannot open recording '%s'\n", path);
+		return -1;
+	}
+
+	hdr = recfile_get_header(replay.file);
+	fprintf(stderr,"Replaying '%s', %lu records\n", path,
+			(unsigned long)recfile_num_records(replay.file));
+
+	replay.setparams = setparams;
+	replay.setdata = setdata;
+	replay.done = done;
+	replay.realtime = realtime;
+	replay.next = 0;
+	replay.start = g_get_monotonic_time();
+
+	recfile_advise(replay.file, 0, 2*REPLAY_ADVISE_CHUNK - 1);
+
+	if (hdr->params_size) {
+		unsigned char params[RECFILE_MAX_PARAMETERS];
+		memcpy(params, hdr->params, hdr->params_size);
+		setparams(params, hdr->params_size);
+	}
+
+	replay.source = g_idle_add(&replay_next, NULL);
+	return 0;
+}
+
+void replay_stop(void)
+{
+	if (NULL==replay.file)
+		return;
+	if (replay.source)
+		g_source_remove(replay.source);
+	replay.source = 0;
+	replay.done = NULL;
+	replay_finish();
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <glib.h>
+
+/* Frames waiting for writer thread. Above this, frames are dropped
+ rather than slowing down acquisition */
+#define RECORD_MAX_QUEUE 4096
+
+void record_set_parameters(const unsigned char *params, size_t size);
+int record_start(const char *path, unsigned long freq);
+void record_frame(const unsigned char *data, size_t size);
+void record_stop(void);
+gboolean record_is_active(void);
+unsigned long record_get_dropped(void);
+
+int replay_start(const char *path, gboolean realtime,
+				 void (*setparams)(unsigned char *params, size_t size),
+				 void (*setdata)(unsigned char *data, size_t size),
+				 void (*done)(void));
+void replay_stop(void);
+
+#endif
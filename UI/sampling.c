@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "sampling.h"
+#include "../protocol.h"
+
+double get_sample_frequency(unsigned long freq, unsigned long prescaler)
+{
+	unsigned long adc_clock = freq / prescaler;
+	double fsample = (double)adc_clock / 13;
+	return fsample;
+}
+
+static const unsigned long timer_dividers[] = { 0, 1, 8, 64, 256, 1024 };
+
+double get_timer_sample_frequency(unsigned long freq, unsigned char clocksel, unsigned short top)
+{
+	if (clocksel==TIMER_CLOCK_NONE || clocksel>TIMER_CLOCK_DIV1024)
+		return 0;
+	return (double)freq / ((double)timer_dividers[clocksel] * ((double)top + 1));
+}
+
+/*
+ Compute timer settings for a given sample rate, and best ADC prescaler
+ (slowest ADC clock which still completes a conversion within a sample
+ period). Auto-triggered conversions take 13.5 ADC clocks.
+ */
+int get_timebase_settings(unsigned long freq, double rate, unsigned char *prescale,
+						  unsigned char *clocksel, unsigned short *top)
+{
+	unsigned char c;
+	unsigned char p;
+	double ticks;
+
+	if (rate<=0)
+		return -1;
+
+	for (c=TIMER_CLOCK_DIV1; c<=TIMER_CLOCK_DIV1024; c++) {
+		ticks = (double)freq / ((double)timer_dividers[c] * rate);
+		if (ticks<=65535.5)
+			break;
+	}
+	if (c>TIMER_CLOCK_DIV1024 || ticks<1.0)
+		return -1;
+
+	*clocksel = c;
+	*top = (unsigned short)(ticks + 0.5) - 1;
+
+	for (p=7; p>1; p--) {
+		if (13.5 * (double)(1<<p) * rate <= (double)freq)
+			break;
+	}
+	*prescale = p;
+	return 0;
+}
+
+double get_parameters_sample_frequency(unsigned long freq, const unsigned char *params,
+									   size_t size)
+{
+	if (size<4)
+		return 0;
+	if (size>PARAMETERS_LOGIC && (params[PARAMETERS_LOGIC] & LOGIC_FLAG_ENABLE) &&
+		params[8]==TIMER_CLOCK_NONE)
+		return (double)freq / LOGIC_LOOP_CYCLES;
+	if (size>=11 && params[8]!=TIMER_CLOCK_NONE)
+		return get_timer_sample_frequency(freq, params[8], (params[9]<<8) | params[10]);
+	return get_sample_frequency(freq, 1UL<<(params[3] & 0x7));
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __SAMPLING_H__
+#define __SAMPLING_H__
+
+#include <stddef.h>
+
+/* Model of target sample rate, for a given CPU frequency */
+
+double get_sample_frequency(unsigned long freq, unsigned long prescaler);
+double get_timer_sample_frequency(unsigned long freq, unsigned char clocksel, unsigned short top);
+int get_timebase_settings(unsigned long freq, double rate, unsigned char *prescale,
+						  unsigned char *clocksel, unsigned short *top);
+
+/* Sample rate from a COMMAND_PARAMETERS_REPLY payload */
+double get_parameters_sample_frequency(unsigned long freq, const unsigned char *params,
+									   size_t size);
+
+#endif
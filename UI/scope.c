@@ -17,6 +17,8 @@
  */
 
 #include "scope.h"
+#include "logic.h"
+#include "trace.h"
 #include <cairo.h>
 #include <math.h>
 #include <string.h>
@@ -26,12 +28,33 @@ G_DEFINE_TYPE (ScopeDisplay, scope_display, GTK_TYPE_DRAWING_AREA);
 static void scope_display_init (ScopeDisplay *scope)
 {
 	scope->zoom=1;
-	scope->dbuf = NULL;
+	scope->dbuf_store = g_malloc0(INGEST_MAX_SAMPLES);
+	scope->dbuf = scope->dbuf_store;
+	scope->frame = NULL;
+	scope->trace_overlay = FALSE;
+	scope->trace_set = 0;
+	scope->dbuf16 = g_malloc0(INGEST_MAX_SAMPLES*sizeof(unsigned short));
+	scope->numSamples = 0;
+	scope->hires = FALSE;
+	scope->logic = FALSE;
+	scope->planes = g_malloc0(LOGIC_CHANNELS*INGEST_MAX_SAMPLES);
+	scope->annotations = NULL;
+	scope->num_annotations = 0;
+	scope->mask = NULL;
+	scope->mask_size = 0;
+	scope->memsegs = 0;
+	scope->memseg_view = 0;
 	scope->xy = FALSE;
+	memset(scope->history, 0, sizeof(scope->history));
+	scope->history_view = FALSE;
+	scope->history_spp = 1;
+	scope->history_back = 0;
+	scope->history_columns = NULL;
+	scope->history_width = 0;
 #ifdef HAVE_DFT
 	scope->mode = MODE_NORMAL;
-	scope->dbuf_real = NULL;
-	scope->dbuf_output = NULL;
+	scope->dbuf_real = g_malloc0(INGEST_MAX_SAMPLES*sizeof(double));
+	scope->dbuf_output = g_malloc0(INGEST_MAX_SAMPLES*sizeof(double));
 #endif
 }
 
@@ -80,12 +103,287 @@ struct { double r,g,b; } colors[] = {
 	{ 0.89,0.73,0.86 }    // Channel 3
 };
 
+/* Extra traces use dimmed channel colors and dashes */
+static void draw_traces(ScopeDisplay *self, GtkWidget *scope, cairo_t *cr)
+{
+	static const double dash[] = { 4.0, 2.0 };
+	struct scope_trace *t;
+	double dim;
+	int n, i, x, start;
+	int lx, ly;
+
+	cairo_set_dash(cr, dash, 2, 0);
+
+	for (n=0; n<SCOPE_MAX_TRACES; n++) {
+		t = &self->traces[n];
+		if (NULL==t->buf || t->channels==0)
+			continue;
+		dim = 0.7 - 0.1 * n;
+
+		for (start=0; start<t->channels; start++) {
+			cairo_set_source_rgb(cr, colors[start].r * dim, colors[start].g * dim,
+								 colors[start].b * dim);
+			lx = -1;
+			ly = 0;
+			for (i=start; i<t->size; i+=t->channels) {
+				x = (i + t->offset) * (int)self->zoom;
+				if (x<0)
+					continue;
+				if (x>scope->allocation.width)
+					break;
+				if (lx>=0) {
+					cairo_move_to(cr, scope->allocation.x + lx, ly);
+					cairo_line_to(cr, scope->allocation.x + x,
+								  scope->allocation.y+scope->allocation.height - t->buf[i]);
+				}
+				lx = x;
+				ly = scope->allocation.y+scope->allocation.height - t->buf[i];
+			}
+			cairo_stroke (cr);
+		}
+	}
+	cairo_set_dash(cr, NULL, 0, 0);
+}
+
+/* One lane per line, line 0 on top. Only transitions are drawn, so
+ cost follows signal activity rather than sample count */
+static void draw_logic(ScopeDisplay *self, GtkWidget *scope, cairo_t *cr)
+{
+	double lane = (double)scope->allocation.height / LOGIC_CHANNELS;
+	double top, y[2], x;
+	const unsigned char *p;
+	gchar text[8];
+	int n, i, count;
+
+	count = self->numSamples;
+	if (self->zoom>1)
+		count = self->numSamples / self->zoom;
+	if (count<1)
+		return;
+
+	cairo_set_font_size (cr, 10);
+	for (n=0; n<LOGIC_CHANNELS; n++) {
+		top = scope->allocation.y + n * lane;
+		y[1] = top + lane * 0.2;
+		y[0] = top + lane * 0.8;
+		p = &self->planes[n * self->numSamples];
+
+		cairo_set_source_rgb(cr, colors[n % 4].r, colors[n % 4].g, colors[n % 4].b);
+		cairo_move_to(cr, scope->allocation.x, y[p[0]]);
+		for (i=1; i<count; i++) {
+			if (p[i]==p[i-1])
+				continue;
+			x = scope->allocation.x + i * self->zoom;
+			cairo_line_to(cr, x, y[p[i-1]]);
+			cairo_line_to(cr, x, y[p[i]]);
+		}
+		cairo_line_to(cr, scope->allocation.x + count * self->zoom, y[p[count-1]]);
+		cairo_stroke(cr);
+
+		sprintf(text, "D%d", n);
+		cairo_move_to(cr, scope->allocation.x + 2, top + lane * 0.55);
+		cairo_show_text(cr, text);
+	}
+}
+
+/* Sample height, with fraction if averaged */
+static inline double sample_at(const ScopeDisplay *self, int i)
+{
+	if (self->hires)
+		return (double)self->dbuf16[i] / 256.0;
+	return self->dbuf[i];
+}
+
+/* Each segment drawn from left edge. Overlaid, older segments are
+ dimmer */
+static void draw_memsegs(ScopeDisplay *self, GtkWidget *scope, cairo_t *cr)
+{
+	const struct ingest_memseg *seg;
+	double bottom = scope->allocation.y + scope->allocation.height;
+	double dim, x;
+	gchar text[48];
+	unsigned s, first, last, ch, i;
+
+	first = 0;
+	last = self->memsegs;
+	if (self->memseg_view>0 && self->memseg_view<=self->memsegs) {
+		first = self->memseg_view - 1;
+		last = first + 1;
+	}
+
+	for (s=first; s<last; s++) {
+		seg = &self->memseg[s];
+		dim = last - first > 1 ? 0.4 + 0.6 * (s + 1) / self->memsegs : 1.0;
+		for (ch=0; ch<self->channels; ch++) {
+			cairo_set_source_rgb(cr, colors[ch].r * dim, colors[ch].g * dim,
+								 colors[ch].b * dim);
+			cairo_move_to(cr, scope->allocation.x, bottom - sample_at(self, seg->start + ch));
+			for (i=ch; i<seg->length && seg->start + i<self->numSamples; i+=self->channels) {
+				x = scope->allocation.x + i * self->zoom;
+				if (x > scope->allocation.x + scope->allocation.width)
+					break;
+				cairo_line_to(cr, x, bottom - sample_at(self, seg->start + i));
+			}
+			cairo_stroke(cr);
+		}
+	}
+
+	seg = &self->memseg[last - 1];
+	if (last - first > 1)
+		sprintf(text, "%u segments, %.3f ms span", self->memsegs,
+				seg->time * 1000.0 / self->freq);
+	else
+		sprintf(text, "Segment %u/%u, +%.3f ms%s", last, self->memsegs,
+				seg->time * 1000.0 / self->freq, seg->triggered ? "" : " (auto)");
+	cairo_set_source_rgb(cr, 0.5, 1.0, 1.0);
+	cairo_set_font_size(cr, 10);
+	cairo_move_to(cr, scope->allocation.x + 4, scope->allocation.y + 12);
+	cairo_show_text(cr, text);
+}
+
+/* Envelopes in dim red, samples outside them marked bright red */
+static void draw_mask(ScopeDisplay *self, GtkWidget *scope, cairo_t *cr)
+{
+	const unsigned char *env[2], *bad;
+	double bottom = scope->allocation.y + scope->allocation.height;
+	double x;
+	size_t n, i, count;
+	int e;
+
+	count = MIN(self->mask_size, self->numSamples / self->zoom);
+	env[0] = self->mask;
+	env[1] = self->mask + self->mask_size;
+	bad = self->mask + 2 * self->mask_size;
+
+	cairo_set_source_rgb(cr, 0.5, 0.1, 0.1);
+	for (e=0; e<2; e++) {
+		cairo_move_to(cr, scope->allocation.x, bottom - env[e][0]);
+		for (i=1; i<count; i++)
+			cairo_line_to(cr, scope->allocation.x + i * self->zoom, bottom - env[e][i]);
+		cairo_stroke(cr);
+	}
+
+	/* Translucent, so trace stays visible under marks */
+	cairo_set_source_rgba(cr, 1.0, 0.0, 0.0, 0.4);
+	for (n=0; n<count; n++) {
+		if (!bad[n])
+			continue;
+		x = scope->allocation.x + n * self->zoom;
+		cairo_rectangle(cr, x - 1, scope->allocation.y, 3, scope->allocation.height);
+	}
+	cairo_fill(cr);
+}
+
+/* Boxes along top, one row per bus. Text is dropped when box is too
+ narrow for it */
+static void draw_annotations(ScopeDisplay *self, GtkWidget *scope, cairo_t *cr)
+{
+	const double row = 14.0;
+	const struct scope_annotation *a;
+	cairo_text_extents_t te;
+	double x0, x1, y, scale;
+	size_t n;
+
+	scale = self->zoom * (self->logic ? 1 : self->channels);
+
+	cairo_set_font_size (cr, 10);
+	for (n=0; n<self->num_annotations; n++) {
+		a = &self->annotations[n];
+		x0 = scope->allocation.x + a->start * scale;
+		x1 = scope->allocation.x + (a->end + 1) * scale;
+		if (x0 > scope->allocation.x + scope->allocation.width)
+			continue;
+		y = scope->allocation.y + 2 + a->row * row;
+
+		cairo_set_source_rgb(cr, 0.2, 0.2, 0.5);
+		cairo_rectangle(cr, x0, y, x1 - x0, row - 2);
+		cairo_fill_preserve(cr);
+		cairo_set_source_rgb(cr, 0.6, 0.6, 1.0);
+		cairo_stroke(cr);
+
+		cairo_text_extents(cr, a->text, &te);
+		if (te.width + 4 > x1 - x0)
+			continue;
+		cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+		cairo_move_to(cr, (x0 + x1 - te.width) / 2, y + row - 5);
+		cairo_show_text(cr, a->text);
+	}
+}
+
+/* Window of history shown, in samples per channel. Same for all
+ channels, as they get the same number of samples */
+static uint64_t history_window(const ScopeDisplay *self, int width, uint64_t *start)
+{
+	const struct history *h = self->history[0];
+	uint64_t first = history_first(h), end = history_end(h);
+	uint64_t span = MAX(2, (uint64_t)(self->history_spp * width));
+	uint64_t back = 0;
+
+	if (end - first>span)
+		back = self->history_back * (end - first - span);
+	*start = end - back>span + first ? end - back - span : first;
+	return span;
+}
+
+/* Long history, reduced to one min/max column per pixel, or drawn as
+ samples once zoomed in past one sample per pixel */
+static void draw_history(ScopeDisplay *self, GtkWidget *scope, cairo_t *cr)
+{
+	int width = scope->allocation.width;
+	double bottom = scope->allocation.y + scope->allocation.height;
+	unsigned char *min, *max;
+	uint64_t start, span, avail;
+	size_t n, i;
+	double x, w;
+	int c;
+
+	if (width!=self->history_width) {
+		g_free(self->history_columns);
+		self->history_columns = g_malloc(2 * width);
+		self->history_width = width;
+	}
+	min = self->history_columns;
+	max = min + width;
+	/* Short history only covers part of width, at the same scale */
+	span = history_window(self, width, &start);
+	avail = MIN(span, history_end(self->history[0]) - start);
+	w = (double)width * avail / span;
+	for (c=0; c<self->channels && c<SCOPE_HISTORY_CHANNELS; c++) {
+		n = history_render(self->history[c], start, avail, min, max, MAX(1, (size_t)w));
+		if (n==0)
+			continue;
+		cairo_set_source_rgb(cr, colors[c].r, colors[c].g, colors[c].b);
+		for (i=0; i<n; i++) {
+			x = scope->allocation.x + i * w / n;
+			if (n==avail) {
+				/* One sample per column */
+				if (i==0)
+					cairo_move_to(cr, x, bottom - min[i]);
+				else
+					cairo_line_to(cr, x, bottom - min[i]);
+			} else {
+				/* Join columns, so fast edges are not gaps */
+				if (i>0 && min[i]>max[i-1])
+					cairo_move_to(cr, x, bottom - max[i-1]);
+				else if (i>0 && max[i]<min[i-1])
+					cairo_move_to(cr, x, bottom - min[i-1]);
+				else
+					cairo_move_to(cr, x, bottom - min[i]);
+				cairo_line_to(cr, x, bottom - max[i]);
+				if (min[i]==max[i])
+					cairo_line_to(cr, x + 1, bottom - max[i]);
+			}
+		}
+		cairo_stroke(cr);
+	}
+}
+
 static void draw(GtkWidget *scope, cairo_t *cr)
 {
 	ScopeDisplay *self = SCOPE_DISPLAY(scope);
 	int i;
 	int lx=scope->allocation.x;
-	int ly=scope->allocation.y+scope->allocation.height;
+	double ly=scope->allocation.y+scope->allocation.height;
 	cairo_text_extents_t te;
 	cairo_font_extents_t fe;
 	double vtextpos;
@@ -124,7 +422,11 @@ static void draw(GtkWidget *scope, cairo_t *cr)
 	}
 
 #else
-	if (NULL!=self->dbuf) {
+	if (self->history_view && !self->logic && self->channels) {
+		draw_history(self, scope, cr);
+	} else if (self->logic && NULL!=self->planes && self->numSamples>0) {
+		draw_logic(self, scope, cr);
+	} else if (NULL!=self->dbuf) {
 
 		if (self->xy && self->channels == 2) {
 
@@ -133,15 +435,17 @@ static void draw(GtkWidget *scope, cairo_t *cr)
 
 			for (i=0; i<self->numSamples; i+=2) {
 				cairo_move_to(cr,
-							  lx + ((int)self->dbuf[i])-127 ,
-							  ly + ((int)self->dbuf[i+1])-127
+							  lx + sample_at(self, i)-127 ,
+							  ly + sample_at(self, i+1)-127
 							 );
 				lx=scope->allocation.x + i*self->zoom;
-				ly=scope->allocation.y+scope->allocation.height - self->dbuf[i];
+				ly=scope->allocation.y+scope->allocation.height - sample_at(self, i);
 				cairo_line_to(cr,lx,ly);
 			}
 			cairo_stroke (cr);
 
+		} else if (self->memsegs>1 && self->channels) {
+			draw_memsegs(self, scope, cr);
 		} else {
 			int start;
 			for (start=0; start<self->channels; start++) {
@@ -154,13 +458,19 @@ static void draw(GtkWidget *scope, cairo_t *cr)
 				for (i=start; i<self->numSamples/self->zoom; i+=self->channels) {
 					cairo_move_to(cr,lx,ly);
 					lx=scope->allocation.x + i*self->zoom;
-					ly=scope->allocation.y+scope->allocation.height - self->dbuf[i];
+					ly=scope->allocation.y+scope->allocation.height - sample_at(self, i);
 					cairo_line_to(cr,lx,ly);
 				}
 				cairo_stroke (cr);
 			}
 		}
 	}
+	if (!self->logic && !self->history_view && self->mask_size)
+		draw_mask(self, scope, cr);
+	if (!self->logic && !self->history_view)
+		draw_traces(self, scope, cr);
+	if (self->num_annotations && self->channels && !self->history_view)
+		draw_annotations(self, scope, cr);
 
 #endif
 
@@ -170,7 +480,13 @@ static void draw(GtkWidget *scope, cairo_t *cr)
 							CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
 
 	double tdiv = (double)self->numSamples*100.0 / self->freq;
-	sprintf(text,"tDiv: %.02fms", tdiv / (double)self->zoom);
+	if (self->history_view && !self->logic && self->channels) {
+		uint64_t start, span = history_window(self, scope->allocation.width, &start);
+		tdiv = (double)span * self->channels * 100.0 / self->freq;
+		sprintf(text,"tDiv: %.02fms", tdiv);
+	} else {
+		sprintf(text,"tDiv: %.02fms", tdiv / (double)self->zoom);
+	}
 	cairo_font_extents(cr, &fe);
 	cairo_text_extents(cr, text, &te);
 
@@ -204,61 +520,138 @@ void scope_display_set_zoom(GtkWidget *scope, unsigned int zoom)
 	self->zoom=zoom;
 	gtk_widget_queue_draw(scope);
 }
+static void history_reset_all(ScopeDisplay *self)
+{
+	int c;
+
+	for (c=0; c<SCOPE_HISTORY_CHANNELS; c++)
+		if (self->history[c])
+			history_reset(self->history[c]);
+}
+
 void scope_display_set_sample_freq(GtkWidget *scope, double freq)
 {
 	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+	/* History only makes sense at one rate */
+	if (freq!=self->freq)
+		history_reset_all(self);
 	self->freq=freq;
 }
 
 void scope_display_set_samples(GtkWidget *scope, unsigned short numSamples)
 {
 	ScopeDisplay *self = SCOPE_DISPLAY(scope);
-	if (self->dbuf)
-		g_free(self->dbuf);
-	self->dbuf = (unsigned char*)g_malloc(numSamples);
-	self->numSamples = numSamples;
+
+	if (numSamples>INGEST_MAX_SAMPLES)
+		numSamples = INGEST_MAX_SAMPLES;
+	self->hires = FALSE;
+	memset(self->planes, 0, LOGIC_CHANNELS*numSamples);
 #ifdef HAVE_DFT
-	if(self->dbuf_real)
-		g_free(self->dbuf_real);
-	self->dbuf_real = g_malloc(numSamples*sizeof(double));
+	if (numSamples!=self->numSamples) {
+		if (self->numSamples)
+			fftw_destroy_plan(self->plan);
+		self->plan = fftw_plan_r2r_1d(numSamples, self->dbuf_real, self->dbuf_output,
+									  FFTW_REDFT01, 0);
+	}
+#endif
+	self->numSamples = numSamples;
+}
 
-	if(self->dbuf_output)
-		g_free(self->dbuf_output);
-	self->dbuf_output = g_malloc(numSamples*sizeof(double));
+/* Back to our own buffer, e.g. to write averaged samples */
+static void own_dbuf(ScopeDisplay *self)
+{
+	if (self->frame) {
+		memcpy(self->dbuf_store, self->dbuf, self->numSamples);
+		frame_unref(self->frame);
+		self->frame = NULL;
+	}
+	self->dbuf = self->dbuf_store;
+}
 
-	self->plan = fftw_plan_r2r_1d(numSamples, self->dbuf_real, self->dbuf_output,
-								  FFTW_REDFT01, 0);
+void scope_display_set_data(GtkWidget *scope, unsigned char *data, size_t size)
+{
+	scope_display_set_frame(scope, NULL, data, size);
+}
 
+void scope_display_set_frame(GtkWidget *scope, struct frame *frame,
+							 unsigned char *data, size_t size)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+	uint64_t t = trace_now();
+#ifdef HAVE_DFT
+	uint64_t tf;
+	unsigned long sum=0;
+	double dc;
+	int i;
 #endif
 
+	self->hires = FALSE;
+	self->trace_frame = trace_get_frame();
+	if (self->logic) {
+		logic_decode(data, MIN(size, self->numSamples), self->planes, self->numSamples);
+		gtk_widget_queue_draw(scope);
+		return;
+	}
+	if (self->history[0] && self->channels) {
+		int c;
+		for (c=0; c<self->channels && c<SCOPE_HISTORY_CHANNELS; c++)
+			history_append_channel(self->history[c], data, MIN(size, self->numSamples),
+								   c, self->channels);
+	}
+	if (frame && size>=self->numSamples) {
+		/* Whole frame, shown from where it was received */
+		frame_ref(frame);
+		if (self->frame)
+			frame_unref(self->frame);
+		self->frame = frame;
+		self->dbuf = data;
+	} else {
+		own_dbuf(self);
+		memcpy(self->dbuf, data, MIN(size, self->numSamples));
+	}
+#ifdef HAVE_DFT
+	for (i=0; i<size && i<self->numSamples; i++)
+		sum+=data[i];
+	dc = (double)sum / (double)self->numSamples;
 
+	for (i=0; i<size && i<self->numSamples; i++)
+		self->dbuf_real[i] = ((double)data[i]) - dc;
+	tf = trace_now();
+	fftw_execute(self->plan);
+	trace_span(TRACE_FFT, tf, trace_now(), self->trace_frame);
+#endif
+	self->trace_set = trace_now();
+	trace_span(TRACE_SET_DATA, t, self->trace_set, self->trace_frame);
+	gtk_widget_queue_draw(scope);
 }
 
-void scope_display_set_data(GtkWidget *scope, unsigned char *data, size_t size)
+/* Averaged frame, 8.8 fixed point (AVERAGE_ONE is 1.0) */
+void scope_display_set_data16(GtkWidget *scope, const unsigned short *data, size_t size)
 {
 	ScopeDisplay *self = SCOPE_DISPLAY(scope);
-	unsigned char *d = data;
+	int i;
 #ifdef HAVE_DFT
 	unsigned long sum=0;
 	double dc;
 #endif
 
-	int i;
-	for (i=0; i<size && i<self->numSamples; i++) {
-		self->dbuf[i] = *d;
+	if (size>self->numSamples)
+		size = self->numSamples;
+	memcpy(self->dbuf16, data, size*sizeof(unsigned short));
+	self->hires = TRUE;
+	own_dbuf(self);
+	for (i=0; i<size; i++) {
+		/* Rounded, for code that wants 8 bits */
+		self->dbuf[i] = MIN((data[i] + 128) >> 8, 255);
 #ifdef HAVE_DFT
-		sum+=*d;
+		sum+=data[i];
 #endif
-		d++;
 	}
 #ifdef HAVE_DFT
-	d = data;
 	dc = (double)sum / (double)self->numSamples;
 
-	for (i=0; i<size && i<self->numSamples; i++) {
-		self->dbuf_real[i] = ((double)*d ) - dc;
-		d++;
-	}
+	for (i=0; i<size; i++)
+		self->dbuf_real[i] = ((double)data[i] - dc) / 256.0;
 	fftw_execute(self->plan);
 #endif
 	gtk_widget_queue_draw(scope);
@@ -276,12 +669,175 @@ void scope_display_set_channels(GtkWidget *scope, unsigned char channels)
 {
 	ScopeDisplay *self = SCOPE_DISPLAY(scope);
 
+	if (channels!=self->channels)
+		history_reset_all(self);
 	self->channels=channels;
 	gtk_widget_queue_draw(scope);
 
 }
+/* Show frames as logic analyzer lines instead of analog traces */
+void scope_display_set_logic(GtkWidget *scope, gboolean logic)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	self->logic = logic;
+	gtk_widget_queue_draw(scope);
+}
+
+void scope_display_set_trace(GtkWidget *scope, int index, const unsigned char *data,
+							 size_t size, unsigned char channels)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+	struct scope_trace *t;
+
+	if (index<0 || index>=SCOPE_MAX_TRACES)
+		return;
+	t = &self->traces[index];
+
+	if (size!=t->size) {
+		g_free(t->buf);
+		t->buf = size ? g_malloc(size) : NULL;
+		t->size = size;
+	}
+	if (size)
+		memcpy(t->buf, data, size);
+	t->channels = channels;
+	gtk_widget_queue_draw(scope);
+}
+
+void scope_display_set_trace_offset(GtkWidget *scope, int index, int offset)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	if (index<0 || index>=SCOPE_MAX_TRACES)
+		return;
+	self->traces[index].offset = offset;
+}
+
+/* Memory segments of next frame. count 0 for unsegmented frames */
+void scope_display_set_memsegs(GtkWidget *scope, const struct ingest_memseg *seg,
+							   unsigned count)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	if (count>MEMSEG_MAX)
+		count = MEMSEG_MAX;
+	memcpy(self->memseg, seg, count * sizeof(*seg));
+	self->memsegs = count;
+}
+
+/* Segment to show, 1-based, or 0 to overlay all */
+void scope_display_set_memseg_view(GtkWidget *scope, unsigned view)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	self->memseg_view = view;
+	gtk_widget_queue_draw(scope);
+}
+
+/* Mask test result for frame shown. size 0 hides mask */
+void scope_display_set_mask(GtkWidget *scope, const unsigned char *lower,
+							const unsigned char *upper, const unsigned char *violations,
+							size_t size)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	if (size!=self->mask_size) {
+		g_free(self->mask);
+		self->mask = size ? g_malloc(3 * size) : NULL;
+		self->mask_size = size;
+	}
+	if (size) {
+		memcpy(self->mask, lower, size);
+		memcpy(self->mask + size, upper, size);
+		memcpy(self->mask + 2 * size, violations, size);
+	}
+	gtk_widget_queue_draw(scope);
+}
+
+/* Replace annotations, usually once per frame */
+void scope_display_set_annotations(GtkWidget *scope, const struct scope_annotation *a,
+								   size_t count)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	if (count!=self->num_annotations) {
+		g_free(self->annotations);
+		self->annotations = count ? g_malloc(count * sizeof(*a)) : NULL;
+		self->num_annotations = count;
+	}
+	if (count)
+		memcpy(self->annotations, a, count * sizeof(*a));
+	gtk_widget_queue_draw(scope);
+}
+
+int scope_display_set_history(GtkWidget *scope, gboolean enable)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+	int c;
+
+	for (c=0; c<SCOPE_HISTORY_CHANNELS; c++) {
+		if (enable && NULL==self->history[c]) {
+			self->history[c] = history_new(SCOPE_HISTORY_BITS);
+			if (NULL==self->history[c]) {
+				scope_display_set_history(scope, FALSE);
+				return -1;
+			}
+		} else if (!enable && self->history[c]) {
+			history_free(self->history[c]);
+			self->history[c] = NULL;
+		}
+	}
+	if (!enable) {
+		g_free(self->history_columns);
+		self->history_columns = NULL;
+		self->history_width = 0;
+	}
+	self->history_view = enable;
+	gtk_widget_queue_draw(scope);
+	return 0;
+}
+
+void scope_display_set_history_view(GtkWidget *scope, double spp, double back)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	self->history_spp = spp;
+	self->history_back = back;
+	gtk_widget_queue_draw(scope);
+}
+
+/* Top right, below tDiv and fMax */
+static void draw_trace_overlay(GtkWidget *scope, cairo_t *cr)
+{
+	unsigned stage, p50, p99;
+	double y = scope->allocation.y + 12;
+	gchar text[64];
+
+	cairo_set_source_rgb(cr, 0.5, 1.0, 1.0);
+	cairo_set_font_size(cr, 10);
+	for (stage=0; stage<TRACE_STAGES; stage++) {
+		if (trace_percentiles(stage, &p50, &p99)==0)
+			continue;
+		sprintf(text, "%-10s p50 %6u us  p99 %6u us", trace_stage_name(stage), p50, p99);
+		cairo_move_to(cr, scope->allocation.x + scope->allocation.width - 230, y);
+		cairo_show_text(cr, text);
+		y += 12;
+	}
+}
+
+void scope_display_set_trace_overlay(GtkWidget *scope, gboolean show)
+{
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+
+	self->trace_overlay = show;
+	gtk_widget_queue_draw(scope);
+}
+
 static gboolean scope_display_expose(GtkWidget *scope, GdkEventExpose *event)
 {
+	ScopeDisplay *self = SCOPE_DISPLAY(scope);
+	uint64_t t = trace_now();
 	cairo_t *cr;
 	/* get a cairo_t */
 	cr = gdk_cairo_create (scope->window);
@@ -292,8 +848,16 @@ static gboolean scope_display_expose(GtkWidget *scope, GdkEventExpose *event)
 	cairo_clip (cr);
 
 	draw (scope, cr);
+	if (self->trace_overlay)
+		draw_trace_overlay(scope, cr);
 
 	cairo_destroy (cr);
+	if (t && self->trace_set) {
+		/* Only first expose after new data counts */
+		trace_span(TRACE_PAINT_WAIT, self->trace_set, t, self->trace_frame);
+		trace_span(TRACE_PAINT, t, trace_now(), self->trace_frame);
+		self->trace_set = 0;
+	}
 	return FALSE;
 }
 
@@ -20,11 +20,39 @@
 #define __SCOPE_H__
 
 #include <gtk/gtk.h>
+#include "ingest.h"
+#include "frame.h"
+#include "history.h"
+#include "../protocol.h"
 
 #ifdef HAVE_DFT
 #include <fftw3.h>
 #endif
 
+/* Extra traces, from additional devices */
+#define SCOPE_MAX_TRACES 4
+
+struct scope_trace {
+	unsigned char *buf;
+	size_t size;
+	unsigned char channels;
+	int offset; /* In samples, relative to main trace */
+};
+
+/* Channels kept in history view, and samples kept per channel, as
+ power of two (4M samples, about 4.7 MB each) */
+#define SCOPE_HISTORY_CHANNELS 4
+#define SCOPE_HISTORY_BITS 22
+
+/* Decoded bus events, drawn over samples. start and end are sample
+ indexes within channel (or logic sample indexes), row is bus */
+struct scope_annotation {
+	unsigned start;
+	unsigned end;
+	unsigned char row;
+	gchar text[32];
+};
+
 typedef struct _ScopeDisplay ScopeDisplay;
 typedef struct _ScopeDisplayClass       ScopeDisplayClass;
 
@@ -32,13 +60,48 @@ struct _ScopeDisplay
 {
 	GtkDrawingArea parent;
 	/* private */
+	/* Samples shown: in frame, which we hold a reference to, or in
+	 dbuf_store. Buffers are allocated once, for INGEST_MAX_SAMPLES */
 	unsigned char *dbuf;
+	unsigned char *dbuf_store;
+	struct frame *frame;
+	/* Latency overlay, see trace.h. Frame shown, and when it was set */
+	gboolean trace_overlay;
+	unsigned long trace_frame;
+	guint64 trace_set;
+	/* Averaged samples, 8.8 fixed point. Drawn instead of dbuf if hires */
+	unsigned short *dbuf16;
+	gboolean hires;
+	/* Logic analyzer frames: bit-planes, LOGIC_CHANNELS * numSamples */
+	gboolean logic;
+	unsigned char *planes;
+	struct scope_annotation *annotations;
+	size_t num_annotations;
+	/* Mask test: lower, upper envelopes and violations, mask_size each */
+	unsigned char *mask;
+	size_t mask_size;
+	/* Memory segments of frame shown. memseg_view 0 overlays them all,
+	 otherwise shows that one (1-based) */
+	struct ingest_memseg memseg[MEMSEG_MAX];
+	unsigned memsegs;
+	unsigned memseg_view;
+	/* History of frames, one per channel, when enabled. History view
+	 shows history_spp samples per pixel, history_back of the way from
+	 newest samples to oldest. Columns hold min then max of each
+	 pixel, history_width of each, and follow widget width */
+	struct history *history[SCOPE_HISTORY_CHANNELS];
+	gboolean history_view;
+	double history_spp;
+	double history_back;
+	unsigned char *history_columns;
+	int history_width;
 	unsigned short numSamples;
 	unsigned char tlevel;
 	unsigned int zoom;
 	unsigned char channels;
 	gboolean xy;
 	double freq;
+	struct scope_trace traces[SCOPE_MAX_TRACES];
 #ifdef HAVE_DFT
 	double *dbuf_real;
 	double *dbuf_output;
@@ -62,10 +125,34 @@ struct _ScopeDisplayClass
 
 GtkWidget *scope_display_new (void);
 void scope_display_set_data(GtkWidget *scope, unsigned char *data, size_t size);
+/* Show p50/p99 latency per stage while tracing */
+void scope_display_set_trace_overlay(GtkWidget *scope, gboolean show);
+/* Same, keeping a reference to frame, which holds data, instead of a copy */
+void scope_display_set_frame(GtkWidget *scope, struct frame *frame,
+							 unsigned char *data, size_t size);
+void scope_display_set_data16(GtkWidget *scope, const unsigned short *data, size_t size);
 void scope_display_set_trigger_level(GtkWidget *scope, unsigned char level);
 void scope_display_set_zoom(GtkWidget *scope, unsigned int zoom);
 void scope_display_set_samples(GtkWidget *scope, unsigned short numSamples);
 void scope_display_set_sample_freq(GtkWidget *scope, double freq);
 void scope_display_set_channels(GtkWidget *scope, unsigned char);
+void scope_display_set_logic(GtkWidget *scope, gboolean logic);
+void scope_display_set_trace(GtkWidget *scope, int index, const unsigned char *data,
+							 size_t size, unsigned char channels);
+void scope_display_set_trace_offset(GtkWidget *scope, int index, int offset);
+void scope_display_set_memsegs(GtkWidget *scope, const struct ingest_memseg *seg,
+								unsigned count);
+void scope_display_set_memseg_view(GtkWidget *scope, unsigned view);
+void scope_display_set_annotations(GtkWidget *scope, const struct scope_annotation *a,
+								   size_t count);
+void scope_display_set_mask(GtkWidget *scope, const unsigned char *lower,
+							const unsigned char *upper, const unsigned char *violations,
+							size_t size);
+/* Keep history of analog frames, and show it instead of last frame.
+ Returns -1 if history cannot be allocated */
+int scope_display_set_history(GtkWidget *scope, gboolean enable);
+/* History samples per pixel (below 1 zooms in), and position, from 0
+ following newest samples to 1 at oldest */
+void scope_display_set_history_view(GtkWidget *scope, double spp, double back);
 
 #endif
@@ -16,30 +16,125 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <termios.h>
-#include <unistd.h>
-#include <fcntl.h>
+
 #include <stdio.h>
-#include <stdlib.h>
-#include <glib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <glib.h>
 #include "serial.h"
-#include "../protocol.h"
+#include "acq.h"
+#include "record.h"
+#include "server.h"
+#include "shmring.h"
+#include "sampling.h"
+#include "filter.h"
+#include "average.h"
+#include "decode.h"
+#include "mask.h"
+
+/* glib glue around the acquisition core. All devices are read by a
+ single epoll thread; results are marshalled to the main loop. Device 0
+ is the main one: it drives the display settings, recording, stats and
+ single shot. */
+
+/* Frames per device waiting for main loop. Above this, frames are
+ dropped so a slow UI cannot grow the queue */
+#define SERIAL_MAX_PENDING 4
+
+/* Data an event carries: decoded events are the largest. Averages
+ (INGEST_MAX_SAMPLES shorts), masks (3 * INGEST_MAX_SAMPLES), frames
+ copied when the pool is empty and parameters are smaller */
+#define SERIAL_EVENT_DATA (DECODE_MAX_EVENTS * sizeof(struct decode_event))
+
+struct serial_device {
+	struct acq *acq;
+	int index;
+	/* Held by reader thread while processing input, and by main loop
+	 while sending commands. acq is not thread-safe */
+	GMutex lock;
+	gint pending;
+	unsigned long dropped;
+	struct filter_bank *filter;
+	struct average *average;
+	struct decoder *decoder;
+	struct mask *mask;
+};
 
-static int fd = -1;
+enum serial_event_type {
+	EVENT_PARAMETERS,
+	EVENT_FRAME,
+	EVENT_AVERAGE,
+	EVENT_DECODE,
+	EVENT_MASK,
+	EVENT_STATS,
+	EVENT_TRIGGER_DONE
+};
 
-static GIOChannel *channel;
-static gint watcher;
-static gboolean in_request;
-static gboolean freeze = FALSE;
-static gboolean delay_request = FALSE;
-static gboolean is_trigger_invert;
+struct serial_event {
+	enum serial_event_type type;
+	struct serial_device *dev;
+	gint64 arrival;
+	unsigned char channels;
+	unsigned char logic;
+	unsigned long frame_no;
+	union {
+		struct acq_parameters params;
+		struct acq_stats stats;
+		struct {
+			unsigned count;
+			struct ingest_memseg seg[MEMSEG_MAX];
+		} memseg;
+		struct {
+			struct mask_stats stats;
+			int failed;
+			int frozen;
+		} mask;
+	} u;
+	/* Frame events reference a pool frame, and point into it. Others
+	 carry their data */
+	struct frame *frame;
+	unsigned char *payload;
+	size_t size;
+	/* In event queue, or free list */
+	struct serial_event *next;
+	unsigned char data[SERIAL_EVENT_DATA];
+};
+
+static struct serial_device devices[SERIAL_MAX_DEVICES];
+static int num_devices = 0;
+static int epfd = -1;
+static int wakefd = -1;
+/* Events for main loop, in order, and eventfd its watch waits on */
+static GMutex queue_lock;
+static struct serial_event *queue_head = NULL, *queue_tail = NULL;
+static int notifyfd = -1;
+static GThread *reader = NULL;
+static struct server *server = NULL;
+static struct shmring *shm = NULL;
+static unsigned long shm_freq;
+static const char *filter_spec;
+static unsigned long filter_clock;
+static unsigned average_frames;
+static int average_exp;
+static const char *decoder_spec;
+static unsigned long decoder_clock;
+static const char *mask_spec;
+static gboolean mask_stop;
+static double shm_rate;
+
+#define FOR_EACH_DEVICE(d) for (d=devices; d<devices+num_devices; d++)
 
 #ifdef STANDALONE
 GMainLoop *loo;
 #endif
 
-static void (*sdata)(unsigned char *data,size_t size);
+static void (*sdata)(unsigned char *data,size_t size,struct frame *frame);
+static void (*savg)(const unsigned short *data,size_t size);
+static void (*sdecoded)(const struct decode_event *ev,size_t count);
+static serial_mask_cb smask;
 static void (*oneshot_cb)(void*) = NULL;
 void *oneshot_cb_data;
 
@@ -49,370 +144,787 @@ extern void scope_got_parameters(unsigned char triggerLevel,
 								 unsigned char prescale,
 								 unsigned short numSamples,
 								 unsigned char flags,
-								 unsigned char numChannels);
-
-void sendchar(int i) {
-	char t = i &0xff;
-	gsize written;
-	GError *error = NULL;
-	g_io_channel_write_chars(channel,&t,sizeof(t),&written,&error);
-}
+								 unsigned char numChannels,
+								 unsigned char timerClock,
+								 unsigned short timerTop,
+								 unsigned char logicFlags,
+								 unsigned char memsegs,
+								 const struct trigger_mode *trig);
 
-void send_packet(unsigned char command, unsigned char *buf, unsigned short size)
-{
-	unsigned char cksum=0;
-	unsigned char i;
-	GError *error = NULL;
+extern void scope_got_stats(const struct acq_stats *stats);
 
-	size++;
-	if (size>127) {
-		size |= 0x8000; // Set MSBit on MSB
-		cksum^= (size>>8);
-		sendchar((size>>8)&0xff);
-		size &= 0x7FFF;
-	}
-	cksum^=(size&0xff);
-	sendchar(size&0xff);
+extern void scope_got_memsegs(const struct ingest_memseg *seg, unsigned count);
 
-	sendchar(command);
-	cksum^=(unsigned char)command;
+extern void scope_got_trace(int device, unsigned char *data, size_t size,
+							unsigned char channels, gint64 arrival);
 
-	size--;
+static void got_parameters(const struct acq_parameters *p)
+{
+	struct trigger_mode trig;
+
+	trig.mode = p->triggerMode;
+	trig.level2 = p->triggerLevel2;
+	trig.param = p->triggerParam;
+	scope_got_parameters(p->triggerLevel, p->holdoffSamples, p->adcref,
+						 p->prescale, p->numSamples, p->flags, p->channels,
+						 p->timerClock, p->timerTop, p->logicFlags, p->memsegs,
+						 &trig);
+	printf("Num samples: %d\n", p->numSamples);
+	printf("Channels: %d \n", p->channels);
+}
 
-	for (i=0;i<size;i++) {
-		cksum^=buf[i];
-		sendchar(buf[i]);
-	}
+void serial_process_parameters(unsigned char *buf, size_t size)
+{
+	struct acq_parameters params;
 
-	//printf("Sending cksum %u\n",cksum);
-	sendchar(cksum);
-	g_io_channel_flush(channel,&error);
+	if (acq_parse_parameters(buf, size, &params)==0)
+		got_parameters(&params);
 }
 
-enum packetstate {
-	SIZE,
-	SIZE2,
-	COMMAND,
-	PAYLOAD,
-	CKSUM
-};
-
+static void init_event(struct serial_event *ev, struct serial_device *dev,
+					   enum serial_event_type type)
+{
+	ev->type = type;
+	ev->dev = dev;
+	ev->arrival = g_get_monotonic_time();
+	ev->channels = dev->acq->channels;
+	ev->logic = dev->acq->logic;
+	ev->frame_no = dev->acq->frames;
+}
 
-enum mystate {
-	PING,
-	GETVERSION,
-	GETPARAMETERS,
-	SAMPLING
-};
+/* Events are all the same size, and recycled: once as many are
+ allocated as are ever in flight, none is */
+static GMutex free_events_lock;
+static struct serial_event *free_events = NULL;
 
-static enum mystate state = PING;
+static struct serial_event *get_event(struct serial_device *dev,
+									  enum serial_event_type type)
+{
+	struct serial_event *ev;
+
+	g_mutex_lock(&free_events_lock);
+	ev = free_events;
+	if (ev)
+		free_events = ev->next;
+	g_mutex_unlock(&free_events_lock);
+	if (NULL==ev)
+		ev = g_malloc(sizeof(*ev));
+	init_event(ev, dev, type);
+	ev->frame = NULL;
+	ev->payload = ev->data;
+	ev->size = 0;
+	return ev;
+}
 
-void process_packet(unsigned char command, unsigned char *buf, unsigned short size)
+static void put_event(struct serial_event *ev)
 {
-	unsigned short ns;
+	if (ev->frame)
+		frame_unref(ev->frame);
+	ev->frame = NULL;
+	g_mutex_lock(&free_events_lock);
+	ev->next = free_events;
+	free_events = ev;
+	g_mutex_unlock(&free_events_lock);
+}
 
-	if (command==COMMAND_PARAMETERS_REPLY) {
-		ns = buf[4] << 8;
-		ns += buf[5];
+/* Event carrying a copy of data. NULL if it does not fit, which limits
+ above rule out */
+static struct serial_event *new_event(struct serial_device *dev,
+									  enum serial_event_type type,
+									  const unsigned char *data, size_t size)
+{
+	struct serial_event *ev;
+
+	if (size>SERIAL_EVENT_DATA)
+		return NULL;
+	ev = get_event(dev, type);
+	ev->size = size;
+	/* No data means caller fills it in */
+	if (size && data)
+		memcpy(ev->data, data, size);
+	return ev;
+}
 
-		is_trigger_invert = buf[6] & FLAG_INVERT_TRIGGER;
+static struct serial_event *get_frame_event(struct serial_device *dev,
+											struct frame *frame,
+											unsigned char *data, size_t size)
+{
+	struct serial_event *ev = get_event(dev, EVENT_FRAME);
 
-		scope_got_parameters(buf[0],buf[1],buf[2],buf[3],ns,buf[6],buf[7]);
-		printf("Num samples: %d %d %d \n", ns, buf[4],buf[5]);
-		printf("Channels: %d \n",buf[7]);
-	}
+	ev->frame = frame_ref(frame);
+	ev->payload = data;
+	ev->size = size;
+	return ev;
+}
 
-	switch(state) {
+/* Hand event to main loop. Only going from empty queue wakes it up, it
+ takes all queued events at once */
+static void queue_event(struct serial_event *ev)
+{
+	guint64 one = 1;
+	int wake;
+
+	ev->next = NULL;
+	g_mutex_lock(&queue_lock);
+	wake = NULL==queue_head;
+	if (queue_tail)
+		queue_tail->next = ev;
+	else
+		queue_head = ev;
+	queue_tail = ev;
+	g_mutex_unlock(&queue_lock);
+	if (wake && write(notifyfd, &one, sizeof(one))<0)
+		perror("write");
+}
 
-	case PING:
-		if (command==COMMAND_PONG) {
-			printf("Got ping reply\n");
-			/* Request version */
-			send_packet(COMMAND_GET_VERSION,NULL,0);
-            state = GETVERSION;
+/* Main loop side */
+static void deliver_event(struct serial_event *ev)
+{
+	int index = ev->dev->index;
+	size_t size;
+
+	switch (ev->type) {
+	case EVENT_PARAMETERS:
+		if (index==0) {
+			ev->u.params.raw = ev->data;
+			got_parameters(&ev->u.params);
 		}
 		break;
-	case GETVERSION:
-		if (command==COMMAND_VERSION_REPLY) {
-			printf("Got version: OSCOPE %d.%d\n", buf[0],buf[1]);
-			send_packet(COMMAND_GET_PARAMETERS,NULL,0);
-			state=GETPARAMETERS;
-		} else {
-			printf("Invalid packet %d\n",command);
+	case EVENT_FRAME:
+		g_atomic_int_dec_and_test(&ev->dev->pending);
+		if (trace_enabled()) {
+			/* arrival is on the same clock */
+			trace_span(TRACE_QUEUE, ev->arrival, trace_clock(), ev->frame_no);
+			trace_set_frame(ev->frame_no);
 		}
+		/* Main trace shows average instead, when there is one. Logic
+		 frames are never averaged */
+		if (index==0)
+			scope_got_memsegs(ev->u.memseg.seg, ev->u.memseg.count);
+		if (index==0 && (NULL==ev->dev->average || ev->logic || ev->u.memseg.count))
+			sdata(ev->payload, ev->size, ev->frame);
+		scope_got_trace(index, ev->payload, ev->size, ev->channels, ev->arrival);
 		break;
-
-	case GETPARAMETERS:
-		in_request=TRUE;
-		send_packet(COMMAND_START_SAMPLING,NULL,0);
-
-		state = SAMPLING;
+	case EVENT_AVERAGE:
+		g_atomic_int_dec_and_test(&ev->dev->pending);
+		savg((const unsigned short*)ev->data, ev->size / sizeof(unsigned short));
 		break;
-
-	case SAMPLING:
-		sdata(buf, size);
-		if ( oneshot_cb && ! delay_request) {
-			in_request=FALSE;
+	case EVENT_DECODE:
+		sdecoded((const struct decode_event*)ev->data,
+				 ev->size / sizeof(struct decode_event));
+		break;
+	case EVENT_MASK:
+		size = ev->size / 3;
+		smask(ev->data, ev->data + size, ev->data + 2 * size, size,
+			  ev->u.mask.failed, &ev->u.mask.stats, ev->u.mask.frozen);
+		break;
+	case EVENT_STATS:
+		if (index==0)
+			scope_got_stats(&ev->u.stats);
+		break;
+	case EVENT_TRIGGER_DONE:
+		if (index==0 && oneshot_cb)
 			oneshot_cb(oneshot_cb_data);
-		} else{
-			if (!freeze) {
-				send_packet(COMMAND_START_SAMPLING,NULL,0);
-				in_request=TRUE;
-			}
-		} 
-		delay_request=FALSE;
-		state=SAMPLING;
-
 		break;
-	default:
-		printf("Invalid packet %d\n",command);
 	}
+	put_event(ev);
 }
 
-void process(unsigned char bIn)
+/* Watch on notifyfd, at idle priority as redraws must not wait */
+static gboolean deliver_events(GIOChannel *source, GIOCondition condition,
+							   gpointer data)
 {
-	static unsigned char pBuf[1024];
-	static unsigned char cksum;
-	static unsigned int pBufPtr;
-	static unsigned short pSize;
-	static unsigned char command;
-
-	static enum packetstate st = SIZE;
+	struct serial_event *ev, *next;
+	guint64 count;
+
+	if (read(notifyfd, &count, sizeof(count))<0 && errno!=EAGAIN)
+		perror("read");
+	g_mutex_lock(&queue_lock);
+	ev = queue_head;
+	queue_head = queue_tail = NULL;
+	g_mutex_unlock(&queue_lock);
+	for (; ev; ev=next) {
+		next = ev->next;
+		deliver_event(ev);
+	}
+	return TRUE;
+}
 
-	cksum^=bIn;
+/* Reader thread side, called with device lock held */
+static void cb_parameters(void *data, const struct acq_parameters *params)
+{
+	struct serial_device *dev = data;
+	struct serial_event *ev;
+
+	if (dev->index==0) {
+		record_set_parameters(params->raw, params->raw_size);
+		if (server)
+			server_publish_parameters(server, params->raw, params->raw_size);
+		shm_rate = get_parameters_sample_frequency(shm_freq, params->raw,
+												   params->raw_size);
+		if (params->channels)
+			shm_rate /= params->channels;
+	}
 
-	switch(st) {
-	case SIZE:
-		cksum = bIn;
-		if (bIn==0)
-			break; // Reset procedure.
-		if (bIn & 0x80) {
-			pSize =((unsigned short)(bIn&0x7F)<<8);
-			st = SIZE2;
-		} else {
-			pSize = bIn;
-			pBufPtr = 0;
-			st = COMMAND;
-		}
-		break;
+	ev = new_event(dev, EVENT_PARAMETERS, params->raw, params->raw_size);
+	if (NULL==ev)
+		return;
+	ev->u.params = *params;
+	queue_event(ev);
+}
 
-	case SIZE2:
-		pSize += bIn;
-		//printf("S1: %u\n",bIn);
-		//printf("Large packet %u\n",pSize);
-		pBufPtr = 0;
-		st = COMMAND;
-		//printf("S+: %u\n",pSize);
-		break;
+static void cb_raw_frame(void *data, const unsigned char *buf, size_t size)
+{
+	struct serial_device *dev = data;
 
-	case COMMAND:
+	if (dev->index!=0)
+		return;
+	record_frame(buf, size);
+	if (server)
+		server_publish_frame(server, buf, size, g_get_real_time());
+}
 
-		command = bIn;
-		//printf("CM: %u\n",command);
-		pSize--;
-		if (pSize>0)
-			st = PAYLOAD;
-		else
-			st = CKSUM;
-		break;
-	case PAYLOAD:
+static void cb_frame(void *data, unsigned char *buf, size_t size)
+{
+	struct serial_device *dev = data;
+	struct serial_event *ev;
+	const struct ingest_memseg *seg;
+	struct frame *frame;
 
-		//printf("< %u %02x\n",pBufPtr,(unsigned) bIn);
-		pBuf[pBufPtr++] = bIn;
-		pSize--;
-		if (pSize==0) {
-			st = CKSUM;
-		}
-		break;
+	if (dev->index==0 && shm)
+		shmring_publish(shm, buf, size, dev->acq->channels, shm_rate);
 
-	case CKSUM:
-		//printf("< SUM %02x\n",(unsigned) bIn);
-		if (cksum==0) {
-			process_packet(command,pBuf,pBufPtr);
-		} else {
-			printf("Packet fails checksum check\n");
-		}
-		st = SIZE;
+	if (g_atomic_int_get(&dev->pending) >= SERIAL_MAX_PENDING) {
+		dev->dropped++;
+		return;
 	}
+	frame = acq_get_frame(dev->acq);
+	if (frame)
+		ev = get_frame_event(dev, frame, buf, size);
+	else
+		ev = new_event(dev, EVENT_FRAME, buf, size);
+	if (NULL==ev)
+		return;
+	g_atomic_int_inc(&dev->pending);
+	seg = acq_get_memsegs(dev->acq, &ev->u.memseg.count);
+	if (seg)
+		memcpy(ev->u.memseg.seg, seg, ev->u.memseg.count * sizeof(*seg));
+	queue_event(ev);
 }
 
-gboolean serial_data_ready(GIOChannel *source,
-						   GIOCondition condition,
-						   gpointer data)
+static void cb_average(void *data, const unsigned short *buf, size_t size)
 {
-	gsize r;
-	gchar c;
-	GError *error = NULL;
+	struct serial_device *dev = data;
+	struct serial_event *ev;
 
-	g_io_channel_read_chars(source,&c,1,&r,&error);
-	if (NULL==error && r==1)  {
-		process((unsigned char)c);
+	if (g_atomic_int_get(&dev->pending) >= SERIAL_MAX_PENDING) {
+		dev->dropped++;
+		return;
 	}
-	return TRUE;
+	ev = new_event(dev, EVENT_AVERAGE, (const unsigned char*)buf,
+				   size * sizeof(unsigned short));
+	if (NULL==ev)
+		return;
+	g_atomic_int_inc(&dev->pending);
+	queue_event(ev);
 }
 
-void loop()
+/* Follows its frame, so not counted as pending. Dropped along with it */
+static void cb_decoded(void *data, const struct decode_event *ev, size_t count)
 {
-#ifdef STANDALONE
-	g_main_loop_run(loo);
-#endif
+	struct serial_device *dev = data;
+	struct serial_event *e;
+
+	if (g_atomic_int_get(&dev->pending) >= SERIAL_MAX_PENDING)
+		return;
+	e = new_event(dev, EVENT_DECODE, (const unsigned char*)ev, count * sizeof(*ev));
+	if (e)
+		queue_event(e);
 }
 
-void serial_reset_target()
+/* Like decoded events, follows its frame and is dropped along with it,
+ unless it froze acquisition */
+static void cb_masked(void *data, const struct mask *mask, int failed)
 {
-	int i;
-	for (i=0; i<512; i++) {
-		sendchar(0x00);
-	}
+	struct serial_device *dev = data;
+	struct serial_event *ev;
+	size_t size = mask_size(mask);
+
+	if (g_atomic_int_get(&dev->pending) >= SERIAL_MAX_PENDING && !dev->acq->freeze)
+		return;
+	ev = new_event(dev, EVENT_MASK, NULL, 3 * size);
+	if (NULL==ev)
+		return;
+	memcpy(ev->data, mask_lower(mask), size);
+	memcpy(ev->data + size, mask_upper(mask), size);
+	memcpy(ev->data + 2 * size, mask_violations(mask), size);
+	mask_get_stats(mask, &ev->u.mask.stats);
+	ev->u.mask.failed = failed;
+	ev->u.mask.frozen = dev->acq->freeze;
+	queue_event(ev);
 }
 
-void serial_set_trigger_level(unsigned char trig)
+static void cb_stats(void *data, const struct acq_stats *stats)
 {
-	send_packet(COMMAND_SET_TRIGGER,&trig,1);
+	struct serial_event *ev = new_event(data, EVENT_STATS, NULL, 0);
+
+	ev->u.stats = *stats;
+	queue_event(ev);
 }
 
-void serial_set_holdoff(unsigned char holdoff)
+static void cb_trigger_done(void *data)
 {
-	send_packet(COMMAND_SET_HOLDOFF,&holdoff,1);
+	queue_event(new_event(data, EVENT_TRIGGER_DONE, NULL, 0));
 }
 
-int real_serial_init(char *device)
+static void cb_message(void *data, const char *msg)
 {
-	struct termios termset;
-	GError *error = NULL;
+	struct serial_device *dev = data;
 
-	fd = open(device, O_RDWR);
-	if (fd<0) {
-		perror("open");
-		return -1;
-	}
+	if (num_devices>1)
+		printf("[%d] %s\n", dev->index, msg);
+	else
+		printf("%s\n", msg);
+}
+
+/* Device reopened after it was lost. Closing the old descriptor already
+ took it out of epoll */
+static void cb_connected(void *data, int fd)
+{
+	struct epoll_event ev;
 
-	fprintf(stderr,"Opened device '%s'\n", device);
+	ev.events = EPOLLIN;
+	ev.data.ptr = data;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)<0)
+		perror("epoll_ctl");
+}
+
+static const struct acq_callbacks callbacks = {
+	.connected = &cb_connected,
+	.parameters = &cb_parameters,
+	.raw_frame = &cb_raw_frame,
+	.frame = &cb_frame,
+	.average = &cb_average,
+	.decoded = &cb_decoded,
+	.masked = &cb_masked,
+	.stats = &cb_stats,
+	.trigger_done = &cb_trigger_done,
+	.message = &cb_message
+};
 
-	tcgetattr(fd, &termset);
+static gpointer serial_reader(gpointer data)
+{
+	struct epoll_event ev[SERIAL_MAX_DEVICES + 1];
+	struct serial_device *dev;
+	int i, n, r;
+
+	for (;;) {
+		n = epoll_wait(epfd, ev, SERIAL_MAX_DEVICES + 1, ACQ_TICK_MS);
+		if (n<0) {
+			if (errno==EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		FOR_EACH_DEVICE(dev) {
+			g_mutex_lock(&dev->lock);
+			acq_tick(dev->acq);
+			g_mutex_unlock(&dev->lock);
+		}
+		for (i=0; i<n; i++) {
+			dev = ev[i].data.ptr;
+			if (NULL==dev)
+				return NULL; /* Woken up by serial_stop() */
+
+			g_mutex_lock(&dev->lock);
+			r = acq_read(dev->acq);
+			g_mutex_unlock(&dev->lock);
+
+			if (r<0) {
+				fprintf(stderr,"Device %d closed\n", dev->index);
+				epoll_ctl(epfd, EPOLL_CTL_DEL, acq_get_fd(dev->acq), NULL);
+			}
+		}
+	}
+	return NULL;
+}
 
-	termset.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
-						 | INLCR | IGNCR | ICRNL | IXON);
-	termset.c_oflag &= ~OPOST;
-	termset.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	termset.c_cflag &= ~(CSIZE | PARENB);
-	termset.c_cflag |= CS8;
+void loop()
+{
+#ifdef STANDALONE
+	g_main_loop_run(loo);
+#endif
+}
 
-	cfsetospeed(&termset,B115200);
-	cfsetispeed(&termset,B115200);
+int real_serial_init(char *device)
+{
+	struct serial_device *dev;
+	struct epoll_event ev;
+	GIOChannel *channel;
 
-	tcsetattr(fd,TCSANOW,&termset);
+	if (num_devices>=SERIAL_MAX_DEVICES) {
+		fprintf(stderr,"Too many devices, at most %d supported\n", SERIAL_MAX_DEVICES);
+		return -1;
+	}
 
-	channel =  g_io_channel_unix_new(fd);
+	if (epfd<0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		wakefd = eventfd(0, EFD_CLOEXEC);
+		if (epfd<0 || wakefd<0) {
+			perror("epoll");
+			return -1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+	}
+	if (notifyfd<0) {
+		notifyfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+		if (notifyfd<0) {
+			perror("eventfd");
+			return -1;
+		}
+		channel = g_io_channel_unix_new(notifyfd);
+		g_io_add_watch_full(channel, G_PRIORITY_DEFAULT_IDLE, G_IO_IN,
+							&deliver_events, NULL, NULL);
+		g_io_channel_unref(channel);
+	}
 
-	if (NULL==channel) {
-		fprintf(stderr,"Cannot open channel\n");
+	dev = &devices[num_devices];
+	dev->index = num_devices;
+	if (!strcmp(device, "auto")) {
+		dev->acq = acq_probe(NULL, 0, ACQ_PROBE_TIMEOUT_MS, &callbacks, dev);
+		if (NULL==dev->acq)
+			fprintf(stderr,"No device found\n");
+	} else {
+		dev->acq = acq_open(device, &callbacks, dev);
+	}
+	if (NULL==dev->acq)
 		return -1;
+	g_mutex_init(&dev->lock);
+
+	if (filter_spec) {
+		dev->filter = filter_bank_new(filter_spec);
+		acq_set_filter(dev->acq, dev->filter, filter_clock);
 	}
-	g_io_channel_set_encoding (channel, NULL, &error);
-	if (error) {
-		fprintf(stderr,"Cannot set encoding: %s\n", error->message);
+	if (average_frames && dev->index==0) {
+		dev->average = average_new(average_frames, average_exp);
+		acq_set_average(dev->acq, dev->average);
 	}
-	error = NULL;
-	g_io_channel_set_flags (channel, G_IO_FLAG_NONBLOCK, &error);
-	if (error) {
-		fprintf(stderr,"Cannot set flags: %s\n", error->message);
+	if (decoder_spec && dev->index==0) {
+		dev->decoder = decoder_new(decoder_spec);
+		acq_set_decoder(dev->acq, dev->decoder, decoder_clock);
 	}
-	g_io_channel_set_close_on_unref (channel, TRUE);
-	if ((watcher=g_io_add_watch(channel, G_IO_IN, &serial_data_ready, NULL))<0) {
-		fprintf(stderr,"Cannot add watch\n");
+	if (mask_spec && dev->index==0) {
+		dev->mask = mask_new(mask_spec);
+		acq_set_mask(dev->acq, dev->mask, mask_stop);
 	}
 
-	fprintf(stderr,"Channel set up OK\n");
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, acq_get_fd(dev->acq), &ev)<0) {
+		perror("epoll_ctl");
+		acq_close(dev->acq);
+		if (dev->filter)
+			filter_bank_free(dev->filter);
+		dev->filter = NULL;
+		if (dev->average)
+			average_free(dev->average);
+		dev->average = NULL;
+		if (dev->decoder)
+			decoder_free(dev->decoder);
+		dev->decoder = NULL;
+		if (dev->mask)
+			mask_free(dev->mask);
+		dev->mask = NULL;
+		return -1;
+	}
+	num_devices++;
 
-	in_request = FALSE;
-	delay_request = FALSE;
+	fprintf(stderr,"Channel set up OK\n");
 
 	return 0;
+}
+
+void serial_set_trigger_level(unsigned char trig)
+{
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_trigger_level(d->acq, trig);
+		g_mutex_unlock(&d->lock);
+	}
+}
 
+void serial_set_holdoff(unsigned char holdoff)
+{
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_holdoff(d->acq, holdoff);
+		g_mutex_unlock(&d->lock);
+	}
 }
+
 void serial_set_prescaler(unsigned char prescaler)
 {
-	// printf("Setting PRESCALE %d\n", prescaler);
-	send_packet(COMMAND_SET_PRESCALER,&prescaler,1);
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_prescaler(d->acq, prescaler);
+		g_mutex_unlock(&d->lock);
+	}
 }
 
 void serial_set_vref(unsigned char vref)
 {
-	//	printf("Setting VREF %d\n", vref);
-	send_packet(COMMAND_SET_VREF,&vref,1);
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_vref(d->acq, vref);
+		g_mutex_unlock(&d->lock);
+	}
 }
 
-static void set_flags()
+void serial_set_trigger_invert(gboolean active)
 {
-	unsigned char c=0;
-	if (is_trigger_invert)
-		c|=FLAG_INVERT_TRIGGER;
-	send_packet(COMMAND_SET_FLAGS,&c,1);
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_trigger_invert(d->acq, active);
+		g_mutex_unlock(&d->lock);
+	}
 }
 
+void serial_set_channels(int channels)
+{
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_channels(d->acq, channels);
+		g_mutex_unlock(&d->lock);
+	}
+}
 
-void serial_set_trigger_invert(gboolean active)
+void serial_set_sample_rate(unsigned char clocksel, unsigned short top)
 {
-	is_trigger_invert = active;
-	set_flags();
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_sample_rate(d->acq, clocksel, top);
+		g_mutex_unlock(&d->lock);
+	}
 }
-void serial_set_channels(int channels)
+
+void serial_set_logic(gboolean enable, const struct logic_trigger *trig)
+{
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_logic(d->acq, enable, trig);
+		g_mutex_unlock(&d->lock);
+	}
+}
+
+void serial_set_memseg(unsigned count)
+{
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_memseg(d->acq, count);
+		g_mutex_unlock(&d->lock);
+	}
+}
+
+void serial_set_trigger_mode(const struct trigger_mode *mode)
+{
+	struct serial_device *d;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_trigger_mode(d->acq, mode);
+		g_mutex_unlock(&d->lock);
+	}
+}
+
+void serial_get_stats(gboolean reset)
 {
-	if (channels<1 || channels>4)
+	if (num_devices==0)
 		return;
-	unsigned char c = channels;
-	send_packet(COMMAND_SET_CHANNELS, &c, 1);
+	g_mutex_lock(&devices[0].lock);
+	acq_get_stats(devices[0].acq, reset);
+	g_mutex_unlock(&devices[0].lock);
 }
 
-int serial_run( void (*setdata)(unsigned char *data,size_t size))
+void serial_autoset(unsigned long clock)
 {
+	if (num_devices==0)
+		return;
+	g_mutex_lock(&devices[0].lock);
+	acq_autoset(devices[0].acq, clock);
+	g_mutex_unlock(&devices[0].lock);
+}
+
+int serial_run( void (*setdata)(unsigned char *data,size_t size,struct frame *frame))
+{
+	struct serial_device *d;
+
 	sdata = setdata;
-	serial_reset_target();
-	fprintf(stderr,"Pinging device...\n");
-	send_packet(COMMAND_PING,(unsigned char*)"BABA",4);
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		if (acq_start(d->acq)<0)
+			fprintf(stderr,"Cannot write to device %d\n", d->index);
+		g_mutex_unlock(&d->lock);
+	}
+	if (num_devices>0)
+		reader = g_thread_new("serial", &serial_reader, NULL);
 	loop();
 	return 0;
 }
 
-void serial_freeze_unfreeze(gboolean freeze)
+void serial_stop(void)
 {
+	struct serial_device *d;
+	guint64 one = 1;
+
+	if (reader) {
+		if (write(wakefd, &one, sizeof(one))<0)
+			perror("write");
+		g_thread_join(reader);
+		reader = NULL;
+	}
+	FOR_EACH_DEVICE(d) {
+		if (d->dropped)
+			fprintf(stderr,"Device %d: %lu frames not displayed\n", d->index, d->dropped);
+		acq_close(d->acq);
+		if (d->filter)
+			filter_bank_free(d->filter);
+		d->filter = NULL;
+		if (d->average)
+			average_free(d->average);
+		d->average = NULL;
+		if (d->decoder)
+			decoder_free(d->decoder);
+		d->decoder = NULL;
+		if (d->mask)
+			mask_free(d->mask);
+		d->mask = NULL;
+		g_mutex_clear(&d->lock);
+	}
+	num_devices = 0;
 }
 
+/* Publish main device frames to viewers. Call before serial_run() */
+void serial_set_server(struct server *srv)
+{
+	server = srv;
+}
 
-void serial_set_oneshot( void(*callback)(void*), void*data )
+/* Publish main device frames, as displayed, to shared memory. Call
+ before serial_run() */
+void serial_set_shmring(struct shmring *ring, unsigned long freq)
 {
-	unsigned char tvalue;
-	oneshot_cb = callback;
-    oneshot_cb_data = data;
-	if (oneshot_cb) {
-		tvalue=0;
-	} else {
-		tvalue=100;
-	}
+	shm = ring;
+	shm_freq = freq;
+}
 
-	send_packet(COMMAND_SET_AUTOTRIG,&tvalue,1);
+/* Filter every device's frames, see filter_bank_new() for spec. Call
+ before devices are opened. Returns -1 if spec is invalid */
+int serial_set_filter(const char *spec, unsigned long clock)
+{
+	struct filter_bank *fb = filter_bank_new(spec);
 
-	if (NULL==oneshot_cb && !in_request) {
-		send_packet(COMMAND_START_SAMPLING,NULL,0);
-	} else {
-		if (in_request)
-			delay_request=TRUE;
-		else
-			send_packet(COMMAND_START_SAMPLING,NULL,0);
+	if (NULL==fb)
+		return -1;
+	filter_bank_free(fb);
+	filter_spec = spec;
+	filter_clock = clock;
+	return 0;
+}
+
+/* Show average of main device's triggered frames, through setavg
+ instead of setdata. Call before devices are opened */
+void serial_set_average(unsigned frames, gboolean exponential,
+						void (*setavg)(const unsigned short *data,size_t size))
+{
+	average_frames = frames;
+	average_exp = exponential;
+	savg = setavg;
+}
+
+/* Decode buses in main device's frames, see decoder_new() for spec.
+ Events for each frame go to decoded. Call before devices are opened.
+ Returns -1 if spec is invalid */
+int serial_set_decoder(const char *spec, unsigned long clock,
+					   void (*decoded)(const struct decode_event *ev,size_t count))
+{
+	struct decoder *d = decoder_new(spec);
+
+	if (NULL==d)
+		return -1;
+	decoder_free(d);
+	decoder_spec = spec;
+	decoder_clock = clock;
+	sdecoded = decoded;
+	return 0;
+}
+
+/* Test main device's frames against mask, see mask_new() for spec.
+ Results go to masked. With stop, first failing frame freezes all
+ devices. Call before devices are opened. Returns -1 if spec is invalid */
+int serial_set_mask(const char *spec, gboolean stop, serial_mask_cb masked)
+{
+	struct mask *m = mask_new(spec);
+
+	if (NULL==m)
+		return -1;
+	mask_free(m);
+	mask_spec = spec;
+	mask_stop = stop;
+	smask = masked;
+	return 0;
+}
+
+int serial_num_devices(void)
+{
+	return num_devices;
+}
+
+/* Stop asking for captures. Unfreezing does not ask for one on its own;
+ serial_set_oneshot() does */
+void serial_freeze_unfreeze(gboolean freeze)
+{
+	struct serial_device *d;
+
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_freeze(d->acq, freeze);
+		g_mutex_unlock(&d->lock);
 	}
 }
 
-gboolean serial_in_request()
+void serial_set_oneshot( void(*callback)(void*), void*data )
 {
-    return in_request;
+	struct serial_device *d;
+
+	oneshot_cb = callback;
+	oneshot_cb_data = data;
+	FOR_EACH_DEVICE(d) {
+		g_mutex_lock(&d->lock);
+		acq_set_oneshot(d->acq, NULL!=callback);
+		g_mutex_unlock(&d->lock);
+	}
 }
 
-double get_sample_frequency(unsigned long freq, unsigned long prescaler)
+gboolean serial_in_request()
 {
-	unsigned long adc_clock = freq / prescaler;
-	double fsample = (double)adc_clock / 13;
-	return fsample;
+	gboolean r;
+
+	if (num_devices==0)
+		return FALSE;
+	g_mutex_lock(&devices[0].lock);
+	r = acq_in_request(devices[0].acq);
+	g_mutex_unlock(&devices[0].lock);
+	return r;
 }
 
 int serial_init(gchar*name)
@@ -20,20 +20,57 @@
 #define __SERIAL_H__
 
 #include <gtk/gtk.h>
+#include "sampling.h"
+#include "acq.h"
+#include "server.h"
+#include "shmring.h"
+#include "logic.h"
+#include "trigger.h"
+#include "mask.h"
 
+/* Devices driven at once. Device 0 is the main one, others are shown as
+ extra traces */
+#define SERIAL_MAX_DEVICES 5
+
+/* Mask test result of a frame: envelopes and violations, size each.
+ frozen is set if failure stopped acquisition */
+typedef void (*serial_mask_cb)(const unsigned char *lower, const unsigned char *upper,
+							   const unsigned char *violations, size_t size, int failed,
+							   const struct mask_stats *stats, gboolean frozen);
+
+/* Can be called once per device, before serial_run() */
 int serial_init(gchar*name);
-int serial_run( void (*setdata)(unsigned char *data,size_t size));
+/* setdata gets the pool frame holding data, to keep a reference instead
+ of a copy; NULL if there is none */
+int serial_run( void (*setdata)(unsigned char *data,size_t size,struct frame *frame));
 void serial_set_trigger_level(unsigned char trig);
 void serial_set_holdoff(unsigned char holdoff);
 void serial_set_prescaler(unsigned char prescaler);
 void serial_set_vref(unsigned char vref);
 void serial_set_trigger_invert(gboolean active);
 void serial_set_channels(int channels);
+void serial_set_sample_rate(unsigned char clocksel, unsigned short top);
+void serial_set_logic(gboolean enable, const struct logic_trigger *trig);
+void serial_set_memseg(unsigned count);
+void serial_set_trigger_mode(const struct trigger_mode *mode);
+void serial_get_stats(gboolean reset);
+/* Autoset first device, see acq_autoset() */
+void serial_autoset(unsigned long clock);
+void serial_process_parameters(unsigned char *buf, size_t size);
 
-double get_sample_frequency(unsigned long freq, unsigned long prescaler);
 void serial_set_oneshot( void(*callback)(void*) , void *data);
 void serial_freeze_unfreeze( gboolean freeze );
 gboolean serial_in_request();
+int serial_num_devices(void);
+void serial_set_server(struct server *srv);
+void serial_set_shmring(struct shmring *ring, unsigned long freq);
+int serial_set_filter(const char *spec, unsigned long clock);
+void serial_set_average(unsigned frames, gboolean exponential,
+						void (*setavg)(const unsigned short *data,size_t size));
+int serial_set_decoder(const char *spec, unsigned long clock,
+					   void (*decoded)(const struct decode_event *ev,size_t count));
+int serial_set_mask(const char *spec, gboolean stop, serial_mask_cb masked);
+void serial_stop(void);
 
 
 #endif
@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "stream.h"
+#include "proto.h"
+
+/* Encoded message, shared by all client queues. Any message fits, and
+ released ones go back to their server for reuse */
+struct server_buf {
+	struct server *srv;
+	struct server_buf *next;
+	int refs;
+	size_t size;
+	unsigned char data[PROTO_MAX_PAYLOAD + 4];
+};
+
+struct server_client {
+	int fd;
+	int flags;
+	int closing;
+	struct proto_parser parser;
+	struct server *srv;
+
+	/* Ring of messages not yet sent. Protected by server lock */
+	struct server_buf *queue[SERVER_QUEUE_SIZE];
+	unsigned head;
+	unsigned count;
+	unsigned long dropped;
+
+	/* Message being written, owned by server thread */
+	struct server_buf *cur;
+	size_t off;
+};
+
+struct server {
+	int listenfd;
+	int wake[2];
+	int stop;
+	char *path;
+	unsigned long freq;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	struct server_client *clients[SERVER_MAX_CLIENTS];
+	int num_clients;
+	int packed_clients;
+	struct server_buf *params;
+	unsigned char channels;
+	uint32_t sequence;
+
+	/* Released messages. Own lock, as they are released with lock held */
+	pthread_mutex_t free_lock;
+	struct server_buf *free_bufs;
+};
+
+/* Once every client queue has filled, nothing is allocated per message */
+static struct server_buf *buf_new(struct server *srv, unsigned char command,
+								  const unsigned char *payload, size_t size)
+{
+	struct server_buf *b;
+
+	if (size>PROTO_MAX_PAYLOAD)
+		return NULL;
+	pthread_mutex_lock(&srv->free_lock);
+	b = srv->free_bufs;
+	if (b)
+		srv->free_bufs = b->next;
+	pthread_mutex_unlock(&srv->free_lock);
+	if (NULL==b)
+		b = malloc(sizeof(*b));
+	if (NULL==b)
+		return NULL;
+	b->srv = srv;
+	b->refs = 1;
+	b->size = proto_encode(b->data, command, payload, size);
+	return b;
+}
+
+static struct server_buf *buf_ref(struct server_buf *b)
+{
+	__sync_fetch_and_add(&b->refs, 1);
+	return b;
+}
+
+static void buf_unref(struct server_buf *b)
+{
+	struct server *srv;
+
+	if (NULL==b || __sync_sub_and_fetch(&b->refs, 1)!=0)
+		return;
+	srv = b->srv;
+	pthread_mutex_lock(&srv->free_lock);
+	b->next = srv->free_bufs;
+	srv->free_bufs = b;
+	pthread_mutex_unlock(&srv->free_lock);
+}
+
+/* Called with lock held */
+static void client_push(struct server_client *c, struct server_buf *b)
+{
+	if (c->count==SERVER_QUEUE_SIZE) {
+		/* Drop oldest, viewer wants latest data */
+		buf_unref(c->queue[c->head]);
+		c->head = (c->head + 1) % SERVER_QUEUE_SIZE;
+		c->count--;
+		c->dropped++;
+	}
+	c->queue[(c->head + c->count) % SERVER_QUEUE_SIZE] = buf_ref(b);
+	c->count++;
+}
+
+static struct server_buf *client_pop(struct server_client *c)
+{
+	struct server_buf *b;
+
+	if (c->count==0)
+		return NULL;
+	b = c->queue[c->head];
+	c->head = (c->head + 1) % SERVER_QUEUE_SIZE;
+	c->count--;
+	return b;
+}
+
+static void server_wake(struct server *srv)
+{
+	char c = 0;
+	if (write(srv->wake[1], &c, 1)<0 && errno!=EAGAIN)
+		perror("write");
+}
+
+static void client_packet(void *data, unsigned char command,
+						  unsigned char *buf, unsigned short size)
+{
+	struct server_client *c = data;
+	struct server *srv = c->srv;
+
+	if (command!=STREAM_SUBSCRIBE || size<1)
+		return;
+
+	pthread_mutex_lock(&srv->lock);
+	if (c->flags & STREAM_FLAG_PACKED)
+		srv->packed_clients--;
+	c->flags = buf[0];
+	if (c->flags & STREAM_FLAG_PACKED)
+		srv->packed_clients++;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static void client_add(struct server *srv, int fd)
+{
+	struct server_client *c;
+	unsigned char hello[STREAM_HELLO_SIZE];
+	struct server_buf *b;
+
+	c = calloc(1, sizeof(*c));
+	if (NULL==c) {
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->srv = srv;
+	proto_parser_init(&c->parser, &client_packet, c);
+
+	hello[0] = STREAM_VERSION;
+	stream_put_le32(&hello[1], srv->freq);
+	b = buf_new(srv, STREAM_HELLO, hello, sizeof(hello));
+
+	pthread_mutex_lock(&srv->lock);
+	if (srv->num_clients>=SERVER_MAX_CLIENTS) {
+		pthread_mutex_unlock(&srv->lock);
+		fprintf(stderr,"Too many stream clients\n");
+		buf_unref(b);
+		close(fd);
+		free(c);
+		return;
+	}
+	if (b)
+		client_push(c, b);
+	if (srv->params)
+		client_push(c, srv->params);
+	srv->clients[srv->num_clients++] = c;
+	pthread_mutex_unlock(&srv->lock);
+
+	buf_unref(b);
+}
+
+/* Called with lock held */
+static void client_free(struct server *srv, struct server_client *c)
+{
+	if (c->flags & STREAM_FLAG_PACKED)
+		srv->packed_clients--;
+	while (c->count)
+		buf_unref(client_pop(c));
+	buf_unref(c->cur);
+	close(c->fd);
+	free(c);
+}
+
+static void client_read(struct server_client *c)
+{
+	unsigned char buf[64];
+	ssize_t r;
+
+	r = read(c->fd, buf, sizeof(buf));
+	if (r>0)
+		proto_parse(&c->parser, buf, r);
+	else if (r==0 || (errno!=EAGAIN && errno!=EINTR))
+		c->closing = 1;
+}
+
+static void client_flush(struct server *srv, struct server_client *c)
+{
+	ssize_t r;
+
+	for (;;) {
+		if (NULL==c->cur) {
+			pthread_mutex_lock(&srv->lock);
+			c->cur = client_pop(c);
+			pthread_mutex_unlock(&srv->lock);
+			if (NULL==c->cur)
+				return;
+			c->off = 0;
+		}
+		r = send(c->fd, c->cur->data + c->off, c->cur->size - c->off,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r<0) {
+			if (errno!=EAGAIN && errno!=EINTR)
+				c->closing = 1;
+			return;
+		}
+		c->off += r;
+		if (c->off==c->cur->size) {
+			buf_unref(c->cur);
+			c->cur = NULL;
+		}
+	}
+}
+
+static void *server_thread(void *data)
+{
+	struct server *srv = data;
+	struct pollfd pfd[SERVER_MAX_CLIENTS + 2];
+	struct server_client *c;
+	char drain[64];
+	int i, j, n, fd;
+
+	while (!srv->stop) {
+		pfd[0].fd = srv->wake[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = srv->listenfd;
+		pfd[1].events = POLLIN;
+
+		pthread_mutex_lock(&srv->lock);
+		n = srv->num_clients;
+		for (i=0; i<n; i++) {
+			c = srv->clients[i];
+			pfd[i+2].fd = c->fd;
+			pfd[i+2].events = POLLIN;
+			if (c->count || c->cur)
+				pfd[i+2].events |= POLLOUT;
+		}
+		pthread_mutex_unlock(&srv->lock);
+
+		if (poll(pfd, n + 2, -1)<0) {
+			if (errno==EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			while (read(srv->wake[0], drain, sizeof(drain))>0);
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			fd = accept4(srv->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd>=0)
+				client_add(srv, fd);
+		}
+
+		/* Clients are only added or removed here, so first n are the
+		 ones polled */
+		for (i=0; i<n; i++) {
+			c = srv->clients[i];
+			if (pfd[i+2].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(c);
+			if (!c->closing && (pfd[i+2].revents & POLLOUT))
+				client_flush(srv, c);
+		}
+
+		pthread_mutex_lock(&srv->lock);
+		for (i=0, j=0; i<srv->num_clients; i++) {
+			c = srv->clients[i];
+			if (c->closing) {
+				if (c->dropped)
+					fprintf(stderr,"Stream client left, %lu messages dropped\n",
+							c->dropped);
+				client_free(srv, c);
+			} else {
+				srv->clients[j++] = c;
+			}
+		}
+		srv->num_clients = j;
+		pthread_mutex_unlock(&srv->lock);
+	}
+	return NULL;
+}
+
+struct server *server_start(const char *address, unsigned long freq)
+{
+	struct server *srv = calloc(1, sizeof(*srv));
+
+	if (NULL==srv)
+		return NULL;
+
+	srv->freq = freq;
+	srv->listenfd = stream_listen(address);
+	if (srv->listenfd<0) {
+		free(srv);
+		return NULL;
+	}
+	fcntl(srv->listenfd, F_SETFL, O_NONBLOCK);
+
+	if (pipe2(srv->wake, O_NONBLOCK | O_CLOEXEC)<0) {
+		perror("pipe");
+		close(srv->listenfd);
+		free(srv);
+		return NULL;
+	}
+	if (strchr(address, '/'))
+		srv->path = strdup(address);
+
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_mutex_init(&srv->free_lock, NULL);
+	if (pthread_create(&srv->thread, NULL, &server_thread, srv)!=0) {
+		perror("pthread_create");
+		close(srv->wake[0]);
+		close(srv->wake[1]);
+		close(srv->listenfd);
+		free(srv->path);
+		free(srv);
+		return NULL;
+	}
+
+	fprintf(stderr,"Serving frames on '%s'\n", address);
+	return srv;
+}
+
+void server_stop(struct server *srv)
+{
+	struct server_buf *b;
+	int i;
+
+	srv->stop = 1;
+	server_wake(srv);
+	pthread_join(srv->thread, NULL);
+
+	for (i=0; i<srv->num_clients; i++)
+		client_free(srv, srv->clients[i]);
+	buf_unref(srv->params);
+
+	close(srv->listenfd);
+	close(srv->wake[0]);
+	close(srv->wake[1]);
+	if (srv->path) {
+		unlink(srv->path);
+		free(srv->path);
+	}
+	while ((b = srv->free_bufs)) {
+		srv->free_bufs = b->next;
+		free(b);
+	}
+	pthread_mutex_destroy(&srv->free_lock);
+	pthread_mutex_destroy(&srv->lock);
+	free(srv);
+}
+
+void server_publish_parameters(struct server *srv, const unsigned char *params,
+							   size_t size)
+{
+	struct server_buf *b = buf_new(srv, STREAM_PARAMETERS, params, size);
+	int i;
+
+	if (NULL==b)
+		return;
+
+	pthread_mutex_lock(&srv->lock);
+	/* Packing stride follows channel count */
+	if (size>=8)
+		srv->channels = params[7];
+	buf_unref(srv->params);
+	srv->params = buf_ref(b);
+	for (i=0; i<srv->num_clients; i++)
+		client_push(srv->clients[i], b);
+	pthread_mutex_unlock(&srv->lock);
+
+	buf_unref(b);
+	server_wake(srv);
+}
+
+void server_publish_frame(struct server *srv, const unsigned char *data,
+						  size_t size, uint64_t timestamp)
+{
+	unsigned char payload[PROTO_MAX_PAYLOAD];
+	struct server_buf *plain, *packed = NULL;
+	size_t psize = 0;
+	uint32_t seq;
+	unsigned char stride;
+	int i, want_packed;
+
+	if (size + STREAM_PACKED_HEADER > PROTO_MAX_PAYLOAD)
+		return;
+
+	pthread_mutex_lock(&srv->lock);
+	seq = srv->sequence++;
+	want_packed = srv->packed_clients>0;
+	stride = srv->channels;
+	pthread_mutex_unlock(&srv->lock);
+
+	stream_put_le32(&payload[0], seq);
+	stream_put_le64(&payload[4], timestamp);
+
+	/* Packed form is built once, only if someone asked for it */
+	if (want_packed) {
+		payload[12] = stride;
+		payload[13] = size & 0xff;
+		payload[14] = size >> 8;
+		psize = stream_pack(&payload[STREAM_PACKED_HEADER], data, size, stride);
+		if (psize)
+			packed = buf_new(srv, STREAM_FRAME_PACKED, payload, psize + STREAM_PACKED_HEADER);
+	}
+
+	memcpy(&payload[STREAM_FRAME_HEADER], data, size);
+	plain = buf_new(srv, STREAM_FRAME, payload, size + STREAM_FRAME_HEADER);
+	if (NULL==plain) {
+		buf_unref(packed);
+		return;
+	}
+
+	pthread_mutex_lock(&srv->lock);
+	for (i=0; i<srv->num_clients; i++) {
+		if (packed && (srv->clients[i]->flags & STREAM_FLAG_PACKED))
+			client_push(srv->clients[i], packed);
+		else
+			client_push(srv->clients[i], plain);
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	buf_unref(plain);
+	buf_unref(packed);
+	server_wake(srv);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Publishes frames and parameter changes to any number of viewers, over
+ TCP or a Unix socket. See stream.h for wire format. Runs its own thread;
+ publishing never blocks on clients. */
+
+/* Messages waiting per client. When full, oldest is dropped */
+#define SERVER_QUEUE_SIZE  32
+#define SERVER_MAX_CLIENTS 256
+
+struct server;
+
+struct server *server_start(const char *address, unsigned long freq);
+void server_stop(struct server *srv);
+
+/* Thread-safe */
+void server_publish_parameters(struct server *srv, const unsigned char *params,
+							   size_t size);
+void server_publish_frame(struct server *srv, const unsigned char *data,
+						  size_t size, uint64_t timestamp);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Example reader for the shared-memory frame ring (shmring.h). Also
+ measures writer-to-reader latency, against a live ring (-l) or a
+ synthetic writer it starts itself (-b) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "shmring.h"
+
+#define SHMREAD_DEFAULT_NAME "/oscope"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int sig)
+{
+	interrupted = 1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+static void wait_head(const struct shmring *ring, uint64_t next, int spin)
+{
+	struct timespec ts = { 0, 200000 };
+
+	while (!interrupted && shmring_head(ring)<=next) {
+		if (spin)
+			sched_yield();
+		else
+			nanosleep(&ts, NULL);
+	}
+}
+
+/* Follow ring, printing or timing each frame. With torn, also counts
+ frames that differ from what bench_writer() wrote. Returns frames read */
+static unsigned long follow(const struct shmring *ring, unsigned long count,
+							int latency, uint64_t *lat, unsigned long *torn)
+{
+	const struct shmring_slot *slot;
+	uint64_t next, lock, t, head, lost = 0;
+	unsigned long n = 0;
+	unsigned long sum;
+	uint32_t i, samples, channels;
+	int intact = 1;
+	size_t j;
+
+	next = shmring_head(ring);
+
+	while (!interrupted && (count==0 || n<count)) {
+		wait_head(ring, next, latency);
+		if (interrupted)
+			break;
+
+		slot = shmring_read_begin(ring, next, &lock);
+		if (NULL==slot) {
+			/* Overwritten, writer lapped us. Skip to newest frame */
+			head = shmring_head(ring);
+			if (head - 1 > next) {
+				lost += head - 1 - next;
+				next = head - 1;
+			} else {
+				lost++;
+				next++;
+			}
+			continue;
+		}
+
+		/* Work on slot in place, then check writer did not touch it */
+		t = slot->timestamp;
+		samples = slot->samples;
+		channels = slot->channels;
+		sum = 0;
+		if (!latency) {
+			for (i=0; i<samples && i*channels<SHMRING_SLOT_DATA; i++)
+				sum += slot->data[i*channels];
+		}
+		if (torn) {
+			intact = slot->frame==next;
+			for (j=0; j<SHMRING_SLOT_DATA; j++)
+				intact &= slot->data[j]==(next & 0xff);
+		}
+		if (shmring_read_end(ring, slot, lock)<0) {
+			lost++;
+			next++;
+			continue;
+		}
+		/* Seqlock said slot was stable, so it must be whole */
+		if (!intact)
+			(*torn)++;
+
+		if (latency)
+			lat[n] = shmring_now() - t;
+		else
+			printf("frame %llu: %u samples x %u channels at %.1f Hz, ch0 mean %.1f\n",
+				   (unsigned long long)next, samples, channels, slot->rate,
+				   samples ? (double)sum / samples : 0.0);
+		n++;
+		next++;
+	}
+	if (lost)
+		fprintf(stderr,"%llu frames missed\n", (unsigned long long)lost);
+	return n;
+}
+
+static void report(uint64_t *lat, unsigned long n)
+{
+	if (n==0)
+		return;
+	qsort(lat, n, sizeof(*lat), &cmp_u64);
+	printf("%lu frames, writer to reader latency (ns): min %llu, p50 %llu, "
+		   "p99 %llu, max %llu\n", n, (unsigned long long)lat[0],
+		   (unsigned long long)lat[n/2], (unsigned long long)lat[n*99/100],
+		   (unsigned long long)lat[n-1]);
+}
+
+/* Synthetic writer, same frame size as largest capture, until killed.
+ Frame n is filled with n & 0xff. Interval 0 writes flat out, lapping
+ the reader */
+static void bench_writer(struct shmring *ring, unsigned interval)
+{
+	unsigned char data[SHMRING_SLOT_DATA];
+	struct timespec ts = { 0, interval * 1000L };
+	unsigned long n;
+
+	for (n=0; ; n++) {
+		memset(data, n & 0xff, sizeof(data));
+		if (interval)
+			nanosleep(&ts, NULL);
+		shmring_publish(ring, data, sizeof(data), 1,
+						interval ? 1000000.0 / interval : 0);
+	}
+}
+
+static int help(const char *cmd)
+{
+	printf("Usage: %s [-l] [-n frames] [name]\n", cmd);
+	printf("       %s -b [-n frames] [-i interval]\n\n", cmd);
+	printf("  name         Ring name (default %s)\n", SHMREAD_DEFAULT_NAME);
+	printf("  -n frames    Stop after this many frames\n");
+	printf("  -l           Measure writer to reader latency instead of printing\n");
+	printf("  -b           Benchmark against a synthetic writer, and check every\n");
+	printf("               frame read is intact. Exit status is 1 if one is not\n");
+	printf("  -i usec      Benchmark writer interval (default 1000), 0 for flat out\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = SHMREAD_DEFAULT_NAME;
+	char benchname[64];
+	struct shmring *ring, *wring = NULL;
+	unsigned long count = 0, n, torn = 0;
+	unsigned interval = 1000;
+	int latency = 0, bench = 0, c;
+	uint64_t *lat = NULL;
+	pid_t pid = 0;
+
+	while ((c=getopt(argc,argv,"ln:bi:"))!=-1) {
+		switch (c) {
+		case 'l':
+			latency = 1;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bench = latency = 1;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			return help(argv[0]);
+		}
+	}
+	if (optind<argc)
+		name = argv[optind];
+
+	if (latency) {
+		if (count==0)
+			count = 10000;
+		lat = malloc(count * sizeof(*lat));
+		if (NULL==lat)
+			return 1;
+	}
+
+	if (bench) {
+		snprintf(benchname, sizeof(benchname), "/oscope-bench-%d", (int)getpid());
+		name = benchname;
+		wring = shmring_create(name, 0);
+		if (NULL==wring)
+			return 1;
+	}
+
+	ring = shmring_open(name);
+	if (NULL==ring)
+		return 1;
+
+	signal(SIGINT, &on_signal);
+	signal(SIGTERM, &on_signal);
+
+	if (bench) {
+		pid = fork();
+		if (pid==0) {
+			/* Runs until killed, so must not inherit on_signal(), and
+			 must not outlive reader */
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			/* Give reader time to start spinning */
+			usleep(100000);
+			bench_writer(wring, interval);
+		}
+	}
+
+	n = follow(ring, count, latency, lat, bench ? &torn : NULL);
+	if (latency)
+		report(lat, n);
+	if (torn)
+		fprintf(stderr,"%lu frames torn\n", torn);
+
+	if (pid>0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	shmring_close(ring);
+	if (wring)
+		shmring_destroy(wring);
+	free(lat);
+	return torn ? 1 : 0;
+}
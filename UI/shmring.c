@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+struct shmring {
+	struct shmring_header *hdr;
+	struct shmring_slot *slots;
+	size_t size;
+	char *name; /* Set for writer only, to unlink on destroy */
+};
+
+uint64_t shmring_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t shmring_size(unsigned slots)
+{
+	return sizeof(struct shmring_header) + (size_t)slots * sizeof(struct shmring_slot);
+}
+
+struct shmring *shmring_create(const char *name, unsigned slots)
+{
+	struct shmring *ring;
+	int fd;
+
+	if (slots==0)
+		slots = SHMRING_SLOTS;
+
+	ring = calloc(1, sizeof(*ring));
+	if (NULL==ring)
+		return NULL;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd<0) {
+		perror(name);
+		free(ring);
+		return NULL;
+	}
+	ring->size = shmring_size(slots);
+	if (ftruncate(fd, ring->size)<0) {
+		perror("ftruncate");
+		close(fd);
+		shm_unlink(name);
+		free(ring);
+		return NULL;
+	}
+	ring->hdr = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->hdr==MAP_FAILED) {
+		perror("mmap");
+		shm_unlink(name);
+		free(ring);
+		return NULL;
+	}
+	ring->slots = (struct shmring_slot*)(ring->hdr + 1);
+	ring->name = strdup(name);
+
+	/* Fresh mapping is zeroed: all slots even, head 0 */
+	ring->hdr->version = SHMRING_VERSION;
+	ring->hdr->slots = slots;
+	ring->hdr->slot_size = sizeof(struct shmring_slot);
+	/* Magic last, readers check it */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(ring->hdr->magic, SHMRING_MAGIC, sizeof(ring->hdr->magic));
+	return ring;
+}
+
+void shmring_publish(struct shmring *ring, const unsigned char *data, size_t size,
+					 unsigned channels, double rate)
+{
+	uint64_t frame = ring->hdr->head;
+	struct shmring_slot *slot = &ring->slots[frame % ring->hdr->slots];
+
+	if (size>SHMRING_SLOT_DATA)
+		size = SHMRING_SLOT_DATA;
+	if (channels==0)
+		channels = 1;
+
+	__atomic_store_n(&slot->lock, 2 * frame + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->frame = frame;
+	slot->timestamp = shmring_now();
+	slot->rate = rate;
+	slot->channels = channels;
+	slot->samples = size / channels;
+	memcpy(slot->data, data, size);
+
+	__atomic_store_n(&slot->lock, 2 * (frame + 1), __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->hdr->head, frame + 1, __ATOMIC_RELEASE);
+}
+
+void shmring_destroy(struct shmring *ring)
+{
+	munmap(ring->hdr, ring->size);
+	if (ring->name) {
+		shm_unlink(ring->name);
+		free(ring->name);
+	}
+	free(ring);
+}
+
+struct shmring *shmring_open(const char *name)
+{
+	struct shmring *ring;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd<0) {
+		perror(name);
+		return NULL;
+	}
+	if (fstat(fd, &st)<0 || st.st_size<sizeof(struct shmring_header)) {
+		fprintf(stderr,"%s: not a frame ring\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (NULL==ring) {
+		close(fd);
+		return NULL;
+	}
+	ring->size = st.st_size;
+	ring->hdr = mmap(NULL, ring->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->hdr==MAP_FAILED) {
+		perror("mmap");
+		free(ring);
+		return NULL;
+	}
+	ring->slots = (struct shmring_slot*)(ring->hdr + 1);
+
+	if (memcmp(ring->hdr->magic, SHMRING_MAGIC, sizeof(ring->hdr->magic)) ||
+		ring->hdr->version!=SHMRING_VERSION ||
+		ring->hdr->slot_size!=sizeof(struct shmring_slot) ||
+		shmring_size(ring->hdr->slots) > ring->size) {
+		fprintf(stderr,"%s: not a frame ring, or unsupported version\n", name);
+		shmring_close(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+void shmring_close(struct shmring *ring)
+{
+	munmap(ring->hdr, ring->size);
+	free(ring);
+}
+
+uint64_t shmring_head(const struct shmring *ring)
+{
+	return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+const struct shmring_slot *shmring_read_begin(const struct shmring *ring,
+											  uint64_t frame, uint64_t *lock)
+{
+	const struct shmring_slot *slot = &ring->slots[frame % ring->hdr->slots];
+
+	*lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+	if (*lock != 2 * (frame + 1))
+		return NULL; /* Not written yet, being written, or overwritten */
+	return slot;
+}
+
+int shmring_read_end(const struct shmring *ring, const struct shmring_slot *slot,
+					 uint64_t lock)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->lock, __ATOMIC_RELAXED)==lock ? 0 : -1;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Frame ring in POSIX shared memory, for analysis processes on the same
+ host. One writer, any number of readers; readers never block writer.
+
+ Layout: struct shmring_header, followed by 'slots' struct shmring_slot.
+ Frame n goes to slot n % slots. Each slot is a seqlock: 'lock' is odd
+ while writer updates slot, and even (2 * (frame + 1)) once frame is
+ complete. Readers check 'lock' before and after using slot, and retry
+ or skip if it changed. 'head' is number of frames published so far.
+
+ Samples are deskewed and interleaved by channel, as shown on display.
+ All timestamps are CLOCK_MONOTONIC, in nanoseconds.
+*/
+
+#define SHMRING_MAGIC      "OSCOSHM1"
+#define SHMRING_VERSION    1
+#define SHMRING_SLOTS      64
+#define SHMRING_SLOT_DATA  1024
+
+struct shmring_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t reserved;
+	uint64_t head;
+};
+
+struct shmring_slot {
+	uint64_t lock;
+	uint64_t frame;
+	uint64_t timestamp;
+	double rate;         /* Samples per second, per channel */
+	uint32_t samples;    /* Per channel */
+	uint16_t channels;
+	uint16_t reserved;
+	unsigned char data[SHMRING_SLOT_DATA];
+};
+
+struct shmring;
+
+/* Writer */
+struct shmring *shmring_create(const char *name, unsigned slots);
+void shmring_publish(struct shmring *ring, const unsigned char *data, size_t size,
+					 unsigned channels, double rate);
+void shmring_destroy(struct shmring *ring);
+
+/* Reader */
+struct shmring *shmring_open(const char *name);
+void shmring_close(struct shmring *ring);
+
+/* Frames published so far */
+uint64_t shmring_head(const struct shmring *ring);
+
+/* Zero-copy read of frame: returns slot, or NULL if frame is not (or no
+ longer) in ring. Slot contents are only valid if shmring_read_end()
+ then returns 0 */
+const struct shmring_slot *shmring_read_begin(const struct shmring *ring,
+											  uint64_t frame, uint64_t *lock);
+int shmring_read_end(const struct shmring *ring, const struct shmring_slot *slot,
+					 uint64_t lock);
+
+uint64_t shmring_now(void);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <string.h>
+
+/*
+ Small SIMD helpers, using GCC vector extensions. Compiler will map
+ these to SSE/AVX/NEON when available, or to plain scalar code.
+ Loads and stores go through memcpy() so they work on unaligned data.
+ */
+
+#define V4SF_WIDTH 4
+#define V4SI_WIDTH 4
+#define V16QU_WIDTH 16
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef unsigned int v4su __attribute__((vector_size(16)));
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+
+static inline v4sf v4sf_load(const float *p)
+{
+	v4sf v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void v4sf_store(float *p, v4sf v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline v4sf v4sf_set1(float f)
+{
+	v4sf v = { f, f, f, f };
+	return v;
+}
+
+static inline v4si v4si_load(const int *p)
+{
+	v4si v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void v4si_store(int *p, v4si v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline v4si v4si_set1(int i)
+{
+	v4si v = { i, i, i, i };
+	return v;
+}
+
+/* Widen four 8-bit samples */
+static inline v4si v4si_load_u8(const unsigned char *p)
+{
+	v4si v = { p[0], p[1], p[2], p[3] };
+	return v;
+}
+
+static inline void v4si_store_u8(unsigned char *p, v4si v)
+{
+	p[0] = v[0];
+	p[1] = v[1];
+	p[2] = v[2];
+	p[3] = v[3];
+}
+
+static inline void v4si_store_u16(unsigned short *p, v4si v)
+{
+	p[0] = v[0];
+	p[1] = v[1];
+	p[2] = v[2];
+	p[3] = v[3];
+}
+
+static inline v16qu v16qu_load(const unsigned char *p)
+{
+	v16qu v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void v16qu_store(unsigned char *p, v16qu v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline v16qu v16qu_set1(unsigned char c)
+{
+	v16qu v = { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+	return v;
+}
+
+/* Top bit of each byte, byte 0 in bit 0 */
+static inline unsigned v16qu_movemask(v16qu v)
+{
+#ifdef __SSE2__
+	typedef char v16qi __attribute__((vector_size(16)));
+	return __builtin_ia32_pmovmskb128((v16qi)v);
+#else
+	unsigned m = 0;
+	int i;
+	for (i=0; i<V16QU_WIDTH; i++)
+		m |= (unsigned)(v[i] >> 7) << i;
+	return m;
+#endif
+}
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "stream.h"
+
+static int stream_unix_address(const char *path, struct sockaddr_un *sun)
+{
+	if (strlen(path) >= sizeof(sun->sun_path))
+		return -1;
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+static struct addrinfo *stream_tcp_address(const char *address, int passive)
+{
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port = strrchr(address, ':');
+	int r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	if (port) {
+		if (port - address >= sizeof(host))
+			return NULL;
+		memcpy(host, address, port - address);
+		host[port - address] = '\0';
+		port++;
+	} else {
+		strcpy(host, passive ? "" : "localhost");
+		port = address;
+	}
+
+	r = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	if (r!=0) {
+		fprintf(stderr,"%s: %s\n", address, gai_strerror(r));
+		return NULL;
+	}
+	return res;
+}
+
+int stream_listen(const char *address)
+{
+	struct sockaddr_un sun;
+	struct addrinfo *res, *ai;
+	int fd = -1, on = 1;
+
+	if (strchr(address, '/')) {
+		if (stream_unix_address(address, &sun)<0)
+			return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd<0)
+			return -1;
+		unlink(address);
+		if (bind(fd, (struct sockaddr*)&sun, sizeof(sun))<0 || listen(fd, 64)<0) {
+			perror(address);
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	res = stream_tcp_address(address, 1);
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd<0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen)==0 && listen(fd, 64)==0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (res)
+		freeaddrinfo(res);
+	if (fd<0)
+		perror(address);
+	return fd;
+}
+
+int stream_connect(const char *address)
+{
+	struct sockaddr_un sun;
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (strchr(address, '/')) {
+		if (stream_unix_address(address, &sun)<0)
+			return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd>=0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun))<0) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	res = stream_tcp_address(address, 0);
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd<0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen)==0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (res)
+		freeaddrinfo(res);
+	return fd;
+}
+
+size_t stream_pack(unsigned char *out, const unsigned char *in, size_t size,
+				   unsigned stride)
+{
+	size_t i, n = 0;
+	int d;
+	unsigned char prev;
+
+	if (stride==0)
+		stride = 1;
+
+#define PUT_NIBBLE(v) do { \
+		if (n/2 >= size) return 0; \
+		if (n & 1) out[n/2] |= (v) & 0xf; else out[n/2] = (v) << 4; \
+		n++; \
+	} while (0)
+
+	for (i=0; i<size; i++) {
+		prev = i<stride ? 0x80 : in[i-stride];
+		d = (signed char)(in[i] - prev);
+		if (d>=-7 && d<=7) {
+			PUT_NIBBLE(d & 0xf);
+		} else {
+			PUT_NIBBLE(0x8);
+			PUT_NIBBLE(in[i] >> 4);
+			PUT_NIBBLE(in[i] & 0xf);
+		}
+	}
+#undef PUT_NIBBLE
+
+	n = (n + 1) / 2;
+	return n < size ? n : 0;
+}
+
+int stream_unpack(unsigned char *out, size_t size, const unsigned char *in,
+				  size_t insize, unsigned stride)
+{
+	size_t i, n = 0;
+	unsigned char v, prev;
+
+	if (stride==0)
+		stride = 1;
+
+#define GET_NIBBLE(v) do { \
+		if (n/2 >= insize) return -1; \
+		v = (n & 1) ? in[n/2] & 0xf : in[n/2] >> 4; \
+		n++; \
+	} while (0)
+
+	for (i=0; i<size; i++) {
+		prev = i<stride ? 0x80 : out[i-stride];
+		GET_NIBBLE(v);
+		if (v==0x8) {
+			GET_NIBBLE(v);
+			out[i] = v << 4;
+			GET_NIBBLE(v);
+			out[i] |= v;
+		} else {
+			/* Sign-extend 4-bit delta */
+			out[i] = prev + (signed char)(v<<4) / 16;
+		}
+	}
+#undef GET_NIBBLE
+	return 0;
+}
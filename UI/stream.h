@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ Stream served to viewers by server.c. Messages use same framing as the
+ device protocol (see proto.h). All values are little-endian.
+
+ Server to client:
+   STREAM_HELLO         - u8 version, u32 target CPU frequency in Hz
+   STREAM_PARAMETERS    - COMMAND_PARAMETERS_REPLY payload
+   STREAM_FRAME         - u32 sequence, u64 timestamp (microseconds
+                          since epoch), COMMAND_BUFFER_SEG payload
+   STREAM_FRAME_PACKED  - u32 sequence, u64 timestamp, u8 stride,
+                          u16 unpacked size, packed samples
+
+ Client to server:
+   STREAM_SUBSCRIBE     - u8 flags (STREAM_FLAG_*)
+
+ Sequence counts every frame published, so gaps show frames dropped for
+ a slow client.
+
+ Packed samples are 4-bit deltas to the sample one stride earlier, most
+ significant nibble first. Nibble 0x8 escapes a literal 8-bit sample,
+ which follows as two nibbles. Stride is the number of channels.
+*/
+
+#define STREAM_VERSION          1
+
+#define STREAM_HELLO            0x01
+#define STREAM_PARAMETERS       0x02
+#define STREAM_FRAME            0x03
+#define STREAM_FRAME_PACKED     0x04
+#define STREAM_SUBSCRIBE        0x10
+
+#define STREAM_FLAG_PACKED      (1<<0)
+
+#define STREAM_HELLO_SIZE       5
+#define STREAM_FRAME_HEADER     12
+#define STREAM_PACKED_HEADER    15
+
+/* Address is a Unix socket path if it contains '/', otherwise a TCP
+ [host:]port. Return a socket, or -1 */
+int stream_listen(const char *address);
+int stream_connect(const char *address);
+
+/* Returns packed size, or 0 if packing would not save space */
+size_t stream_pack(unsigned char *out, const unsigned char *in, size_t size,
+				   unsigned stride);
+/* Returns 0, or -1 if input is truncated */
+int stream_unpack(unsigned char *out, size_t size, const unsigned char *in,
+				  size_t insize, unsigned stride);
+
+static inline void stream_put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t stream_get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static inline void stream_put_le64(unsigned char *p, uint64_t v)
+{
+	stream_put_le32(p, v);
+	stream_put_le32(p + 4, v >> 32);
+}
+
+static inline uint64_t stream_get_le64(const unsigned char *p)
+{
+	return stream_get_le32(p) | ((uint64_t)stream_get_le32(p + 4) << 32);
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+struct trace_ring {
+	struct trace_ring *next;
+	unsigned tid;
+	/* Spans written so far; slot is head % TRACE_RING_SIZE */
+	unsigned long head;
+	struct trace_span span[TRACE_RING_SIZE];
+};
+
+struct trace_stats {
+	unsigned long head;
+	uint32_t us[TRACE_STATS];
+};
+
+int trace_on = 0;
+
+static struct trace_ring *rings = NULL;
+static unsigned num_rings = 0;
+static __thread struct trace_ring *ring = NULL;
+static __thread unsigned long current_frame = 0;
+static struct trace_stats stats[TRACE_STAGES];
+
+static const char *const stage_names[TRACE_STAGES] = {
+	"read",
+	"parse",
+	"process",
+	"queue",
+	"set_data",
+	"fft",
+	"paint_wait",
+	"paint"
+};
+
+void trace_enable(int enable)
+{
+	__atomic_store_n(&trace_on, enable, __ATOMIC_RELEASE);
+}
+
+uint64_t trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_set_frame(unsigned long frame)
+{
+	current_frame = frame;
+}
+
+unsigned long trace_get_frame(void)
+{
+	return current_frame;
+}
+
+const char *trace_stage_name(enum trace_stage stage)
+{
+	return stage<TRACE_STAGES ? stage_names[stage] : "?";
+}
+
+/* First span of this thread. Rings are never freed */
+static struct trace_ring *thread_ring(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+
+	if (NULL==r)
+		return NULL;
+	r->tid = __atomic_add_fetch(&num_rings, 1, __ATOMIC_RELAXED);
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return r;
+}
+
+void trace_record(enum trace_stage stage, uint64_t start, uint64_t end,
+				  unsigned long frame, long arg)
+{
+	struct trace_span *s;
+	struct trace_stats *st;
+
+	if (NULL==ring && NULL==(ring = thread_ring()))
+		return;
+	s = &ring->span[ring->head % TRACE_RING_SIZE];
+	s->start = start;
+	s->end = end;
+	s->frame = frame;
+	s->arg = arg;
+	s->stage = stage;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+	if (stage<TRACE_STAGES) {
+		st = &stats[stage];
+		st->us[st->head % TRACE_STATS] = end>start ? end - start : 0;
+		__atomic_store_n(&st->head, st->head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+unsigned trace_percentiles(enum trace_stage stage, unsigned *p50, unsigned *p99)
+{
+	uint32_t us[TRACE_STATS];
+	unsigned long head;
+	unsigned n;
+
+	*p50 = *p99 = 0;
+	if (stage>=TRACE_STAGES)
+		return 0;
+	head = __atomic_load_n(&stats[stage].head, __ATOMIC_ACQUIRE);
+	n = head<TRACE_STATS ? head : TRACE_STATS;
+	if (n==0)
+		return 0;
+	memcpy(us, stats[stage].us, n * sizeof(us[0]));
+	qsort(us, n, sizeof(us[0]), &cmp_u32);
+	*p50 = us[(n - 1) / 2];
+	*p99 = us[(n - 1) * 99 / 100];
+	return n;
+}
+
+int trace_dump(const char *path)
+{
+	struct trace_ring *r;
+	const struct trace_span *s;
+	unsigned long head, i;
+	const char *sep = "";
+	FILE *out;
+
+	out = fopen(path, "w");
+	if (NULL==out) {
+		perror(path);
+		return -1;
+	}
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (r=__atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r=r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (i = head>TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i<head; i++) {
+			s = &r->span[i % TRACE_RING_SIZE];
+			fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+					"\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu,"
+					"\"args\":{\"frame\":%lu",
+					sep, trace_stage_name(s->stage), r->tid,
+					(unsigned long long)s->start,
+					(unsigned long long)(s->end>s->start ? s->end - s->start : 0),
+					s->frame);
+			if (s->arg>=0)
+				fprintf(out, ",\"arg\":%ld", s->arg);
+			fprintf(out, "}}");
+			sep = ",";
+		}
+	}
+	fprintf(out, "\n]}\n");
+	if (fclose(out)!=0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+void trace_print_stats(FILE *out)
+{
+	unsigned stage, p50, p99, n;
+
+	for (stage=0; stage<TRACE_STAGES; stage++) {
+		n = trace_percentiles(stage, &p50, &p99);
+		if (n)
+			fprintf(out, "%-10s p50 %6u us  p99 %6u us  (%u frames)\n",
+					trace_stage_name(stage), p50, p99, n);
+	}
+}
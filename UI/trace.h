@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ Latency tracing, from serial bytes to pixels.
+
+ Each stage a frame goes through records a span: start and end time,
+ frame number and an optional argument. Spans go to a ring buffer of
+ the thread recording them, so recording takes no lock; rings are
+ registered once per thread. Per stage, the last TRACE_STATS latencies
+ are kept for p50/p99. Each stage is recorded by one thread only.
+
+ When disabled, a trace point costs one load and branch: trace_now()
+ returns 0 without reading the clock, and trace_span() ignores spans
+ starting at 0.
+
+ trace_dump() writes Chrome trace-event JSON, for chrome://tracing or
+ Perfetto. Disable tracing first: spans recorded while dumping may come
+ out torn.
+ */
+
+enum trace_stage {
+	/* First to last byte of frame read from tty */
+	TRACE_READ,
+	/* Last byte read to frame reassembled and parsed */
+	TRACE_PARSE,
+	/* Filters, mask, average, decoders and frame callbacks */
+	TRACE_PROCESS,
+	/* Frame queued by reader thread to picked up by main loop */
+	TRACE_QUEUE,
+	/* Display: scope_display_set_data(), FFT, and waiting for expose */
+	TRACE_SET_DATA,
+	TRACE_FFT,
+	TRACE_PAINT_WAIT,
+	TRACE_PAINT,
+	TRACE_STAGES
+};
+
+#define TRACE_RING_SIZE  8192
+#define TRACE_STATS      256
+
+struct trace_span {
+	uint64_t start;
+	uint64_t end;
+	unsigned long frame;
+	long arg;
+	unsigned short stage;
+};
+
+extern int trace_on;
+
+void trace_enable(int enable);
+
+static inline int trace_enabled(void)
+{
+	return __builtin_expect(trace_on, 0);
+}
+
+/* Monotonic clock in microseconds, same as g_get_monotonic_time() */
+uint64_t trace_clock(void);
+
+/* Clock, or 0 when disabled */
+static inline uint64_t trace_now(void)
+{
+	return trace_enabled() ? trace_clock() : 0;
+}
+
+void trace_record(enum trace_stage stage, uint64_t start, uint64_t end,
+				  unsigned long frame, long arg);
+
+static inline void trace_span(enum trace_stage stage, uint64_t start, uint64_t end,
+							  unsigned long frame)
+{
+	if (start)
+		trace_record(stage, start, end, frame, -1);
+}
+
+/* Same, with argument shown in trace viewer, e.g. a device timestamp */
+static inline void trace_span_arg(enum trace_stage stage, uint64_t start, uint64_t end,
+								  unsigned long frame, long arg)
+{
+	if (start)
+		trace_record(stage, start, end, frame, arg);
+}
+
+/* Frame the calling thread works on, for stages that are not told */
+void trace_set_frame(unsigned long frame);
+unsigned long trace_get_frame(void);
+
+const char *trace_stage_name(enum trace_stage stage);
+
+/* Percentiles of recent latencies of stage, in microseconds. Returns
+ number of latencies they come from, 0 if none */
+unsigned trace_percentiles(enum trace_stage stage, unsigned *p50, unsigned *p99);
+
+/* Returns -1 on error */
+int trace_dump(const char *path);
+
+/* Table of stage percentiles, one line per stage with data */
+void trace_print_stats(FILE *out);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trigger.h"
+
+static const char *mode_names[TRIGGER_MODE_MAX + 1] = {
+	[TRIGGER_MODE_EDGE]       = "edge",
+	[TRIGGER_MODE_HYSTERESIS] = "hyst",
+	[TRIGGER_MODE_PULSE_GT]   = "pulse-gt",
+	[TRIGGER_MODE_PULSE_LT]   = "pulse-lt",
+	[TRIGGER_MODE_WINDOW_IN]  = "window-in",
+	[TRIGGER_MODE_WINDOW_OUT] = "window-out",
+	[TRIGGER_MODE_RUNT]       = "runt",
+};
+
+const char *trigger_mode_name(unsigned char mode)
+{
+	return mode<=TRIGGER_MODE_MAX ? mode_names[mode] : NULL;
+}
+
+int trigger_parse(const char *spec, struct trigger_mode *t)
+{
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+	unsigned char mode;
+	unsigned long v = 0;
+	char *end;
+
+	memset(t, 0, sizeof(*t));
+	t->level2 = 255;
+
+	for (mode=0; mode<=TRIGGER_MODE_MAX; mode++)
+		if (strlen(mode_names[mode])==len && strncmp(spec, mode_names[mode], len)==0)
+			break;
+	if (mode>TRIGGER_MODE_MAX)
+		goto bad;
+	t->mode = mode;
+
+	if (mode==TRIGGER_MODE_EDGE) {
+		if (arg)
+			goto bad;
+		return 0;
+	}
+	if (!arg || !arg[1])
+		goto bad;
+	v = strtoul(arg + 1, &end, 0);
+	if (*end || v>255)
+		goto bad;
+
+	switch (mode) {
+	case TRIGGER_MODE_HYSTERESIS:
+	case TRIGGER_MODE_PULSE_GT:
+	case TRIGGER_MODE_PULSE_LT:
+		t->param = v;
+		break;
+	default:
+		t->level2 = v;
+		break;
+	}
+	return 0;
+bad:
+	fprintf(stderr,"Bad trigger mode '%s': want edge, hyst:n, pulse-gt:n, pulse-lt:n,\n"
+			"window-in:level, window-out:level or runt:level, n and level up to 255\n",
+			spec);
+	return -1;
+}
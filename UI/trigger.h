@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __TRIGGER_H__
+#define __TRIGGER_H__
+
+#include "../protocol.h"
+
+/* Analog trigger modes (COMMAND_SET_TRIGGER_MODE) */
+
+struct trigger_mode {
+	unsigned char mode;   /* TRIGGER_MODE_* */
+	unsigned char level2; /* Window and runt second level */
+	unsigned char param;  /* Hysteresis, or pulse width in samples */
+};
+
+/*
+ Parse a trigger mode, level being the one set with COMMAND_SET_TRIGGER:
+
+   edge             plain edge, the default
+   hyst:n           edge, once signal was n below level
+   pulse-gt:n       end of pulse above level wider than n samples
+   pulse-lt:n       end of pulse above level narrower than n samples
+   window-in:l2     signal enters band between level and l2
+   window-out:l2    signal leaves band between level and l2
+   runt:l2          pulse rises past level but not up to l2
+
+ With inverted trigger, "above" reads "below" and l2 of runt is below
+ level. Returns -1 on error.
+ */
+int trigger_parse(const char *spec, struct trigger_mode *t);
+
+/* Spec name of mode, NULL if unknown */
+const char *trigger_mode_name(unsigned char mode);
+
+#endif
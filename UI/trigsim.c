@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2009 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ oscope-trigsim: run the firmware trigger state machine (../trigstate.h)
+ on synthetic waveforms, the way the ADC ISR feeds it, and check each
+ mode triggers on the expected sample or not at all. Run by make check.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "../trigstate.h"
+
+#define WAVE_MAX 1024
+
+struct wave {
+	uint8_t v[WAVE_MAX];
+	unsigned n;
+};
+
+static void hold(struct wave *w, uint8_t v, unsigned count)
+{
+	while (count-- && w->n<WAVE_MAX)
+		w->v[w->n++] = v;
+}
+
+/* Alternate v-a and v+a, starting below */
+static void noise(struct wave *w, uint8_t v, uint8_t a, unsigned count)
+{
+	unsigned i;
+
+	for (i=0; i<count && w->n<WAVE_MAX; i++)
+		w->v[w->n++] = i & 1 ? v + a : v - a;
+}
+
+static void ramp(struct wave *w, uint8_t from, uint8_t to, unsigned count)
+{
+	unsigned i;
+
+	for (i=0; i<count && w->n<WAVE_MAX; i++)
+		w->v[w->n++] = from + ((int)to - from) * (int)i / (int)(count - 1);
+}
+
+/* As the ISR does from arm: samples XORed with invert, last is 255
+ after holdoff. Index of sample that triggered, -1 if none */
+static int run(const struct wave *w, uint8_t mode, uint8_t level,
+			   uint8_t level2, uint8_t param, int inverted)
+{
+	struct trigger_state t;
+	uint8_t last = 255;
+	uint8_t v;
+	unsigned i;
+
+	trigger_state_setup(&t, mode, level, level2, param, inverted ? 0xff : 0);
+	for (i=0; i<w->n; i++) {
+		v = w->v[i] ^ t.invert;
+		if (trigger_state_check(&t, v, last))
+			return i;
+		last = v;
+	}
+	return -1;
+}
+
+static unsigned cases, failures;
+
+static void expect(const char *name, int got, int expected)
+{
+	cases++;
+	if (got==expected)
+		return;
+	failures++;
+	printf("FAIL %s: triggered at %d, expected %d\n", name, got, expected);
+}
+
+int main(void)
+{
+	struct wave w;
+
+	/* Edge */
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 10);
+	ramp(&w, 50, 200, 16);
+	expect("edge, ramp", run(&w, TRIGGER_MODE_EDGE, 128, 255, 0, 0), 18);
+
+	memset(&w, 0, sizeof(w));
+	noise(&w, 128, 3, 40);
+	expect("edge, noise at level", run(&w, TRIGGER_MODE_EDGE, 128, 255, 0, 0), 1);
+
+	/* Hysteresis, level 128, arms below 118 */
+	expect("hysteresis, noise at level",
+		   run(&w, TRIGGER_MODE_HYSTERESIS, 128, 255, 10, 0), -1);
+
+	memset(&w, 0, sizeof(w));
+	noise(&w, 128, 3, 20);
+	hold(&w, 110, 5);
+	noise(&w, 128, 3, 20);
+	expect("hysteresis, dip then rise",
+		   run(&w, TRIGGER_MODE_HYSTERESIS, 128, 255, 10, 0), 26);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 5);
+	hold(&w, 120, 5);
+	hold(&w, 200, 5);
+	expect("hysteresis, dip not below arm",
+		   run(&w, TRIGGER_MODE_HYSTERESIS, 128, 255, 10, 0), -1);
+
+	/* Pulse wider than 5 samples */
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 200, 5);
+	hold(&w, 50, 5);
+	expect("pulse-gt, 5 wide", run(&w, TRIGGER_MODE_PULSE_GT, 128, 255, 5, 0), -1);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 200, 6);
+	hold(&w, 50, 5);
+	expect("pulse-gt, 6 wide", run(&w, TRIGGER_MODE_PULSE_GT, 128, 255, 5, 0), 11);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 200, 300);
+	hold(&w, 50, 5);
+	expect("pulse-gt, 300 wide", run(&w, TRIGGER_MODE_PULSE_GT, 128, 255, 5, 0), 305);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 10);
+	hold(&w, 50, 5);
+	expect("pulse-gt, in progress at arm",
+		   run(&w, TRIGGER_MODE_PULSE_GT, 128, 255, 5, 0), -1);
+
+	/* Pulse narrower than 5 samples */
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 200, 4);
+	hold(&w, 50, 5);
+	expect("pulse-lt, 4 wide", run(&w, TRIGGER_MODE_PULSE_LT, 128, 255, 5, 0), 9);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 200, 5);
+	hold(&w, 50, 5);
+	expect("pulse-lt, 5 wide", run(&w, TRIGGER_MODE_PULSE_LT, 128, 255, 5, 0), -1);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 2);
+	hold(&w, 50, 5);
+	expect("pulse-lt, in progress at arm",
+		   run(&w, TRIGGER_MODE_PULSE_LT, 128, 255, 5, 0), -1);
+
+	/* Window 100 to 150 */
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 120, 5);
+	expect("window-in, from below", run(&w, TRIGGER_MODE_WINDOW_IN, 100, 150, 0, 0), 5);
+	expect("window-in, levels swapped", run(&w, TRIGGER_MODE_WINDOW_IN, 150, 100, 0, 0), 5);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 5);
+	hold(&w, 120, 5);
+	expect("window-in, from above", run(&w, TRIGGER_MODE_WINDOW_IN, 100, 150, 0, 0), 5);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 120, 10);
+	expect("window-in, inside at arm", run(&w, TRIGGER_MODE_WINDOW_IN, 100, 150, 0, 0), -1);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 120, 5);
+	hold(&w, 200, 5);
+	expect("window-out, above", run(&w, TRIGGER_MODE_WINDOW_OUT, 100, 150, 0, 0), 5);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 120, 5);
+	hold(&w, 50, 5);
+	expect("window-out, below", run(&w, TRIGGER_MODE_WINDOW_OUT, 100, 150, 0, 0), 5);
+
+	/* Runt, level 100, full pulse reaches 200 */
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 220, 5);
+	hold(&w, 50, 5);
+	expect("runt, full pulse", run(&w, TRIGGER_MODE_RUNT, 100, 200, 0, 0), -1);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 150, 5);
+	hold(&w, 50, 5);
+	expect("runt, runt", run(&w, TRIGGER_MODE_RUNT, 100, 200, 0, 0), 10);
+
+	/* Inverted: same modes on a falling signal */
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 10);
+	ramp(&w, 200, 50, 16);
+	expect("inverted edge", run(&w, TRIGGER_MODE_EDGE, 128, 255, 0, 1), 18);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 5);
+	hold(&w, 50, 8);
+	hold(&w, 200, 5);
+	expect("inverted pulse-gt", run(&w, TRIGGER_MODE_PULSE_GT, 128, 255, 5, 1), 13);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 5);
+	hold(&w, 120, 5);
+	hold(&w, 200, 5);
+	expect("inverted runt", run(&w, TRIGGER_MODE_RUNT, 150, 50, 0, 1), 10);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 200, 5);
+	hold(&w, 30, 5);
+	hold(&w, 200, 5);
+	expect("inverted runt, full pulse", run(&w, TRIGGER_MODE_RUNT, 150, 50, 0, 1), -1);
+
+	memset(&w, 0, sizeof(w));
+	hold(&w, 50, 5);
+	hold(&w, 120, 5);
+	expect("inverted window-in", run(&w, TRIGGER_MODE_WINDOW_IN, 100, 150, 0, 1), 5);
+
+	printf("%u trigger cases, %u failed\n", cases, failures);
+	return failures ? 1 : 0;
+}
@@ -19,7 +19,9 @@
 #include <avr/io.h>
 #include <avr/power.h>
 #include <avr/interrupt.h>
+#include <util/crc16.h>
 #include "protocol.h"
+#include "trigstate.h"
 
 /* Baud rate, for communication with PC */
 #define BAUD_RATE 115200
@@ -49,6 +51,13 @@ static unsigned short dataBufferPtr;
 /* Current trigger level. 0 means no trigger */
 static unsigned char triggerLevel;
 
+/* Trigger mode, see COMMAND_SET_TRIGGER_MODE. trig is what the ISR
+ works from, see trigstate.h */
+static uint8_t triggerMode;
+static uint8_t triggerLevel2;
+static uint8_t triggerParam;
+static struct trigger_state trig;
+
 /* Auto-trigger samples. If we don't trigger and we reach this number of
  samples without triggerting, then we trigger */
 static unsigned char autoTrigSamples;
@@ -65,6 +74,11 @@ static unsigned char prescale;
 /* Current ACD reference */
 static unsigned char adcref;
 
+/* Timer1 clock select and compare value, when ADC conversions are
+ triggered by Timer1. A zero clock select means ADC is free-running */
+static unsigned char timerClock;
+static unsigned short timerTop;
+
 /* Current flags. See defines below */
 static byte gflags = 0;
 
@@ -78,28 +92,128 @@ static enum state st;
 static uint8_t channels;
 static uint8_t current_channel;
 
+/* Options negotiated with COMMAND_SET_PROTOCOL_OPTIONS */
+static uint8_t protocolOptions;
+
+/* Logic analyzer mode, see COMMAND_SET_LOGIC. Trigger fires when lines
+ in logicMask|logicEdge match logicValue, and a line in logicEdge has just
+ changed */
+static uint8_t logicFlags;
+static uint8_t logicMask;
+static uint8_t logicValue;
+static uint8_t logicEdge;
+
+/* Port sampled in logic mode. PD0 and PD1 are the serial port */
+#define LOGIC_PIN PIND
+
+/* Logic trigger is polled, much faster than samples come in analog
+ mode. Auto-trigger waits this many 256-poll rounds per
+ autoTrigSamples, about 0.25s for the usual 100 */
+#define LOGIC_AUTOTRIG_POLLS 16
+
+/* Memory segments, see COMMAND_SET_MEMSEG. Segment being filled spans
+ memsegStart to memsegEnd. memsegSaw is cleared if any segment of
+ capture was auto-triggered */
+static uint8_t memsegCount;
+static uint8_t memsegIndex;
+static unsigned short memsegLength;
+static unsigned short memsegStart;
+static unsigned short memsegEnd;
+static uint8_t memsegSaw;
+
+/* Identifies capture held in dataBuffer, for COMMAND_GET_SEGMENT */
+static uint8_t captureId;
+
+/* Outgoing packet state, see packet_begin() */
+static unsigned char txCksum;
+
+/* COBS receive state. Bytes left in current block, and whether block
+ ends with an implied zero */
+static uint8_t cobsLeft;
+static uint8_t cobsZero;
+
+/* Consecutive zeroes received. Enough of them fall back to size-prefixed
+ framing, see reset procedure in README.protocol */
+static uint8_t zeroCount;
+
+/* Piece of an outgoing packet. Packets are sent from several buffers, so
+ that segments can be built straight from dataBuffer */
+struct txpiece {
+	const unsigned char *buf;
+	unsigned short size;
+};
+
+/* Command, payload pieces and checksum */
+#define MAX_TX_PIECES 5
+
+/* Performance counters. See COMMAND_GET_STATS */
+static struct {
+	uint32_t conversions;      /* Conversions seen by ADC ISR */
+	uint32_t stored;           /* Samples stored in dataBuffer */
+	uint32_t missed;           /* ADIF already set when ISR returned */
+	uint32_t autoTriggers;     /* Captures started by auto-trigger */
+	uint32_t realTriggers;     /* Captures started by trigger level */
+	uint32_t txStallUs;        /* Time spent blocked in send_packet() */
+	uint8_t  maxIsrTicks;      /* Longest ADC ISR, in Timer2 ticks */
+	uint16_t rxChecksumErrors; /* Received packets failing checksum */
+	uint16_t rxOversize;       /* Received packets over MAX_PACKET_SIZE */
+} stats;
+
+/* Timer2 prescaler, used to measure ISR length */
+#define STATS_TIMER_DIV 8
+
 #define BYTE_FLAG_TRIGGERED       (1<<7) /* Signal is triggered */
 #define BYTE_FLAG_STARTCONVERSION (1<<6) /* Request conversion to start */
 #define BYTE_FLAG_CONVERSIONDONE  (1<<5) /* Conversion done flag */
 #define BYTE_FLAG_STOREDATA       (1<<4) /* Internal flag - store data in buffer */
 #define BYTE_FLAG_SAWTRIGGER      (1<<3) /* Whether we found trigger or was auto */
-#define BYTE_FLAG_IGNORE_SAMPLE   (1<<2) /* Ignore next sample - we have a 2-ADC clock delay */
 #define BYTE_FLAG_JUST_TRIGGERED  (1<<1) /* Just triggered */
 
 #define BYTE_FLAG_INVERTTRIGGER   FLAG_INVERT_TRIGGER /* Trigger is inverted (negative edge) */
 
 #define BIT(x) (1<<x)
 
+static void setup_timer()
+{
+	TCCR1B = 0; // Stop timer
+	TCCR1A = 0;
+	TCNT1 = 0;
+
+	if (timerClock) {
+		/* CTC mode, TOP=OCR1A. Compare B fires at same time, and it's
+		 what triggers the ADC */
+		OCR1A = timerTop;
+		OCR1B = timerTop;
+		TIFR1 = BIT(OCF1B);
+		TCCR1B = BIT(WGM12) | (timerClock & 0x7);
+	}
+}
+
 static void setup_adc()
 {
 	ADCSRA = 0;
-	ADCSRB = 0; // Free-running mode
+	if (logicFlags & LOGIC_FLAG_ENABLE) {
+		/* ADC stays off, Timer1 may still pace samples */
+		setup_timer();
+		return;
+	}
+	if (timerClock)
+		ADCSRB = BIT(ADTS2)|BIT(ADTS0); // Timer1 compare match B
+	else
+		ADCSRB = 0; // Free-running mode
 	// DIDR0 = ~1; // Enable only first analog input
 	ADMUX = 0x20; // left-aligned, channel 0
 	ADMUX |= (adcref<<REFS0); // internal 1.1v reference, left-aligned, channel 0
 
 	PRR &= ~BIT(PRADC); /* Disable ADC power reduction */
 	ADCSRA = BIT(ADIE)|BIT(ADEN)|BIT(ADSC)|BIT(ADATE)|prescale; // Start conversion, enable autotrigger
+	setup_timer();
+}
+
+static void setup_stats_timer()
+{
+	TCCR2A = 0;
+	TCCR2B = BIT(CS21); // Normal mode, clk/8
 }
 
 static void start_sampling()
@@ -116,9 +230,27 @@ static void adc_set_frequency(unsigned char divider)
 	ADCSRA |= (divider & 0x7);
 }
 
+/* Logic captures are never segmented */
+static uint8_t memseg_count()
+{
+	return (logicFlags & LOGIC_FLAG_ENABLE) ? 1 : memsegCount;
+}
+
+/* Rewind to first segment. Call with interrupts off */
+static void memseg_rewind()
+{
+	memsegIndex = 0;
+	memsegLength = numSamples / memseg_count();
+	memsegStart = 0;
+	memsegEnd = memsegLength;
+	memsegSaw = 1;
+}
+
+/* Zero would wrap capture loops, fewer samples than segments leaves
+ segments empty */
 static void set_num_samples(unsigned short num)
 {
-	if (num>1024)
+	if (num==0 || num>1024 || num<memsegCount)
 		return;
 
 	if (NULL!=dataBuffer)
@@ -128,61 +260,299 @@ static void set_num_samples(unsigned short num)
 	cli();
 
 	numSamples  = num;
-	dataBuffer = (unsigned char*)malloc(numSamples + 2);
-    // Why +1 ? So we can store some flags and values.
+	dataBuffer = (unsigned char*)malloc(numSamples + TRAILER_SIZE +
+										(memsegCount>1 ? memsegCount * MEMSEG_INFO_SIZE : 0));
+    // Why more? So we can store some flags and values.
+	gflags &= ~(BYTE_FLAG_STOREDATA|BYTE_FLAG_TRIGGERED|BYTE_FLAG_SAWTRIGGER);
+	dataBufferPtr = 0;
+	current_channel = 0;
+	memseg_rewind();
+
+	sei();
+}
 
+static void set_memseg(uint8_t count)
+{
+	if (count<1 || count>MEMSEG_MAX || count>numSamples)
+		return;
+	memsegCount = count;
+	/* Segment info lives after trailer */
+	set_num_samples(numSamples);
+}
+
+
+/* Work out trigger levels as ISR sees them. Call whenever trigger level,
+ mode or flags change */
+static void trigger_setup()
+{
+	uint8_t inv = (gflags & BYTE_FLAG_INVERTTRIGGER) ? 0xff : 0;
+
+	cli();
+	trigger_state_setup(&trig, triggerMode, triggerLevel, triggerLevel2,
+						triggerParam, inv);
 	sei();
 }
 
+static void rx_reset()
+{
+	st = SIZE;
+	pSize = 0;
+	pBufPtr = 0;
+	cksum = 0;
+	cobsLeft = 0;
+	cobsZero = 0;
+}
 
 void setup()
 {
 	prescale = BIT(ADPS0)|BIT(ADPS1)|BIT(ADPS2);
 	adcref = 0x0; // Default
+	timerClock = TIMER_CLOCK_NONE;
+	timerTop = 0;
 	dataBuffer=NULL;
 	triggerLevel=0;
+	triggerMode = TRIGGER_MODE_EDGE;
+	triggerLevel2 = 255;
+	triggerParam = 0;
 	autoTrigSamples = 255;
 	autoTrigCount = 0;
 	holdoffSamples = 0;
 	channels = 1;
 	current_channel = 0;
+	protocolOptions = 0;
+	captureId = 0;
+	logicFlags = 0;
+	logicMask = 0;
+	logicValue = 0;
+	logicEdge = 0;
+	memsegCount = 1;
     gflags=0;
 
+	memset(&stats, 0, sizeof(stats));
+
 	Serial.begin(BAUD_RATE);
+	setup_stats_timer();
 	setup_adc();
 
 
 	set_num_samples(962);
-	st = SIZE;
+	zeroCount = 0;
+	rx_reset();
 }
 
-static void send_packet(unsigned char command, unsigned char *buf, unsigned short size)
+static void packet_begin(unsigned char command, unsigned short size)
 {
-	unsigned char cksum=command;
-	unsigned short i;
-	unsigned short rsize = size;
+	unsigned short rsize = size + 1;
+
+	txCksum = command;
 
-	rsize++;
 	if (rsize>127) {
 		rsize |= 0x8000; // Set MSBit on MSB
-		cksum^= (rsize>>8);
+		txCksum^= (rsize>>8);
 		Serial.write((rsize>>8)&0xff);
 	}
-	cksum^= (rsize&0xff);
+	txCksum^= (rsize&0xff);
 	Serial.write(rsize&0xff);
 
 	Serial.write(command);
+}
 
-	rsize=size;
+static void packet_data(const unsigned char *buf, unsigned short size)
+{
+	unsigned short i;
 
-	for (i=0;i<rsize;i++) {
-		cksum^=buf[i];
+	for (i=0;i<size;i++) {
+		txCksum^=buf[i];
 		Serial.write(buf[i]);
 	}
-	Serial.write(cksum);
 }
 
-static void send_parameters(unsigned char*buf)
+static void packet_end()
+{
+	Serial.write(txCksum);
+}
+
+/* Move to next byte of a packet, skipping empty pieces */
+static void tx_advance(const struct txpiece *p, uint8_t n, uint8_t *i, unsigned short *off)
+{
+	(*off)++;
+	while (*i<n && *off>=p[*i].size) {
+		(*i)++;
+		*off = 0;
+	}
+}
+
+/* COBS-encode pieces on the fly. Each block is found by looking ahead
+ for the next zero, so no staging buffer is needed */
+static void cobs_send(const struct txpiece *p, uint8_t n)
+{
+	uint8_t i = 0, si;
+	unsigned short off = 0, soff;
+	uint8_t run, k;
+
+	for (;;) {
+		si = i;
+		soff = off;
+		run = 0;
+		while (run<COBS_MAX_RUN && si<n && p[si].buf[soff]!=0) {
+			run++;
+			tx_advance(p, n, &si, &soff);
+		}
+
+		Serial.write(run+1);
+		for (k=0; k<run; k++) {
+			Serial.write(p[i].buf[off]);
+			tx_advance(p, n, &i, &off);
+		}
+
+		if (run==COBS_MAX_RUN)
+			continue; /* No implied zero */
+		if (i>=n)
+			break;
+		tx_advance(p, n, &i, &off); /* Skip zero */
+	}
+	Serial.write(0);
+}
+
+static void send_packetv(unsigned char command, const struct txpiece *data, uint8_t n)
+{
+	struct txpiece p[MAX_TX_PIECES];
+	unsigned short size = 0, j;
+	unsigned char ck = command;
+	unsigned long start = micros();
+	uint8_t i;
+
+	if (protocolOptions & PROTOCOL_OPTION_COBS) {
+		for (i=0; i<n; i++)
+			for (j=0; j<data[i].size; j++)
+				ck ^= data[i].buf[j];
+		p[0].buf = &command;
+		p[0].size = 1;
+		for (i=0; i<n; i++)
+			p[i+1] = data[i];
+		p[n+1].buf = &ck;
+		p[n+1].size = 1;
+		cobs_send(p, n+2);
+	} else {
+		for (i=0; i<n; i++)
+			size += data[i].size;
+		packet_begin(command, size);
+		for (i=0; i<n; i++)
+			packet_data(data[i].buf, data[i].size);
+		packet_end();
+	}
+
+	stats.txStallUs += micros() - start;
+}
+
+static void send_packet(unsigned char command, unsigned char *buf, unsigned short size)
+{
+	struct txpiece p;
+
+	p.buf = buf;
+	p.size = size;
+	send_packetv(command, &p, 1);
+}
+
+static unsigned short capture_size()
+{
+	uint8_t count = memseg_count();
+
+	return numSamples + TRAILER_SIZE + (count>1 ? count * MEMSEG_INFO_SIZE : 0);
+}
+
+static uint8_t segment_count()
+{
+	return (capture_size() + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+}
+
+static void send_segment(uint8_t index)
+{
+	unsigned char hdr[SEGMENT_HEADER_SIZE];
+	unsigned char crc[SEGMENT_CRC_SIZE];
+	struct txpiece p[3];
+	unsigned short offset = (unsigned short)index * SEGMENT_SIZE;
+	unsigned short len = capture_size() - offset;
+	uint16_t c = 0xffff;
+	unsigned short i;
+
+	if (len>SEGMENT_SIZE)
+		len = SEGMENT_SIZE;
+
+	hdr[0] = captureId;
+	hdr[1] = index;
+	hdr[2] = segment_count();
+
+	for (i=0; i<SEGMENT_HEADER_SIZE; i++)
+		c = _crc_ccitt_update(c, hdr[i]);
+	for (i=0; i<len; i++)
+		c = _crc_ccitt_update(c, dataBuffer[offset + i]);
+	crc[0] = c >> 8;
+	crc[1] = c & 0xff;
+
+	p[0].buf = hdr;
+	p[0].size = SEGMENT_HEADER_SIZE;
+	p[1].buf = &dataBuffer[offset];
+	p[1].size = len;
+	p[2].buf = crc;
+	p[2].size = SEGMENT_CRC_SIZE;
+	send_packetv(COMMAND_FRAME_SEGMENT, p, 3);
+}
+
+static void send_capture()
+{
+	uint8_t i, count;
+
+	captureId++;
+	if (protocolOptions & PROTOCOL_OPTION_SEGMENTS) {
+		count = segment_count();
+		for (i=0; i<count; i++)
+			send_segment(i);
+	} else {
+		send_packet(COMMAND_BUFFER_SEG, dataBuffer, capture_size());
+	}
+}
+
+static unsigned char *put_be32(unsigned char *buf, uint32_t v)
+{
+	*buf++ = v >> 24;
+	*buf++ = v >> 16;
+	*buf++ = v >> 8;
+	*buf++ = v;
+	return buf;
+}
+
+static unsigned char *put_be16(unsigned char *buf, uint16_t v)
+{
+	*buf++ = v >> 8;
+	*buf++ = v;
+	return buf;
+}
+
+static void send_stats(unsigned char flags)
+{
+	static unsigned char buf[STATS_REPLY_SIZE];
+	unsigned char *p = buf;
+
+	/* ISR updates most of these, take a consistent snapshot */
+	cli();
+	p = put_be32(p, stats.conversions);
+	p = put_be32(p, stats.stored);
+	p = put_be32(p, stats.missed);
+	p = put_be32(p, stats.autoTriggers);
+	p = put_be32(p, stats.realTriggers);
+	p = put_be32(p, stats.txStallUs);
+	p = put_be16(p, (uint16_t)stats.maxIsrTicks * STATS_TIMER_DIV);
+	p = put_be16(p, stats.rxChecksumErrors);
+	p = put_be16(p, stats.rxOversize);
+	if (flags & STATS_FLAG_RESET)
+		memset(&stats, 0, sizeof(stats));
+	sei();
+
+	send_packet(COMMAND_STATS_REPLY, buf, sizeof(buf));
+}
+
+static void fill_parameters(unsigned char *buf)
 {
 	buf[0] = triggerLevel;
 	buf[1] = holdoffSamples;
@@ -192,7 +562,136 @@ static void send_parameters(unsigned char*buf)
 	buf[5] = numSamples & 0xff;
 	buf[6] = gflags;
 	buf[7] = channels;
-	send_packet(COMMAND_PARAMETERS_REPLY, buf, 8);
+	buf[8] = timerClock;
+	buf[9] = (timerTop >> 8);
+	buf[10] = timerTop & 0xff;
+	buf[PARAMETERS_LOGIC] = logicFlags;
+	buf[PARAMETERS_LOGIC+1] = logicMask;
+	buf[PARAMETERS_LOGIC+2] = logicValue;
+	buf[PARAMETERS_LOGIC+3] = logicEdge;
+	buf[PARAMETERS_MEMSEG] = memsegCount;
+	buf[PARAMETERS_TRIGGER] = triggerMode;
+	buf[PARAMETERS_TRIGGER+1] = triggerLevel2;
+	buf[PARAMETERS_TRIGGER+2] = triggerParam;
+}
+
+static void send_parameters()
+{
+	static unsigned char buf[PARAMETERS_SIZE];
+
+	fill_parameters(buf);
+	send_packet(COMMAND_PARAMETERS_REPLY, buf, PARAMETERS_SIZE);
+}
+
+/* Everything host needs to start, in one reply. Like
+ COMMAND_SET_PROTOCOL_OPTIONS, reply uses current framing, and options
+ apply afterwards */
+static void send_hello(uint8_t options)
+{
+	static unsigned char buf[HELLO_SIZE];
+
+	buf[HELLO_VERSION] = PROTOCOL_VERSION_HIGH;
+	buf[HELLO_VERSION+1] = PROTOCOL_VERSION_LOW;
+	buf[HELLO_CAPABILITIES] = CAPABILITY_TIMER | CAPABILITY_STATS | CAPABILITY_LOGIC |
+		CAPABILITY_MEMSEG | CAPABILITY_TRIGGER_MODES;
+	buf[HELLO_OPTIONS] = options & (PROTOCOL_OPTION_SEGMENTS|PROTOCOL_OPTION_COBS);
+	fill_parameters(&buf[HELLO_PARAMETERS]);
+	send_packet(COMMAND_HELLO_REPLY, buf, HELLO_SIZE);
+	protocolOptions = buf[HELLO_OPTIONS];
+	rx_reset();
+}
+
+static void set_logic(uint8_t flags, uint8_t mask, uint8_t value, uint8_t edge)
+{
+	cli();
+	logicFlags = flags & LOGIC_FLAG_ENABLE;
+	logicMask = mask;
+	logicValue = value;
+	logicEdge = edge;
+	/* Drop analog capture in progress. A requested one is taken in
+	 new mode */
+	gflags &= ~(BYTE_FLAG_STOREDATA|BYTE_FLAG_TRIGGERED|BYTE_FLAG_SAWTRIGGER);
+	dataBufferPtr = 0;
+	current_channel = 0;
+	memseg_rewind();
+	sei();
+	setup_adc();
+}
+
+/* LOGIC_LOOP_CYCLES per sample: in (1), st (2), nop (1), sbiw (2),
+ brne (2). Must run with interrupts off. n must not be zero */
+static void logic_sample_fast(unsigned char *p, unsigned short n)
+{
+	asm volatile(
+		"1:	in __tmp_reg__, %[pin]\n\t"
+		"st Z+, __tmp_reg__\n\t"
+		"nop\n\t"
+		"sbiw %[n], 1\n\t"
+		"brne 1b\n\t"
+		: "+z" (p), [n] "+w" (n)
+		: [pin] "I" (_SFR_IO_ADDR(LOGIC_PIN))
+		: "memory");
+}
+
+/* One sample per Timer1 compare match. Interrupts are left on, slow
+ captures can take seconds; an ISR only delays a sample, since pacing
+ comes from timer flag */
+static void logic_sample_timer(unsigned char *p, unsigned short n)
+{
+	TCNT1 = 0;
+	TIFR1 = BIT(OCF1A);
+	do {
+		while (!(TIFR1 & BIT(OCF1A)));
+		TIFR1 = BIT(OCF1A);
+		*p++ = LOGIC_PIN;
+	} while (--n);
+}
+
+/* Logic analyzer capture: poll for trigger, then fill dataBuffer with
+ LOGIC_PIN samples. Returns 0 without capturing if host sent something
+ while we waited for trigger */
+static uint8_t logic_capture()
+{
+	uint8_t care = logicMask | logicEdge;
+	uint8_t prev, cur, saw = 0;
+	unsigned long polls = 0;
+	unsigned long limit = (unsigned long)autoTrigSamples * LOGIC_AUTOTRIG_POLLS * 256;
+
+	prev = LOGIC_PIN;
+	while (care) {
+		cur = LOGIC_PIN;
+		if (((cur ^ logicValue) & care)==0 &&
+			(logicEdge==0 || ((prev ^ cur) & logicEdge))) {
+			saw = 1;
+			break;
+		}
+		prev = cur;
+		if ((++polls & 0xff)==0) {
+			if (Serial.available())
+				return 0;
+			if (limit && polls>=limit)
+				break;
+		}
+	}
+
+	if (saw)
+		stats.realTriggers++;
+	else
+		stats.autoTriggers++;
+
+	if (timerClock) {
+		logic_sample_timer(dataBuffer, numSamples);
+	} else {
+		cli();
+		logic_sample_fast(dataBuffer, numSamples);
+		sei();
+	}
+	stats.stored += numSamples;
+
+	dataBuffer[numSamples+TRAILER_TRIGGERED] = saw;
+	dataBuffer[numSamples+TRAILER_CHANNELS] = 1;
+	dataBuffer[numSamples+TRAILER_MUX_DELAY] = 0;
+	return 1;
 }
 
 static void process_packet(unsigned char command, unsigned char *buf, unsigned short size)
@@ -211,6 +710,7 @@ static void process_packet(unsigned char command, unsigned char *buf, unsigned s
 		break;
 	case COMMAND_SET_TRIGGER:
 		triggerLevel = buf[0];
+		trigger_setup();
 		break;
 	case COMMAND_SET_HOLDOFF:
 		holdoffSamples = buf[0];
@@ -231,7 +731,7 @@ static void process_packet(unsigned char command, unsigned char *buf, unsigned s
 		set_num_samples((unsigned short)buf[0]<<8 | buf[1]);
 		/* No break - so we reply with parameters */
 	case COMMAND_GET_PARAMETERS:
-		send_parameters(buf);
+		send_parameters();
 		break;
 	case COMMAND_SET_FLAGS:
 		cli();
@@ -239,13 +739,69 @@ static void process_packet(unsigned char command, unsigned char *buf, unsigned s
 		buf[0] &= BYTE_FLAG_INVERTTRIGGER;
 		gflags |= buf[0];
 		sei();
-		send_parameters(buf);
+		trigger_setup();
+		send_parameters();
 		break;
 	case COMMAND_SET_CHANNELS:
 		cli();
 		channels = buf[0];
 		sei();
-		send_parameters(buf);
+		send_parameters();
+		break;
+	case COMMAND_GET_STATS:
+		send_stats(size>0 ? buf[0] : 0);
+		break;
+	case COMMAND_SET_SAMPLE_RATE:
+		timerClock = buf[0] & 0x7;
+		timerTop = (unsigned short)buf[1]<<8 | buf[2];
+		setup_adc();
+		send_parameters();
+		break;
+	case COMMAND_SET_PROTOCOL_OPTIONS:
+		buf[0] &= PROTOCOL_OPTION_SEGMENTS|PROTOCOL_OPTION_COBS;
+		/* Reply still uses current framing, new one applies afterwards */
+		send_packet(COMMAND_PROTOCOL_OPTIONS_REPLY, buf, 1);
+		protocolOptions = buf[0];
+		rx_reset();
+		break;
+	case COMMAND_SET_LOGIC:
+		if (size<4) {
+			send_packet(COMMAND_ERROR,NULL,0);
+			break;
+		}
+		set_logic(buf[0], buf[1], buf[2], buf[3]);
+		send_parameters();
+		break;
+	case COMMAND_SET_MEMSEG:
+		if (size<1) {
+			send_packet(COMMAND_ERROR,NULL,0);
+			break;
+		}
+		set_memseg(buf[0]);
+		send_parameters();
+		break;
+	case COMMAND_HELLO:
+		send_hello(size>0 ? buf[0] : 0);
+		break;
+	case COMMAND_SET_TRIGGER_MODE:
+		if (size<3 || buf[0]>TRIGGER_MODE_MAX) {
+			send_packet(COMMAND_ERROR,NULL,0);
+			break;
+		}
+		triggerMode = buf[0];
+		triggerLevel2 = buf[1];
+		triggerParam = buf[2];
+		trigger_setup();
+		send_parameters();
+		break;
+	case COMMAND_GET_SEGMENT:
+		/* Capture is held until next COMMAND_START_SAMPLING */
+		if (size>=2 && buf[0]==captureId && buf[1]<segment_count() &&
+			!(gflags & BYTE_FLAG_STARTCONVERSION)) {
+			send_segment(buf[1]);
+		} else {
+			send_packet(COMMAND_ERROR,NULL,0);
+		}
 		break;
 	default:
 		send_packet(COMMAND_ERROR,NULL,0);
@@ -269,8 +825,10 @@ static void process(unsigned char bIn)
 			st = SIZE2;
 		} else {
 			pSize = bIn;
-			if (bIn>MAX_PACKET_SIZE)
+			if (bIn>MAX_PACKET_SIZE) {
+				stats.rxOversize++;
 				break;
+			}
 			pBufPtr = 0;
 			st = COMMAND;
 		}
@@ -278,8 +836,11 @@ static void process(unsigned char bIn)
 
 	case SIZE2:
 		pSize += bIn;
-		if (bIn>MAX_PACKET_SIZE)
+		if (pSize>MAX_PACKET_SIZE) {
+			stats.rxOversize++;
+			st = SIZE;
 			break;
+		}
 		pBufPtr = 0;
 		st = COMMAND;
 		break;
@@ -305,58 +866,121 @@ static void process(unsigned char bIn)
 	case CKSUM:
 		if (cksum==0) {
 			process_packet(command,pBuf,pBufPtr);
+		} else {
+			stats.rxChecksumErrors++;
 		}
 		st = SIZE;
 	}
 }
 
+static void cobs_put(unsigned char bIn)
+{
+	cksum ^= bIn;
+	if (pSize==0)
+		command = bIn;
+	else if (pBufPtr<MAX_PACKET_SIZE)
+		pBuf[pBufPtr++] = bIn;
+	if (pSize <= MAX_PACKET_SIZE + 1)
+		pSize++; /* Saturate, so a long run of garbage stays oversize */
+}
+
+/* COBS framing: command, payload and checksum, encoded so that zero only
+ appears as frame delimiter. Garbage is discarded up to next zero */
+static void process_cobs(unsigned char bIn)
+{
+	if (bIn!=0) {
+		zeroCount = 0;
+		if (cobsLeft==0) {
+			if (cobsZero)
+				cobs_put(0);
+			cobsLeft = bIn - 1;
+			cobsZero = (bIn!=COBS_MAX_RUN+1);
+		} else {
+			cobs_put(bIn);
+			cobsLeft--;
+		}
+		return;
+	}
+
+	if (pSize > MAX_PACKET_SIZE + 1) {
+		stats.rxOversize++;
+	} else if (pSize>=2 && cobsLeft==0) {
+		if (cksum==0)
+			process_packet(command, pBuf, pBufPtr - 1);
+		else
+			stats.rxChecksumErrors++;
+	} else if (pSize>0) {
+		stats.rxChecksumErrors++; /* Truncated */
+	}
+
+	if (++zeroCount > MAX_PACKET_SIZE) {
+		/* Host is running reset procedure */
+		protocolOptions = 0;
+		zeroCount = 0;
+	}
+	rx_reset();
+}
+
 void loop() {
 	int bIn;
 	if (Serial.available()>0) {
 		bIn =  Serial.read();
-		process(bIn & 0xff);
+		if (protocolOptions & PROTOCOL_OPTION_COBS)
+			process_cobs(bIn & 0xff);
+		else
+			process(bIn & 0xff);
 	} else if (gflags & BYTE_FLAG_CONVERSIONDONE) {
 		cli();
 		gflags &= ~ BYTE_FLAG_CONVERSIONDONE;
-		/* Update flags */
-		dataBuffer[numSamples] = gflags & BYTE_FLAG_SAWTRIGGER ? 1: 0;
-		dataBuffer[numSamples+1] = channels;
 		sei();
-		send_packet(COMMAND_BUFFER_SEG, dataBuffer, numSamples + 2);
+		/* Trailer was filled by ISR */
+		send_capture();
+	} else if ((logicFlags & LOGIC_FLAG_ENABLE) && (gflags & BYTE_FLAG_STARTCONVERSION)) {
+		if (logic_capture()) {
+			cli();
+			gflags &= ~BYTE_FLAG_STARTCONVERSION;
+			sei();
+			send_capture();
+		}
 	} else {
 	}
 }
 
-#define TRIGGER_NOISE_LEVEL 1
-
 #if 1
 
 ISR(ADC_vect)
 {
 	static unsigned char last=0;
 	static unsigned char holdoff;
+	unsigned char sample;
 	register byte flags = gflags;
+	unsigned char start = TCNT2;
+
+	stats.conversions++;
+
+	/* Clear Timer1 compare flag, otherwise next compare match will not
+	 trigger a new conversion. Harmless if free-running */
+	TIFR1 = BIT(OCF1B);
 
 	if (holdoff>0) {
 		holdoff--;
-		return;
+		goto out;
 	}
     flags &= ~BYTE_FLAG_JUST_TRIGGERED;
+	sample = ADCH;
 
 	if (!(flags & BYTE_FLAG_TRIGGERED) && triggerLevel>0) {
 
 		if (autoTrigCount>0 && autoTrigCount >= autoTrigSamples ) {
 			flags |= BYTE_FLAG_TRIGGERED;
 			flags |= BYTE_FLAG_JUST_TRIGGERED;
+			stats.autoTriggers++;
 		} else {
 
-			if ( !(flags&BYTE_FLAG_INVERTTRIGGER) && ADCH>=triggerLevel && last<triggerLevel) {
-
-				flags |= BYTE_FLAG_TRIGGERED|BYTE_FLAG_JUST_TRIGGERED|BYTE_FLAG_SAWTRIGGER;
-
-			} else if ( flags&BYTE_FLAG_INVERTTRIGGER && ADCH<=triggerLevel && last>triggerLevel) {
+			if (trigger_state_check(&trig, sample ^ trig.invert, last)) {
 
 				flags |= BYTE_FLAG_TRIGGERED|BYTE_FLAG_JUST_TRIGGERED|BYTE_FLAG_SAWTRIGGER;
+				stats.realTriggers++;
 
 			} else {
 				if (autoTrigSamples>0)
@@ -364,17 +988,28 @@ ISR(ADC_vect)
 			}
 		}
 	} else {
-		if (!(flags & BYTE_FLAG_TRIGGERED))
+		if (!(flags & BYTE_FLAG_TRIGGERED)) {
 			flags |= BYTE_FLAG_JUST_TRIGGERED; // no triggering
+			stats.autoTriggers++;
+		}
 		flags |= BYTE_FLAG_TRIGGERED;
 	}
 
-	last=ADCH;
+	last = sample ^ trig.invert;
 
 	if (flags & BYTE_FLAG_TRIGGERED) {
 
-		if (flags & BYTE_FLAG_STARTCONVERSION && dataBufferPtr==0) {
+		if (flags & BYTE_FLAG_STARTCONVERSION && dataBufferPtr==memsegStart &&
+			!(flags & BYTE_FLAG_STOREDATA)) {
 			flags |= BYTE_FLAG_STOREDATA;
+			if (memsegLength!=numSamples) {
+				unsigned char *info = &dataBuffer[numSamples + TRAILER_SIZE +
+												  memsegIndex * MEMSEG_INFO_SIZE];
+				info[MEMSEG_INFO_TRIGGERED] = flags & BYTE_FLAG_SAWTRIGGER ? 1 : 0;
+				info[MEMSEG_INFO_TIME] = stats.conversions >> 16;
+				info[MEMSEG_INFO_TIME+1] = stats.conversions >> 8;
+				info[MEMSEG_INFO_TIME+2] = stats.conversions;
+			}
 		}
 
 		if (flags & BYTE_FLAG_STOREDATA) {
@@ -386,48 +1021,68 @@ ISR(ADC_vect)
 				current_channel = 0;
 			}
 
+			/* When free-running, next conversion already started, so
+			 this only applies to the one after. Host gets this from
+			 TRAILER_MUX_DELAY and aligns channels itself */
 			ADMUX = (ADMUX&0xf0)|(current_channel&0xf);
 
-			if (!(flags & BYTE_FLAG_IGNORE_SAMPLE)) {
-				dataBuffer[dataBufferPtr] = ADCH;
-			} else {
-				// Go back one sample
-				dataBufferPtr--;
-			}
-
-			if (channels>1 && (flags&BYTE_FLAG_JUST_TRIGGERED)) {
-				flags |= BYTE_FLAG_IGNORE_SAMPLE; // Ignore next sample.
-			} else {
-                flags &= ~BYTE_FLAG_IGNORE_SAMPLE; // Ignore next sample.
-			}
-
+			dataBuffer[dataBufferPtr] = sample;
+			stats.stored++;
 		}
 		dataBufferPtr++;
 
-		if (dataBufferPtr>numSamples) {
+		if (dataBufferPtr>memsegEnd) {
 
-			/* End of this conversion. Perform holdoff if needed */
+			/* End of this conversion. Perform holdoff if needed. With
+			 memory segments, move to next one, and only finish capture
+			 after last */
 			if (flags & BYTE_FLAG_STOREDATA) {
-				flags |= BYTE_FLAG_CONVERSIONDONE;
-				flags &= ~BYTE_FLAG_STARTCONVERSION;
+				if (!(flags & BYTE_FLAG_SAWTRIGGER))
+					memsegSaw = 0;
+				if (++memsegIndex < memsegCount) {
+					memsegStart = memsegEnd;
+					memsegEnd += memsegLength;
+				} else {
+					flags |= BYTE_FLAG_CONVERSIONDONE;
+					flags &= ~BYTE_FLAG_STARTCONVERSION;
+
+					dataBuffer[numSamples+TRAILER_TRIGGERED] = memsegSaw;
+					dataBuffer[numSamples+TRAILER_CHANNELS] = channels;
+					/* Samples before this index are all from channel 0 */
+					dataBuffer[numSamples+TRAILER_MUX_DELAY] = timerClock ? 0 : 1;
+					memsegIndex = 0;
+					memsegStart = 0;
+					memsegEnd = memsegLength;
+					memsegSaw = 1;
+				}
 			}
 
 			flags &= ~BYTE_FLAG_STOREDATA;
 			flags &= ~BYTE_FLAG_TRIGGERED;
 			flags &= ~BYTE_FLAG_SAWTRIGGER;
-			flags &= ~BYTE_FLAG_IGNORE_SAMPLE;
 			// Reset muxer
 			ADMUX &= 0xf0;
+			current_channel = 0;
 			holdoff=holdoffSamples;
+			/* Free-running, the conversion in flight still uses the old
+			 mux. It must not reach the trigger, so it is held off too */
+			if (holdoff==0 && !timerClock && channels>1)
+				holdoff=1;
 			autoTrigCount=0;
-			dataBufferPtr=0;
-			if (flags&BYTE_FLAG_INVERTTRIGGER)
-				last=0;
-			else
-				last=255;
+			dataBufferPtr=memsegStart;
+			/* No edge right after holdoff, and mode starts over */
+			last=255;
+			trig.armed=0;
 		}
 	}
 	gflags=flags;
+
+out:
+	start = TCNT2 - start;
+	if (start > stats.maxIsrTicks)
+		stats.maxIsrTicks = start;
+	if (ADCSRA & BIT(ADIF))
+		stats.missed++;
 }
 
 #else
@@ -20,8 +20,8 @@
 #define __PROTOCOL_H__
 
 /* Our version */
-#define PROTOCOL_VERSION_HIGH 0x02
-#define PROTOCOL_VERSION_LOW  0x02
+#define PROTOCOL_VERSION_HIGH 0x03
+#define PROTOCOL_VERSION_LOW  0x05
 
 /* Serial commands we support */
 #define COMMAND_PING           0x3E
@@ -36,12 +36,110 @@
 #define COMMAND_SET_AUTOTRIG   0x49
 #define COMMAND_SET_FLAGS      0x50
 #define COMMAND_SET_CHANNELS   0x51
+#define COMMAND_SET_SAMPLE_RATE 0x52
+#define COMMAND_GET_STATS      0x53
+#define COMMAND_SET_PROTOCOL_OPTIONS 0x54
+#define COMMAND_GET_SEGMENT    0x55
+#define COMMAND_SET_LOGIC      0x56
+#define COMMAND_SET_MEMSEG     0x57
+#define COMMAND_SET_TRIGGER_MODE 0x58
+#define COMMAND_HELLO          0x59
 #define COMMAND_VERSION_REPLY  0x80
 #define COMMAND_BUFFER_SEG     0x81
+#define COMMAND_FRAME_SEGMENT  0x82
 #define COMMAND_PARAMETERS_REPLY 0x87
+#define COMMAND_STATS_REPLY    0x88
+#define COMMAND_PROTOCOL_OPTIONS_REPLY 0x89
+#define COMMAND_HELLO_REPLY    0x8A
 #define COMMAND_PONG           0xE3
 #define COMMAND_ERROR          0xFF
 
 #define FLAG_INVERT_TRIGGER  (1<<0)
 
+/* COMMAND_BUFFER_SEG trailer, appended after samples. Offsets are
+ relative to end of samples */
+#define TRAILER_TRIGGERED    0 /* 1 if trigger seen, 0 if auto-triggered */
+#define TRAILER_CHANNELS     1 /* Number of interleaved channels */
+#define TRAILER_MUX_DELAY    2 /* Mux schedule (v2.5), see README.protocol */
+#define TRAILER_SIZE         3
+
+/* COMMAND_SET_PROTOCOL_OPTIONS options */
+#define PROTOCOL_OPTION_SEGMENTS (1<<0) /* Send captures as COMMAND_FRAME_SEGMENT */
+#define PROTOCOL_OPTION_COBS     (1<<1) /* COBS framing (v3.1), see README.protocol */
+
+/* Longest run of non-zero bytes in a COBS block (code byte 0xFF) */
+#define COBS_MAX_RUN         254
+
+/* COMMAND_FRAME_SEGMENT layout: capture id, segment index, segment
+ count, up to SEGMENT_SIZE bytes of capture, CRC-16 (big-endian) */
+#define SEGMENT_SIZE         128
+#define SEGMENT_HEADER_SIZE  3
+#define SEGMENT_CRC_SIZE     2
+
+/* COMMAND_SET_TRIGGER_MODE modes (v3.4). Levels are for rising signal;
+ FLAG_INVERT_TRIGGER mirrors them */
+#define TRIGGER_MODE_EDGE        0 /* Crossing trigger level */
+#define TRIGGER_MODE_HYSTERESIS  1 /* Crossing, after being param below level */
+#define TRIGGER_MODE_PULSE_GT    2 /* End of pulse above level, longer than param samples */
+#define TRIGGER_MODE_PULSE_LT    3 /* End of pulse above level, shorter than param samples */
+#define TRIGGER_MODE_WINDOW_IN   4 /* Entering band from level to level2 */
+#define TRIGGER_MODE_WINDOW_OUT  5 /* Leaving band from level to level2 */
+#define TRIGGER_MODE_RUNT        6 /* Back below level without reaching level2 */
+#define TRIGGER_MODE_MAX         6
+
+/* COMMAND_SET_LOGIC flags (v3.2) */
+#define LOGIC_FLAG_ENABLE    (1<<0) /* Capture a digital port instead of ADC */
+
+/* Lines in a logic capture, one bit each per sample */
+#define LOGIC_CHANNELS       8
+
+/* CPU cycles per sample of a free-running logic capture */
+#define LOGIC_LOOP_CYCLES    8
+
+/* Memory segments (v3.3): capture split into up to MEMSEG_MAX equal
+ parts, each filled by its own trigger. Segment info follows trailer,
+ MEMSEG_INFO_SIZE bytes per segment */
+#define MEMSEG_MAX           16
+#define MEMSEG_INFO_TRIGGERED 0 /* 1 if trigger seen, 0 if auto-triggered */
+#define MEMSEG_INFO_TIME     1 /* ADC conversion count at first sample, 24-bit big-endian */
+#define MEMSEG_INFO_SIZE     4
+
+/* COMMAND_PARAMETERS_REPLY offset of logic settings: flags, trigger
+ mask, trigger value, edge mask. Then number of memory segments (v3.3) */
+#define PARAMETERS_LOGIC     11
+#define PARAMETERS_MEMSEG    15
+/* Trigger mode, second level and parameter (v3.4) */
+#define PARAMETERS_TRIGGER   16
+#define PARAMETERS_SIZE      19
+
+/* COMMAND_HELLO_REPLY layout (v3.5): version high and low, capabilities,
+ protocol options now in use, then COMMAND_PARAMETERS_REPLY payload */
+#define HELLO_VERSION        0
+#define HELLO_CAPABILITIES   2
+#define HELLO_OPTIONS        3
+#define HELLO_PARAMETERS     4
+#define HELLO_SIZE           (HELLO_PARAMETERS + PARAMETERS_SIZE)
+
+/* COMMAND_HELLO_REPLY capabilities */
+#define CAPABILITY_TIMER     (1<<0) /* COMMAND_SET_SAMPLE_RATE */
+#define CAPABILITY_STATS     (1<<1) /* COMMAND_GET_STATS */
+#define CAPABILITY_LOGIC     (1<<2) /* COMMAND_SET_LOGIC */
+#define CAPABILITY_MEMSEG    (1<<3) /* COMMAND_SET_MEMSEG */
+#define CAPABILITY_TRIGGER_MODES (1<<4) /* COMMAND_SET_TRIGGER_MODE */
+
+/* COMMAND_GET_STATS flags */
+#define STATS_FLAG_RESET     (1<<0)
+
+/* COMMAND_STATS_REPLY payload size */
+#define STATS_REPLY_SIZE     30
+
+/* Timer1 clock selection for COMMAND_SET_SAMPLE_RATE. TIMER_CLOCK_NONE
+ means ADC is free-running */
+#define TIMER_CLOCK_NONE     0
+#define TIMER_CLOCK_DIV1     1
+#define TIMER_CLOCK_DIV8     2
+#define TIMER_CLOCK_DIV64    3
+#define TIMER_CLOCK_DIV256   4
+#define TIMER_CLOCK_DIV1024  5
+
 #endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2007 Alvaro Lopes <alvieboy@alvie.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __TRIGSTATE_H__
+#define __TRIGSTATE_H__
+
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ Analog trigger state machine, see COMMAND_SET_TRIGGER_MODE. Shared by
+ the firmware ISR and the host simulation (UI/trigsim.c).
+
+ Samples are XORed with invert before they get here, so that every
+ mode looks for a rising signal. low and high are levels as seen after
+ that, arm is the level hysteresis mode must go below to arm. armed and
+ count hold mode state between samples.
+ */
+
+struct trigger_state {
+	uint8_t mode;
+	uint8_t param;
+	uint8_t invert;
+	uint8_t low;
+	uint8_t high;
+	uint8_t arm;
+	uint8_t armed;
+	uint8_t count;
+};
+
+/* Work out levels as the check sees them */
+static inline void trigger_state_setup(struct trigger_state *t, uint8_t mode,
+									   uint8_t level, uint8_t level2,
+									   uint8_t param, uint8_t invert)
+{
+	uint8_t low = level ^ invert;
+	uint8_t high = level2 ^ invert;
+
+	/* Window is the same band whatever the polarity */
+	if ((mode==TRIGGER_MODE_WINDOW_IN || mode==TRIGGER_MODE_WINDOW_OUT) &&
+		high<low) {
+		uint8_t tmp = low;
+		low = high;
+		high = tmp;
+	}
+	t->mode = mode;
+	t->param = param;
+	t->invert = invert;
+	t->low = low;
+	t->high = high;
+	t->arm = low>param ? low-param : 1;
+	t->armed = 0;
+	t->count = 0;
+}
+
+/* Trigger test for one sample, v and last already XORed with invert.
+ Each mode is a few 8-bit compares, so it fits in conversion time even
+ at fastest prescaler */
+static inline uint8_t trigger_state_check(struct trigger_state *t,
+										  uint8_t v, uint8_t last)
+{
+	switch (t->mode) {
+	case TRIGGER_MODE_HYSTERESIS:
+		/* Edge only counts once signal went well below level */
+		if (v<t->arm) {
+			t->armed = 1;
+		} else if (t->armed && v>=t->low) {
+			t->armed = 0;
+			return 1;
+		}
+		return 0;
+
+	case TRIGGER_MODE_PULSE_GT:
+	case TRIGGER_MODE_PULSE_LT:
+		/* Count samples above level from rising edge, test on falling */
+		if (v>=t->low) {
+			if (last<t->low) {
+				t->armed = 1;
+				t->count = 0;
+			} else if (t->count<255) {
+				t->count++;
+			}
+			return 0;
+		}
+		if (last<t->low || !t->armed)
+			return 0;
+		t->armed = 0;
+		/* Pulse was count+1 samples wide */
+		if (t->mode==TRIGGER_MODE_PULSE_GT)
+			return t->count>=t->param;
+		return t->count+1<t->param;
+
+	case TRIGGER_MODE_WINDOW_IN:
+		if (v<t->low || v>t->high) {
+			t->armed = 1;
+		} else if (t->armed) {
+			t->armed = 0;
+			return 1;
+		}
+		return 0;
+
+	case TRIGGER_MODE_WINDOW_OUT:
+		if (v>=t->low && v<=t->high) {
+			t->armed = 1;
+		} else if (t->armed) {
+			t->armed = 0;
+			return 1;
+		}
+		return 0;
+
+	case TRIGGER_MODE_RUNT:
+		/* Rose past level, back below it without reaching level2 */
+		if (v>=t->high) {
+			t->armed = 0;
+		} else if (v>=t->low) {
+			if (last<t->low)
+				t->armed = 1;
+		} else if (t->armed) {
+			t->armed = 0;
+			return 1;
+		}
+		return 0;
+
+	default:
+		return v>=t->low && last<t->low;
+	}
+}
+
+#endif